@@ -1,5 +1,8 @@
+#include <sys/types.h>
+
 #include <assert.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -11,17 +14,19 @@ main(int argc, char *argv[])
 {
 	int	 	 fd;
 	struct opts	 opts;
-	size_t		 sz;
+	struct sess	 sess;
 	struct blkset	*p;
 
 	memset(&opts, 0, sizeof(struct opts));
+	memset(&sess, 0, sizeof(struct sess));
+	sess.opts = &opts;
 
 	assert(2 == argc);
 
 	fd = open(argv[1], O_NONBLOCK | O_RDONLY, 0);
 	assert(fd != -1);
 
-	p = blk_recv(&opts, fd, 16, "");
+	p = blk_recv(&sess, fd, "");
 	blkset_free(p);
 	return EXIT_SUCCESS;
 }
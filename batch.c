@@ -0,0 +1,360 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/stat.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <paths.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * A batch (--write-batch) is what the sender sent the receiver in a
+ * session, from the file list to the end of the last phase, so that
+ * other destinations in the same state as the session's can be brought
+ * up to date with it (--read-batch) without a sender.
+ * It's recorded by the client, whichever side it's on, as it's read or
+ * written.
+ * The sender's done the block matching once: replaying only reads the
+ * stream, so it can be written to a pipe and read from another.
+ *
+ * It starts with a header, all little-endian:
+ *
+ *   magic (8 bytes), version (4), protocol (4), seed (4), flags (4),
+ *   unused (8)
+ *
+ * The flags are what the stream was sent with, which must be those we
+ * read it with.
+ */
+#define	BATCH_MAGIC		"ORSYNCBA"
+#define	BATCH_VERSION		1
+#define	BATCH_HDR		32
+#define	BATCH_BUF		(64 * 1024)
+
+#define	BATCH_INC_FLIST		0x01 /* incremental file list */
+#define	BATCH_XXH		0x02 /* XXH64 rather than MD4 */
+#define	BATCH_COMPRESS		0x04 /* -z */
+#define	BATCH_RECURSIVE		0x08 /* -r */
+#define	BATCH_GIDS		0x10 /* -g */
+#define	BATCH_LINKS		0x20 /* -l */
+#define	BATCH_PERMS		0x40 /* -p */
+#define	BATCH_TIMES		0x80 /* -t */
+#define	BATCH_FLAGS		0xff
+
+struct	batch {
+	char		*path; /* batch file or NULL for stdout */
+	int		 fd; /* batch file */
+	int		 out; /* record writes (not reads) */
+	int		 on; /* recording */
+	unsigned char	 buf[BATCH_BUF]; /* pending writes */
+	size_t		 bufsz; /* bytes in buf */
+};
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	uint32_t	 v;
+
+	memcpy(&v, p, sizeof(uint32_t));
+	return le32toh(v);
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+
+	v = htole32(v);
+	memcpy(p, &v, sizeof(uint32_t));
+}
+
+/*
+ * Write all of "buf" of size "sz" to the batch.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+batch_write(struct sess *sess, struct batch *b, const void *buf, size_t sz)
+{
+	ssize_t	 ssz;
+
+	while (sz > 0) {
+		if ((ssz = write(b->fd, buf, sz)) == -1) {
+			if (errno == EINTR)
+				continue;
+			ERR(sess, "%s: write", b->path == NULL ?
+				"(stdout)" : b->path);
+			return 0;
+		}
+		buf = (const char *)buf + ssz;
+		sz -= ssz;
+	}
+	return 1;
+}
+
+/*
+ * Create the batch "path" (or standard output, if "-") and write its
+ * header for the session's handshake and options.
+ * If "out", we're the sender and record what we write, otherwise what
+ * we read.
+ * Recording starts with batch_record().
+ * Returns the batch or NULL on failure.
+ */
+struct batch *
+batch_open(struct sess *sess, const char *path, int out)
+{
+	struct batch	*b;
+	unsigned char	 hdr[BATCH_HDR];
+	uint32_t	 flags = 0;
+
+	if ((b = calloc(1, sizeof(struct batch))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	}
+	b->out = out;
+
+	if (strcmp(path, "-") == 0)
+		b->fd = STDOUT_FILENO;
+	else if ((b->path = strdup(path)) == NULL) {
+		ERR(sess, "strdup");
+		free(b);
+		return NULL;
+	} else if ((b->fd = open(path,
+	    O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+		ERR(sess, "%s: open", path);
+		free(b->path);
+		free(b);
+		return NULL;
+	}
+
+	if (sess->inc_flist)
+		flags |= BATCH_INC_FLIST;
+	if (sess->xxh)
+		flags |= BATCH_XXH;
+	if (sess->opts->compress)
+		flags |= BATCH_COMPRESS;
+	if (sess->opts->recursive)
+		flags |= BATCH_RECURSIVE;
+	if (sess->opts->preserve_gids)
+		flags |= BATCH_GIDS;
+	if (sess->opts->preserve_links)
+		flags |= BATCH_LINKS;
+	if (sess->opts->preserve_perms)
+		flags |= BATCH_PERMS;
+	if (sess->opts->preserve_times)
+		flags |= BATCH_TIMES;
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, BATCH_MAGIC, 8);
+	put32(hdr + 8, BATCH_VERSION);
+	put32(hdr + 12, sess->lver);
+	put32(hdr + 16, sess->seed);
+	put32(hdr + 20, flags);
+
+	if (!batch_write(sess, b, hdr, sizeof(hdr))) {
+		ERRX1(sess, "batch_write");
+		batch_free(b);
+		return NULL;
+	}
+
+	LOG2(sess, "%s: writing batch", b->path == NULL ?
+		"(stdout)" : b->path);
+	return b;
+}
+
+/*
+ * Start (or stop, if "on" is zero) recording the stream.
+ */
+void
+batch_record(struct batch *b, int on)
+{
+
+	b->on = on;
+}
+
+/*
+ * Called with all data read ("out" is zero) or written by the session.
+ * If we're recording that direction, add "buf" of size "sz".
+ * Returns zero on failure, non-zero on success.
+ */
+int
+batch_tee(struct sess *sess, struct batch *b, int out,
+	const void *buf, size_t sz)
+{
+
+	if (!b->on || b->out != out)
+		return 1;
+
+	if (b->bufsz + sz > sizeof(b->buf)) {
+		if (!batch_write(sess, b, b->buf, b->bufsz)) {
+			ERRX1(sess, "batch_write");
+			return 0;
+		}
+		b->bufsz = 0;
+	}
+
+	if (sz > sizeof(b->buf)) {
+		if (!batch_write(sess, b, buf, sz)) {
+			ERRX1(sess, "batch_write");
+			return 0;
+		}
+		return 1;
+	}
+
+	memcpy(b->buf + b->bufsz, buf, sz);
+	b->bufsz += sz;
+	return 1;
+}
+
+/*
+ * Write out what's pending and close the batch once the session is
+ * complete.
+ * It must still be freed with batch_free().
+ * Returns zero on failure, non-zero on success.
+ */
+int
+batch_close(struct sess *sess, struct batch *b)
+{
+
+	if (!batch_write(sess, b, b->buf, b->bufsz)) {
+		ERRX1(sess, "batch_write");
+		return 0;
+	}
+	b->bufsz = 0;
+
+	if (b->path != NULL && close(b->fd) == -1) {
+		b->fd = -1;
+		ERR(sess, "%s: close", b->path);
+		return 0;
+	}
+	b->fd = -1;
+	free(b->path);
+	b->path = NULL;
+	return 1;
+}
+
+/*
+ * Free the batch.
+ * If it wasn't closed, the session failed: remove what we've written.
+ * Passing a NULL to this function is ok.
+ */
+void
+batch_free(struct batch *b)
+{
+
+	if (b == NULL)
+		return;
+	if (b->path != NULL) {
+		if (b->fd != -1)
+			close(b->fd);
+		unlink(b->path);
+		free(b->path);
+	}
+	free(b);
+}
+
+/*
+ * Bring "root" up to date with the batch of --read-batch.
+ * This runs the receiver as if the batch were the sender, with what
+ * the uploader would send it thrown away.
+ * As the sender's already done the block matching, we don't sign.
+ *
+ * Pledges: those of the receiver.
+ */
+int
+rsync_batch(const struct opts *opts, const char *root)
+{
+	struct sess	 sess;
+	struct opts	 o = *opts;
+	unsigned char	 hdr[BATCH_HDR];
+	uint32_t	 flags;
+	int		 fd, nfd, rc = 0;
+
+	memset(&sess, 0, sizeof(struct sess));
+	sess.opts = &o;
+	sess.lver = RSYNC_PROTOCOL;
+	sess.stats.start = stats_now();
+
+	if (strcmp(opts->read_batch, "-") == 0)
+		fd = STDIN_FILENO;
+	else if ((fd = open(opts->read_batch, O_RDONLY)) == -1) {
+		ERR(&sess, "%s: open", opts->read_batch);
+		return 0;
+	}
+
+	if ((nfd = open(_PATH_DEVNULL, O_WRONLY | O_NONBLOCK)) == -1) {
+		ERR(&sess, "%s: open", _PATH_DEVNULL);
+		goto out;
+	}
+
+	if (!io_read_buf(&sess, fd, hdr, sizeof(hdr))) {
+		ERRX1(&sess, "io_read_buf");
+		goto out;
+	} else if (memcmp(hdr, BATCH_MAGIC, 8) != 0) {
+		ERRX(&sess, "%s: not a batch", opts->read_batch);
+		goto out;
+	} else if (get32(hdr + 8) != BATCH_VERSION) {
+		ERRX(&sess, "%s: unknown batch version %" PRIu32,
+			opts->read_batch, get32(hdr + 8));
+		goto out;
+	}
+
+	sess.rver = get32(hdr + 12);
+	sess.seed = get32(hdr + 16);
+	flags = get32(hdr + 20);
+
+	if (sess.rver != sess.lver) {
+		ERRX(&sess, "%s: batch protocol %" PRId32 " is not "
+			"our own (%" PRId32 ")", opts->read_batch,
+			sess.rver, sess.lver);
+		goto out;
+	} else if (flags & ~BATCH_FLAGS) {
+		ERRX(&sess, "%s: unknown batch flags: %#" PRIx32,
+			opts->read_batch, flags);
+		goto out;
+	}
+
+	sess.inc_flist = (flags & BATCH_INC_FLIST) != 0;
+	sess.xxh = (flags & BATCH_XXH) != 0;
+	o.compress = (flags & BATCH_COMPRESS) != 0;
+	o.recursive = (flags & BATCH_RECURSIVE) != 0;
+	o.preserve_gids = (flags & BATCH_GIDS) != 0;
+	o.preserve_links = (flags & BATCH_LINKS) != 0;
+	o.preserve_perms = (flags & BATCH_PERMS) != 0;
+	o.preserve_times = (flags & BATCH_TIMES) != 0;
+	o.whole_file = 1;
+
+	LOG2(&sess, "%s: reading batch, protocol %" PRId32
+		", seed %" PRId32 ", %s", opts->read_batch,
+		sess.rver, sess.seed, sess.xxh ? "XXH64" : "MD4");
+
+	if (!rsync_receiver(&sess, fd, nfd, root)) {
+		ERRX1(&sess, "rsync_receiver");
+		goto out;
+	}
+	rc = 1;
+out:
+	if (nfd != -1)
+		close(nfd);
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return rc;
+}
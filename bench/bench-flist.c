@@ -0,0 +1,123 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../extern.h"
+#include "bench.h"
+
+/*
+ * Micro-benchmark of generating the file list of a generated tree with
+ * flist_gen() (with and without walking threads), then encoding it with
+ * flist_send() and decoding it with flist_recv().
+ */
+
+#define	DIRS		100
+#define	FILES		100
+
+static const size_t threads[] = { 0, 4 };
+
+int
+main(void)
+{
+	struct sess	 sess;
+	struct opts	 opts;
+	struct flist	*fl, *rfl = NULL;
+	char		 root[] = "/tmp/bench-flist.XXXXXX";
+	char		 path[PATH_MAX], lpath[] = "/tmp/bench-flist.XXXXXX";
+	char		 name[64], *argv[1];
+	size_t		 i, j, flsz, rflsz = 0;
+	double		 t;
+	int		 fd;
+
+	bench_sess(&sess, &opts);
+	opts.recursive = 1;
+
+	if (mkdtemp(root) == NULL)
+		err(EXIT_FAILURE, "mkdtemp");
+	for (i = 0; i < DIRS; i++) {
+		snprintf(path, sizeof(path), "%s/d%zu", root, i);
+		if (mkdir(path, 0755) == -1)
+			err(EXIT_FAILURE, "%s", path);
+		for (j = 0; j < FILES; j++) {
+			snprintf(path, sizeof(path),
+				"%s/d%zu/f%zu", root, i, j);
+			if ((fd = open(path,
+			    O_WRONLY | O_CREAT | O_EXCL, 0644)) == -1)
+				err(EXIT_FAILURE, "%s", path);
+			close(fd);
+		}
+	}
+
+	for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+		opts.walk_threads = threads[i];
+		if ((argv[0] = strdup(root)) == NULL)
+			err(EXIT_FAILURE, "strdup");
+		fl = NULL;
+		flsz = 0;
+		t = bench_now();
+		if (!flist_gen(&sess, 1, argv, &fl, &flsz))
+			errx(EXIT_FAILURE, "flist_gen");
+		snprintf(name, sizeof(name),
+			"flist_gen/%zu-threads", threads[i]);
+		bench_report(name, bench_now() - t, 0, flsz);
+		free(argv[0]);
+		if (i < sizeof(threads) / sizeof(threads[0]) - 1)
+			flist_free(fl, flsz);
+	}
+
+	if ((fd = mkstemp(lpath)) == -1)
+		err(EXIT_FAILURE, "mkstemp");
+	unlink(lpath);
+
+	t = bench_now();
+	if (!flist_send(&sess, -1, fd, fl, flsz) ||
+	    !io_write_flush(&sess))
+		errx(EXIT_FAILURE, "flist_send");
+	bench_report("flist_send", bench_now() - t, 0, flsz);
+
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		err(EXIT_FAILURE, "lseek");
+	t = bench_now();
+	if (!flist_recv(&sess, fd, &rfl, &rflsz))
+		errx(EXIT_FAILURE, "flist_recv");
+	bench_report("flist_recv", bench_now() - t, 0, rflsz);
+	close(fd);
+
+	flist_free(fl, flsz);
+	flist_free(rfl, rflsz);
+
+	for (i = 0; i < DIRS; i++) {
+		for (j = 0; j < FILES; j++) {
+			snprintf(path, sizeof(path),
+				"%s/d%zu/f%zu", root, i, j);
+			unlink(path);
+		}
+		snprintf(path, sizeof(path), "%s/d%zu", root, i);
+		rmdir(path);
+	}
+	rmdir(root);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,104 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../extern.h"
+#include "../md4.h"
+#include "bench.h"
+
+/*
+ * Micro-benchmarks of the block hashes: the fast (rolling) hash over
+ * whole blocks and rolled a byte at a time, and the slow hash (MD4 and
+ * XXH64) one block at a time and several in parallel.
+ */
+
+#define	DATA_SIZE	(64 * 1024 * 1024)
+#define	LANES		8
+
+static const size_t blklens[] = { 700, 8 * 1024, 128 * 1024 };
+
+int
+main(void)
+{
+	struct sess	 sess;
+	struct opts	 opts;
+	struct hashroll	 r;
+	unsigned char	*buf, md[LANES][MD4_DIGEST_LENGTH];
+	unsigned char	*mds[LANES];
+	const void	*bufs[LANES];
+	char		 name[64];
+	size_t		 i, j, k, len, n;
+	double		 t;
+	volatile uint32_t sum = 0;
+
+	bench_sess(&sess, &opts);
+	if ((buf = malloc(DATA_SIZE)) == NULL)
+		return EXIT_FAILURE;
+	bench_fill(buf, DATA_SIZE, 1);
+	for (i = 0; i < LANES; i++)
+		mds[i] = md[i];
+
+	for (i = 0; i < sizeof(blklens) / sizeof(blklens[0]); i++) {
+		len = blklens[i];
+		n = DATA_SIZE / len;
+
+		t = bench_now();
+		for (j = 0; j < n; j++)
+			sum += hash_fast(buf + j * len, len);
+		snprintf(name, sizeof(name), "hash_fast/%zu", len);
+		bench_report(name, bench_now() - t, n * len, n);
+
+		for (sess.xxh = 0; sess.xxh <= 1; sess.xxh++) {
+			t = bench_now();
+			for (j = 0; j < n; j++)
+				hash_slow(buf + j * len, len, md[0], &sess);
+			snprintf(name, sizeof(name), "hash_slow/%s/%zu",
+				sess.xxh ? "xxh64" : "md4", len);
+			bench_report(name, bench_now() - t, n * len, n);
+
+			t = bench_now();
+			for (j = 0; j + LANES <= n; j += LANES) {
+				for (k = 0; k < LANES; k++)
+					bufs[k] = buf + (j + k) * len;
+				hash_slow_many(bufs, LANES, len, mds, &sess);
+			}
+			snprintf(name, sizeof(name), "hash_slow_many/%s/%zu",
+				sess.xxh ? "xxh64" : "md4", len);
+			bench_report(name, bench_now() - t, j * len, j);
+		}
+		sess.xxh = 0;
+	}
+
+	/* Rolling over every offset, as the sender does on a miss. */
+
+	len = blklens[0];
+	t = bench_now();
+	hash_roll_init(&r, buf, len);
+	for (j = len; j < DATA_SIZE; j++) {
+		hash_roll(&r, buf[j - len], buf[j]);
+		sum += hash_roll_sum(&r);
+	}
+	bench_report("hash_roll/700", bench_now() - t,
+		DATA_SIZE - len, DATA_SIZE - len);
+
+	free(buf);
+	return EXIT_SUCCESS;
+}
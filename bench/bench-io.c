@@ -0,0 +1,127 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../extern.h"
+#include "bench.h"
+
+/*
+ * Micro-benchmark of encoding and decoding integers into buffers, as
+ * done for the block signatures, and through the session's write and
+ * read-ahead buffers, as done for most of the protocol.
+ */
+
+#define	COUNT		(8 * 1024 * 1024)
+
+int
+main(void)
+{
+	struct sess	 sess;
+	struct opts	 opts;
+	char		*buf, path[] = "/tmp/bench-io.XXXXXX";
+	size_t		 i, pos;
+	int32_t		 v;
+	int64_t		 lv;
+	double		 t;
+	int		 fd, nullfd;
+	volatile int32_t sum = 0;
+
+	bench_sess(&sess, &opts);
+
+	if ((buf = malloc(COUNT * sizeof(int32_t))) == NULL)
+		err(EXIT_FAILURE, "malloc");
+	if ((nullfd = open("/dev/null", O_WRONLY, 0)) == -1)
+		err(EXIT_FAILURE, "/dev/null");
+
+	t = bench_now();
+	for (pos = i = 0; i < COUNT; i++)
+		io_buffer_int(&sess, buf, &pos,
+			COUNT * sizeof(int32_t), i);
+	bench_report("io_buffer_int", bench_now() - t,
+		COUNT * sizeof(int32_t), COUNT);
+
+	t = bench_now();
+	for (pos = i = 0; i < COUNT; i++) {
+		io_unbuffer_int(&sess, buf, &pos,
+			COUNT * sizeof(int32_t), &v);
+		sum += v;
+	}
+	bench_report("io_unbuffer_int", bench_now() - t,
+		COUNT * sizeof(int32_t), COUNT);
+
+	t = bench_now();
+	for (i = 0; i < COUNT; i++)
+		if (!io_write_int(&sess, nullfd, i))
+			errx(EXIT_FAILURE, "io_write_int");
+	if (!io_write_flush(&sess))
+		errx(EXIT_FAILURE, "io_write_flush");
+	bench_report("io_write_int", bench_now() - t,
+		COUNT * sizeof(int32_t), COUNT);
+
+	t = bench_now();
+	for (i = 0; i < COUNT; i++)
+		if (!io_write_long(&sess, nullfd, (int64_t)i << 32))
+			errx(EXIT_FAILURE, "io_write_long");
+	if (!io_write_flush(&sess))
+		errx(EXIT_FAILURE, "io_write_flush");
+	bench_report("io_write_long", bench_now() - t, 0, COUNT);
+
+	/* Read back what we've written to a file. */
+
+	if ((fd = mkstemp(path)) == -1)
+		err(EXIT_FAILURE, "mkstemp");
+	unlink(path);
+	for (i = 0; i < COUNT; i++)
+		if (!io_write_int(&sess, fd, i))
+			errx(EXIT_FAILURE, "io_write_int");
+	for (i = 0; i < COUNT; i++)
+		if (!io_write_long(&sess, fd, (int64_t)i << 32))
+			errx(EXIT_FAILURE, "io_write_long");
+	if (!io_write_flush(&sess))
+		errx(EXIT_FAILURE, "io_write_flush");
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		err(EXIT_FAILURE, "lseek");
+
+	t = bench_now();
+	for (i = 0; i < COUNT; i++) {
+		if (!io_read_int(&sess, fd, &v))
+			errx(EXIT_FAILURE, "io_read_int");
+		sum += v;
+	}
+	bench_report("io_read_int", bench_now() - t,
+		COUNT * sizeof(int32_t), COUNT);
+
+	t = bench_now();
+	for (i = 0; i < COUNT; i++) {
+		if (!io_read_long(&sess, fd, &lv))
+			errx(EXIT_FAILURE, "io_read_long");
+		sum += lv >> 32;
+	}
+	bench_report("io_read_long", bench_now() - t, 0, COUNT);
+
+	close(fd);
+	close(nullfd);
+	free(buf);
+	return EXIT_SUCCESS;
+}
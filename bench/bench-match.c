@@ -0,0 +1,160 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../extern.h"
+#include "../md4.h"
+#include "bench.h"
+
+/*
+ * Micro-benchmark of the sender's block matching, blk_match_step(), on
+ * a synthetic file of which a given ratio of blocks differ from those
+ * the receiver signed.
+ * The signature is read with blk_recv() like the real thing and the
+ * output goes to /dev/null.
+ * The file is DATA_MB, unless BENCH_MB says otherwise: blk_find() is
+ * only really put to work by big files with many blocks changed.
+ */
+
+#define	DATA_MB		(32)
+
+static const double ratios[] = { 0.0, 0.01, 0.1, 0.5, 1.0 };
+
+/*
+ * Write the signature of "buf" with blocks of "len" as it comes over
+ * the wire into a temporary file and read it back with blk_recv().
+ */
+static struct blkset *
+sign(struct sess *sess, const unsigned char *buf, size_t sz, size_t len)
+{
+	char		 path[] = "/tmp/bench-match.XXXXXX";
+	unsigned char	 md[MD4_DIGEST_LENGTH];
+	struct blkset	*blks;
+	size_t		 i, n, blen;
+	int		 fd;
+
+	n = (sz + len - 1) / len;
+	if ((fd = mkstemp(path)) == -1)
+		err(EXIT_FAILURE, "mkstemp");
+	unlink(path);
+
+	if (!io_write_int(sess, fd, n) ||
+	    !io_write_int(sess, fd, len) ||
+	    !io_write_int(sess, fd, CSUM_LENGTH_PHASE1) ||
+	    !io_write_int(sess, fd, sz % len))
+		errx(EXIT_FAILURE, "io_write_int");
+	for (i = 0; i < n; i++) {
+		blen = i == n - 1 && sz % len ? sz % len : len;
+		hash_slow(buf + i * len, blen, md, sess);
+		if (!io_write_int(sess, fd, hash_fast(buf + i * len, blen)) ||
+		    !io_write_buf(sess, fd, md, CSUM_LENGTH_PHASE1))
+			errx(EXIT_FAILURE, "io_write_buf");
+	}
+	if (!io_write_flush(sess))
+		errx(EXIT_FAILURE, "io_write_flush");
+
+	if (lseek(fd, 0, SEEK_SET) == -1)
+		err(EXIT_FAILURE, "lseek");
+	if ((blks = blk_recv(sess, fd, path)) == NULL)
+		errx(EXIT_FAILURE, "blk_recv");
+	close(fd);
+	return blks;
+}
+
+int
+main(void)
+{
+	struct sess	 sess;
+	struct opts	 opts;
+	struct blkset	*blks;
+	struct blkmatch	*bm;
+	unsigned char	*buf, *nbuf;
+	char		 path[] = "/tmp/bench-match.XXXXXX", name[64];
+	size_t		 i, j, len, sz, off;
+	ssize_t		 ssz;
+	uint32_t	 x = 1;
+	double		 t;
+	int		 fd, nullfd, c;
+
+	bench_sess(&sess, &opts);
+	sz = bench_size(DATA_MB);
+
+	if ((buf = malloc(sz)) == NULL ||
+	    (nbuf = malloc(sz)) == NULL)
+		err(EXIT_FAILURE, "malloc");
+	if ((nullfd = open("/dev/null", O_WRONLY, 0)) == -1)
+		err(EXIT_FAILURE, "/dev/null");
+
+	/* Blocks are sized as the uploader does. */
+
+	bench_fill(buf, sz, 1);
+	len = ceil(sqrt(sz));
+	if (len % 8)
+		len += 8 - len % 8;
+	if (len > BLOCK_SIZE_MAX)
+		len = BLOCK_SIZE_MAX;
+	blks = sign(&sess, buf, sz, len);
+
+	for (i = 0; i < sizeof(ratios) / sizeof(ratios[0]); i++) {
+		/* Change a few bytes in the given ratio of blocks. */
+
+		memcpy(nbuf, buf, sz);
+		for (j = 0; j < blks->blksz; j++) {
+			x = x * 1103515245 + 12345;
+			if ((x >> 8) % 10000 >= ratios[i] * 10000)
+				continue;
+			nbuf[j * len + (x >> 16) % blks->blks[j].len]++;
+		}
+
+		if ((fd = mkstemp(path)) == -1)
+			err(EXIT_FAILURE, "mkstemp");
+		for (off = 0; off < sz; off += ssz)
+			if ((ssz = write(fd, nbuf + off, sz - off)) == -1)
+				err(EXIT_FAILURE, "%s: write", path);
+		close(fd);
+
+		t = bench_now();
+		if ((bm = blk_match_alloc(&sess, blks, path)) == NULL)
+			errx(EXIT_FAILURE, "blk_match_alloc");
+		while ((c = blk_match_step(&sess, nullfd, bm)) > 0)
+			continue;
+		if (c < 0 || !io_write_flush(&sess))
+			errx(EXIT_FAILURE, "blk_match_step");
+		blk_match_free(bm);
+
+		snprintf(name, sizeof(name), "blk_match/%zu%%-changed",
+			(size_t)(ratios[i] * 100));
+		bench_report(name, bench_now() - t, sz, 0);
+
+		unlink(path);
+		memcpy(path + strlen(path) - 6, "XXXXXX", 6);
+	}
+
+	blkset_free(blks);
+	free(buf);
+	free(nbuf);
+	return EXIT_SUCCESS;
+}
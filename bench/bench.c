@@ -0,0 +1,108 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../extern.h"
+#include "bench.h"
+
+/*
+ * Fill "buf" with "sz" bytes of pseudo-random data from "seed", so runs
+ * are repeatable.
+ */
+void
+bench_fill(void *buf, size_t sz, uint32_t seed)
+{
+	unsigned char	*p = buf;
+	uint32_t	 x = seed ? seed : 1;
+	size_t		 i;
+
+	for (i = 0; i < sz; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		p[i] = x;
+	}
+}
+
+/*
+ * The size in bytes of the data a benchmark works over: "def" MB, or
+ * the MB in BENCH_MB if it's set in the environment.
+ */
+size_t
+bench_size(size_t def)
+{
+	const char		*cp;
+	char			*ep;
+	unsigned long long	 mb;
+
+	if ((cp = getenv("BENCH_MB")) == NULL || *cp == '\0')
+		return def * 1024 * 1024;
+	errno = 0;
+	mb = strtoull(cp, &ep, 10);
+	if (*ep != '\0' || errno != 0 || mb == 0 ||
+	    mb > SIZE_MAX / (1024 * 1024))
+		errx(EXIT_FAILURE, "BENCH_MB: %s: invalid", cp);
+	return mb * 1024 * 1024;
+}
+
+/*
+ * Seconds on the monotonic clock.
+ */
+double
+bench_now(void)
+{
+
+	return stats_now() / 1e9;
+}
+
+/*
+ * Print the rate of a benchmark that handled "bytes" bytes and "items"
+ * items (either may be zero) in "secs" seconds.
+ */
+void
+bench_report(const char *name, double secs, double bytes, double items)
+{
+
+	printf("%-32s %8.3f s", name, secs);
+	if (bytes > 0.0)
+		printf(" %10.1f MB/s", bytes / secs / (1024.0 * 1024.0));
+	if (items > 0.0)
+		printf(" %12.0f /s", items / secs);
+	putchar('\n');
+	fflush(stdout);
+}
+
+/*
+ * Set up a session as the server would, with default options.
+ */
+void
+bench_sess(struct sess *sess, struct opts *opts)
+{
+
+	memset(opts, 0, sizeof(struct opts));
+	memset(sess, 0, sizeof(struct sess));
+	sess->opts = opts;
+	sess->lver = sess->rver = RSYNC_PROTOCOL;
+	sess->seed = 0x5eed;
+}
@@ -0,0 +1,35 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * Shared by the micro-benchmarks in bench/, which are run by "make
+ * bench" along with bench/e2e.sh.
+ */
+
+__BEGIN_DECLS
+
+void	 bench_fill(void *, size_t, uint32_t);
+double	 bench_now(void);
+void	 bench_report(const char *, double, double, double);
+void	 bench_sess(struct sess *, struct opts *);
+size_t	 bench_size(size_t);
+
+__END_DECLS
+
+#endif /*!BENCH_H*/
@@ -0,0 +1,74 @@
+#! /bin/sh
+#	$Id$
+#
+# End-to-end benchmark of local transfers, which run the sender and the
+# receiver as two processes over a pipe like a remote transfer would.
+# Reports MB/s of file data and files/s from --stats-json.
+# The big file is 256 MB unless BENCH_MB says otherwise.
+#
+# Usage: [BENCH_MB=size] sh bench/e2e.sh [openrsync]
+
+set -e
+
+case "${1:-./openrsync}" in
+/*)	O="${1:-./openrsync}" ;;
+*)	O="$(pwd)/${1:-./openrsync}" ;;
+esac
+MB="${BENCH_MB:-256}"
+T="$(mktemp -d /tmp/bench-e2e.XXXXXX)"
+trap 'rm -rf "$T"' EXIT
+
+# Pull a field out of the final --stats-json line.
+
+field()
+{
+	sed -n 's/.*"'"$1"'": \([0-9.]*\).*/\1/p' "$T/stats" | tail -n 1
+}
+
+# Run a transfer with the given arguments and report its rates.
+
+run()
+{
+	name="$1"
+	shift
+	"$O" --rsync-path="$O" --stats-json "$@" > "$T/stats"
+	awk -v n="$name" -v e="$(field elapsed)" \
+	    -v l="$(field literal)" -v m="$(field matched)" \
+	    -v f="$(field files_xfer)" -v t="$(field files)" \
+	    'BEGIN { if (e <= 0) e = 0.001;
+		printf("%-32s %8.3f s %10.1f MB/s %12.1f files/s\n",
+		    n, e, (l + m) / e / 1048576, (f ? f : t) / e) }'
+}
+
+# Five directories of a thousand 4 KB files and one big file.
+
+mkdir -p "$T/src/small" "$T/src/big"
+for d in 0 1 2 3 4; do
+	mkdir "$T/src/small/$d"
+	dd if=/dev/urandom of="$T/chunk" bs=4096 count=1000 2>/dev/null
+	(cd "$T/src/small/$d" && split -b 4096 -a 3 "$T/chunk")
+done
+rm -f "$T/chunk"
+dd if=/dev/urandom of="$T/src/big/file" bs=1048576 count="$MB" 2>/dev/null
+
+run "small files" -rt "$T/src/small/" "$T/dst/small"
+run "small files, unchanged" -rt "$T/src/small/" "$T/dst/small"
+run "big file" -rt "$T/src/big/" "$T/dst/big"
+
+# Change a few scattered bytes for the delta transfer.
+
+for off in 1 4096 65536 1048576 16777216 134217728; do
+	[ "$off" -lt $((MB * 1048576)) ] || continue
+	printf x | dd of="$T/src/big/file" bs=1 seek="$off" \
+	    conv=notrunc 2>/dev/null
+done
+run "big file, delta" -r --no-whole-file "$T/src/big/" "$T/dst/big"
+run "big file, delta, -z" -rz --no-whole-file "$T/src/big/" "$T/dst/big"
+
+# Then rewrite three quarters of it, so that at most offsets the blocks
+# are looked up but not found.
+
+dd if=/dev/urandom of="$T/src/big/file" bs=1048576 count=$((MB * 3 / 4)) \
+    conv=notrunc 2>/dev/null
+run "big file, mostly changed" -r --no-whole-file \
+    "$T/src/big/" "$T/dst/big"
@@ -22,74 +22,159 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "md4.h"
+#include "xxhash.h"
 #include "extern.h"
 
 /*
- * Flush out "size" bytes of the buffer, doing all of the appropriate
- * chunking of the data, then the subsequent token (or zero).
+ * Index over a block set's fast hashes, built by the sender in
+ * blk_recv() so that blk_find() needn't scan every block.
+ * The bitmap is a cheap pre-filter keyed on 16 bits of the hash.
+ * Candidates are then found by walking the bucket's chain.
+ * Chains are terminated by BLKHASH_END.
+ */
+#define	BLKHASH_END	SIZE_MAX
+
+struct	blkhash {
+	uint8_t		 map[65536 / 8]; /* pre-filter bitmap */
+	unsigned int	 shift; /* 32 less log2(bucket count) */
+	size_t		*tab; /* first block in each bucket */
+	size_t		*next; /* next block in bucket */
+};
+
+/*
+ * The 16-bit pre-filter tag is the sum of the two halves of the fast
+ * hash, mixing both a(k, l) and b(k, l).
+ */
+#define	BLKHASH_TAG(_h) \
+	((uint16_t)((_h) + ((_h) >> 16)))
+
+/*
+ * Multiplicative (Fibonacci) hashing keeps the top bits.
+ */
+#define	BLKHASH_BUCKET(_p, _h) \
+	((uint32_t)((_h) * 2654435761U) >> (_p)->shift)
+
+/*
+ * Allocate the lookup index for "blksz" blocks, with no blocks yet.
+ * The bucket count is the smallest power of two at least as big as the
+ * number of blocks.
+ * Returns NULL on failure.
+ */
+static struct blkhash *
+blk_hash_alloc(struct sess *sess, size_t blksz)
+{
+	struct blkhash	*h;
+	size_t		 i, tabsz = 1;
+	unsigned int	 bits = 0;
+
+	assert(blksz > 0);
+
+	while (tabsz < blksz && bits < 31) {
+		tabsz <<= 1;
+		bits++;
+	}
+
+	if ((h = calloc(1, sizeof(struct blkhash))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	}
+	h->shift = 32 - bits;
+	h->tab = reallocarray(NULL, tabsz, sizeof(size_t));
+	h->next = reallocarray(NULL, blksz, sizeof(size_t));
+	if (h->tab == NULL || h->next == NULL) {
+		ERR(sess, "reallocarray");
+		free(h->tab);
+		free(h->next);
+		free(h);
+		return NULL;
+	}
+
+	for (i = 0; i < tabsz; i++)
+		h->tab[i] = BLKHASH_END;
+
+	LOG4(sess, "indexing %zu blocks into %zu buckets", blksz, tabsz);
+	return h;
+}
+
+/*
+ * Add block "i" with fast hash "fhash" to the lookup index.
+ * Blocks must be added in descending order: they're chained in
+ * ascending order so that lookups return the same block (the lowest
+ * index) as a linear scan would.
+ */
+static void
+blk_hash_add(struct blkhash *h, size_t i, uint32_t fhash)
+{
+	size_t	 j;
+
+	/* A shift of 32 is undefined, so special-case one bucket. */
+
+	j = h->shift < 32 ? BLKHASH_BUCKET(h, fhash) : 0;
+	h->next[i] = h->tab[j];
+	h->tab[j] = i;
+	h->map[BLKHASH_TAG(fhash) >> 3] |= 1 << (BLKHASH_TAG(fhash) & 7);
+}
+
+/*
+ * Flush out "size" bytes of the file in "m" from "offs", doing all of
+ * the appropriate chunking of the data, and add it to the file hash.
  * This is symmetrised in blk_merge().
  * Return zero on failure, non-zero on success.
  */
 static int
-blk_flush(struct sess *sess, int fd,
-	const void *b, off_t size, int32_t token)
+blk_flush_data(struct sess *sess, int fd, struct fmap *m,
+	off_t offs, off_t size, struct hashfile *ctx)
 {
-	off_t	i = 0, sz;
+	off_t		 sz;
+	const void	*b;
 
-	while (i < size) {
-		sz = MAX_CHUNK < (size - i) ?
-			MAX_CHUNK : (size - i);
-		if (!io_write_int(sess, fd, sz)) {
-			ERRX1(sess, "io_write_int");
+	while (size > 0) {
+		sz = MAX_CHUNK < size ? MAX_CHUNK : size;
+		if ((b = fmap_get(sess, m, offs, sz)) == NULL) {
+			ERRX1(sess, "fmap_get");
 			return 0;
-		} else if (!io_write_buf(sess, fd, b + i, sz)) {
-			ERRX1(sess, "io_write_buf");
+		} else if (!token_send_data(sess, fd, b, sz)) {
+			ERRX1(sess, "token_send_data");
 			return 0;
 		}
-		i += sz;
-	}
-
-	if (!io_write_int(sess, fd, token)) {
-		ERRX1(sess, "io_write_int");
-		return 0;
+		hash_file_update(ctx, b, sz);
+		sess->stats.literal += sz;
+		offs += sz;
+		size -= sz;
 	}
 
 	return 1;
 }
 
 /*
- * From our current position of "offs" in buffer "buf" of total size
- * "size", see if we can find a matching block in our list of blocks.
+ * From our current position of "offs" in the file, with "remain" bytes
+ * of the file in "buf" from there on (at least as many as a block),
+ * see if we can find a matching block in our list of blocks.
+ * The "fhash" is the fast hash of the block-sized (or shorter, at the
+ * end of the file) window at "offs", as rolled by our caller.
  * The "hint" refers to the block that *might* work.
  * Returns the blk or NULL if no matching block was found.
  */
 static struct blk *
-blk_find(struct sess *sess, const void *buf, off_t size, off_t offs,
-	const struct blkset *blks, const char *path, size_t hint)
+blk_find(struct sess *sess, const void *buf, off_t remain, off_t offs,
+	const struct blkset *blks, const char *path, size_t hint,
+	uint32_t fhash)
 {
-	unsigned char	 md[MD4_DIGEST_LENGTH];
-	uint32_t	 fhash;
-	off_t		 remain, osz;
+	unsigned char	 md[CSUM_LENGTH_PHASE2];
+	off_t		 osz;
 	size_t		 i;
 	int		 have_md = 0;
+	const struct blkhash *h;
 
-	/*
-	 * First, compute our fast hash.
-	 * FIXME: yes, this can be a rolling computation, but I'm
-	 * deliberately making it simple first.
-	 */
-
-	remain = size - offs;
 	assert(remain);
 	osz = remain < (off_t)blks->len ? remain : (off_t)blks->len;
-	fhash = hash_fast(buf + offs, (size_t)osz);
-	have_md = 0;
 
 	/*
 	 * Start with our match hint.
@@ -99,7 +184,7 @@ blk_find(struct sess *sess, const void *buf, off_t size, off_t offs,
 	if (hint < blks->blksz &&
 	    fhash == blks->blks[hint].chksum_short &&
 	    (size_t)osz == blks->blks[hint].len) {
-		hash_slow(buf + offs, (size_t)osz, md, sess);
+		hash_slow(buf, (size_t)osz, md, sess);
 		have_md = 1;
 		if (memcmp(md, blks->blks[hint].chksum_long, blks->csum) == 0) {
 			LOG4(sess, "%s: found matching hinted match: "
@@ -113,11 +198,22 @@ blk_find(struct sess *sess, const void *buf, off_t size, off_t offs,
 	}
 
 	/*
-	 * Now loop and look for the fast hash.
+	 * Now look for the fast hash.
+	 * The pre-filter bitmap rules out most misses without touching
+	 * the buckets; otherwise, only walk blocks in the same bucket.
 	 * If it's found, move on to the slow hash.
 	 */
 
-	for (i = 0; i < blks->blksz; i++) {
+	h = blks->hash;
+	assert(h != NULL);
+
+	if (!(h->map[BLKHASH_TAG(fhash) >> 3] &
+	    (1 << (BLKHASH_TAG(fhash) & 7))))
+		return NULL;
+
+	i = h->shift < 32 ? BLKHASH_BUCKET(h, fhash) : 0;
+
+	for (i = h->tab[i]; i != BLKHASH_END; i = h->next[i]) {
 		if (fhash != blks->blks[i].chksum_short)
 			continue;
 		if ((size_t)osz != blks->blks[i].len)
@@ -133,7 +229,7 @@ blk_find(struct sess *sess, const void *buf, off_t size, off_t offs,
 		/* Compute slow hash on demand. */
 
 		if (have_md == 0) {
-			hash_slow(buf + offs, (size_t)osz, md, sess);
+			hash_slow(buf, (size_t)osz, md, sess);
 			have_md = 1;
 		}
 
@@ -147,6 +243,103 @@ blk_find(struct sess *sess, const void *buf, off_t size, off_t offs,
 	return NULL;
 }
 
+/*
+ * The sender's progress in matching a file against a block set.
+ * See blk_match_step().
+ */
+struct	blkmatch {
+	const struct blkset *blks; /* the receiver's blocks */
+	const char	*path; /* file being matched */
+	int		 fd; /* its descriptor */
+	off_t		 size; /* its size */
+	struct fmap	 m; /* window over the file */
+	struct hashfile	 ctx; /* file hash so far */
+	struct hashroll	 roll; /* fast hash at offs */
+	int		 rehash; /* roll must be reinitialised */
+	off_t		 offs; /* position of scan */
+	off_t		 last; /* first byte not yet sent */
+	off_t		 end; /* scan stops here */
+	size_t		 hint; /* next block that probably matches */
+	off_t		 fromcopy; /* bytes sent as tokens */
+	off_t		 fromdown; /* bytes sent as data */
+};
+
+/*
+ * Start matching the local file "path" against the blocks created by a
+ * remote machine, to find out which blocks of our file they don't have.
+ * The file is read through a window in one pass, so we don't care how
+ * big it is, and once we're done with the data we needn't keep it
+ * cached.
+ * Returns NULL on failure.
+ * On success, blk_match_free() must be called with the pointer.
+ */
+struct blkmatch *
+blk_match_alloc(struct sess *sess,
+	const struct blkset *blks, const char *path)
+{
+	struct blkmatch	*p;
+	struct stat	 st;
+
+	if ((p = calloc(1, sizeof(struct blkmatch))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	}
+
+	p->blks = blks;
+	p->path = path;
+	if ((p->fd = open(path, O_RDONLY, 0)) == -1) {
+		ERR(sess, "%s: open", path);
+		free(p);
+		return NULL;
+	} else if (fstat(p->fd, &st) == -1) {
+		ERR(sess, "%s: fstat", path);
+		close(p->fd);
+		free(p);
+		return NULL;
+	}
+
+	p->size = st.st_size;
+	fmap_init(&p->m, p->fd, p->size, FMAP_DROP);
+
+	/*
+	 * The file hash is seeded at the beginning (unlike the block
+	 * hashes) and built up as the file is sent.
+	 * Since we're seeding the hash, this always gives us some sort
+	 * of data even if the file's zero-length.
+	 */
+
+	hash_file_init(&p->ctx, sess);
+
+	/*
+	 * If the file's empty or we don't have any blocks from the
+	 * sender, then we simply send the whole file.
+	 * Otherwise, stop searching at the length of the file minus the
+	 * size of the last block.
+	 * The reason for this being that we don't need to do an
+	 * incremental hash within the last block---if it doesn't match,
+	 * it doesn't match.
+	 */
+
+	if (p->size && blks->blksz)
+		p->end = p->size + 1 - blks->blks[blks->blksz - 1].len;
+	p->rehash = 1;
+	return p;
+}
+
+/*
+ * Passing a NULL to this function is ok.
+ */
+void
+blk_match_free(struct blkmatch *p)
+{
+
+	if (p == NULL)
+		return;
+	fmap_free(&p->m);
+	close(p->fd);
+	free(p);
+}
+
 /*
  * The main reconstruction algorithm on the sender side.
  * Scans byte-wise over the input file, looking for matching blocks in
@@ -154,161 +347,233 @@ blk_find(struct sess *sess, const void *buf, off_t size, off_t offs,
  * If a block is found, emit all data up until the block, then the token
  * for the block.
  * The receiving end can then reconstruct the file trivially.
- * Return zero on failure, non-zero on success.
+ * This part broadly symmetrises blk_merge().
+ * Each call does a bounded amount of work: it returns after it's sent
+ * some data or a token, so at most a chunk is scanned.
+ * Returns <0 on failure, 0 once the file (and its hash) has been sent,
+ * >0 if there's more to do.
  */
-static int
-blk_match_send(struct sess *sess, const char *path, int fd,
-	const void *buf, off_t size, const struct blkset *blks)
+int
+blk_match_step(struct sess *sess, int fd, struct blkmatch *p)
 {
-	off_t		 offs, last, end, fromcopy = 0, fromdown = 0,
-			 total = 0, sz;
-	int32_t		 tok;
+	const struct blkset *blks = p->blks;
+	off_t		 sz, need, woffs = 0, wend = 0;
 	struct blk	*blk;
-	size_t		 hint = 0;
+	const uint8_t	*win = NULL;
+	const void	*b;
+	unsigned char	 filemd[HASH_FILE_MAX];
+	size_t		 mdsz;
 
-	/*
-	 * Stop searching at the length of the file minus the size of
-	 * the last block.
-	 * The reason for this being that we don't need to do an
-	 * incremental hash within the last block---if it doesn't match,
-	 * it doesn't match.
-	 */
+	for ( ; p->offs < p->end; p->offs++) {
+		/*
+		 * Our window into the file, "win", starts at "woffs".
+		 * It must hold the unsent data from "last", the block
+		 * at "offs", and the byte after it to roll in.
+		 * Unsent data is kept under a chunk (see below), so
+		 * this is bounded by the block size.
+		 */
+
+		need = p->offs + (off_t)blks->len + 1;
+		if (need > p->size)
+			need = p->size;
+		if (win == NULL || need > wend) {
+			win = fmap_get(sess, &p->m, p->last, need - p->last);
+			if (win == NULL) {
+				ERRX1(sess, "fmap_get");
+				return -1;
+			}
+			woffs = p->last;
+			wend = p->m.offs + p->m.len;
+		}
 
-	end = size + 1 - blks->blks[blks->blksz - 1].len;
+		/*
+		 * The fast hash is computed in full only at the start
+		 * and after jumping over a matched block.
+		 * Otherwise, it's rolled forward by one byte, shrinking
+		 * the window if we've run into the end of the file.
+		 */
 
-	for (last = offs = 0; offs < end; offs++) {
-		blk = blk_find(sess, buf, size,
-			offs, blks, path, hint);
-		if (blk == NULL)
-			continue;
+		if (p->rehash) {
+			sz = p->size - p->offs < (off_t)blks->len ?
+				p->size - p->offs : (off_t)blks->len;
+			hash_roll_init(&p->roll, win + (p->offs - woffs),
+				(size_t)sz);
+			p->rehash = 0;
+		}
+
+		blk = blk_find(sess, win + (p->offs - woffs),
+			p->size - p->offs, p->offs, blks, p->path,
+			p->hint, hash_roll_sum(&p->roll));
+
+		if (blk == NULL) {
+			if (p->offs + (off_t)p->roll.len < p->size)
+				hash_roll(&p->roll, win[p->offs - woffs],
+					win[p->offs + p->roll.len - woffs]);
+			else
+				hash_roll_out(&p->roll, win[p->offs - woffs]);
+
+			/*
+			 * Send unmatched data as soon as we have a full
+			 * chunk (as blk_flush_data() would chunk it anyway)
+			 * so that we needn't hold onto it.
+			 */
+
+			if (p->offs + 1 - p->last < MAX_CHUNK)
+				continue;
+			if (!blk_flush_data(sess, fd,
+			    &p->m, p->last, MAX_CHUNK, &p->ctx)) {
+				ERRX1(sess, "blk_flush_data");
+				return -1;
+			}
+			p->fromdown += MAX_CHUNK;
+			p->last = ++p->offs;
+			return 1;
+		}
 
-		sz = offs - last;
-		fromdown += sz;
-		total += sz;
+		sz = p->offs - p->last;
+		p->fromdown += sz;
 		LOG4(sess, "%s: flushing %jd B before %zu B "
-			"block %zu", path, (intmax_t)sz, blk->len,
+			"block %zu", p->path, (intmax_t)sz, blk->len,
 			blk->idx);
-		tok = -(blk->idx + 1);
 
 		/*
 		 * Write the data we have, then follow it with the tag
 		 * of the block that matches.
 		 * The receiver will then write our data, then the data
 		 * it already has in the matching block.
+		 * The block still goes into our file hash.
 		 */
 
-		if (!blk_flush(sess, fd, buf + last, sz, tok)) {
-			ERRX1(sess, "blk_flush");
-			return 0;
+		if (!blk_flush_data(sess, fd, &p->m, p->last, sz, &p->ctx)) {
+			ERRX1(sess, "blk_flush_data");
+			return -1;
+		} else if ((b = fmap_get(sess,
+		    &p->m, p->offs, blk->len)) == NULL) {
+			ERRX1(sess, "fmap_get");
+			return -1;
+		} else if (!token_send_block(sess,
+		    fd, blk->idx, b, blk->len)) {
+			ERRX1(sess, "token_send_block");
+			return -1;
 		}
-
-		fromcopy += blk->len;
-		total += blk->len;
-		offs += blk->len - 1;
-		last = offs + 1;
-		hint = blk->idx + 1;
+		hash_file_update(&p->ctx, b, blk->len);
+
+		sess->stats.matched += blk->len;
+		p->fromcopy += blk->len;
+		p->offs += blk->len;
+		p->last = p->offs;
+		p->hint = blk->idx + 1;
+		p->rehash = 1;
+		return 1;
 	}
 
-	/* Emit remaining data and send terminator token. */
+	/* Emit remaining data a chunk at a time. */
 
-	sz = size - last;
-	total += sz;
-	fromdown += sz;
+	if ((sz = p->size - p->last) > MAX_CHUNK)
+		sz = MAX_CHUNK;
 
-	LOG4(sess, "%s: flushing remaining %jd B", path, (intmax_t)sz);
+	if (sz > 0) {
+		if (!blk_flush_data(sess, fd, &p->m, p->last, sz, &p->ctx)) {
+			ERRX1(sess, "blk_flush_data");
+			return -1;
+		}
+		p->fromdown += sz;
+		p->last += sz;
+		if (p->last < p->size)
+			return 1;
+	}
 
-	if (!blk_flush(sess, fd, buf + last, sz, 0)) {
-		ERRX1(sess, "blk_flush");
-		return 0;
+	/* Send terminator token and the full file hash. */
+
+	mdsz = hash_file_final(&p->ctx, filemd);
+
+	if (!token_send_end(sess, fd)) {
+		ERRX1(sess, "token_send_end");
+		return -1;
+	} else if (!io_write_buf(sess, fd, filemd, mdsz)) {
+		ERRX1(sess, "io_write_buf");
+		return -1;
 	}
 
-	LOG3(sess, "%s: flushed (chunked) %jd B total, "
-		"%.2f%% upload ratio", path, (intmax_t)total,
-		100.0 * fromdown / total);
-	return 1;
+	if (p->end > 0)
+		LOG3(sess, "%s: flushed (chunked) %jd B total, "
+			"%.2f%% upload ratio", p->path, (intmax_t)p->size,
+			100.0 * p->fromdown / p->size);
+	else
+		LOG3(sess, "%s: flushed (un-chunked) %jd B, "
+			"100%% upload ratio", p->path, (intmax_t)p->size);
+	return 0;
 }
 
 /*
- * Given a local file "path" and the blocks created by a remote machine,
- * find out which blocks of our file they don't have and send them.
- * Return zero on failure, non-zero on success.
+ * Pick the block length for a file of "sz" bytes.
+ * A block costs its checksums in the signature and, if data in it has
+ * changed, its length in literal data: for "c" changes in the file,
+ * the total is least at around sqrt(sz / c).
+ * Like the reference rsync, we start by assuming one change, so use the
+ * rounded square root of the file size, at least BLOCK_SIZE_MIN and at
+ * most BLOCK_SIZE_MAX.
+ * Once we've received a few files for which we had blocks, we instead
+ * estimate the changes from how many runs of literal data they had per
+ * byte, allowing smaller blocks for files that change a lot.
+ * With --block-size, we use that.
  */
-int
-blk_match(struct sess *sess, int fd,
-	const struct blkset *blks, const char *path)
+size_t
+blkset_len(const struct sess *sess, off_t sz)
 {
-	int		 nfd = -1, rc = 0, c;
-	struct stat	 st;
-	void		*map = MAP_FAILED;
-	size_t		 mapsz;
-	unsigned char	 filemd[MD4_DIGEST_LENGTH];
-
-	/* Start by mapping our file into memory. */
-
-	if ((nfd = open(path, O_RDONLY, 0)) == -1) {
-		ERR(sess, "%s: open", path);
-		goto out;
-	} else if (fstat(nfd, &st) == -1) {
-		ERR(sess, "%s: fstat", path);
-		goto out;
+	const struct stats *st = &sess->stats;
+	double		 c = 1.0;
+	size_t		 len, min = BLOCK_SIZE_MIN;
+
+	if (sess->opts->block_size > 0)
+		return sess->opts->block_size;
+
+	if (st->delta_files >= BLOCK_LEARN_FILES && st->delta_size > 0) {
+		c = (double)st->delta_runs / st->delta_size * sz;
+		if (c > 1.0)
+			min = BLOCK_SIZE_LEARN_MIN;
+		else
+			c = 1.0;
 	}
 
-	/*
-	 * We might possibly have a zero-length file, in which case the
-	 * mmap() will fail, so only do this with non-zero files.
-	 */
-
-	if ((mapsz = st.st_size) > 0) {
-		map = mmap(NULL, mapsz, PROT_READ, MAP_SHARED, nfd, 0);
-		if (map == MAP_FAILED) {
-			ERR(sess, "%s: mmap", path);
-			goto out;
-		}
-	}
+	len = ceil(sqrt(sz / c));
 
 	/*
-	 * If the file's empty or we don't have any blocks from the
-	 * sender, then simply send the whole file.
-	 * Otherwise, run the hash matching routine and send raw chunks
-	 * and subsequent matching tokens.
-	 * This part broadly symmetrises blk_merge().
+	 * Always be a multiple of eight.
+	 * There's no reason to do this, but rsync does.
 	 */
 
-	if (st.st_size && blks->blksz) {
-		c = blk_match_send(sess, path, fd, map, st.st_size, blks);
-		if (!c) {
-			ERRX1(sess, "blk_match_send");
-			goto out;
-		}
-	} else {
-		if (!blk_flush(sess, fd, map, st.st_size, 0)) {
-			ERRX1(sess, "blk_flush");
-			goto out;
-		}
-		LOG3(sess, "%s: flushed (un-chunked) %jd B, 100%% upload ratio",
-		    path, (intmax_t)st.st_size);
-	}
+	if ((len % 8) > 0)
+		len += 8 - (len % 8);
 
-	/*
-	 * Now write the full file hash.
-	 * Since we're seeding the hash, this always gives us some sort
-	 * of data even if the file's zero-length.
-	 */
+	if (len < min)
+		len = min;
+	else if (len > BLOCK_SIZE_MAX)
+		len = BLOCK_SIZE_MAX;
+	return len;
+}
 
-	hash_file(map, st.st_size, filemd, sess);
+/*
+ * Prepare the overall block set's metadata for a file of "sz" bytes in
+ * blocks of "len", usually from blkset_len().
+ * We always have at least one block.
+ */
+void
+blkset_init(struct blkset *p, off_t sz, size_t len)
+{
 
-	if (!io_write_buf(sess, fd, filemd, MD4_DIGEST_LENGTH)) {
-		ERRX1(sess, "io_write_buf");
-		goto out;
-	}
+	assert(len > 0);
+	p->len = len;
+	p->size = sz;
+	if ((p->blksz = sz / p->len) == 0)
+		p->rem = sz;
+	else
+		p->rem = sz % p->len;
 
-	rc = 1;
-out:
-	if (map != MAP_FAILED)
-		munmap(map, mapsz);
-	if (-1 != nfd)
-		close(nfd);
-	return rc;
+	/* If we have a remainder, then we need an extra block. */
+
+	if (p->rem)
+		p->blksz++;
 }
 
 /* FIXME: remove. */
@@ -318,6 +583,11 @@ blkset_free(struct blkset *p)
 
 	if (p == NULL)
 		return;
+	if (p->hash != NULL) {
+		free(p->hash->tab);
+		free(p->hash->next);
+		free(p->hash);
+	}
 	free(p->blks);
 	free(p);
 }
@@ -360,9 +630,9 @@ blk_recv(struct sess *sess, int fd, const char *path)
 {
 	struct blkset	*s;
 	int32_t		 i;
-	size_t		 j;
+	size_t		 j, pos, sz, blkbufsz;
 	struct blk	*b;
-	off_t		 offs = 0;
+	char		 hdr[16], *blkbuf = NULL;
 
 	if ((s = calloc(1, sizeof(struct blkset))) == NULL) {
 		ERR(sess, "calloc");
@@ -372,79 +642,113 @@ blk_recv(struct sess *sess, int fd, const char *path)
 	/*
 	 * The block prologue consists of a few values that we'll need
 	 * in reading the individual blocks for this file.
-	 * FIXME: read into buffer and unbuffer.
 	 */
 
-	if (!io_read_size(sess, fd, &s->blksz)) {
-		ERRX1(sess, "io_read_size");
+	sz = sizeof(int32_t) + /* block count */
+	     sizeof(int32_t) + /* block length */
+	     sizeof(int32_t) + /* checksum length */
+	     sizeof(int32_t); /* block remainder */
+	assert(sz <= sizeof(hdr));
+
+	pos = 0;
+	if (!io_read_buf(sess, fd, hdr, sz)) {
+		ERRX1(sess, "io_read_buf");
+		goto out;
+	} else if (!io_unbuffer_size(sess, hdr, &pos, sz, &s->blksz)) {
+		ERRX1(sess, "io_unbuffer_size");
 		goto out;
-	} else if (!io_read_size(sess, fd, &s->len)) {
-		ERRX1(sess, "io_read_size");
+	} else if (!io_unbuffer_size(sess, hdr, &pos, sz, &s->len)) {
+		ERRX1(sess, "io_unbuffer_size");
 		goto out;
-	} else if (!io_read_size(sess, fd, &s->csum)) {
-		ERRX1(sess, "io_read_int");
+	} else if (!io_unbuffer_size(sess, hdr, &pos, sz, &s->csum)) {
+		ERRX1(sess, "io_unbuffer_size");
 		goto out;
-	} else if (!io_read_size(sess, fd, &s->rem)) {
-		ERRX1(sess, "io_read_int");
+	} else if (!io_unbuffer_size(sess, hdr, &pos, sz, &s->rem)) {
+		ERRX1(sess, "io_unbuffer_size");
 		goto out;
 	} else if (s->rem && s->rem >= s->len) {
 		ERRX(sess, "block remainder is "
 			"greater than block size");
 		goto out;
+	} else if (s->csum > hash_slow_len(sess)) {
+		ERRX(sess, "block checksum is too long");
+		goto out;
+	} else if (s->blksz && s->len == 0) {
+		ERRX(sess, "block length is zero");
+		goto out;
 	}
 
 	LOG3(sess, "%s: read block prologue: %zu blocks of "
 		"%zu B, %zu B remainder, %zu B checksum", path,
 		s->blksz, s->len, s->rem, s->csum);
 
-	if (s->blksz) {
-		s->blks = calloc(s->blksz, sizeof(struct blk));
-		if (s->blks == NULL) {
-			ERR(sess, "calloc");
-			goto out;
-		}
+	/*
+	 * No blocks (and no length) is what's sent for files that don't
+	 * exist or are sent whole.
+	 * Otherwise, make sure the blocks can describe a file of sane
+	 * size, which also bounds the buffer we read them into.
+	 */
+
+	if (s->blksz == 0) {
+		s->size = 0;
+		LOG3(sess, "%s: read blocks: 0 blocks, 0 B total "
+			"blocked data", path);
+		return s;
+	} else if (s->blksz > (SIZE_MAX - s->len) / s->len ||
+	    (off_t)(s->blksz * s->len) < 0) {
+		ERRX(sess, "block set is too large");
+		goto out;
 	}
 
 	/*
-	 * Read each block individually.
-	 * FIXME: read buffer and unbuffer.
+	 * Read all of the blocks at once, then decode them.
+	 * We decode from the last block back so that we can build the
+	 * lookup index as we go.
 	 */
 
-	for (j = 0; j < s->blksz; j++) {
-		b = &s->blks[j];
-		if (!io_read_int(sess, fd, &i)) {
-			ERRX1(sess, "io_read_int");
-			goto out;
-		}
-		b->chksum_short = i;
+	blkbufsz = sizeof(int32_t) + s->csum;
+	if ((blkbuf = reallocarray(NULL, s->blksz, blkbufsz)) == NULL) {
+		ERR(sess, "reallocarray");
+		goto out;
+	} else if ((s->blks = calloc(s->blksz, sizeof(struct blk))) == NULL) {
+		ERR(sess, "calloc");
+		goto out;
+	} else if ((s->hash = blk_hash_alloc(sess, s->blksz)) == NULL) {
+		ERRX1(sess, "blk_hash_alloc");
+		goto out;
+	} else if (!io_read_buf(sess, fd, blkbuf, s->blksz * blkbufsz)) {
+		ERRX1(sess, "io_read_buf");
+		goto out;
+	}
 
-		assert(s->csum <= sizeof(b->chksum_long));
-		if (!io_read_buf(sess,
-		    fd, b->chksum_long, s->csum)) {
-			ERRX1(sess, "io_read_buf");
-			goto out;
-		}
+	for (j = s->blksz; j > 0; j--) {
+		b = &s->blks[j - 1];
+		pos = (j - 1) * blkbufsz;
+		io_unbuffer_int(sess, blkbuf,
+			&pos, s->blksz * blkbufsz, &i);
+		b->chksum_short = i;
+		io_unbuffer_buf(sess, blkbuf, &pos,
+			s->blksz * blkbufsz, b->chksum_long, s->csum);
 
 		/*
 		 * If we're the last block, then we're assigned the
 		 * remainder of the data.
 		 */
 
-		b->offs = offs;
-		b->idx = j;
-		b->len = (j == (s->blksz - 1) && s->rem) ?
-			s->rem : s->len;
-		offs += b->len;
-
-		LOG4(sess, "%s: read block %zu, "
-			"length %zu B", path, b->idx, b->len);
+		b->idx = j - 1;
+		b->offs = (off_t)b->idx * s->len;
+		b->len = (j == s->blksz && s->rem) ? s->rem : s->len;
+		blk_hash_add(s->hash, b->idx, b->chksum_short);
 	}
 
-	s->size = offs;
+	s->size = (off_t)(s->blksz - 1) * s->len + s->blks[s->blksz - 1].len;
+	free(blkbuf);
+
 	LOG3(sess, "%s: read blocks: %zu blocks, %jd B total "
 		"blocked data", path, s->blksz, (intmax_t)s->size);
 	return s;
 out:
+	free(blkbuf);
 	blkset_free(s);
 	return NULL;
 }
@@ -482,7 +786,7 @@ blk_send_ack(struct sess *sess, int fd, struct blkset *p)
 		ERRX1(sess, "io_unbuffer_size");
 	else if (p->len && p->rem >= p->len)
 		ERRX1(sess, "non-zero length is less than remainder");
-	else if (p->csum == 0 || p->csum > 16)
+	else if (p->csum == 0 || p->csum > hash_slow_len(sess))
 		ERRX1(sess, "inappropriate checksum length");
 	else
 		return 1;
@@ -506,19 +810,17 @@ blk_merge(struct sess *sess, int fd, int ffd,
 	void		*pp;
 	ssize_t		 ssz;
 	int		 rc = 0;
-	unsigned char	 md[MD4_DIGEST_LENGTH],
-			 ourmd[MD4_DIGEST_LENGTH];
+	unsigned char	 md[HASH_FILE_MAX],
+			 ourmd[HASH_FILE_MAX];
+	size_t		 mdsz;
 	off_t		 total = 0, fromcopy = 0, fromdown = 0;
-	MD4_CTX		 ctx;
-
-	MD4_Init(&ctx);
+	struct hashfile	 ctx;
 
-	rawtok = htole32(sess->seed);
-	MD4_Update(&ctx, (unsigned char *)&rawtok, sizeof(int32_t));
+	hash_file_init(&ctx, sess);
 
 	for (;;) {
 		/*
-		 * This matches the sequence in blk_flush().
+		 * This matches the sequence in blk_match_step().
 		 * We read the size/token, then optionally the data.
 		 * The size >0 for reading data, 0 for no more data, and
 		 * <0 for a token indicator.
@@ -555,7 +857,7 @@ blk_merge(struct sess *sess, int fd, int ffd,
 			LOG4(sess, "%s: received %zd B block, now %jd "
 				"B total", path, ssz, (intmax_t)total);
 
-			MD4_Update(&ctx, buf, sz);
+			hash_file_update(&ctx, buf, sz);
 		} else {
 			tok = -rawtok - 1;
 			if (tok >= block->blksz) {
@@ -591,20 +893,20 @@ blk_merge(struct sess *sess, int fd, int ffd,
 				"B total", path, block->blks[tok].len,
 				(intmax_t)total);
 
-			MD4_Update(&ctx, map + block->blks[tok].offs,
+			hash_file_update(&ctx, map + block->blks[tok].offs,
 			    block->blks[tok].len);
 		}
 	}
 
 
-	/* Make sure our resulting MD4_ hashes match. */
+	/* Make sure our resulting file hashes match. */
 
-	MD4_Final(ourmd, &ctx);
+	mdsz = hash_file_final(&ctx, ourmd);
 
-	if (!io_read_buf(sess, fd, md, MD4_DIGEST_LENGTH)) {
+	if (!io_read_buf(sess, fd, md, mdsz)) {
 		ERRX1(sess, "io_read_buf");
 		goto out;
-	} else if (memcmp(md, ourmd, MD4_DIGEST_LENGTH)) {
+	} else if (memcmp(md, ourmd, mdsz)) {
 		ERRX(sess, "%s: file hash does not match", path);
 		goto out;
 	}
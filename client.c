@@ -39,6 +39,7 @@ int
 rsync_client(const struct opts *opts, int fd, const struct fargs *f)
 {
 	struct sess	 sess;
+	uint32_t	 caps;
 	int		 rc = 0;
 
 	/* Standard rsync preamble, sender side. */
@@ -46,6 +47,7 @@ rsync_client(const struct opts *opts, int fd, const struct fargs *f)
 	memset(&sess, 0, sizeof(struct sess));
 	sess.opts = opts;
 	sess.lver = RSYNC_PROTOCOL;
+	sess.stats.start = stats_now();
 
 	if (!io_write_int(&sess, fd, sess.lver)) {
 		ERRX1(&sess, "io_write_int");
@@ -58,6 +60,36 @@ rsync_client(const struct opts *opts, int fd, const struct fargs *f)
 		goto out;
 	}
 
+	/*
+	 * An openrsync server agreeing to our extensions flags them
+	 * above its version.
+	 * It mustn't do so unless we've asked.
+	 */
+
+	caps = (uint32_t)sess.rver >> RSYNC_CAP_SHIFT;
+	sess.rver &= (1 << RSYNC_CAP_SHIFT) - 1;
+
+	if (caps & ~(RSYNC_CAP_INC_FLIST | RSYNC_CAP_XXH)) {
+		ERRX(&sess, "unknown server extensions: %#" PRIx32, caps);
+		goto out;
+	}
+	if (caps & RSYNC_CAP_INC_FLIST) {
+		if (!fargs_inc_flist(opts)) {
+			ERRX(&sess, "server sent unrequested "
+				"incremental file list");
+			goto out;
+		}
+		sess.inc_flist = 1;
+	}
+	if (caps & RSYNC_CAP_XXH) {
+		if (!fargs_xxh(opts)) {
+			ERRX(&sess, "server sent unrequested "
+				"XXH64 checksums");
+			goto out;
+		}
+		sess.xxh = 1;
+	}
+
 	if (sess.rver < sess.lver) {
 		ERRX(&sess, "remote protocol is older "
 			"than our own (%" PRId32 " < %" PRId32 "): "
@@ -67,11 +99,23 @@ rsync_client(const struct opts *opts, int fd, const struct fargs *f)
 	}
 
 	LOG2(&sess, "client detected client version %" PRId32
-		", server version %" PRId32 ", seed %" PRId32,
-		sess.lver, sess.rver, sess.seed);
+		", server version %" PRId32 ", seed %" PRId32 ", %s",
+		sess.lver, sess.rver, sess.seed, sess.xxh ? "XXH64" : "MD4");
 
 	sess.mplex_reads = 1;
 
+	/*
+	 * The batch (--write-batch) records what the sender sends, so
+	 * what we write if we're the sender, otherwise what we read.
+	 */
+
+	if (opts->write_batch != NULL &&
+	    (sess.batch = batch_open(&sess, opts->write_batch,
+	     FARGS_RECEIVER != f->mode)) == NULL) {
+		ERRX1(&sess, "batch_open");
+		goto out;
+	}
+
 	/*
 	 * Now we need to get our list of files.
 	 * Senders (and locals) send; receivers receive.
@@ -100,7 +144,13 @@ rsync_client(const struct opts *opts, int fd, const struct fargs *f)
 		WARNX(&sess, "data remains in read pipe");
 #endif
 
+	if (sess.batch != NULL && !batch_close(&sess, sess.batch)) {
+		ERRX1(&sess, "batch_close");
+		goto out;
+	}
+
 	rc = 1;
 out:
+	batch_free(sess.batch);
 	return rc;
 }
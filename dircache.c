@@ -0,0 +1,192 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * Most directories kept open.
+ */
+#define	DIRCACHE_MAX	32
+
+/*
+ * Open directories of the destination, so that files may be looked up
+ * from their parent rather than with their whole path from the root,
+ * which has the kernel look up every component again, every time.
+ * As the file list is sorted, files come directory by directory, and a
+ * few directories are enough.
+ * The least recently used is closed to make room for another.
+ */
+struct	dircent {
+	char		*path; /* directory from the root */
+	size_t		 pathlen; /* length of path */
+	int		 fd; /* open directory */
+	uint64_t	 used; /* when last used */
+};
+
+struct	dircache {
+	int		 rootfd; /* destination directory */
+	struct dircent	 ents[DIRCACHE_MAX]; /* open directories */
+	size_t		 entsz; /* number of ents */
+	size_t		 last; /* most recently used */
+	uint64_t	 clock; /* uses so far */
+};
+
+/*
+ * Allocate a cache of directories under "rootfd", which stays ours.
+ * Returns NULL on failure.
+ */
+struct dircache *
+dircache_alloc(struct sess *sess, int rootfd)
+{
+	struct dircache	*c;
+
+	if ((c = calloc(1, sizeof(struct dircache))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	}
+	c->rootfd = rootfd;
+	return c;
+}
+
+/*
+ * Find the open directory "path" of length "len".
+ * Returns the entry or NULL if not found.
+ */
+static struct dircent *
+dircache_find(struct dircache *c, const char *path, size_t len)
+{
+	struct dircent	*e;
+	size_t		 i;
+
+	if (c->entsz > 0) {
+		e = &c->ents[c->last];
+		if (e->pathlen == len && memcmp(e->path, path, len) == 0)
+			return e;
+	}
+	for (i = 0; i < c->entsz; i++) {
+		e = &c->ents[i];
+		if (e->pathlen == len && memcmp(e->path, path, len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * Open the directory "path" of length "len", from the closest of its
+ * ancestors that's open (or the root), and add it to the cache.
+ * Returns the entry or NULL on failure.
+ */
+static struct dircent *
+dircache_add(struct dircache *c, const char *path, size_t len)
+{
+	struct dircent	*e, *from = NULL;
+	char		*dir;
+	size_t		 i;
+	int		 fd;
+
+	for (i = 0; i < c->entsz; i++) {
+		e = &c->ents[i];
+		if (e->pathlen < len && path[e->pathlen] == '/' &&
+		    memcmp(e->path, path, e->pathlen) == 0 &&
+		    (from == NULL || e->pathlen > from->pathlen))
+			from = e;
+	}
+
+	if ((dir = strndup(path, len)) == NULL)
+		return NULL;
+	fd = from == NULL ?
+		openat(c->rootfd, dir, O_RDONLY | O_DIRECTORY, 0) :
+		openat(from->fd, dir + from->pathlen + 1,
+		       O_RDONLY | O_DIRECTORY, 0);
+	if (fd == -1) {
+		free(dir);
+		return NULL;
+	}
+
+	/* Make room by closing the least recently used. */
+
+	if (c->entsz < DIRCACHE_MAX)
+		e = &c->ents[c->entsz++];
+	else {
+		e = &c->ents[0];
+		for (i = 1; i < c->entsz; i++)
+			if (c->ents[i].used < e->used)
+				e = &c->ents[i];
+		close(e->fd);
+		free(e->path);
+	}
+
+	e->path = dir;
+	e->pathlen = len;
+	e->fd = fd;
+	return e;
+}
+
+/*
+ * Get the directory to look up "path" (relative to the root) from,
+ * setting "name" to what to look up in it.
+ * If the directory can't be opened, this is the root and the whole
+ * path, so the caller's lookup fails (or not) as it would otherwise.
+ * The descriptor is the cache's, and only valid until the next call.
+ * Always returns the descriptor: this doesn't fail.
+ */
+int
+dircache_get(struct dircache *c, const char *path, const char **name)
+{
+	struct dircent	*e;
+	const char	*cp;
+	size_t		 len;
+
+	*name = path;
+	if (c->rootfd == -1 || (cp = strrchr(path, '/')) == NULL)
+		return c->rootfd;
+	len = cp - path;
+
+	if ((e = dircache_find(c, path, len)) == NULL &&
+	    (e = dircache_add(c, path, len)) == NULL)
+		return c->rootfd;
+
+	e->used = ++c->clock;
+	c->last = e - c->ents;
+	*name = cp + 1;
+	return e->fd;
+}
+
+/*
+ * Close all directories and free.
+ * Passing a NULL to this function is ok.
+ */
+void
+dircache_free(struct dircache *c)
+{
+	size_t	 i;
+
+	if (c == NULL)
+		return;
+	for (i = 0; i < c->entsz; i++) {
+		close(c->ents[i].fd);
+		free(c->ents[i].path);
+	}
+	free(c);
+}
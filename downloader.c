@@ -14,7 +14,10 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
-#include <sys/mman.h>
+#ifdef __linux__
+# define _GNU_SOURCE /* copy_file_range(2) */
+#endif
+
 #include <sys/stat.h>
 
 #include <assert.h>
@@ -31,14 +34,28 @@
 
 #include "extern.h"
 #include "md4.h"
+#include "xxhash.h"
+
+/*
+ * Where we have copy_file_range(2), runs of blocks from the origin file
+ * are copied by the kernel (or shared, on file-systems that can).
+ */
+#if defined(__linux__) || defined(__FreeBSD__)
+# define HAVE_COPY_FILE_RANGE
+#endif
 
 /*
  * A small optimisation: have a 1 MB pre-write buffer.
- * Disable the pre-write buffer by having this be zero.
- * (It doesn't affect performance much.)
+ * Literal data is read directly into it, so it mustn't be zero.
  */
 #define	OBUF_SIZE	(1024 * 1024)
 
+/*
+ * With -S, runs of zeroes this long (in each buffer we write out) are
+ * skipped over rather than written, leaving holes.
+ */
+#define	SPARSE_SIZE	(4096)
+
 enum	downloadst {
 	DOWNLOAD_READ_NEXT = 0,
 	DOWNLOAD_READ_LOCAL,
@@ -53,21 +70,32 @@ struct	download {
 	enum downloadst	    state; /* state of affairs */
 	size_t		    idx; /* index of current file */
 	struct blkset	    blk; /* its blocks */
-	void		   *map; /* mmap of current file */
-	size_t		    mapsz; /* length of mapsz */
+	struct fmap	    map; /* window over origin file */
 	int		    ofd; /* open origin file */
 	int		    fd; /* open output file */
 	char		   *fname; /* output filename */
-	MD4_CTX		    ctx; /* current hashing context */
+	struct hashfile	    ctx; /* current hashing context */
 	off_t		    downloaded; /* total downloaded */
 	off_t		    total; /* total in file */
 	const struct flist *fl; /* file list */
 	size_t		    flsz; /* size of file list */
 	int		    rootfd; /* destination directory */
+	struct dircache	   *dirs; /* directories under rootfd */
 	int		    fdin; /* read descriptor from sender */
 	char		   *obuf; /* pre-write buffer */
 	size_t		    obufsz; /* current size of obuf */
 	size_t		    obufmax; /* max size we'll wbuffer */
+	off_t		    runoffs; /* origin offset of block run */
+	size_t		    runlen; /* length of block run (or zero) */
+	int		    nocopy; /* no copy_file_range(2) */
+	off_t		    hole; /* zeroes skipped but not yet seeked */
+	struct sigbuild	   *sig; /* signature to cache or NULL */
+	int		    inlit; /* last token was literal data */
+	size_t		    runs; /* runs of literal data */
+	int		    phase; /* phases completed */
+	size_t		   *redo; /* files to ask for again */
+	size_t		    redosz; /* number of redo */
+	size_t		    redomax; /* allocated redo */
 };
 
 
@@ -109,29 +137,34 @@ log_file(struct sess *sess,
 /*
  * Reinitialise a download context w/o overwriting the persistent parts
  * of the structure (like p->fl or p->flsz) for index "idx".
- * The MD4 context is pre-seeded.
+ * The file hash is pre-seeded.
  */
 static void
 download_reinit(struct sess *sess, struct download *p, size_t idx)
 {
-	int32_t seed = htole32(sess->seed);
 
 	assert(p->state == DOWNLOAD_READ_NEXT);
 
 	p->idx = idx;
 	memset(&p->blk, 0, sizeof(struct blkset));
-	p->map = MAP_FAILED;
-	p->mapsz = 0;
+	memset(&p->map, 0, sizeof(struct fmap));
 	p->ofd = -1;
 	p->fd = -1;
 	p->fname = NULL;
-	MD4_Init(&p->ctx);
+	hash_file_init(&p->ctx, sess);
 	p->downloaded = p->total = 0;
+	p->runoffs = 0;
+	p->runlen = 0;
+	p->hole = 0;
+	p->sig = NULL;
+	p->inlit = 0;
+	p->runs = 0;
+	/* Don't touch p->nocopy. */
 	/* Don't touch p->fl. */
 	/* Don't touch p->flsz. */
 	/* Don't touch p->rootfd. */
+	/* Don't touch p->dirs. */
 	/* Don't touch p->fdin. */
-	MD4_Update(&p->ctx, &seed, sizeof(int32_t));
 }
 
 /*
@@ -142,25 +175,26 @@ download_reinit(struct sess *sess, struct download *p, size_t idx)
 static void
 download_cleanup(struct download *p, int cleanup)
 {
+	const char	*name;
+	int		 dfd;
 
-	if (p->map != MAP_FAILED) {
-		assert(p->mapsz);
-		munmap(p->map, p->mapsz);
-		p->map = MAP_FAILED;
-		p->mapsz = 0;
-	}
+	fmap_free(&p->map);
 	if (p->ofd != -1) {
 		close(p->ofd);
 		p->ofd = -1;
 	}
 	if (p->fd != -1) {
 		close(p->fd);
-		if (cleanup && p->fname != NULL)
-			unlinkat(p->rootfd, p->fname, 0);
+		if (cleanup && p->fname != NULL) {
+			dfd = dircache_get(p->dirs, p->fname, &name);
+			unlinkat(dfd, name, 0);
+		}
 		p->fd = -1;
 	}
 	free(p->fname);
 	p->fname = NULL;
+	sigcache_build_free(p->sig);
+	p->sig = NULL;
 	p->state = DOWNLOAD_READ_NEXT;
 }
 
@@ -186,18 +220,42 @@ download_alloc(struct sess *sess, int fdin,
 	p->flsz = flsz;
 	p->rootfd = rootfd;
 	p->fdin = fdin;
+	p->phase = 0;
+	p->redo = NULL;
+	p->redosz = p->redomax = 0;
+	if ((p->dirs = dircache_alloc(sess, rootfd)) == NULL) {
+		ERRX1(sess, "dircache_alloc");
+		free(p);
+		return NULL;
+	}
+	/* Copied runs of blocks wouldn't have holes, so write them. */
+	p->nocopy = sess->opts->sparse;
 	download_reinit(sess, p, 0);
 	p->obufsz = 0;
 	p->obuf = NULL;
 	p->obufmax = OBUF_SIZE;
 	if (p->obufmax && (p->obuf = malloc(p->obufmax)) == NULL) {
 		ERR(sess, "malloc");
+		dircache_free(p->dirs);
 		free(p);
 		return NULL;
 	}
 	return p;
 }
 
+/*
+ * With an incremental file list, pass the downloader the list "fl" of
+ * size "flsz" after more has been appended to it.
+ */
+void
+download_flist(struct download *p, const struct flist *fl, size_t flsz)
+{
+
+	assert(flsz >= p->flsz);
+	p->fl = fl;
+	p->flsz = flsz;
+}
+
 /*
  * Perform all cleanups (including removing stray files) and free.
  * Passing a NULL to this function is ok.
@@ -209,10 +267,168 @@ download_free(struct download *p)
 	if (p == NULL)
 		return;
 	download_cleanup(p, 1);
+	dircache_free(p->dirs);
 	free(p->obuf);
+	free(p->redo);
 	free(p);
 }
 
+/*
+ * The files (by increasing index) whose hashes didn't match once
+ * received in the first phase, filling in their number "sz".
+ * When replaying a batch, these are instead the files not updated.
+ */
+const size_t *
+download_redo(const struct download *p, size_t *sz)
+{
+
+	*sz = p->redosz;
+	return p->redo;
+}
+
+/*
+ * Remember the current file to ask for again in the second phase.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+download_redo_add(struct sess *sess, struct download *p)
+{
+	void	*pp;
+	size_t	 max;
+
+	if (p->redosz == p->redomax) {
+		max = p->redomax ? p->redomax * 2 : 64;
+		pp = reallocarray(p->redo, max, sizeof(size_t));
+		if (pp == NULL) {
+			ERR(sess, "reallocarray");
+			return 0;
+		}
+		p->redo = pp;
+		p->redomax = max;
+	}
+	p->redo[p->redosz++] = p->idx;
+	return 1;
+}
+
+/*
+ * When replaying a batch, the current file was received again in the
+ * second phase, so it's no longer one we didn't update.
+ */
+static void
+download_redo_del(struct download *p)
+{
+	size_t	 i;
+
+	for (i = 0; i < p->redosz; i++)
+		if (p->redo[i] == p->idx) {
+			memmove(&p->redo[i], &p->redo[i + 1],
+				(p->redosz - i - 1) * sizeof(size_t));
+			p->redosz--;
+			break;
+		}
+}
+
+/*
+ * Write "buf" of size "sz" to the output file.
+ * If we're making sparse files, runs of zeroes are instead accumulated
+ * in p->hole and seeked over before the next write: the file is only
+ * extended over a trailing hole by sparse_finish().
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+buf_write(struct sess *sess, struct download *p, const char *buf, size_t sz)
+{
+	size_t	 len, datasz;
+	ssize_t	 ssz;
+	uint64_t t;
+
+	while (sz > 0) {
+		datasz = 0;
+		if (sess->opts->sparse) {
+			/* Skip zeroes, then collect data up to the next. */
+
+			while (sz > 0) {
+				len = sz < SPARSE_SIZE ? sz : SPARSE_SIZE;
+				if (buf[0] != '\0' ||
+				    memcmp(buf, buf + 1, len - 1))
+					break;
+				p->hole += len;
+				buf += len;
+				sz -= len;
+			}
+			while (datasz < sz) {
+				len = sz - datasz < SPARSE_SIZE ?
+					sz - datasz : SPARSE_SIZE;
+				if (datasz > 0 && buf[datasz] == '\0' &&
+				    memcmp(buf + datasz,
+				    buf + datasz + 1, len - 1) == 0)
+					break;
+				datasz += len;
+			}
+			if (datasz == 0)
+				break;
+			if (p->hole > 0 &&
+			    lseek(p->fd, p->hole, SEEK_CUR) == -1) {
+				ERR(sess, "%s: lseek", p->fname);
+				return 0;
+			}
+			p->hole = 0;
+		} else
+			datasz = sz;
+
+		t = stats_now();
+		ssz = write(p->fd, buf, datasz);
+		sess->stats.write += stats_now() - t;
+		if (ssz < 0) {
+			ERR(sess, "%s: write", p->fname);
+			return 0;
+		} else if ((size_t)ssz != datasz) {
+			ERRX(sess, "%s: short write", p->fname);
+			return 0;
+		}
+		buf += datasz;
+		sz -= datasz;
+	}
+	return 1;
+}
+
+/*
+ * With -S, make sure the output file is as long as what we've been
+ * given, which it isn't if it ended with zeroes we seeked over.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+sparse_finish(struct sess *sess, struct download *p)
+{
+	off_t	 offs;
+
+	if (p->hole == 0)
+		return 1;
+	if ((offs = lseek(p->fd, p->hole, SEEK_CUR)) == -1) {
+		ERR(sess, "%s: lseek", p->fname);
+		return 0;
+	} else if (ftruncate(p->fd, offs) == -1) {
+		ERR(sess, "%s: ftruncate", p->fname);
+		return 0;
+	}
+	p->hole = 0;
+	return 1;
+}
+
+/*
+ * Add "sz" bytes of the output file, "buf", to its hash and, if we're
+ * caching it, its signature.
+ */
+static void
+buf_hash(struct sess *sess,
+	const void *buf, size_t sz, struct download *p)
+{
+
+	hash_file_update(&p->ctx, buf, sz);
+	if (p->sig != NULL)
+		sigcache_build_add(sess, p->sig, buf, sz);
+}
+
 /*
  * Optimisation: instead of dumping directly into the output file, keep
  * a buffer and write as much as we can into the buffer.
@@ -226,7 +442,6 @@ buf_copy(struct sess *sess,
 	const char *buf, size_t sz, struct download *p)
 {
 	size_t	 rem, tocopy;
-	ssize_t	 ssz;
 
 	assert(p->obufsz <= p->obufmax);
 
@@ -257,11 +472,8 @@ buf_copy(struct sess *sess,
 		assert(p->obufmax);
 		assert(p->obufsz <= p->obufmax);
 		assert(p->obuf != NULL);
-		if ((ssz = write(p->fd, p->obuf, p->obufsz)) < 0) {
-			ERR(sess, "%s: write", p->fname);
-			return 0;
-		} else if ((size_t)ssz != p->obufsz) {
-			ERRX(sess, "%s: short write", p->fname);
+		if (!buf_write(sess, p, p->obuf, p->obufsz)) {
+			ERRX1(sess, "buf_write");
 			return 0;
 		}
 		p->obufsz = 0;
@@ -272,25 +484,122 @@ buf_copy(struct sess *sess,
 	 * If we have no pre-write buffer, this is it.
 	 */
 
-	if (sz) {
-		if ((ssz = write(p->fd, buf, sz)) < 0) {
-			ERR(sess, "%s: write", p->fname);
+	if (sz && !buf_write(sess, p, buf, sz)) {
+		ERRX1(sess, "buf_write");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Write out the run of blocks from the origin file we've collected, if
+ * any, after what's already buffered.
+ * We use copy_file_range(2) unless it's not supported here, in which
+ * case we fall back to writing from our window over the origin file.
+ * The run is always within that window, so this doesn't read it again.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+run_flush(struct sess *sess, struct download *p)
+{
+	const char	*cbuf;
+#ifdef HAVE_COPY_FILE_RANGE
+	ssize_t		 ssz;
+	uint64_t	 t;
+#endif
+
+	if (p->runlen == 0)
+		return 1;
+
+#ifdef HAVE_COPY_FILE_RANGE
+	if (!p->nocopy && !buf_copy(sess, NULL, 0, p)) {
+		ERRX1(sess, "buf_copy");
+		return 0;
+	}
+	while (!p->nocopy && p->runlen > 0) {
+		t = stats_now();
+		ssz = copy_file_range(p->ofd,
+			&p->runoffs, p->fd, NULL, p->runlen, 0);
+		sess->stats.write += stats_now() - t;
+		if (ssz == -1) {
+			if (errno != EXDEV && errno != EINVAL &&
+			    errno != ENOSYS && errno != EOPNOTSUPP) {
+				ERR(sess, "%s: copy_file_range", p->fname);
+				return 0;
+			}
+			LOG3(sess, "%s: copy_file_range not "
+				"supported: writing", p->fname);
+			p->nocopy = 1;
+		} else if (ssz == 0) {
+			ERRX(sess, "%s: copy_file_range: "
+				"origin file truncated", p->fname);
 			return 0;
-		} else if ((size_t)ssz != sz) {
-			ERRX(sess, "%s: short write", p->fname);
+		} else
+			p->runlen -= ssz;
+	}
+#endif
+
+	if (p->runlen > 0) {
+		assert(fmap_has(&p->map, p->runoffs, p->runlen));
+		cbuf = fmap_get(sess, &p->map, p->runoffs, p->runlen);
+		if (cbuf == NULL) {
+			ERRX1(sess, "fmap_get");
+			return 0;
+		} else if (!buf_copy(sess, cbuf, p->runlen, p)) {
+			ERRX1(sess, "buf_copy");
+			return 0;
+		}
+	}
+
+	p->runlen = 0;
+	return 1;
+}
+
+/*
+ * Read "sz" bytes of literal file data from the sender straight into
+ * our pre-write buffer, draining it to the file as it fills, and hash
+ * the data where it lands.
+ * This way, data is copied only once between the sender and the file.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+buf_read(struct sess *sess, size_t sz, struct download *p)
+{
+	size_t	 rem;
+
+	assert(p->obufmax > 0);
+	assert(p->obuf != NULL);
+
+	while (sz > 0) {
+		if (p->obufsz == p->obufmax &&
+		    !buf_copy(sess, NULL, 0, p)) {
+			ERRX1(sess, "buf_copy");
+			return 0;
+		}
+		rem = p->obufmax - p->obufsz;
+		if (rem > sz)
+			rem = sz;
+		if (!io_read_buf(sess, p->fdin,
+		    p->obuf + p->obufsz, rem)) {
+			ERRX1(sess, "io_read_buf");
 			return 0;
 		}
+		buf_hash(sess, p->obuf + p->obufsz, rem, p);
+		p->obufsz += rem;
+		sz -= rem;
 	}
 	return 1;
 }
 
 /*
  * The downloader waits on a file the sender is going to give us, opens
- * and mmaps the existing file, opens a temporary file, dumps the file
+ * the existing file, opens a temporary file, dumps the file
  * (or metadata) into the temporary file, then renames.
  * This happens in several possible phases to avoid blocking.
  * Returns <0 on failure, 0 on no more data (end of phase), >0 on
  * success (more data to be read from the sender).
+ * Of the latter, 2 means that a segment of an incremental file list is
+ * to be read by the caller with flist_recv_seg().
  */
 int
 rsync_downloader(struct download *p, struct sess *sess, int *ofd)
@@ -299,13 +608,18 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 	uint32_t	 hash;
 	const struct flist *f;
 	size_t		 sz, dirlen, tok;
-	const char	*cp;
+	const char	*cp, *name;
 	mode_t		 perm;
 	struct stat	 st;
-	char		*buf = NULL;
-	unsigned char	 ourmd[MD4_DIGEST_LENGTH],
-			 md[MD4_DIGEST_LENGTH];
+	const char	*cbuf;
+	const void	*dbuf;
+	off_t		 offs;
+	unsigned char	 ourmd[HASH_FILE_MAX],
+			 md[HASH_FILE_MAX];
+	size_t		 mdsz;
 	struct timespec	 tv[2];
+	uint64_t	 t;
+	int		 c, dfd;
 
 	/*
 	 * If we don't have a download already in session, then the next
@@ -321,8 +635,12 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 		} else if (idx >= 0 && (size_t)idx >= p->flsz) {
 			ERRX(sess, "index out of bounds");
 			return -1;
+		} else if (idx == FLIST_SEGMENT && sess->inc_flist) {
+			LOG3(sess, "downloader: file list segment");
+			return 2;
 		} else if (idx < 0) {
 			LOG3(sess, "downloader: phase complete");
+			p->phase++;
 			return 0;
 		}
 
@@ -334,7 +652,7 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 		/*
 		 * Now get our block information.
 		 * This is all we'll need to reconstruct the file from
-		 * the map, as block sizes are regular.
+		 * the origin file, as block sizes are regular.
 		 */
 
 		download_reinit(sess, p, idx);
@@ -348,13 +666,14 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 		 * block input.
 		 * We do this in a non-blocking way, so if the open
 		 * succeeds, then we'll go reentrant til the file is
-		 * readable and we can mmap() it.
+		 * readable and we can read from it.
 		 * Set the file descriptor that we want to wait for.
 		 */
 
 		p->state = DOWNLOAD_READ_LOCAL;
 		f = &p->fl[idx];
-		p->ofd = openat(p->rootfd, f->path, O_RDONLY | O_NONBLOCK, 0);
+		dfd = dircache_get(p->dirs, f->path, &name);
+		p->ofd = openat(dfd, name, O_RDONLY | O_NONBLOCK, 0);
 
 		if (p->ofd == -1 && errno != ENOENT) {
 			ERR(sess, "%s: openat", f->path);
@@ -380,7 +699,7 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 	 * Next in sequence: we have an open download session but
 	 * haven't created our temporary file.
 	 * This means that we've already opened (or tried to open) the
-	 * original file in a nonblocking way, and we can map it.
+	 * original file in a nonblocking way, and we can read it.
 	 */
 
 	if (p->state == DOWNLOAD_READ_LOCAL) {
@@ -389,7 +708,10 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 		/*
 		 * Try to fstat() the file descriptor if valid and make
 		 * sure that we're still a regular file.
-		 * Then, if it has non-zero size, mmap() it for hashing.
+		 * Then, if it has non-zero size and the uploader sent
+		 * blocks for it (not with -W), ready it for reading
+		 * blocks.
+		 * We're its last reader, as it's about to be replaced.
 		 */
 
 		if (p->ofd != -1 &&
@@ -401,15 +723,14 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 			goto out;
 		}
 
-		if (p->ofd != -1 && st.st_size > 0) {
-			p->mapsz = st.st_size;
-			p->map = mmap(NULL, p->mapsz,
-				PROT_READ, MAP_SHARED, p->ofd, 0);
-			if (p->map == MAP_FAILED) {
-				ERR(sess, "%s: mmap", f->path);
-				goto out;
-			}
-		}
+		/*
+		 * Blocks are copied from all over the origin file (and
+		 * the same ones again), so don't read ahead of them nor
+		 * drop what we've read.
+		 */
+
+		if (p->ofd != -1 && st.st_size > 0 && p->blk.blksz > 0)
+			fmap_init(&p->map, p->ofd, st.st_size, FMAP_RANDOM);
 
 		/* Success either way: we don't need this. */
 
@@ -451,14 +772,21 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 		else
 			perm = f->st.mode;
 
-		p->fd = openat(p->rootfd, p->fname,
-			O_APPEND|O_WRONLY|O_CREAT|O_EXCL, perm);
+		dfd = dircache_get(p->dirs, p->fname, &name);
+		p->fd = openat(dfd, name, O_WRONLY|O_CREAT|O_EXCL, perm);
 
 		if (p->fd == -1) {
 			ERR(sess, "%s: openat", p->fname);
 			goto out;
 		}
 
+		if (sess->sigcache != NULL && f->st.size > 0 &&
+		    (p->sig = sigcache_build_alloc(sess,
+		     f->st.size)) == NULL) {
+			ERRX1(sess, "sigcache_build_alloc");
+			goto out;
+		}
+
 		/*
 		 * FIXME: we can technically wait until the temporary
 		 * file is writable, but since it's guaranteed to be
@@ -473,8 +801,8 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 	}
 
 	/*
-	 * This matches the sequence in blk_flush().
-	 * If we've gotten here, then we have a possibly-open map file
+	 * This matches the sequence in blk_match_step().
+	 * If we've gotten here, then we have a possibly-open origin file
 	 * (not for new files) and our temporary file is writable.
 	 * We read the size/token, then optionally the data.
 	 * The size >0 for reading data, 0 for no more data, and <0 for
@@ -486,29 +814,37 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 	assert(p->fd != -1);
 	assert(p->fdin != -1);
 
-	if (!io_read_int(sess, p->fdin, &rawtok)) {
-		ERRX1(sess, "io_read_int");
+	if (!token_recv(sess, p->fdin, &rawtok, &dbuf)) {
+		ERRX1(sess, "token_recv");
 		goto out;
 	}
 
+	/*
+	 * Literal data is either still to be read or, if compressed,
+	 * has been inflated for us.
+	 */
+
 	if (rawtok > 0) {
 		sz = rawtok;
-		if ((buf = malloc(sz)) == NULL) {
-			ERR(sess, "realloc");
+		if (!run_flush(sess, p)) {
+			ERRX1(sess, "run_flush");
 			goto out;
-		}
-		if (!io_read_buf(sess, p->fdin, buf, sz)) {
-			ERRX1(sess, "io_read_int");
+		} else if (dbuf == NULL && !buf_read(sess, sz, p)) {
+			ERRX1(sess, "buf_read");
 			goto out;
-		} else if (!buf_copy(sess, buf, sz, p)) {
+		} else if (dbuf != NULL && !buf_copy(sess, dbuf, sz, p)) {
 			ERRX1(sess, "buf_copy");
 			goto out;
 		}
+		if (dbuf != NULL)
+			buf_hash(sess, dbuf, sz, p);
+		if (!p->inlit)
+			p->runs++;
+		p->inlit = 1;
 		p->total += sz;
 		p->downloaded += sz;
+		sess->stats.literal += sz;
 		LOG4(sess, "%s: received %zu B block", p->fname, sz);
-		MD4_Update(&p->ctx, buf, sz);
-		free(buf);
 		return 1;
 	} else if (rawtok < 0) {
 		tok = -rawtok - 1;
@@ -518,54 +854,101 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 				p->fname, tok, p->blk.blksz);
 			goto out;
 		}
-		sz = tok == p->blk.blksz - 1 ? p->blk.rem : p->blk.len;
+		sz = tok < p->blk.blksz - 1 || p->blk.rem == 0 ?
+			p->blk.len : p->blk.rem;
 		assert(sz);
-		assert(p->map != MAP_FAILED);
-		buf = p->map + (tok * p->blk.len);
+		offs = (off_t)tok * p->blk.len;
 
 		/*
 		 * Now we read from our block.
 		 * We should only be at this point if we have a
 		 * block to read from, i.e., if we were able to
-		 * map our origin file and create a block
+		 * open our origin file and create a block
 		 * profile from it.
+		 * It may have changed size since then, though.
+		 * We still read the block to hash it, but only write
+		 * it out once we have the whole run of blocks that
+		 * follow each other, which ends before our window
+		 * over the origin file moves on.
 		 */
 
-		assert(p->map != MAP_FAILED);
-		if (!buf_copy(sess, buf, sz, p)) {
-			ERRX1(sess, "buf_copy");
+		if (offs + (off_t)sz > p->map.size) {
+			ERRX(sess, "%s: block %zu past end of "
+				"origin file", p->fname, tok);
+			goto out;
+		}
+		if (p->runlen > 0 &&
+		    (offs != p->runoffs + (off_t)p->runlen ||
+		     !fmap_has(&p->map, offs, sz)) &&
+		    !run_flush(sess, p)) {
+			ERRX1(sess, "run_flush");
+			goto out;
+		}
+		if ((cbuf = fmap_get(sess, &p->map, offs, sz)) == NULL) {
+			ERRX1(sess, "fmap_get");
+			goto out;
+		} else if (!token_see(sess, cbuf, sz)) {
+			ERRX1(sess, "token_see");
 			goto out;
 		}
+		if (p->runlen == 0)
+			p->runoffs = offs;
+		p->runlen += sz;
+		p->inlit = 0;
 		p->total += sz;
+		sess->stats.matched += sz;
 		LOG4(sess, "%s: copied %zu B", p->fname, sz);
-		MD4_Update(&p->ctx, buf, sz);
+		buf_hash(sess, cbuf, sz, p);
 		return 1;
 	}
 
-	if (!buf_copy(sess, NULL, 0, p)) {
+	if (!run_flush(sess, p)) {
+		ERRX1(sess, "run_flush");
+		goto out;
+	} else if (!buf_copy(sess, NULL, 0, p)) {
 		ERRX1(sess, "buf_copy");
 		goto out;
+	} else if (!sparse_finish(sess, p)) {
+		ERRX1(sess, "sparse_finish");
+		goto out;
 	}
 
 	assert(rawtok == 0);
 	assert(p->obufsz == 0);
 
 	/*
-	 * Make sure our resulting MD4 hashes match.
-	 * FIXME: if the MD4 hashes don't match, then our file has
-	 * changed out from under us.
-	 * This should require us to re-run the sequence in another
-	 * phase.
+	 * Make sure our resulting file hashes match.
+	 * If they don't, then our file has changed out from under us
+	 * (or its cached signature was wrong, or the short checksums
+	 * collided), so in the first phase we drop what we have and ask
+	 * for the file again in the second.
+	 * A batch can't be asked for anything, so there we drop the file
+	 * and carry on, though it might come again in the second phase
+	 * if it did when the batch was written.
 	 */
 
-	MD4_Final(ourmd, &p->ctx);
+	mdsz = hash_file_final(&p->ctx, ourmd);
 
-	if (!io_read_buf(sess, p->fdin, md, MD4_DIGEST_LENGTH)) {
+	if (!io_read_buf(sess, p->fdin, md, mdsz)) {
 		ERRX1(sess, "io_read_buf");
 		goto out;
-	} else if (memcmp(md, ourmd, MD4_DIGEST_LENGTH)) {
-		ERRX(sess, "%s: hash does not match", p->fname);
-		goto out;
+	} else if (memcmp(md, ourmd, mdsz)) {
+		if (sess->opts->read_batch != NULL)
+			WARNX(sess, "%s: hash does not match: "
+				"skipping", f->path);
+		else if (p->phase > 0) {
+			ERRX(sess, "%s: hash does not match", p->fname);
+			goto out;
+		} else
+			WARNX(sess, "%s: hash does not match: "
+				"trying again", f->path);
+		if ((sess->opts->read_batch == NULL || p->phase == 0) &&
+		    !download_redo_add(sess, p)) {
+			ERRX1(sess, "download_redo_add");
+			goto out;
+		}
+		download_cleanup(p, 1);
+		return 1;
 	}
 
 	if (sess->opts->preserve_gids) {
@@ -594,12 +977,45 @@ rsync_downloader(struct download *p, struct sess *sess, int *ofd)
 		LOG4(sess, "%s: updated date", f->path);
 	}
 
-	/* Finally, rename the temporary to the real file. */
+	/*
+	 * Finally, rename the temporary to the real file.
+	 * They're in the same directory, so the temporary's name is as
+	 * far into its path as the file's.
+	 */
 
-	if (renameat(p->rootfd, p->fname, p->rootfd, f->path) == -1) {
+	t = stats_now();
+	dfd = dircache_get(p->dirs, f->path, &name);
+	if (renameat(dfd, p->fname + (name - f->path), dfd, name) == -1) {
 		ERR(sess, "%s: renameat: %s", p->fname, f->path);
 		goto out;
 	}
+	sess->stats.rename += stats_now() - t;
+	sess->stats.files_xfer++;
+	if (sess->opts->read_batch != NULL && p->phase > 0)
+		download_redo_del(p);
+
+	/* Learn how much files change for picking block lengths. */
+
+	if (p->blk.blksz > 0) {
+		sess->stats.delta_files++;
+		sess->stats.delta_size += p->total;
+		sess->stats.delta_runs += p->runs;
+	}
+
+	/* The file is as we'll find it when next signing it. */
+
+	if (p->sig != NULL) {
+		if (fstat(p->fd, &st) == -1) {
+			ERR(sess, "%s: fstat", f->path);
+			goto out;
+		}
+		c = sigcache_build_put(sess, sess->sigcache, p->sig, &st);
+		p->sig = NULL;
+		if (!c) {
+			ERRX1(sess, "sigcache_build_put");
+			goto out;
+		}
+	}
 
 	log_file(sess, p, f);
 	download_cleanup(p, 0);
@@ -22,6 +22,23 @@
  */
 #define	RSYNC_PROTOCOL	(27)
 
+/*
+ * Extensions an openrsync server agrees to by setting them in the upper
+ * half of the protocol version it sends, if (and only if) the client
+ * has asked for them with its "-e" argument.
+ * These aren't part of the rsync protocol.
+ */
+#define	RSYNC_CAP_INC_FLIST 0x0001 /* incremental file list, "-e.O" */
+#define	RSYNC_CAP_XXH	0x0002 /* XXH64 checksums, "-e.X" */
+#define	RSYNC_CAP_SHIFT	(16)
+
+/*
+ * With an incremental file list, the sender announces each segment of
+ * the file list by sending this in place of a file index.
+ * See flist_gen_inc().
+ */
+#define	FLIST_SEGMENT	(-2)
+
 /*
  * Maximum amount of file data sent over the wire at once.
  */
@@ -33,6 +50,19 @@
  */
 #define	BLOCK_SIZE_MIN	(700)
 
+/*
+ * The maximum block length, as in newer rsync.
+ */
+#define	BLOCK_SIZE_MAX	(128 * 1024)
+
+/*
+ * Once we've received this many files that we had blocks for, we pick
+ * block lengths from how much they changed, as small as this.
+ * See blkset_len().
+ */
+#define	BLOCK_LEARN_FILES	(4)
+#define	BLOCK_SIZE_LEARN_MIN	(256)
+
 /*
  * The sender and receiver use a two-phase synchronisation process.
  * The first uses two-byte hashes; the second, 16-byte.
@@ -41,6 +71,11 @@
 #define	CSUM_LENGTH_PHASE1 (2)
 #define	CSUM_LENGTH_PHASE2 (16)
 
+/*
+ * Longest whole-file hash: see hash_file_final().
+ */
+#define	HASH_FILE_MAX	(16)
+
 /*
  * Operating mode for a client or a server.
  * Sender means we synchronise local files with those from remote.
@@ -69,26 +104,27 @@ struct	fargs {
 /*
  * The subset of stat(2) information that we need.
  * (There are some parts we don't use yet.)
+ * Fields are ordered largest first so that it packs without padding.
  */
 struct	flstat {
+	off_t		 size; /* size */
+	time_t		 mtime; /* modification */
 	mode_t		 mode; /* mode */
 	uid_t		 uid; /* user */
 	gid_t		 gid; /* group */
-	off_t		 size; /* size */
-	time_t		 mtime; /* modification */
 	unsigned int	 flags;
 #define	FLSTAT_TOP_DIR	 0x01 /* a top-level directory */
-
 };
 
 /*
  * A list of files with their statistics.
+ * The strings belong to the list and are freed with flist_free().
  */
 struct	flist {
 	char		*path; /* path relative to root */
 	const char	*wpath; /* "working" path for receiver */
-	struct flstat	 st; /* file information */
 	char		*link; /* symlink target or NULL */
+	struct flstat	 st; /* file information */
 };
 
 /*
@@ -105,8 +141,30 @@ struct	opts {
 	int		 preserve_perms; /* -p */
 	int		 preserve_links; /* -l */
 	int		 preserve_gids; /* -g */
+	int		 sparse; /* -S */
+	int		 compress; /* -z */
+	int		 whole_file; /* -W */
+	int		 no_whole_file; /* --no-whole-file */
 	int		 del; /* --delete */
+	size_t		 block_size; /* --block-size or 0 */
+	const char	*sig_cache; /* --sig-cache */
+	int32_t		 checksum_seed; /* --checksum-seed */
+	int		 stats; /* --stats */
+	int		 stats_json; /* --stats-json */
+	size_t		 stats_interval; /* --stats-interval */
 	const char	*rsync_path; /* --rsync-path */
+	size_t		 sign_threads; /* --sign-threads */
+	size_t		 stat_threads; /* --stat-threads */
+	size_t		 walk_threads; /* --walk-threads */
+	int		 no_inc_recursive; /* --no-inc-recursive */
+	int		 inc_recursive; /* server: client asked (-e.O) */
+	int		 xxh; /* server: client asked (-e.X) */
+	int		 checksum_md4; /* --checksum-choice=md4 */
+	size_t		 streams; /* --streams (or --stream) or 0 */
+	size_t		 stream; /* which of the streams (or the last) */
+	int		 stream_fd; /* client: pipe for its stats */
+	const char	*write_batch; /* --write-batch or NULL */
+	const char	*read_batch; /* --read-batch or NULL */
 };
 
 /*
@@ -132,6 +190,54 @@ struct	blkset {
 	size_t		 csum; /* checksum length */
 	struct blk	*blks; /* all blocks */
 	size_t		 blksz; /* number of blks */
+	struct blkhash	*hash; /* lookup index (sender) or NULL */
+};
+
+/*
+ * State of a rolling fast hash over a window of "len" bytes.
+ * See hash_roll_init().
+ */
+struct	hashroll {
+	uint32_t	 a; /* a(k, l) */
+	uint32_t	 b; /* b(k, l) */
+	size_t		 len; /* window length */
+};
+
+/*
+ * Bytes of writes buffered before they're written out.
+ * See io_write_buf().
+ */
+#define	IO_WBUF_SIZE	(64 * 1024)
+
+/*
+ * Bytes read ahead at a time.
+ * See io_read_buf().
+ */
+#define	IO_RBUF_SIZE	(64 * 1024)
+
+/*
+ * Counters and timers for each stage of a transfer, kept by each side
+ * for the work it does itself (see --stats).
+ * Times are nanoseconds of the monotonic clock: see stats_now().
+ */
+struct	stats {
+	uint64_t	 start; /* start of session */
+	uint64_t	 last; /* last interval report */
+	uint64_t	 flist_gen; /* generating the file list */
+	uint64_t	 flist_xfer; /* sending or receiving it */
+	uint64_t	 sign; /* generating signatures */
+	uint64_t	 match; /* matching blocks */
+	uint64_t	 write; /* writing to disc */
+	uint64_t	 rename; /* renaming into place */
+	uint64_t	 del; /* finding and deleting files */
+	uint64_t	 files; /* files in the file list */
+	uint64_t	 files_xfer; /* files sent or received */
+	uint64_t	 files_del; /* files deleted */
+	uint64_t	 literal; /* literal data bytes */
+	uint64_t	 matched; /* matched data bytes */
+	uint64_t	 delta_files; /* received files with blocks */
+	uint64_t	 delta_size; /* their total size */
+	uint64_t	 delta_runs; /* their runs of literal data */
 };
 
 /*
@@ -148,6 +254,50 @@ struct	sess {
 	int		   mplex_reads; /* multiplexing reads? */
 	size_t		   mplex_read_remain; /* remaining bytes */
 	int		   mplex_writes; /* multiplexing writes? */
+	char		   wbuf[IO_WBUF_SIZE]; /* buffered writes */
+	size_t		   wbufsz; /* bytes in wbuf */
+	int		   wbuffd; /* descriptor of wbuf */
+	int		   wbufmplex; /* wbuf is multiplexed */
+	char		   rbuf[IO_RBUF_SIZE]; /* read ahead */
+	size_t		   rbufpos; /* position in rbuf */
+	size_t		   rbufsz; /* bytes in rbuf */
+	int		   rbuffd; /* descriptor of rbuf */
+	int		   inc_flist; /* incremental file list? */
+	int		   xxh; /* XXH64 rather than MD4 hashes? */
+	struct token	  *token; /* compression state (-z) */
+	struct sigcache	  *sigcache; /* --sig-cache or NULL */
+	struct batch	  *batch; /* --write-batch or NULL */
+	struct stats	   stats; /* --stats */
+};
+
+/*
+ * A window over a file read with pread(2), in place of mapping all of
+ * it into memory.
+ * See fmap_get().
+ */
+struct	fmap {
+	int		 fd; /* file being read */
+	off_t		 size; /* size of file */
+	int		 flags; /* FMAP_xxx */
+#define	FMAP_DROP	 0x01 /* drop cached pages behind window */
+#define	FMAP_RANDOM	 0x02 /* don't read ahead unless sequential */
+	off_t		 dropped; /* pages dropped before this */
+	char		*buf; /* window contents */
+	size_t		 bufmax; /* allocated size of buf */
+	off_t		 offs; /* file offset of buf */
+	size_t		 len; /* valid bytes in buf */
+};
+
+/*
+ * Progress in writing a message with io_write_avail(), which may take
+ * any number of calls.
+ * Initialise to all zeroes.
+ */
+struct	iowrite {
+	unsigned char	 hdr[sizeof(int32_t)]; /* multiplex header */
+	size_t		 hdrpos; /* bytes of hdr written */
+	size_t		 hdrsz; /* size of hdr (zero if none) */
+	size_t		 left; /* bytes left in frame */
 };
 
 /*
@@ -159,8 +309,38 @@ struct	ident {
 	char	*name; /* resolved name */
 };
 
+struct	batch;
+struct	blkhash;
+struct	blkmatch;
+struct	dircache;
 struct	download;
+struct	flgen;
+struct	hashfile;
+struct	pollfd;
+struct	pool;
+struct	sigbuild;
+struct	sigcache;
+struct	stat;
+struct	token;
 struct	upload;
+struct	walk;
+
+/*
+ * A job run by a worker thread of struct pool.
+ * Returns zero on failure, non-zero on success.
+ */
+typedef int	(*pool_fn)(void *, size_t);
+
+/*
+ * Called by walk() for each file found with its path, lstat(2), and
+ * symbolic link target (or NULL), which the function must free.
+ * Returns zero on failure, non-zero on success.
+ */
+typedef int	(*walk_fn)(struct sess *, void *,
+			const char *, const struct stat *, char *);
+
+#define	WALK_LINKS	0x01 /* read symbolic link targets */
+#define	WALK_QUIET	0x02 /* don't warn of files we can't stat */
 
 #define LOG0(_sess, _fmt, ...) \
 	rsync_log((_sess), __FILE__, __LINE__, -1, (_fmt), ##__VA_ARGS__)
@@ -218,8 +398,15 @@ int		  flist_gen(struct sess *, size_t, char **,
 int		  flist_gen_local(struct sess *, const char *,
 			struct flist **, size_t *);
 void		  flist_free(struct flist *, size_t);
+void		  flist_gen_free(struct flgen *);
+struct flgen	 *flist_gen_inc(struct sess *, char *,
+			struct flist **, size_t *);
+int		  flist_gen_next(struct sess *, struct flgen *,
+			struct flist **, size_t *);
 int		  flist_recv(struct sess *, int,
 			struct flist **, size_t *);
+int		  flist_recv_seg(struct sess *, int,
+			struct flist **, size_t *);
 int		  flist_send(struct sess *, int, int,
 			const struct flist *, size_t);
 int		  flist_gen_dels(struct sess *, const char *,
@@ -227,23 +414,33 @@ int		  flist_gen_dels(struct sess *, const char *,
 			const struct flist *, size_t);
 
 char		**fargs_cmdline(struct sess *, const struct fargs *);
+int		  fargs_inc_flist(const struct opts *);
+int		  fargs_xxh(const struct opts *);
 
 int		  io_read_buf(struct sess *, int, void *, size_t);
 int		  io_read_byte(struct sess *, int, uint8_t *);
+int		  io_read_buffered(const struct sess *, int);
 int		  io_read_check(struct sess *, int);
 int		  io_read_flush(struct sess *, int);
 int		  io_read_int(struct sess *, int, int32_t *);
 int		  io_read_long(struct sess *, int, int64_t *);
 int		  io_read_size(struct sess *, int, size_t *);
 int		  io_read_ulong(struct sess *, int, uint64_t *);
+int		  io_write_avail(struct sess *, int, struct iowrite *,
+			const void *, size_t, size_t *);
 int		  io_write_buf(struct sess *, int, const void *, size_t);
+int		  io_write_flush(struct sess *);
 int		  io_write_byte(struct sess *, int, uint8_t);
 int		  io_write_int(struct sess *, int, int32_t);
 int		  io_write_line(struct sess *, int, const char *);
 int		  io_write_long(struct sess *, int, int64_t);
 
+void		  io_buffer_byte(struct sess *, void *,
+			size_t *, size_t, uint8_t);
 void		  io_buffer_int(struct sess *, void *,
 			size_t *, size_t, int32_t);
+void		  io_buffer_long(struct sess *, void *,
+			size_t *, size_t, int64_t);
 void		  io_buffer_buf(struct sess *, void *,
 			size_t *, size_t, const void *, size_t);
 
@@ -258,26 +455,37 @@ void		  rsync_child(const struct opts *, int, const struct fargs *)
 			__attribute__((noreturn));
 int		  rsync_receiver(struct sess *, int, int, const char *);
 int		  rsync_sender(struct sess *, int, int, size_t, char **);
+int		  rsync_batch(const struct opts *, const char *);
 int		  rsync_client(const struct opts *, int, const struct fargs *);
 int		  rsync_socket(const struct opts *, const struct fargs *);
 int		  rsync_server(const struct opts *, size_t, char *[]);
 int		  rsync_downloader(struct download *, struct sess *, int *);
 int		  rsync_uploader(struct upload *,
-			int *, struct sess *, int *);
+			struct pollfd *, struct sess *, struct pollfd *);
 int		  rsync_uploader_tail(struct upload *, struct sess *);
 
 struct download	 *download_alloc(struct sess *, int,
 			const struct flist *, size_t, int);
+void		  download_flist(struct download *,
+			const struct flist *, size_t);
 void		  download_free(struct download *);
+const size_t	 *download_redo(const struct download *, size_t *);
 struct upload	 *upload_alloc(struct sess *, int, int, size_t,
 			const struct flist *, size_t, mode_t);
+int		  upload_flist(struct upload *, struct sess *,
+			const struct flist *, size_t, int);
 void		  upload_free(struct upload *);
+int		  upload_idle(const struct upload *);
+void		  upload_redo(struct upload *, struct sess *,
+			const size_t *, size_t);
 
 struct blkset	 *blk_recv(struct sess *, int, const char *);
 int		  blk_recv_ack(struct sess *,
 			int, const struct blkset *, int32_t);
-int		  blk_match(struct sess *, int,
+struct blkmatch	 *blk_match_alloc(struct sess *,
 			const struct blkset *, const char *);
+void		  blk_match_free(struct blkmatch *);
+int		  blk_match_step(struct sess *, int, struct blkmatch *);
 int		  blk_send(struct sess *, int, size_t,
 			const struct blkset *, const char *);
 int		  blk_send_ack(struct sess *, int, struct blkset *);
@@ -285,20 +493,94 @@ int		  blk_merge(struct sess *, int, int,
 			const struct blkset *, int, const char *,
 			const void *, size_t, float *);
 void		  blkset_free(struct blkset *);
+void		  blkset_init(struct blkset *, off_t, size_t);
+size_t		  blkset_len(const struct sess *, off_t);
 
 uint32_t	  hash_fast(const void *, size_t);
+void		  hash_roll(struct hashroll *, uint8_t, uint8_t);
+void		  hash_roll_init(struct hashroll *, const void *, size_t);
+void		  hash_roll_out(struct hashroll *, uint8_t);
+uint32_t	  hash_roll_sum(const struct hashroll *);
+void		  hash_file_init(struct hashfile *, const struct sess *);
+void		  hash_file_update(struct hashfile *, const void *, size_t);
+size_t		  hash_file_final(struct hashfile *, unsigned char *);
+size_t		  hash_slow_len(const struct sess *);
 void		  hash_slow(const void *, size_t,
 			unsigned char *, const struct sess *);
-void		  hash_file(const void *, size_t,
-			unsigned char *, const struct sess *);
+void		  hash_slow_many(const void *const [], size_t, size_t,
+			unsigned char *const [], const struct sess *);
+
+struct dircache	 *dircache_alloc(struct sess *, int);
+void		  dircache_free(struct dircache *);
+int		  dircache_get(struct dircache *, const char *,
+			const char **);
+
+void		  fmap_free(struct fmap *);
+const void	 *fmap_get(struct sess *, struct fmap *, off_t, size_t);
+int		  fmap_has(const struct fmap *, off_t, size_t);
+void		  fmap_init(struct fmap *, int, off_t, int);
 
 int		  mkpath(struct sess *, char *);
 
+struct pool	 *pool_alloc(struct sess *, size_t);
+void		  pool_cancel(struct pool *);
+size_t		  pool_done(struct pool *);
+int		  pool_extend(struct sess *, struct pool *, size_t);
+void		  pool_free(struct pool *);
+int		  pool_ok(struct pool *);
+size_t		  pool_size(const struct pool *);
+int		  pool_start(struct sess *, struct pool *,
+			pool_fn, void *, size_t);
+size_t		  pool_wait(struct pool *, size_t);
+
 char		 *symlink_read(struct sess *, const char *);
 char		 *symlinkat_read(struct sess *, int, const char *);
 
+int		  walk(struct sess *, struct pool *, const char *, int,
+			walk_fn, void *);
+struct walk	 *walk_alloc(struct sess *, struct pool *, const char *,
+			int, walk_fn, void *);
+void		  walk_free(struct walk *);
+int		  walk_step(struct sess *, struct walk *);
+
+int		  sigcache_build_put(struct sess *, struct sigcache *,
+			struct sigbuild *, const struct stat *);
+void		  sigcache_build_add(struct sess *, struct sigbuild *,
+			const void *, size_t);
+struct sigbuild	 *sigcache_build_alloc(struct sess *, off_t);
+void		  sigcache_build_free(struct sigbuild *);
+int		  sigcache_close(struct sess *, struct sigcache *);
+void		  sigcache_drop(struct sigcache *, const struct stat *);
+void		  sigcache_fail(struct sess *, struct sigcache *);
+void		  sigcache_free(struct sigcache *);
+int		  sigcache_get(struct sess *, struct sigcache *,
+			const struct stat *, struct blkset *);
+void		  sigcache_keep(struct sigcache *, const struct stat *);
+struct sigcache	 *sigcache_open(struct sess *, const char *);
+
+int		  batch_close(struct sess *, struct batch *);
+void		  batch_free(struct batch *);
+struct batch	 *batch_open(struct sess *, const char *, int);
+void		  batch_record(struct batch *, int);
+int		  batch_tee(struct sess *, struct batch *, int,
+			const void *, size_t);
+
+int		  token_buffered(const struct sess *);
+void		  token_free(struct sess *);
+int		  token_recv(struct sess *, int, int32_t *, const void **);
+int		  token_see(struct sess *, const void *, size_t);
+int		  token_send_block(struct sess *, int, size_t,
+			const void *, size_t);
+int		  token_send_data(struct sess *, int, const void *, size_t);
+int		  token_send_end(struct sess *, int);
+
 int		  sess_stats_send(struct sess *, int);
 int		  sess_stats_recv(struct sess *, int);
+int		  sess_stats_merge(struct sess *, int);
+void		  sess_stats_report(struct sess *, int);
+void		  sess_stats_tick(struct sess *);
+int		  sess_stats_timeout(const struct sess *);
+uint64_t	  stats_now(void);
 
 void		  idents_free(struct ident *, size_t);
 void		  idents_gid_remap(struct sess *, struct ident *, size_t);
@@ -17,13 +17,38 @@
 #include <sys/stat.h>
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "extern.h"
 
 #define	RSYNC_PATH	"rsync"
 
+/*
+ * Whether the client asks for (and would use) an incremental file list:
+ * a recursive transfer without deletion, which needs the whole list
+ * up front, unless it's been turned off.
+ */
+int
+fargs_inc_flist(const struct opts *opts)
+{
+
+	return opts->recursive && !opts->del && !opts->no_inc_recursive;
+}
+
+/*
+ * Whether the client asks for XXH64 in place of MD4 checksums, which an
+ * openrsync server agrees to unless told not to, as we can be.
+ */
+int
+fargs_xxh(const struct opts *opts)
+{
+
+	return !opts->checksum_md4;
+}
+
 char **
 fargs_cmdline(struct sess *sess, const struct fargs *f)
 {
@@ -42,7 +67,7 @@ fargs_cmdline(struct sess *sess, const struct fargs *f)
 	argsz += 1;	/* dot separator */
 	argsz += 1;	/* sink file */
 	argsz += 5;	/* per-mode maximum */
-	argsz += 11;	/* shared args */
+	argsz += 22;	/* shared args */
 	argsz += 1;	/* NULL pointer */
 	argsz += f->sourcesz;
 
@@ -70,6 +95,10 @@ fargs_cmdline(struct sess *sess, const struct fargs *f)
 
 	if (sess->opts->del)
 		args[i++] = "--delete";
+	if (sess->opts->sparse)
+		args[i++] = "-S";
+	if (sess->opts->whole_file)
+		args[i++] = "-W";
 	if (sess->opts->preserve_gids)
 		args[i++] = "-g";
 	if (sess->opts->preserve_links)
@@ -90,6 +119,91 @@ fargs_cmdline(struct sess *sess, const struct fargs *f)
 		args[i++] = "-v";
 	if (sess->opts->verbose > 0)
 		args[i++] = "-v";
+	if (sess->opts->compress)
+		args[i++] = "-z";
+	if (fargs_inc_flist(sess->opts) && fargs_xxh(sess->opts))
+		args[i++] = "-e.OX";
+	else if (fargs_inc_flist(sess->opts))
+		args[i++] = "-e.O";
+	else if (fargs_xxh(sess->opts))
+		args[i++] = "-e.X";
+
+	/* Only for the openrsync receiver, so only if asked for. */
+
+	if (sess->opts->sign_threads > 0 && f->mode == FARGS_SENDER) {
+		if (asprintf(&args[i++], "--sign-threads=%zu",
+		    sess->opts->sign_threads) == -1) {
+			ERR(sess, "asprintf");
+			free(args);
+			return NULL;
+		}
+	}
+
+	/* The receiver checks whether files are up to date. */
+
+	if (sess->opts->stat_threads > 0 && f->mode == FARGS_SENDER) {
+		if (asprintf(&args[i++], "--stat-threads=%zu",
+		    sess->opts->stat_threads) == -1) {
+			ERR(sess, "asprintf");
+			free(args);
+			return NULL;
+		}
+	}
+
+	/* The receiver signs files, so it picks their block size. */
+
+	if (sess->opts->block_size > 0 && f->mode == FARGS_SENDER) {
+		if (asprintf(&args[i++], "--block-size=%zu",
+		    sess->opts->block_size) == -1) {
+			ERR(sess, "asprintf");
+			free(args);
+			return NULL;
+		}
+	}
+
+	/* The receiver signs files, so it caches signatures. */
+
+	if (sess->opts->sig_cache != NULL && f->mode == FARGS_SENDER) {
+		if (asprintf(&args[i++], "--sig-cache=%s",
+		    sess->opts->sig_cache) == -1) {
+			ERR(sess, "asprintf");
+			free(args);
+			return NULL;
+		}
+	}
+
+	/* The server picks the seed. */
+
+	if (sess->opts->checksum_seed != 0) {
+		if (asprintf(&args[i++], "--checksum-seed=%" PRId32,
+		    sess->opts->checksum_seed) == -1) {
+			ERR(sess, "asprintf");
+			free(args);
+			return NULL;
+		}
+	}
+
+	/* The receiver picks the files of its stream. */
+
+	if (sess->opts->streams > 0 && f->mode == FARGS_SENDER) {
+		if (asprintf(&args[i++], "--stream=%zu/%zu",
+		    sess->opts->stream, sess->opts->streams) == -1) {
+			ERR(sess, "asprintf");
+			free(args);
+			return NULL;
+		}
+	}
+
+	/* Both sides walk trees (the receiver with --delete). */
+
+	if (sess->opts->walk_threads > 0) {
+		if (asprintf(&args[i++], "--walk-threads=%zu",
+		    sess->opts->walk_threads) == -1) {
+			ERR(sess, "asprintf");
+			free(args);
+			return NULL;
+		}
+	}
 
 	/* Terminate with a full-stop for reasons unknown. */
 
@@ -20,9 +20,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fts.h>
 #include <inttypes.h>
-#include <search.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,10 +31,28 @@
 /*
  * We allocate our file list in chunk sizes so as not to do it one by
  * one.
- * Preferrably we get one or two allocation.
+ * The list doubles in size from there, so even large lists only need
+ * a few reallocations.
  */
 #define	FLIST_CHUNK_SIZE (1024)
 
+/*
+ * Size of the chunks from which a file list's strings are allocated.
+ * Longer strings get a chunk of their own.
+ */
+#define	FLIST_STR_SIZE	(64 * 1024)
+
+/*
+ * Number of files we walk before sending them as a segment of an
+ * incremental file list.
+ */
+#define	FLIST_SEGMENT_SIZE (4096)
+
+/*
+ * Bytes of encoded file list we collect before writing them out.
+ */
+#define	FLIST_BUF_SIZE	(64 * 1024)
+
 /*
  * These flags are part of the rsync protocol.
  * They are sent as the first byte for a file transmission and encode
@@ -48,6 +64,91 @@
 #define FLIST_NAME_LONG	 0x0040 /* name >255 bytes */
 #define FLIST_TIME_SAME  0x0080 /* time is repeat */
 
+/*
+ * A chunk of the strings (paths and link targets) of a file list.
+ * Strings are carved out of these one after the other and are never
+ * freed individually, so a file list and all of its strings are freed
+ * at once in flist_free().
+ */
+struct	flchunk {
+	struct flchunk	*next; /* next (older) chunk */
+	size_t		 sz; /* size of buf */
+	size_t		 pos; /* bytes already used in buf */
+	char		 buf[]; /* strings */
+};
+
+/*
+ * Allocated just before the entries of every file list, so that the
+ * list itself (the pointer to its first entry) is all callers need to
+ * pass around.
+ * See flist_realloc().
+ */
+struct	flhdr {
+	struct flchunk	*strs; /* string chunks, newest first */
+	size_t		 max; /* entries allocated */
+};
+
+#define	FLIST_HDR(_fl) ((struct flhdr *)(void *)(_fl) - 1)
+
+/*
+ * Allocate "sz" bytes for a string of file list "fl", which must have
+ * been allocated by flist_realloc().
+ * Returns NULL on failure.
+ * The result is freed with the list.
+ */
+static char *
+flist_stralloc(struct sess *sess, struct flist *fl, size_t sz)
+{
+	struct flhdr	*h = FLIST_HDR(fl);
+	struct flchunk	*c = h->strs;
+	char		*p;
+
+	assert(fl != NULL);
+
+	if (c == NULL || c->sz - c->pos < sz) {
+		if ((c = malloc(sizeof(struct flchunk) +
+		    (sz > FLIST_STR_SIZE ? sz : FLIST_STR_SIZE))) == NULL) {
+			ERR(sess, "malloc");
+			return NULL;
+		}
+		c->sz = sz > FLIST_STR_SIZE ? sz : FLIST_STR_SIZE;
+		c->pos = 0;
+
+		/*
+		 * Keep allocating from the current chunk if this one
+		 * is only for the (long) string.
+		 */
+
+		if (sz > FLIST_STR_SIZE / 2 && h->strs != NULL) {
+			c->next = h->strs->next;
+			h->strs->next = c;
+		} else {
+			c->next = h->strs;
+			h->strs = c;
+		}
+	}
+
+	p = c->buf + c->pos;
+	c->pos += sz;
+	return p;
+}
+
+/*
+ * Copy the string "str" into file list "fl".
+ * Returns NULL on failure.
+ * The result is freed with the list.
+ */
+static char *
+flist_strdup(struct sess *sess, struct flist *fl, const char *str)
+{
+	size_t	 sz = strlen(str) + 1;
+	char	*p;
+
+	if ((p = flist_stralloc(sess, fl, sz)) != NULL)
+		memcpy(p, str, sz);
+	return p;
+}
+
 /*
  * Requied way to sort a filename list.
  */
@@ -60,76 +161,54 @@ flist_cmp(const void *p1, const void *p2)
 }
 
 /*
- * Deduplicate our file list (which may be zero-length).
+ * Deduplicate our sorted file list (which may be zero-length) in
+ * place.
  * Returns zero on failure, non-zero on success.
  */
 static int
 flist_dedupe(struct sess *sess, struct flist **fl, size_t *sz)
 {
 	size_t		 i, j;
-	struct flist	*new;
-	struct flist	*f, *fnext;
+	struct flist	*f, *flast;
 
 	if (*sz == 0)
 		return 1;
 
-	/* Create a new buffer, "new", and copy. */
-
-	new = calloc(*sz, sizeof(struct flist));
-	if (new == NULL) {
-		ERR(sess, "calloc");
-		return 0;
-	}
-
-	for (i = j = 0; i < *sz - 1; i++) {
+	for (i = j = 1; i < *sz; i++) {
 		f = &(*fl)[i];
-		fnext = &(*fl)[i + 1];
+		flast = &(*fl)[j - 1];
 
-		if (strcmp(f->wpath, fnext->wpath)) {
-			new[j++] = *f;
+		if (strcmp(flast->wpath, f->wpath)) {
+			(*fl)[j++] = *f;
 			continue;
 		}
 
 		/*
 		 * Our working (destination) paths are the same.
 		 * If the actual file is the same (as given on the
-		 * command-line), then we can just discard the first.
+		 * command-line), then we can just discard the second.
 		 * Otherwise, we need to bail out: it means we have two
 		 * different files with the relative path on the
 		 * destination side.
 		 */
 
-		if (strcmp(f->path, fnext->path) == 0) {
-			new[j++] = *f;
-			i++;
+		if (strcmp(flast->path, f->path) == 0) {
 			WARNX(sess, "%s: duplicate path: %s",
 			    f->wpath, f->path);
-			free(fnext->path);
-			free(fnext->link);
-			fnext->path = fnext->link = NULL;
 			continue;
 		}
 
 		ERRX(sess, "%s: duplicate working path for "
 		    "possibly different file: %s, %s",
-		    f->wpath, f->path, fnext->path);
-		free(new);
+		    f->wpath, flast->path, f->path);
 		return 0;
 	}
 
-	/* Don't forget the last entry. */
-
-	if (i == *sz - 1)
-		new[j++] = (*fl)[i];
-
 	/*
-	 * Reassign to the deduplicated array.
 	 * If we started out with *sz > 0, which we check for at the
 	 * beginning, then we'll always continue having *sz > 0.
 	 */
 
-	free(*fl);
-	*fl = new;
 	*sz = j;
 	assert(*sz);
 	return 1;
@@ -167,42 +246,6 @@ flist_topdirs(struct sess *sess, struct flist *fl, size_t flsz)
 	}
 }
 
-/*
- * Filter through the fts() file information.
- * We want directories (pre-order), regular files, and symlinks.
- * Everything else is skipped and possibly warned about.
- * Return zero to skip, non-zero to examine.
- */
-static int
-flist_fts_check(struct sess *sess, FTSENT *ent)
-{
-
-	if (ent->fts_info == FTS_F  ||
-	    ent->fts_info == FTS_D ||
-	    ent->fts_info == FTS_SL ||
-	    ent->fts_info == FTS_SLNONE)
-		return 1;
-
-	if (ent->fts_info == FTS_DC) {
-		WARNX(sess, "%s: directory cycle", ent->fts_path);
-	} else if (ent->fts_info == FTS_DNR) {
-		errno = ent->fts_errno;
-		WARN(sess, "%s: unreadable directory", ent->fts_path);
-	} else if (ent->fts_info == FTS_DOT) {
-		WARNX(sess, "%s: skipping dot-file", ent->fts_path);
-	} else if (ent->fts_info == FTS_ERR) {
-		errno = ent->fts_errno;
-		WARN(sess, "%s", ent->fts_path);
-	} else if (ent->fts_info == FTS_DEFAULT) {
-		WARNX(sess, "%s: skipping special", ent->fts_path);
-	} else if (ent->fts_info == FTS_NS) {
-		errno = ent->fts_errno;
-		WARN(sess, "%s: could not stat", ent->fts_path);
-	}
-
-	return 0;
-}
-
 /*
  * Copy necessary elements in "st" into the fields of "f".
  */
@@ -216,40 +259,81 @@ flist_copy_stat(struct flist *f, const struct stat *st)
 	f->st.mtime = st->st_mtime;
 }
 
+/*
+ * Free the file list "f" and all of its strings.
+ * Passing a NULL to this function is ok.
+ */
 void
 flist_free(struct flist *f, size_t sz)
 {
-	size_t	 i;
+	struct flhdr	*h;
+	struct flchunk	*c;
 
 	if (f == NULL)
 		return;
 
-	for (i = 0; i < sz; i++) {
-		free(f[i].path);
-		free(f[i].link);
+	h = FLIST_HDR(f);
+	while ((c = h->strs) != NULL) {
+		h->strs = c->next;
+		free(c);
 	}
-	free(f);
+	free(h);
 }
 
 /*
- * Serialise our file list (which may be zero-length) to the wire.
+ * Write out "*bufpos" bytes of the encoded file list in "buf".
  * Makes sure that the receiver isn't going to block on sending us
  * return messages on the log channel.
  * Return zero on failure, non-zero on success.
  */
+static int
+flist_send_buf(struct sess *sess, int fdin, int fdout,
+	const char *buf, size_t *bufpos)
+{
+
+	/*
+	 * If applicable, unclog the read buffer.
+	 * This happens when the receiver has a lot of log messages and
+	 * all we're doing is sending our file list without checking for
+	 * messages.
+	 */
+
+	if (sess->mplex_reads &&
+	    io_read_check(sess, fdin) &&
+	     !io_read_flush(sess, fdin)) {
+		ERRX1(sess, "io_read_flush");
+		return 0;
+	} else if (!io_write_buf(sess, fdout, buf, *bufpos)) {
+		ERRX1(sess, "io_write_buf");
+		return 0;
+	}
+
+	*bufpos = 0;
+	return 1;
+}
+
+/*
+ * Serialise our file list (which may be zero-length) to the wire.
+ * Entries are encoded into a buffer and written out in batches.
+ * Each is sent relative to the last: we only send the part of the name
+ * that isn't shared with the last and flag the time, mode, and gid if
+ * they're the same.
+ * Return zero on failure, non-zero on success.
+ */
 int
 flist_send(struct sess *sess, int fdin, int fdout, const struct flist *fl,
     size_t flsz)
 {
-	size_t		 i, sz, gidsz = 0;
+	size_t		 i, sz, partial, linksz, gidsz = 0;
+	size_t		 bufpos = 0, bufmax = 0, need;
 	uint8_t		 flag;
-	const struct flist *f;
+	const struct flist *f, *last = NULL;
 	const char	*fn;
+	char		*buf = NULL;
+	void		*pp;
 	struct ident	*gids = NULL;
 	int		 rc = 0;
 
-	/* Double-check that we've no pending multiplexed data. */
-
 	LOG2(sess, "sending file metadata list: %zu", flsz);
 
 	for (i = 0; i < flsz; i++) {
@@ -257,65 +341,85 @@ flist_send(struct sess *sess, int fdin, int fdout, const struct flist *fl,
 		fn = f->wpath;
 		sz = strlen(f->wpath);
 		assert(sz > 0);
+		linksz = (S_ISLNK(f->st.mode) &&
+			sess->opts->preserve_links) ? strlen(f->link) : 0;
 
 		/*
-		 * If applicable, unclog the read buffer.
-		 * This happens when the receiver has a lot of log
-		 * messages and all we're doing is sending our file list
-		 * without checking for messages.
+		 * Share up to 255 bytes of the last name, then send the
+		 * rest with a byte-sized length if it fits.
 		 */
 
-		if (sess->mplex_reads &&
-		    io_read_check(sess, fdin) &&
-		     !io_read_flush(sess, fdin)) {
-			ERRX1(sess, "io_read_flush");
-			goto out;
+		flag = 0;
+		partial = 0;
+		if (last != NULL) {
+			while (partial < UINT8_MAX && fn[partial] != '\0' &&
+			       fn[partial] == last->wpath[partial])
+				partial++;
+			if (partial > 0)
+				flag |= FLIST_NAME_SAME;
+			if ((int32_t)f->st.mtime == (int32_t)last->st.mtime)
+				flag |= FLIST_TIME_SAME;
+			if ((int32_t)f->st.mode == (int32_t)last->st.mode)
+				flag |= FLIST_MODE_SAME;
+			if (sess->opts->preserve_gids &&
+			    (int32_t)f->st.gid == (int32_t)last->st.gid)
+				flag |= FLIST_GID_SAME;
 		}
+		if (sz - partial > UINT8_MAX)
+			flag |= FLIST_NAME_LONG;
 
-		/*
-		 * For ease, make all of our filenames be "long"
-		 * regardless their actual length.
-		 * This also makes sure that we don't transmit a zero
-		 * byte unintentionally.
-		 */
+		/* A zero flag would end the list, so send long. */
 
-		flag = FLIST_NAME_LONG;
+		if (flag == 0)
+			flag = FLIST_NAME_LONG;
 
 		LOG3(sess, "%s: sending file metadata: "
 			"size %jd, mtime %jd, mode %o",
 			fn, (intmax_t)f->st.size,
 			(intmax_t)f->st.mtime, f->st.mode);
 
-		/* Now write to the wire. */
-		/* FIXME: buffer this. */
-
-		if (!io_write_byte(sess, fdout, flag)) {
-			ERRX1(sess, "io_write_byte");
-			goto out;
-		} else if (!io_write_int(sess, fdout, sz)) {
-			ERRX1(sess, "io_write_int");
-			goto out;
-		} else if (!io_write_buf(sess, fdout, fn, sz)) {
-			ERRX1(sess, "io_write_buf");
-			goto out;
-		} else if (!io_write_long(sess, fdout, f->st.size)) {
-			ERRX1(sess, "io_write_long");
-			goto out;
-		} else if (!io_write_int(sess, fdout, f->st.mtime)) {
-			ERRX1(sess, "io_write_int");
-			goto out;
-		} else if (!io_write_int(sess, fdout, f->st.mode)) {
-			ERRX1(sess, "io_write_int");
-			goto out;
+		/* Make room for the largest possible entry. */
+
+		need = sizeof(uint8_t) + /* flag */
+		    sizeof(uint8_t) + /* shared name length */
+		    sizeof(int32_t) + sz - partial + /* name */
+		    sizeof(int32_t) + sizeof(int64_t) + /* size */
+		    sizeof(int32_t) + /* mtime */
+		    sizeof(int32_t) + /* mode */
+		    sizeof(int32_t) + /* gid */
+		    sizeof(int32_t) + linksz; /* link */
+
+		if (bufpos + need > bufmax) {
+			pp = realloc(buf, bufpos + need + FLIST_BUF_SIZE);
+			if (pp == NULL) {
+				ERR(sess, "realloc");
+				goto out;
+			}
+			buf = pp;
+			bufmax = bufpos + need + FLIST_BUF_SIZE;
 		}
 
+		io_buffer_byte(sess, buf, &bufpos, bufmax, flag);
+		if (flag & FLIST_NAME_SAME)
+			io_buffer_byte(sess, buf, &bufpos, bufmax, partial);
+		if (flag & FLIST_NAME_LONG)
+			io_buffer_int(sess, buf, &bufpos, bufmax, sz - partial);
+		else
+			io_buffer_byte(sess, buf, &bufpos, bufmax, sz - partial);
+		io_buffer_buf(sess, buf, &bufpos, bufmax,
+			fn + partial, sz - partial);
+		io_buffer_long(sess, buf, &bufpos, bufmax, f->st.size);
+		if (!(flag & FLIST_TIME_SAME))
+			io_buffer_int(sess, buf, &bufpos, bufmax, f->st.mtime);
+		if (!(flag & FLIST_MODE_SAME))
+			io_buffer_int(sess, buf, &bufpos, bufmax, f->st.mode);
+
 		/* Conditional part: gid. */
 
 		if (sess->opts->preserve_gids) {
-			if (!io_write_int(sess, fdout, f->st.gid)) {
-				ERRX1(sess, "io_write_int");
-				goto out;
-			} 
+			if (!(flag & FLIST_GID_SAME))
+				io_buffer_int(sess, buf,
+					&bufpos, bufmax, f->st.gid);
 			if (!idents_gid_add(sess, &gids, &gidsz, f->st.gid)) {
 				ERRX1(sess, "idents_gid_add");
 				goto out;
@@ -324,28 +428,37 @@ flist_send(struct sess *sess, int fdin, int fdout, const struct flist *fl,
 
 		/* Conditional part: link. */
 
-		if (S_ISLNK(f->st.mode) &&
-		    sess->opts->preserve_links) {
-			fn = f->link;
-			sz = strlen(f->link);
-			if (!io_write_int(sess, fdout, sz)) {
-				ERRX1(sess, "io_write_int");
-				goto out;
-			}
-			if (!io_write_buf(sess, fdout, fn, sz)) {
-				ERRX1(sess, "io_write_int");
-				goto out;
-			}
+		if (linksz > 0) {
+			io_buffer_int(sess, buf, &bufpos, bufmax, linksz);
+			io_buffer_buf(sess, buf,
+				&bufpos, bufmax, f->link, linksz);
 		}
 
 		if (S_ISREG(f->st.mode))
 			sess->total_size += f->st.size;
+
+		if (bufpos >= FLIST_BUF_SIZE &&
+		    !flist_send_buf(sess, fdin, fdout, buf, &bufpos)) {
+			ERRX1(sess, "flist_send_buf");
+			goto out;
+		}
+		last = f;
 	}
 
 	/* Signal end of file list. */
 
-	if (!io_write_byte(sess, fdout, 0)) {
-		ERRX1(sess, "io_write_byte");
+	if (bufpos + 1 > bufmax) {
+		if ((pp = realloc(buf, bufpos + 1)) == NULL) {
+			ERR(sess, "realloc");
+			goto out;
+		}
+		buf = pp;
+		bufmax = bufpos + 1;
+	}
+	io_buffer_byte(sess, buf, &bufpos, bufmax, 0);
+
+	if (!flist_send_buf(sess, fdin, fdout, buf, &bufpos)) {
+		ERRX1(sess, "flist_send_buf");
 		goto out;
 	}
 
@@ -361,6 +474,7 @@ flist_send(struct sess *sess, int fdin, int fdout, const struct flist *fl,
 
 	rc = 1;
 out:
+	free(buf);
 	idents_free(gids, gidsz);
 	return rc;
 }
@@ -370,12 +484,12 @@ out:
  * This is the most expensive part of the file list transfer, so a lot
  * of attention has gone into transmitting as little as possible.
  * Micro-optimisation, but whatever.
- * Fills in "f" with the full path on success.
+ * Fills in "f", an entry of "fl", with the full path on success.
  * Returns zero on failure, non-zero on success.
  */
 static int
-flist_recv_name(struct sess *sess, int fd, struct flist *f, uint8_t flags,
-    char last[MAXPATHLEN])
+flist_recv_name(struct sess *sess, int fd, struct flist *fl, struct flist *f,
+    uint8_t flags, char last[MAXPATHLEN])
 {
 	uint8_t		 bval;
 	size_t		 partial = 0;
@@ -393,8 +507,11 @@ flist_recv_name(struct sess *sess, int fd, struct flist *f, uint8_t flags,
 		if (!io_read_byte(sess, fd, &bval)) {
 			ERRX1(sess, "io_read_byte");
 			return 0;
+		} else if ((partial = bval) > strlen(last)) {
+			ERRX(sess, "shared name is longer "
+				"than last name");
+			return 0;
 		}
-		partial = bval;
 	}
 
 	/* Get the (possibly-remaining) filename length. */
@@ -421,8 +538,8 @@ flist_recv_name(struct sess *sess, int fd, struct flist *f, uint8_t flags,
 		return 0;
 	}
 
-	if ((f->path = malloc(len + 1)) == NULL) {
-		ERR(sess, "malloc");
+	if ((f->path = flist_stralloc(sess, fl, len + 1)) == NULL) {
+		ERRX1(sess, "flist_stralloc");
 		return 0;
 	}
 	f->path[len] = '\0';
@@ -458,48 +575,76 @@ flist_recv_name(struct sess *sess, int fd, struct flist *f, uint8_t flags,
 }
 
 /*
- * Reallocate a file list in chunks of FLIST_CHUNK_SIZE;
+ * Add a zeroed entry to the file list, allocating it if "*fl" is NULL
+ * and growing it by FLIST_CHUNK_SIZE, then doubling, as required.
+ * All file lists must be allocated this way, as the list is preceded
+ * by its struct flhdr.
  * Returns zero on failure, non-zero on success.
  */
 static int
-flist_realloc(struct sess *sess, struct flist **fl, size_t *sz, size_t *max)
+flist_realloc(struct sess *sess, struct flist **fl, size_t *sz)
 {
-	void	*pp;
+	struct flhdr	*h = NULL;
+	size_t		 max = 0, nmax;
+	void		*pp;
+
+	if (*fl != NULL) {
+		h = FLIST_HDR(*fl);
+		max = h->max;
+	}
 
-	if (*sz + 1 <= *max)  {
+	if (*sz + 1 <= max)  {
 		(*sz)++;
 		return 1;
 	}
 
-	pp = recallocarray(*fl, *max,
-		*max + FLIST_CHUNK_SIZE, sizeof(struct flist));
+	nmax = max < FLIST_CHUNK_SIZE ? max + FLIST_CHUNK_SIZE : max * 2;
+	if (nmax > (SIZE_MAX - sizeof(struct flhdr)) /
+	    sizeof(struct flist)) {
+		ERRX(sess, "file list too large");
+		return 0;
+	}
+
+	pp = realloc(h, sizeof(struct flhdr) + nmax * sizeof(struct flist));
 	if (pp == NULL) {
-		ERR(sess, "recallocarray");
+		ERR(sess, "realloc");
 		return 0;
 	}
-	*fl = pp;
-	*max += FLIST_CHUNK_SIZE;
+	h = pp;
+	if (*fl == NULL)
+		h->strs = NULL;
+	h->max = nmax;
+	*fl = (struct flist *)(h + 1);
+	memset(*fl + max, 0, (nmax - max) * sizeof(struct flist));
 	(*sz)++;
 	return 1;
 }
 
 /*
- * Copy a regular or symbolic link file "path" into "f".
+ * Add a regular or symbolic link file "path" to the list.
  * This handles the correct path creation and symbolic linking.
  * Returns zero on failure, non-zero on success.
  */
 static int
-flist_append(struct sess *sess, struct flist *f, struct stat *st,
-    const char *path)
+flist_append(struct sess *sess, struct flist **fl, size_t *sz,
+    struct stat *st, const char *path)
 {
+	struct flist	*f;
+	char		*link;
+
+	if (!flist_realloc(sess, fl, sz)) {
+		ERRX1(sess, "flist_realloc");
+		return 0;
+	}
+	f = &(*fl)[*sz - 1];
 
 	/*
 	 * Copy the full path for local addressing and transmit
 	 * only the filename part for the receiver.
 	 */
 
-	if ((f->path = strdup(path)) == NULL) {
-		ERR(sess, "strdup");
+	if ((f->path = flist_strdup(sess, *fl, path)) == NULL) {
+		ERRX1(sess, "flist_strdup");
 		return 0;
 	}
 
@@ -519,28 +664,35 @@ flist_append(struct sess *sess, struct flist *f, struct stat *st,
 	/* Optionally copy link information. */
 
 	if (S_ISLNK(st->st_mode)) {
-		f->link = symlink_read(sess, f->path);
-		if (f->link == NULL) {
+		if ((link = symlink_read(sess, f->path)) == NULL) {
 			ERRX1(sess, "symlink_read");
 			return 0;
 		}
+		f->link = flist_strdup(sess, *fl, link);
+		free(link);
+		if (f->link == NULL) {
+			ERRX1(sess, "flist_strdup");
+			return 0;
+		}
 	}
 
 	return 1;
 }
 
 /*
- * Receive a file list from the wire, filling in length "sz" (which may
- * possibly be zero) and list "flp" on success.
+ * Receive a file list from the wire, appending its entries to "flp" of
+ * length "sz" (both of which may be updated on failure, too) and
+ * sorting them.
+ * The list received may be zero-length.
  * Return zero on failure, non-zero on success.
  */
-int
-flist_recv(struct sess *sess, int fd, struct flist **flp, size_t *sz)
+static int
+flist_recv_list(struct sess *sess, int fd, struct flist **flp, size_t *sz)
 {
-	struct flist	*fl = NULL;
+	struct flist	*fl = *flp;
 	struct flist	*ff;
 	const struct flist *fflast = NULL;
-	size_t		 i, j, flsz = 0, flmax = 0, lsz, gidsz = 0;
+	size_t		 i, j, flsz = *sz, start = *sz, lsz, gidsz = 0;
 	uint8_t		 flag;
 	char		 last[MAXPATHLEN];
 	uint64_t	 lval; /* temporary values... */
@@ -556,17 +708,17 @@ flist_recv(struct sess *sess, int fd, struct flist **flp, size_t *sz)
 		} else if (flag == 0)
 			break;
 
-		if (!flist_realloc(sess, &fl, &flsz, &flmax)) {
+		if (!flist_realloc(sess, &fl, &flsz)) {
 			ERRX1(sess, "flist_realloc");
 			goto out;
 		}
 
 		ff = &fl[flsz - 1];
-		fflast = flsz > 1 ? &fl[flsz - 2] : NULL;
+		fflast = flsz > start + 1 ? &fl[flsz - 2] : NULL;
 
 		/* Filename first. */
 
-		if (!flist_recv_name(sess, fd, ff, flag, last)) {
+		if (!flist_recv_name(sess, fd, fl, ff, flag, last)) {
 			ERRX1(sess, "flist_recv_name");
 			goto out;
 		}
@@ -635,11 +787,12 @@ flist_recv(struct sess *sess, int fd, struct flist **flp, size_t *sz)
 				ERRX(sess, "empty link name");
 				goto out;
 			}
-			ff->link = calloc(lsz + 1, 1);
+			ff->link = flist_stralloc(sess, fl, lsz + 1);
 			if (ff->link == NULL) {
-				ERR(sess, "calloc");
+				ERRX1(sess, "flist_stralloc");
 				goto out;
 			}
+			ff->link[lsz] = '\0';
 			if (!io_read_buf(sess, fd, ff->link, lsz)) {
 				ERRX1(sess, "io_read_buf");
 				goto out;
@@ -671,16 +824,15 @@ flist_recv(struct sess *sess, int fd, struct flist **flp, size_t *sz)
 
 	/* Remember to order the received list. */
 
-	LOG2(sess, "received file metadata list: %zu", flsz);
-	qsort(fl, flsz, sizeof(struct flist), flist_cmp);
-	flist_topdirs(sess, fl, flsz);
+	LOG2(sess, "received file metadata list: %zu", flsz - start);
+	qsort(fl + start, flsz - start, sizeof(struct flist), flist_cmp);
 	*sz = flsz;
 	*flp = fl;
 
 	/* Lastly, reassign group identifiers. */
 
 	if (sess->opts->preserve_gids) {
-		for (i = 0; i < flsz; i++) {
+		for (i = start; i < flsz; i++) {
 			for (j = 0; j < gidsz; j++)
 				if ((int32_t)fl[i].st.gid == gids[j].id)
 					break;
@@ -692,82 +844,146 @@ flist_recv(struct sess *sess, int fd, struct flist **flp, size_t *sz)
 	idents_free(gids, gidsz);
 	return 1;
 out:
-	flist_free(fl, flsz);
 	idents_free(gids, gidsz);
-	*sz = 0;
-	*flp = NULL;
+	*sz = flsz;
+	*flp = fl;
 	return 0;
 }
 
 /*
- * Generate a flist possibly-recursively given a file root, which may
- * also be a regular file or symlink.
- * On success, augments the generated list in "flp" of length "sz".
+ * Receive a file list from the wire, filling in length "sz" (which may
+ * possibly be zero) and list "flp" on success.
+ * Return zero on failure, non-zero on success.
+ */
+int
+flist_recv(struct sess *sess, int fd, struct flist **flp, size_t *sz)
+{
+
+	*flp = NULL;
+	*sz = 0;
+
+	if (!flist_recv_list(sess, fd, flp, sz)) {
+		ERRX1(sess, "flist_recv_list");
+		flist_free(*flp, *sz);
+		*flp = NULL;
+		*sz = 0;
+		return 0;
+	}
+
+	flist_topdirs(sess, *flp, *sz);
+	return 1;
+}
+
+/*
+ * Receive a segment of an incremental file list (see flist_gen_inc())
+ * and append it to the list "flp" of length "sz".
+ * An empty segment ends the list.
+ * The list must still be freed by the caller on failure.
+ * Return zero on failure, non-zero on success.
+ */
+int
+flist_recv_seg(struct sess *sess, int fd, struct flist **flp, size_t *sz)
+{
+
+	if (!flist_recv_list(sess, fd, flp, sz)) {
+		ERRX1(sess, "flist_recv_list");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * State passed to flist_gen_dirent_fn() while walking a root.
+ */
+struct	flist_gen_walk {
+	struct flist	**fl; /* list being generated */
+	size_t		 *sz; /* entries in list */
+	size_t		  stripdir; /* bytes to strip from path */
+	size_t		  flsz; /* entries added for this root */
+};
+
+/*
+ * An incremental file list being generated.
+ * See flist_gen_inc().
+ */
+struct	flgen {
+	struct pool		*pool; /* directory readers or NULL */
+	struct walk		*walk; /* walk of the root */
+	struct flist_gen_walk	 gw; /* where we're putting files */
+};
+
+/*
+ * Add each file found by walk() to the list.
  * Returns zero on failure, non-zero on success.
  */
 static int
-flist_gen_dirent(struct sess *sess, char *root, struct flist **fl, size_t *sz,
-    size_t *max)
+flist_gen_dirent_fn(struct sess *sess, void *arg, const char *path,
+	const struct stat *st, char *link)
 {
-	char		*cargv[2], *cp;
-	int		 rc = 0;
-	FTS		*fts;
-	FTSENT		*ent;
-	struct flist	*f;
-	size_t		 flsz = 0, stripdir;
-	struct stat	 st;
+	struct flist_gen_walk	*gw = arg;
+	struct flist		*f;
+	size_t			 sz;
 
-	cargv[0] = root;
-	cargv[1] = NULL;
+	/* We don't allow symlinks without -l. */
 
-	/*
-	 * If we're a file, then revert to the same actions we use for
-	 * the non-recursive scan.
-	 */
+	if (S_ISLNK(st->st_mode) && !sess->opts->preserve_links) {
+		WARNX(sess, "%s: skipping symlink", path);
+		free(link);
+		return 1;
+	}
 
-	if (lstat(root, &st) == -1) {
-		ERR(sess, "%s: lstat", root);
+	/* Allocate a new file entry. */
+
+	if (!flist_realloc(sess, gw->fl, gw->sz)) {
+		ERRX1(sess, "flist_realloc");
+		free(link);
 		return 0;
-	} else if (S_ISREG(st.st_mode)) {
-		if (!flist_realloc(sess, fl, sz, max)) {
-			ERRX1(sess, "flist_realloc");
-			return 0;
-		}
-		f = &(*fl)[(*sz) - 1];
-		assert(f != NULL);
+	}
+	gw->flsz++;
+	f = &(*gw->fl)[*gw->sz - 1];
 
-		if (!flist_append(sess, f, &st, root)) {
-			ERRX1(sess, "flist_append");
-			return 0;
-		} else if (unveil(root, "r") == -1) {
-			ERR(sess, "%s: unveil", root);
-			return 0;
-		}
-		return 1;
-	} else if (S_ISLNK(st.st_mode)) {
-		if (!sess->opts->preserve_links) {
-			WARNX(sess, "%s: skipping symlink", root);
-			return 1;
-		} else if (!flist_realloc(sess, fl, sz, max)) {
-			ERRX1(sess, "flist_realloc");
+	if (link != NULL) {
+		f->link = flist_strdup(sess, *gw->fl, link);
+		free(link);
+		if (f->link == NULL) {
+			ERRX1(sess, "flist_strdup");
 			return 0;
 		}
-		f = &(*fl)[(*sz) - 1];
-		assert(f != NULL);
+	}
 
-		if (!flist_append(sess, f, &st, root)) {
-			ERRX1(sess, "flist_append");
+	/* Our path defaults to "." for the root. */
+
+	sz = strlen(path);
+	if ('\0' == path[gw->stripdir]) {
+		if ((f->path = flist_stralloc(sess, *gw->fl, sz + 2)) == NULL) {
+			ERRX1(sess, "flist_stralloc");
 			return 0;
-		} else if (unveil(root, "r") == -1) {
-			ERR(sess, "%s: unveil", root);
+		}
+		memcpy(f->path, path, sz);
+		f->path[sz] = '.';
+		f->path[sz + 1] = '\0';
+	} else {
+		if ((f->path = flist_strdup(sess, *gw->fl, path)) == NULL) {
+			ERRX1(sess, "flist_strdup");
 			return 0;
 		}
-		return 1;
-	} else if (!S_ISDIR(st.st_mode)) {
-		WARNX(sess, "%s: skipping special", root);
-		return 1;
 	}
 
+	f->wpath = f->path + gw->stripdir;
+	flist_copy_stat(f, st);
+	return 1;
+}
+
+/*
+ * How much of the paths under the directory "root" we strip for the
+ * receiver.
+ */
+static size_t
+flist_stripdir(const char *root)
+{
+	const char	*cp;
+	size_t		 stripdir;
+
 	/*
 	 * If we end with a slash, it means that we're not supposed to
 	 * copy the directory part itself---only the contents.
@@ -789,88 +1005,84 @@ flist_gen_dirent(struct sess *sess, char *root, struct flist **fl, size_t *sz,
 		if ((cp = strrchr(root, '/')) != NULL)
 			stripdir = cp - root + 1;
 
+	return stripdir;
+}
+
+/*
+ * Generate a flist possibly-recursively given a file root, which may
+ * also be a regular file or symlink.
+ * Directories are walked with walk(), using the pool "p" if not NULL.
+ * On success, augments the generated list in "flp" of length "sz".
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+flist_gen_dirent(struct sess *sess, struct pool *p, char *root,
+    struct flist **fl, size_t *sz)
+{
+	size_t			 stripdir;
+	struct stat		 st;
+	struct flist_gen_walk	 gw;
+
 	/*
-	 * If we're recursive, then we need to take down all of the
-	 * files and directory components, so use fts(3).
-	 * Copying the information file-by-file into the flstat.
-	 * We'll make sense of it in flist_send.
+	 * If we're a file, then revert to the same actions we use for
+	 * the non-recursive scan.
 	 */
 
-	if ((fts = fts_open(cargv, FTS_PHYSICAL, NULL)) == NULL) {
-		ERR(sess, "fts_open");
+	if (lstat(root, &st) == -1) {
+		ERR(sess, "%s: lstat", root);
 		return 0;
-	}
-
-	errno = 0;
-	while ((ent = fts_read(fts)) != NULL) {
-		if (!flist_fts_check(sess, ent)) {
-			errno = 0;
-			continue;
-		}
-
-		/* We don't allow symlinks without -l. */
-
-		assert(ent->fts_statp != NULL);
-		if (S_ISLNK(ent->fts_statp->st_mode) &&
-		    !sess->opts->preserve_links) {
-			WARNX(sess, "%s: skipping "
-				"symlink", ent->fts_path);
-			continue;
-		}
-
-		/* Allocate a new file entry. */
-
-		if (!flist_realloc(sess, fl, sz, max)) {
-			ERRX1(sess, "flist_realloc");
-			goto out;
+	} else if (S_ISREG(st.st_mode)) {
+		if (!flist_append(sess, fl, sz, &st, root)) {
+			ERRX1(sess, "flist_append");
+			return 0;
+		} else if (unveil(root, "r") == -1) {
+			ERR(sess, "%s: unveil", root);
+			return 0;
 		}
-		flsz++;
-		f = &(*fl)[*sz - 1];
-
-		/* Our path defaults to "." for the root. */
-
-		if ('\0' == ent->fts_path[stripdir]) {
-			if (asprintf(&f->path, "%s.", ent->fts_path) < 0) {
-				ERR(sess, "asprintf");
-				f->path = NULL;
-				goto out;
-			}
-		} else {
-			if ((f->path = strdup(ent->fts_path)) == NULL) {
-				ERR(sess, "strdup");
-				goto out;
-			}
+		return 1;
+	} else if (S_ISLNK(st.st_mode)) {
+		if (!sess->opts->preserve_links) {
+			WARNX(sess, "%s: skipping symlink", root);
+			return 1;
+		} else if (!flist_append(sess, fl, sz, &st, root)) {
+			ERRX1(sess, "flist_append");
+			return 0;
+		} else if (unveil(root, "r") == -1) {
+			ERR(sess, "%s: unveil", root);
+			return 0;
 		}
+		return 1;
+	} else if (!S_ISDIR(st.st_mode)) {
+		WARNX(sess, "%s: skipping special", root);
+		return 1;
+	}
 
-		f->wpath = f->path + stripdir;
-		flist_copy_stat(f, ent->fts_statp);
+	stripdir = flist_stripdir(root);
 
-		/* Optionally copy link information. */
+	/*
+	 * If we're recursive, then we need to take down all of the
+	 * files and directory components, so walk the tree.
+	 * Copying the information file-by-file into the flstat.
+	 * We'll make sense of it in flist_send.
+	 */
 
-		if (S_ISLNK(ent->fts_statp->st_mode)) {
-			f->link = symlink_read(sess, f->path);
-			if (f->link == NULL) {
-				ERRX1(sess, "symlink_read");
-				goto out;
-			}
-		}
+	memset(&gw, 0, sizeof(struct flist_gen_walk));
+	gw.fl = fl;
+	gw.sz = sz;
+	gw.stripdir = stripdir;
 
-		/* Reset errno for next fts_read() call. */
-		errno = 0;
-	}
-	if (errno) {
-		ERR(sess, "fts_read");
-		goto out;
+	if (!walk(sess, p, root,
+	    sess->opts->preserve_links ? WALK_LINKS : 0,
+	    flist_gen_dirent_fn, &gw)) {
+		ERRX1(sess, "walk");
+		return 0;
 	} else if (unveil(root, "r") == -1) {
 		ERR(sess, "%s: unveil", root);
-		goto out;
+		return 0;
 	}
 
-	LOG3(sess, "generated %zu filenames: %s", flsz, root);
-	rc = 1;
-out:
-	fts_close(fts);
-	return rc;
+	LOG3(sess, "generated %zu filenames: %s", gw.flsz, root);
+	return 1;
 }
 
 /*
@@ -884,19 +1096,28 @@ static int
 flist_gen_dirs(struct sess *sess, size_t argc, char **argv, struct flist **flp,
     size_t *sz)
 {
-	size_t		 i, max = 0;
+	size_t		 i;
+	struct pool	*p = NULL;
+
+	if (sess->opts->walk_threads > 0 &&
+	    (p = pool_alloc(sess, sess->opts->walk_threads)) == NULL) {
+		ERRX1(sess, "pool_alloc");
+		return 0;
+	}
 
 	for (i = 0; i < argc; i++)
-		if (!flist_gen_dirent(sess, argv[i], flp, sz, &max))
+		if (!flist_gen_dirent(sess, p, argv[i], flp, sz))
 			break;
 
+	pool_free(p);
+
 	if (i == argc) {
 		LOG2(sess, "recursively generated %zu filenames", *sz);
 		return 1;
 	}
 
 	ERRX1(sess, "flist_gen_dirent");
-	flist_free(*flp, max);
+	flist_free(*flp, *sz);
 	*flp = NULL;
 	*sz = 0;
 	return 0;
@@ -912,17 +1133,12 @@ static int
 flist_gen_files(struct sess *sess, size_t argc, char **argv,
     struct flist **flp, size_t *sz)
 {
-	struct flist	*fl = NULL, *f;
+	struct flist	*fl = NULL;
 	size_t		 i, flsz = 0;
 	struct stat	 st;
 
 	assert(argc);
 
-	if ((fl = calloc(argc, sizeof(struct flist))) == NULL) {
-		ERR(sess, "calloc");
-		return 0;
-	}
-
 	for (i = 0; i < argc; i++) {
 		if ('\0' == argv[i][0])
 			continue;
@@ -952,16 +1168,12 @@ flist_gen_files(struct sess *sess, size_t argc, char **argv,
 			continue;
 		}
 
-
-		f = &fl[flsz++];
-		assert(f != NULL);
-
 		/* Add this file to our file-system worldview. */
 
 		if (unveil(argv[i], "r") == -1) {
 			ERR(sess, "%s: unveil", argv[i]);
 			goto out;
-		} else if (!flist_append(sess, f, &st, argv[i])) {
+		} else if (!flist_append(sess, &fl, &flsz, &st, argv[i])) {
 			ERRX1(sess, "flist_append");
 			goto out;
 		}
@@ -972,7 +1184,7 @@ flist_gen_files(struct sess *sess, size_t argc, char **argv,
 	*flp = fl;
 	return 1;
 out:
-	flist_free(fl, argc);
+	flist_free(fl, flsz);
 	*sz = 0;
 	*flp = NULL;
 	return 0;
@@ -1019,6 +1231,164 @@ flist_gen(struct sess *sess, size_t argc, char **argv, struct flist **flp,
 	return 0;
 }
 
+/*
+ * Start generating the file list for the single recursive "root" in
+ * segments, for an incremental file list.
+ * The first segment, the root itself, is put into "flp" of length
+ * "sz".
+ * Each following segment is appended by flist_gen_next().
+ * Returns NULL on failure.
+ * On success, flist_gen_free() must be called with the pointer and
+ * "fl" will need to be freed with flist_free().
+ */
+struct flgen *
+flist_gen_inc(struct sess *sess, char *root, struct flist **flp,
+    size_t *sz)
+{
+	struct flgen	*g;
+	struct stat	 st;
+
+	assert(sess->opts->recursive);
+
+	*flp = NULL;
+	*sz = 0;
+
+	if (lstat(root, &st) == -1) {
+		ERR(sess, "%s: lstat", root);
+		return NULL;
+	} else if ((g = calloc(1, sizeof(struct flgen))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	}
+
+	/* We'll be reading everything under root from here on. */
+
+	if (unveil(root, "r") == -1) {
+		ERR(sess, "%s: unveil", root);
+		goto out;
+	} else if (unveil(NULL, NULL) == -1) {
+		ERR(sess, "unveil");
+		goto out;
+	}
+
+	if (sess->opts->walk_threads > 0 &&
+	    (g->pool = pool_alloc(sess, sess->opts->walk_threads)) == NULL) {
+		ERRX1(sess, "pool_alloc");
+		goto out;
+	}
+
+	g->gw.fl = flp;
+	g->gw.sz = sz;
+	g->gw.stripdir = flist_stripdir(root);
+
+	g->walk = walk_alloc(sess, g->pool, root,
+		sess->opts->preserve_links ? WALK_LINKS : 0,
+		flist_gen_dirent_fn, &g->gw);
+	if (g->walk == NULL) {
+		ERRX1(sess, "walk_alloc");
+		goto out;
+	}
+
+	flist_topdirs(sess, *flp, *sz);
+	return g;
+out:
+	flist_free(*flp, *sz);
+	*flp = NULL;
+	*sz = 0;
+	flist_gen_free(g);
+	return NULL;
+}
+
+/*
+ * Append the next segment (sorted, but not sorted into the rest) of the
+ * incremental list started with flist_gen_inc() to "flp" of length
+ * "sz".
+ * Segments hold the contents of at least FLIST_SEGMENT_SIZE files,
+ * stopping at the end of a directory, unless it's the last.
+ * Returns <0 on failure, 0 if there are no more segments (nothing was
+ * appended), >0 if a segment was appended.
+ */
+int
+flist_gen_next(struct sess *sess, struct flgen *g, struct flist **flp,
+    size_t *sz)
+{
+	size_t	 start = *sz;
+	int	 c = 1;
+
+	g->gw.fl = flp;
+	g->gw.sz = sz;
+
+	while (*sz - start < FLIST_SEGMENT_SIZE &&
+	    (c = walk_step(sess, g->walk)) > 0)
+		continue;
+
+	if (c < 0) {
+		ERRX1(sess, "walk_step");
+		return -1;
+	} else if (*sz == start)
+		return 0;
+
+	qsort(*flp + start, *sz - start, sizeof(struct flist), flist_cmp);
+	LOG3(sess, "generated file list segment: %zu", *sz - start);
+	return 1;
+}
+
+/*
+ * Free the incremental list generator.
+ * Passing a NULL to this function is ok.
+ */
+void
+flist_gen_free(struct flgen *g)
+{
+
+	if (g == NULL)
+		return;
+	walk_free(g->walk);
+	pool_free(g->pool);
+	free(g);
+}
+
+/*
+ * State passed to flist_gen_dels_fn() while walking a root.
+ */
+struct	flist_dels_walk {
+	struct flist	**fl; /* files to delete */
+	size_t		 *sz; /* entries in list */
+	size_t		  stripdir; /* bytes to strip from path */
+};
+
+/*
+ * Add each file found by walk() to the list of candidates for deletion.
+ * We don't know yet which of these we're synchronising: that's sorted
+ * out once we have them all by flist_gen_dels().
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+flist_gen_dels_fn(struct sess *sess, void *arg, const char *path,
+	const struct stat *st, char *link)
+{
+	struct flist_dels_walk	*dw = arg;
+	struct flist		*f;
+
+	free(link);
+	if (dw->stripdir >= strlen(path))
+		return 1;
+
+	if (!flist_realloc(sess, dw->fl, dw->sz)) {
+		ERRX1(sess, "flist_realloc");
+		return 0;
+	}
+	f = &(*dw->fl)[*dw->sz - 1];
+
+	if ((f->path = flist_strdup(sess, *dw->fl, path)) == NULL) {
+		ERRX1(sess, "flist_strdup");
+		return 0;
+	}
+	f->wpath = f->path + dw->stripdir;
+	flist_copy_stat(f, st);
+	return 1;
+}
+
 /*
  * Generate a list of files in root to delete that are within the
  * top-level directories stipulated by "wfl".
@@ -1031,14 +1401,11 @@ int
 flist_gen_dels(struct sess *sess, const char *root, struct flist **fl,
     size_t *sz,	const struct flist *wfl, size_t wflsz)
 {
-	char		**cargv = NULL;
-	int		  rc = 0, c;
-	FTS		 *fts = NULL;
-	FTSENT		 *ent;
-	struct flist	 *f;
-	size_t		  cargvs = 0, i, j, max = 0, stripdir;
-	ENTRY		  hent;
-	ENTRY		 *hentp;
+	char			**cargv = NULL;
+	int			  rc = 0, c;
+	struct pool		 *p = NULL;
+	struct flist_dels_walk	  dw;
+	size_t			  cargvs = 0, i, j, k;
 
 	*fl = NULL;
 	*sz = 0;
@@ -1105,97 +1472,56 @@ flist_gen_dels(struct sess *sess, const char *root, struct flist **fl,
 
 	LOG2(sess, "delete from %zu directories", cargvs);
 
-	/*
-	 * Next, use the standard hcreate(3) hashtable interface to hash
-	 * all of the files that we want to synchronise.
-	 * This way, we'll be able to determine which files we want to
-	 * delete in O(n) time instead of O(n * search) time.
-	 * Plus, we can do the scan in-band and only allocate the files
-	 * we want to delete.
-	 */
-
-	if (!hcreate(wflsz)) {
-		ERR(sess, "hcreate");
-		goto out;
-	}
-
-	for (i = 0; i < wflsz; i++) {
-		memset(&hent, 0, sizeof(ENTRY));
-		if ((hent.key = strdup(wfl[i].wpath)) == NULL) {
-			ERR(sess, "strdup");
-			goto out;
-		}
-		if ((hentp = hsearch(hent, ENTER)) == NULL) {
-			ERR(sess, "hsearch");
-			goto out;
-		} else if (hentp->key != hent.key) {
-			ERRX(sess, "%s: duplicate", wfl[i].wpath);
-			free(hent.key);
-			goto out;
-		}
-	}
-
 	/*
 	 * Now we're going to try to descend into all of the top-level
 	 * directories stipulated by the file list.
 	 * If the directories don't exist, it's ok.
 	 */
 
-	if ((fts = fts_open(cargv, FTS_PHYSICAL, NULL)) == NULL) {
-		ERR(sess, "fts_open");
+	if (sess->opts->walk_threads > 0 &&
+	    (p = pool_alloc(sess, sess->opts->walk_threads)) == NULL) {
+		ERRX1(sess, "pool_alloc");
 		goto out;
 	}
 
-	stripdir = strlen(root) + 1;
-	errno = 0;
-	while ((ent = fts_read(fts)) != NULL) {
-		if (ent->fts_info == FTS_NS)
-			continue;
-		if (!flist_fts_check(sess, ent)) {
-			errno = 0;
-			continue;
-		} else if (stripdir >= ent->fts_pathlen)
-			continue;
-
-		/* Look up in hashtable. */
-
-		memset(&hent, 0, sizeof(ENTRY));
-		hent.key = ent->fts_path + stripdir;
-		if (hsearch(hent, FIND) != NULL)
-			continue;
+	memset(&dw, 0, sizeof(struct flist_dels_walk));
+	dw.fl = fl;
+	dw.sz = sz;
+	dw.stripdir = strlen(root) + 1;
 
-		/* Not found: we'll delete it. */
-
-		if (!flist_realloc(sess, fl, sz, &max)) {
-			ERRX1(sess, "flist_realloc");
+	for (i = 0; i < cargvs; i++)
+		if (!walk(sess, p, cargv[i],
+		    WALK_QUIET, flist_gen_dels_fn, &dw)) {
+			ERRX1(sess, "walk");
 			goto out;
 		}
-		f = &(*fl)[*sz - 1];
 
-		if ((f->path = strdup(ent->fts_path)) == NULL) {
-			ERR(sess, "strdup");
-			goto out;
-		}
-		f->wpath = f->path + stripdir;
-		assert(ent->fts_statp != NULL);
-		flist_copy_stat(f, ent->fts_statp);
-		errno = 0;
-	}
+	/*
+	 * Both our local files and those we're synchronising (already
+	 * sorted and deduplicated when received) are now in the same
+	 * order, so one pass over the two tells us which local files
+	 * don't exist in the synchronised set.
+	 * Keep only those, in order.
+	 */
 
-	if (errno) {
-		ERR(sess, "fts_read");
-		goto out;
+	qsort(*fl, *sz, sizeof(struct flist), flist_cmp);
+
+	for (i = j = k = 0; i < *sz; i++) {
+		while (j < wflsz &&
+		    (c = strcmp(wfl[j].wpath, (*fl)[i].wpath)) < 0)
+			j++;
+		if (j < wflsz && c == 0)
+			continue;
+		(*fl)[k++] = (*fl)[i];
 	}
+	*sz = k;
 
-	qsort(*fl, *sz, sizeof(struct flist), flist_cmp);
 	rc = 1;
 out:
-	if (fts != NULL)
-		fts_close(fts);
+	pool_free(p);
 	for (i = 0; i < cargvs; i++)
 		free(cargv[i]);
 	free(cargv);
-	hdestroy();
 	return rc;
 }
 
@@ -1203,13 +1529,19 @@ out:
  * Delete all files and directories in "fl".
  * If called with a zero-length "fl", does nothing.
  * If dry_run is specified, simply write what would be done.
+ * The list is sorted, so working backward removes the contents of
+ * directories before the directories themselves, and runs of files in
+ * the same directory are removed relative to it, opened just once.
  * Return zero on failure, non-zero on success.
  */
 int
 flist_del(struct sess *sess, int root, const struct flist *fl, size_t flsz)
 {
-	ssize_t	 i;
-	int	 flag;
+	ssize_t		 i;
+	int		 flag, dfd = -1, rc = 0;
+	const char	*cp, *base;
+	char		*dir = NULL;
+	size_t		 dirsz = 0;
 
 	if (flsz == 0)
 		return 1;
@@ -1219,16 +1551,62 @@ flist_del(struct sess *sess, int root, const struct flist *fl, size_t flsz)
 
 	for (i = flsz - 1; i >= 0; i--) {
 		LOG1(sess, "%s: deleting", fl[i].wpath);
+		sess->stats.files_del++;
 		if (sess->opts->dry_run)
 			continue;
 		assert(root != -1);
+
+		/*
+		 * Switch to the file's parent directory unless we're
+		 * already there.
+		 * If it's gone, so is the file.
+		 */
+
+		if ((cp = strrchr(fl[i].wpath, '/')) == NULL) {
+			if (dfd != -1)
+				close(dfd);
+			dfd = -1;
+			free(dir);
+			dir = NULL;
+			base = fl[i].wpath;
+		} else {
+			base = cp + 1;
+			if (dir == NULL ||
+			    dirsz != (size_t)(cp - fl[i].wpath) ||
+			    strncmp(dir, fl[i].wpath, dirsz)) {
+				if (dfd != -1)
+					close(dfd);
+				dfd = -1;
+				free(dir);
+				dirsz = cp - fl[i].wpath;
+				if ((dir = strndup(fl[i].wpath,
+				    dirsz)) == NULL) {
+					ERR(sess, "strndup");
+					goto out;
+				}
+				dfd = openat(root, dir,
+					O_RDONLY | O_DIRECTORY, 0);
+				if (dfd == -1 && errno != ENOENT) {
+					ERR(sess, "%s: openat", dir);
+					goto out;
+				}
+			}
+			if (dfd == -1)
+				continue;
+		}
+
 		flag = S_ISDIR(fl[i].st.mode) ? AT_REMOVEDIR : 0;
-		if (unlinkat(root, fl[i].wpath, flag) == -1 &&
+		if (unlinkat(dfd == -1 ? root : dfd, base, flag) == -1 &&
 		    errno != ENOENT) {
 			ERR(sess, "%s: unlinkat", fl[i].wpath);
-			return 0;
+			goto out;
 		}
 	}
 
-	return 1;
+	rc = 1;
+out:
+	if (dfd != -1)
+		close(dfd);
+	free(dir);
+	return rc;
 }
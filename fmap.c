@@ -0,0 +1,154 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * Bytes read into the window at a time, unless a bigger range is
+ * asked for.
+ */
+#define	FMAP_WINDOW	(1024 * 1024)
+
+/*
+ * Start a window over the open regular file "fd" of size "size".
+ * With FMAP_DROP in "flags", we're the last reader of the file, so tell
+ * the kernel to drop the pages we've moved past and don't need cached.
+ * With FMAP_RANDOM, the file is read here and there (like an origin
+ * file being copied from), so we only read ahead when reading on from
+ * where the window ends.
+ * This doesn't read anything yet.
+ */
+void
+fmap_init(struct fmap *m, int fd, off_t size, int flags)
+{
+
+	memset(m, 0, sizeof(struct fmap));
+	m->fd = fd;
+	m->size = size;
+	m->flags = flags;
+#ifdef POSIX_FADV_SEQUENTIAL
+	if (size > 0 && !(flags & FMAP_RANDOM))
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+/*
+ * Free the window (but don't close the file).
+ * Passing a window that's never been read is ok.
+ */
+void
+fmap_free(struct fmap *m)
+{
+
+	free(m->buf);
+	m->buf = NULL;
+	m->bufmax = m->len = 0;
+}
+
+/*
+ * Whether the "len" bytes of the file at "offs" are in the window, so
+ * fmap_get() would return them without reading.
+ */
+int
+fmap_has(const struct fmap *m, off_t offs, size_t len)
+{
+
+	return offs >= m->offs &&
+		offs + (off_t)len <= m->offs + (off_t)m->len;
+}
+
+/*
+ * Get a pointer to the "len" bytes of the file at "offs", which must be
+ * within the file.
+ * The pointer is good until the next call.
+ * Moving forward keeps the overlap with the current window and reads
+ * ahead at least FMAP_WINDOW, so sequential access reads each byte
+ * once; moving backward before the window re-reads it.
+ * With FMAP_RANDOM, only moving on from the window's end reads ahead.
+ * Otherwise, we read only what's asked for.
+ * Returns NULL on failure, including the file having shrunk.
+ */
+const void *
+fmap_get(struct sess *sess, struct fmap *m, off_t offs, size_t len)
+{
+	size_t	 want, keep = 0;
+	ssize_t	 ssz;
+	void	*pp;
+
+	assert(offs >= 0);
+	assert(offs + (off_t)len <= m->size);
+
+	if (fmap_has(m, offs, len))
+		return m->buf + (offs - m->offs);
+
+	if ((m->flags & FMAP_RANDOM) && offs != m->offs + (off_t)m->len)
+		want = len;
+	else
+		want = len > FMAP_WINDOW ? len : FMAP_WINDOW;
+	if ((off_t)want > m->size - offs)
+		want = m->size - offs;
+
+	if (want > m->bufmax) {
+		if ((pp = realloc(m->buf, want)) == NULL) {
+			ERR(sess, "realloc");
+			return NULL;
+		}
+		m->buf = pp;
+		m->bufmax = want;
+	}
+
+	if (offs >= m->offs && offs < m->offs + (off_t)m->len) {
+		keep = m->offs + m->len - offs;
+		memmove(m->buf, m->buf + (offs - m->offs), keep);
+	}
+
+#ifdef POSIX_FADV_DONTNEED
+	if ((m->flags & FMAP_DROP) && offs > m->dropped) {
+		posix_fadvise(m->fd, m->dropped,
+			offs - m->dropped, POSIX_FADV_DONTNEED);
+		m->dropped = offs;
+	}
+#endif
+
+	m->offs = offs;
+	m->len = keep;
+
+	while (m->len < want) {
+		ssz = pread(m->fd, m->buf + m->len,
+			want - m->len, m->offs + m->len);
+		if (ssz == -1) {
+			ERR(sess, "pread");
+			m->len = 0;
+			return NULL;
+		} else if (ssz == 0) {
+			ERRX(sess, "pread: file truncated");
+			m->len = 0;
+			return NULL;
+		}
+		m->len += ssz;
+	}
+
+	return m->buf;
+}
@@ -18,23 +18,45 @@
 
 #include <assert.h>
 #include <endian.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HASH_X86
+# include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+# define HASH_NEON
+# include <arm_neon.h>
+#endif
 
 #include "extern.h"
 #include "md4.h"
+#include "xxhash.h"
 
 /*
- * A fast 32-bit hash.
- * Described in Tridgell's "Efficient Algorithms for Sorting and
- * Synchronization" thesis and the "Rolling checksum" document.
+ * Kernel computing the a(k, l) and b(k, l) parts of the fast hash over
+ * a full buffer.
+ * Vectorised variants are picked at run-time by hash_fast_pick()
+ * and must give bit-identical results to hash_fast_scalar().
  */
-uint32_t
-hash_fast(const void *buf, size_t len)
+typedef void	(*hash_fast_fn)(const void *, size_t,
+			uint32_t *, uint32_t *);
+
+static pthread_once_t hash_fast_once = PTHREAD_ONCE_INIT;
+static hash_fast_fn hash_fast_kern;
+
+/*
+ * The portable kernel.
+ * This is also used for the tails of the vectorised kernels.
+ */
+static void
+hash_fast_scalar(const void *buf, size_t len, uint32_t *ap, uint32_t *bp)
 {
 	size_t			 i = 0;
-	uint32_t		 a = 0, /* part of a(k, l) */
-				 b = 0; /* b(k, l) */
+	uint32_t		 a = *ap, /* part of a(k, l) */
+				 b = *bp; /* b(k, l) */
 	const signed char	*dat = buf;
 
 	if (len > 4)
@@ -54,13 +76,256 @@ hash_fast(const void *buf, size_t len)
 		b += a;
 	}
 
+	*ap = a;
+	*bp = b;
+}
+
+/*
+ * The vectorised kernels all work the same way, over chunks of "n"
+ * signed bytes X_0 ... X_n-1.
+ * Each chunk adds its byte sum S to a(k, l) and adds n times the prior
+ * a(k, l) plus the weighted sum W = n X_0 + (n - 1) X_1 + ... + X_n-1
+ * to b(k, l), exactly as n steps of the scalar recurrence would.
+ * Lanes accumulate S, W, and the running prefix of S, and are reduced
+ * once at the end.
+ * All arithmetic wraps modulo 2^32, which is all that's kept anyway.
+ */
+
+#ifdef HASH_X86
+__attribute__((target("avx2")))
+static uint32_t
+hash_fast_hsum_avx2(__m256i v)
+{
+	__m128i	 s;
+
+	s = _mm_add_epi32(_mm256_castsi256_si128(v),
+		_mm256_extracti128_si256(v, 1));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+	return (uint32_t)_mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("avx2")))
+static void
+hash_fast_avx2(const void *buf, size_t len, uint32_t *ap, uint32_t *bp)
+{
+	const __m256i	 w = _mm256_setr_epi8(32, 31, 30, 29, 28, 27,
+				26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+				16, 15, 14, 13, 12, 11, 10, 9, 8, 7,
+				6, 5, 4, 3, 2, 1),
+			 one8 = _mm256_set1_epi8(1),
+			 one16 = _mm256_set1_epi16(1);
+	__m256i		 x, vs, vp, vw;
+	const uint8_t	*dat = buf;
+	size_t		 i = 0;
+
+	vs = vp = vw = _mm256_setzero_si256();
+
+	for ( ; i + 32 <= len; i += 32) {
+		x = _mm256_loadu_si256((const __m256i *)(dat + i));
+		vp = _mm256_add_epi32(vp, vs);
+		vs = _mm256_add_epi32(vs, _mm256_madd_epi16
+			(_mm256_maddubs_epi16(one8, x), one16));
+		vw = _mm256_add_epi32(vw, _mm256_madd_epi16
+			(_mm256_maddubs_epi16(w, x), one16));
+	}
+
+	*ap = hash_fast_hsum_avx2(vs);
+	*bp = 32 * hash_fast_hsum_avx2(vp) + hash_fast_hsum_avx2(vw);
+	hash_fast_scalar(dat + i, len - i, ap, bp);
+}
+
+__attribute__((target("sse4.1")))
+static uint32_t
+hash_fast_hsum_sse41(__m128i s)
+{
+
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+	s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+	return (uint32_t)_mm_cvtsi128_si32(s);
+}
+
+__attribute__((target("sse4.1")))
+static void
+hash_fast_sse41(const void *buf, size_t len, uint32_t *ap, uint32_t *bp)
+{
+	const __m128i	 w = _mm_setr_epi8(16, 15, 14, 13, 12, 11,
+				10, 9, 8, 7, 6, 5, 4, 3, 2, 1),
+			 one8 = _mm_set1_epi8(1),
+			 one16 = _mm_set1_epi16(1);
+	__m128i		 x, vs, vp, vw;
+	const uint8_t	*dat = buf;
+	size_t		 i = 0;
+
+	vs = vp = vw = _mm_setzero_si128();
+
+	for ( ; i + 16 <= len; i += 16) {
+		x = _mm_loadu_si128((const __m128i *)(dat + i));
+		vp = _mm_add_epi32(vp, vs);
+		vs = _mm_add_epi32(vs, _mm_madd_epi16
+			(_mm_maddubs_epi16(one8, x), one16));
+		vw = _mm_add_epi32(vw, _mm_madd_epi16
+			(_mm_maddubs_epi16(w, x), one16));
+	}
+
+	*ap = hash_fast_hsum_sse41(vs);
+	*bp = 16 * hash_fast_hsum_sse41(vp) + hash_fast_hsum_sse41(vw);
+	hash_fast_scalar(dat + i, len - i, ap, bp);
+}
+#endif /* HASH_X86 */
+
+#ifdef HASH_NEON
+static void
+hash_fast_neon(const void *buf, size_t len, uint32_t *ap, uint32_t *bp)
+{
+	static const int8_t w[16] = { 16, 15, 14, 13, 12, 11,
+				10, 9, 8, 7, 6, 5, 4, 3, 2, 1 };
+	const int8x16_t	 vwt = vld1q_s8(w);
+	int8x16_t	 x;
+	int16x8_t	 p;
+	int32x4_t	 vs, vp, vw;
+	const int8_t	*dat = buf;
+	size_t		 i = 0;
+
+	vs = vp = vw = vdupq_n_s32(0);
+
+	for ( ; i + 16 <= len; i += 16) {
+		x = vld1q_s8(dat + i);
+		vp = vaddq_s32(vp, vs);
+		vs = vpadalq_s16(vs, vpaddlq_s8(x));
+		p = vmull_s8(vget_low_s8(x), vget_low_s8(vwt));
+		p = vmlal_high_s8(p, x, vwt);
+		vw = vpadalq_s16(vw, p);
+	}
+
+	*ap = (uint32_t)vaddvq_s32(vs);
+	*bp = 16 * (uint32_t)vaddvq_s32(vp) + (uint32_t)vaddvq_s32(vw);
+	hash_fast_scalar(dat + i, len - i, ap, bp);
+}
+#endif /* HASH_NEON */
+
+/*
+ * Pick the best kernel for this CPU.
+ * This is run once, by whichever thread first uses the fast hash.
+ */
+static void
+hash_fast_pick(void)
+{
+	hash_fast_fn	 fn = hash_fast_scalar;
+
+#if defined(HASH_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		fn = hash_fast_avx2;
+	else if (__builtin_cpu_supports("sse4.1"))
+		fn = hash_fast_sse41;
+#elif defined(HASH_NEON)
+	fn = hash_fast_neon;
+#endif
+	hash_fast_kern = fn;
+}
+
+/*
+ * A fast 32-bit hash.
+ * Described in Tridgell's "Efficient Algorithms for Sorting and
+ * Synchronization" thesis and the "Rolling checksum" document.
+ */
+uint32_t
+hash_fast(const void *buf, size_t len)
+{
+	struct hashroll	 r;
+
+	hash_roll_init(&r, buf, len);
+	return hash_roll_sum(&r);
+}
+
+/*
+ * Start a rolling fast hash over the "len" bytes of "buf".
+ * This computes the a(k, l) and b(k, l) parts that hash_fast()
+ * combines, so that the window may then be moved a byte at a time with
+ * hash_roll() or hash_roll_out().
+ */
+void
+hash_roll_init(struct hashroll *r, const void *buf, size_t len)
+{
+
+	r->a = r->b = 0;
+	r->len = len;
+	pthread_once(&hash_fast_once, hash_fast_pick);
+	hash_fast_kern(buf, len, &r->a, &r->b);
+}
+
+/*
+ * Move the window forward by one byte: "out" is the byte leaving at the
+ * front, "in" the one entering at the back.
+ * This is the O(1) recurrence from the "Rolling checksum" document:
+ * a(k+1, l+1) = a(k, l) - X_k + X_l+1 and
+ * b(k+1, l+1) = b(k, l) - (l - k + 1) X_k + a(k+1, l+1).
+ */
+void
+hash_roll(struct hashroll *r, uint8_t out, uint8_t in)
+{
+	uint32_t	 x = (signed char)out;
+
+	r->a += (uint32_t)(signed char)in - x;
+	r->b += r->a - r->len * x;
+}
+
+/*
+ * Like hash_roll(), but shrinks the window by one byte, as happens
+ * when it runs into the end of the buffer.
+ */
+void
+hash_roll_out(struct hashroll *r, uint8_t out)
+{
+	uint32_t	 x = (signed char)out;
+
+	assert(r->len > 0);
+	r->b -= r->len * x;
+	r->a -= x;
+	r->len--;
+}
+
+/*
+ * Combine the rolling parts into the value given by hash_fast().
+ */
+uint32_t
+hash_roll_sum(const struct hashroll *r)
+{
+
 	/* s(k, l) = (eps % M) + 2^16 b(k, l) % M */
 
-	return (a & 0xffff) + (b << 16);
+	return (r->a & 0xffff) + (r->b << 16);
+}
+
+/*
+ * Write the XXH64 hash "h" into "md" as its canonical (big-endian)
+ * bytes, zeroing the rest of a long checksum.
+ */
+static void
+hash_xxh_put(unsigned char *md, uint64_t h)
+{
+	uint64_t	 be = htobe64(h);
+
+	memcpy(md, &be, XXH64_DIGEST_LENGTH);
+	memset(md + XXH64_DIGEST_LENGTH, 0,
+		CSUM_LENGTH_PHASE2 - XXH64_DIGEST_LENGTH);
 }
 
 /*
- * Slow MD4-based hash with trailing seed.
+ * How many bytes of the long checksum from hash_slow() mean anything.
+ */
+size_t
+hash_slow_len(const struct sess *sess)
+{
+
+	return sess->xxh ? XXH64_DIGEST_LENGTH : CSUM_LENGTH_PHASE2;
+}
+
+/*
+ * Slow hash filling in a long checksum of CSUM_LENGTH_PHASE2 bytes:
+ * MD4-based with trailing seed or, if agreed on, XXH64 seeded with the
+ * seed.
  */
 void
 hash_slow(const void *buf, size_t len,
@@ -69,6 +334,11 @@ hash_slow(const void *buf, size_t len,
 	MD4_CTX		 ctx;
 	int32_t		 seed = htole32(sess->seed);
 
+	if (sess->xxh) {
+		hash_xxh_put(md, xxh64(buf, len, (uint32_t)sess->seed));
+		return;
+	}
+
 	MD4_Init(&ctx);
 	MD4_Update(&ctx, buf, len);
 	MD4_Update(&ctx, (unsigned char *)&seed, sizeof(int32_t));
@@ -76,19 +346,69 @@ hash_slow(const void *buf, size_t len,
 }
 
 /*
- * Hash an entire file.
- * This is similar to hash_slow() except the seed is hashed at the end
- * of the sequence, not the beginning.
+ * Like hash_slow(), but for "n" buffers of the same length "len",
+ * writing the digests into "md".
+ * This is considerably faster than hashing one at a time.
  */
 void
-hash_file(const void *buf, size_t len,
-	unsigned char *md, const struct sess *sess)
+hash_slow_many(const void *const buf[], size_t n, size_t len,
+	unsigned char *const md[], const struct sess *sess)
 {
-	MD4_CTX		 ctx;
 	int32_t		 seed = htole32(sess->seed);
+	size_t		 i;
 
-	MD4_Init(&ctx);
-	MD4_Update(&ctx, (unsigned char *)&seed, sizeof(int32_t));
-	MD4_Update(&ctx, buf, len);
-	MD4_Final(md, &ctx);
+	if (sess->xxh) {
+		for (i = 0; i < n; i++)
+			hash_xxh_put(md[i],
+				xxh64(buf[i], len, (uint32_t)sess->seed));
+		return;
+	}
+
+	MD4_Lanes(md, buf, n, len, &seed, sizeof(int32_t));
+}
+
+/*
+ * Start the hash of a whole file, which is of the same kind as
+ * hash_slow(), but seeded at the beginning.
+ */
+void
+hash_file_init(struct hashfile *h, const struct sess *sess)
+{
+	int32_t		 seed = htole32(sess->seed);
+
+	if ((h->xxh = sess->xxh)) {
+		xxh64_init(&h->xxh64, (uint32_t)sess->seed);
+		return;
+	}
+	MD4_Init(&h->md4);
+	MD4_Update(&h->md4, &seed, sizeof(int32_t));
+}
+
+void
+hash_file_update(struct hashfile *h, const void *buf, size_t len)
+{
+
+	if (h->xxh)
+		xxh64_update(&h->xxh64, buf, len);
+	else
+		MD4_Update(&h->md4, buf, len);
+}
+
+/*
+ * Finish the file hash into "md", which must have room for
+ * HASH_FILE_MAX bytes.
+ * Returns the length of the hash.
+ */
+size_t
+hash_file_final(struct hashfile *h, unsigned char *md)
+{
+	uint64_t	 be;
+
+	if (h->xxh) {
+		be = htobe64(xxh64_final(&h->xxh64));
+		memcpy(md, &be, XXH64_DIGEST_LENGTH);
+		return XXH64_DIGEST_LENGTH;
+	}
+	MD4_Final(md, &h->md4);
+	return MD4_DIGEST_LENGTH;
 }
@@ -15,6 +15,7 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 #include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <assert.h>
 #include <endian.h>
@@ -28,11 +29,26 @@
 
 #include "extern.h"
 
+/*
+ * Whether we've read ahead data from "fd" that's yet to be consumed.
+ * Event loops must treat this as the descriptor being readable, as
+ * poll() won't show it.
+ */
+int
+io_read_buffered(const struct sess *sess, int fd)
+{
+
+	return sess->rbufpos < sess->rbufsz && sess->rbuffd == fd;
+}
+
 int
 io_read_check(struct sess *sess, int fd)
 {
 	struct pollfd	pfd;
 
+	if (io_read_buffered(sess, fd))
+		return 1;
+
 	pfd.fd = fd;
 	pfd.events = POLLIN;
 
@@ -44,110 +60,244 @@ io_read_check(struct sess *sess, int fd)
 }
 
 /*
- * Write buffer to non-blocking descriptor.
- * Returns zero on failure, non-zero on success (zero or more bytes).
+ * Blocking write of all "iovsz" buffers in "iov", which we may modify.
+ * Returns 0 on failure, non-zero on success (all bytes written).
  */
 static int
-io_write_nonblocking(struct sess *sess,
-	int fd, const void *buf, size_t bsz, size_t *sz)
+io_writev_blocking(struct sess *sess, int fd, struct iovec *iov, int iovsz)
 {
 	struct pollfd	pfd;
 	ssize_t		wsz;
 
-	*sz = 0;
-
-	if (bsz == 0)
-		return 1;
-
 	pfd.fd = fd;
 	pfd.events = POLLOUT;
 
-	if (poll(&pfd, 1, INFTIM) < 0) {
-		ERR(sess, "poll");
-		return 0;
-	}
-	if ((pfd.revents & (POLLERR|POLLNVAL))) {
-		ERRX(sess, "poll: bad fd");
-		return 0;
-	} else if ((pfd.revents & POLLHUP)) {
-		ERRX(sess, "poll: hangup");
-		return 0;
-	} else if (!(pfd.revents & POLLOUT)) {
-		ERRX(sess, "poll: unknown event");
-		return 0;
-	}
+	while (iovsz > 0) {
+		if (iov->iov_len == 0) {
+			iov++;
+			iovsz--;
+			continue;
+		}
 
-	if ((wsz = write(fd, buf, bsz)) < 0) {
-		ERR(sess, "write");
-		return 0;
+		if (poll(&pfd, 1, INFTIM) < 0) {
+			ERR(sess, "poll");
+			return 0;
+		}
+		if ((pfd.revents & (POLLERR|POLLNVAL))) {
+			ERRX(sess, "poll: bad fd");
+			return 0;
+		} else if ((pfd.revents & POLLHUP)) {
+			ERRX(sess, "poll: hangup");
+			return 0;
+		} else if (!(pfd.revents & POLLOUT)) {
+			ERRX(sess, "poll: unknown event");
+			return 0;
+		}
+
+		if ((wsz = writev(fd, iov, iovsz)) < 0) {
+			ERR(sess, "writev");
+			return 0;
+		} else if (wsz == 0) {
+			ERRX(sess, "writev: short write");
+			return 0;
+		}
+
+		for ( ; iovsz > 0 && (size_t)wsz >= iov->iov_len; iovsz--)
+			wsz -= (iov++)->iov_len;
+		if (iovsz > 0) {
+			iov->iov_base = (char *)iov->iov_base + wsz;
+			iov->iov_len -= wsz;
+		}
 	}
 
-	*sz = wsz;
 	return 1;
 }
 
 /*
- * Blocking write of the full size of the buffer.
- * Returns 0 on failure, non-zero on success (all bytes written).
+ * Write out what's buffered followed by "buf" of size "sz" (which may
+ * be empty), wrapping it into multiplex frames if the buffer was set up
+ * for that.
+ * We try to do this all in one system call.
+ * Returns zero on failure, non-zero on success.
  */
 static int
-io_write_blocking(struct sess *sess,
-	int fd, const void *buf, size_t sz)
+io_write_out(struct sess *sess, const void *buf, size_t sz)
 {
-	size_t		wsz;
-	int		c;
-
-	while (sz > 0) {
-		c = io_write_nonblocking(sess, fd, buf, sz, &wsz);
-		if (!c) {
-			ERRX1(sess, "io_write_nonblocking");
+	struct iovec	 iov[3];
+	int32_t		 tag;
+	size_t		 wsz;
+
+	if (!sess->wbufmplex) {
+		iov[0].iov_base = sess->wbuf;
+		iov[0].iov_len = sess->wbufsz;
+		iov[1].iov_base = (void *)buf;
+		iov[1].iov_len = sz;
+		if (!io_writev_blocking(sess, sess->wbuffd, iov, 2)) {
+			ERRX1(sess, "io_writev_blocking");
 			return 0;
-		} else if (wsz == 0) {
-			ERRX(sess, "io_write_nonblocking: short write");
+		}
+		sess->wbufsz = 0;
+		return 1;
+	}
+
+	/*
+	 * Each frame has a 4-byte header with the tag identifier (7 for
+	 * normal data) and a 3-byte length.
+	 * The buffer always fits into a frame, but what follows it might
+	 * need more.
+	 */
+
+	do {
+		wsz = sz < 0xFFFFFF - sess->wbufsz ?
+			sz : 0xFFFFFF - sess->wbufsz;
+		tag = htole32((7 << 24) + sess->wbufsz + wsz);
+		iov[0].iov_base = &tag;
+		iov[0].iov_len = sizeof(tag);
+		iov[1].iov_base = sess->wbuf;
+		iov[1].iov_len = sess->wbufsz;
+		iov[2].iov_base = (void *)buf;
+		iov[2].iov_len = wsz;
+		if (!io_writev_blocking(sess, sess->wbuffd, iov, 3)) {
+			ERRX1(sess, "io_writev_blocking");
 			return 0;
 		}
-		buf += wsz;
+		sess->wbufsz = 0;
+		buf = (const char *)buf + wsz;
 		sz -= wsz;
-	}
+	} while (sz > 0);
 
 	return 1;
 }
 
+/*
+ * Write out everything buffered by io_write_buf().
+ * This must be done before we wait on the other side, lest it be
+ * waiting on what we've buffered: blocking reads do this themselves,
+ * but event loops must do so before they poll.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+io_write_flush(struct sess *sess)
+{
+
+	if (sess->wbufsz == 0)
+		return 1;
+	if (!io_write_out(sess, NULL, 0)) {
+		ERRX1(sess, "io_write_out");
+		return 0;
+	}
+	return 1;
+}
+
 /*
  * Write "buf" of size "sz" to non-blocking descriptor.
+ * This is buffered: small writes are collected and written out (and
+ * multiplexed, if we're doing so) together when the buffer fills or
+ * with io_write_flush().
+ * Large writes go out directly along with what's buffered.
  * Returns zero on failure, non-zero on success (all bytes written to
- * the descriptor).
+ * the buffer or descriptor).
  */
 int
 io_write_buf(struct sess *sess, int fd, const void *buf, size_t sz)
 {
-	int32_t	 tag, tagbuf;
-	size_t	 wsz;
-	int	 c;
 
-	if (!sess->mplex_writes) {
-		c = io_write_blocking(sess, fd, buf, sz);
-		sess->total_write += sz;
-		return c;
+	/*
+	 * Don't mix up descriptors or multiplexing modes (which change
+	 * after the protocol preamble) in the buffer.
+	 */
+
+	if (sess->wbufsz > 0 &&
+	    (sess->wbuffd != fd ||
+	     sess->wbufmplex != sess->mplex_writes) &&
+	    !io_write_flush(sess)) {
+		ERRX1(sess, "io_write_flush");
+		return 0;
 	}
 
-	while (sz > 0) {
-		wsz = sz & 0xFFFFFF;
-		tag = (7 << 24) + wsz;
-		tagbuf = htole32(tag);
-		if (!io_write_blocking(sess, fd, &tagbuf, sizeof(tagbuf))) {
-			ERRX1(sess, "io_write_blocking");
-			return 0;
+	sess->wbuffd = fd;
+	sess->wbufmplex = sess->mplex_writes;
+	sess->total_write += sz;
+
+	if (sess->batch != NULL &&
+	    !batch_tee(sess, sess->batch, 1, buf, sz)) {
+		ERRX1(sess, "batch_tee");
+		return 0;
+	}
+
+	if (sess->wbufsz + sz <= sizeof(sess->wbuf)) {
+		memcpy(sess->wbuf + sess->wbufsz, buf, sz);
+		sess->wbufsz += sz;
+		return 1;
+	}
+
+	if (!io_write_out(sess, buf, sz)) {
+		ERRX1(sess, "io_write_out");
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Write as much of "buf" of size "sz" as the non-blocking descriptor
+ * will take without waiting, which may be nothing, and set "wsz" to how
+ * much that was.
+ * This is for writers that mustn't block, e.g., because the other side
+ * might be blocked writing to us.
+ * If we're multiplexing, messages are framed as by io_write_buf(); "w"
+ * tracks a frame in progress, so the next call must continue the same
+ * message (with at least as many bytes) until the frame is done.
+ * Returns zero on failure, non-zero on success (zero or more bytes).
+ */
+int
+io_write_avail(struct sess *sess, int fd, struct iowrite *w,
+	const void *buf, size_t sz, size_t *wsz)
+{
+	ssize_t	 ssz;
+	int32_t	 tag;
+
+	*wsz = 0;
+
+	if (sz == 0)
+		return 1;
+
+	if (!io_write_flush(sess)) {
+		ERRX1(sess, "io_write_flush");
+		return 0;
+	}
+
+	if (w->left == 0) {
+		w->left = sz < MAX_CHUNK ? sz : MAX_CHUNK;
+		w->hdrpos = w->hdrsz = 0;
+		if (sess->mplex_writes) {
+			tag = htole32((7 << 24) + w->left);
+			memcpy(w->hdr, &tag, sizeof(tag));
+			w->hdrsz = sizeof(tag);
 		}
-		if (!io_write_blocking(sess, fd, buf, wsz)) {
-			ERRX1(sess, "io_write_blocking");
+	}
+
+	while (w->hdrpos < w->hdrsz) {
+		ssz = write(fd, w->hdr + w->hdrpos, w->hdrsz - w->hdrpos);
+		if (ssz == -1 && errno == EAGAIN)
+			return 1;
+		else if (ssz == -1) {
+			ERR(sess, "write");
 			return 0;
 		}
-		sess->total_write += wsz;
-		sz -= wsz;
-		buf += wsz;
+		w->hdrpos += ssz;
+	}
+
+	assert(sz >= w->left);
+	if ((ssz = write(fd, buf, w->left)) == -1 && errno == EAGAIN)
+		return 1;
+	else if (ssz == -1) {
+		ERR(sess, "write");
+		return 0;
 	}
 
+	w->left -= ssz;
+	sess->total_write += ssz;
+	*wsz = ssz;
 	return 1;
 }
 
@@ -179,6 +329,7 @@ io_read_nonblocking(struct sess *sess,
 {
 	struct pollfd	pfd;
 	ssize_t		rsz;
+	int		c;
 
 	*sz = 0;
 
@@ -188,7 +339,19 @@ io_read_nonblocking(struct sess *sess,
 	pfd.fd = fd;
 	pfd.events = POLLIN;
 
-	if (poll(&pfd, 1, INFTIM) < 0) {
+	/*
+	 * If we'd have to wait, first write out what we've buffered, as
+	 * the other side may be waiting for it.
+	 */
+
+	if ((c = poll(&pfd, 1, 0)) == 0) {
+		if (!io_write_flush(sess)) {
+			ERRX1(sess, "io_write_flush");
+			return 0;
+		}
+		c = poll(&pfd, 1, INFTIM);
+	}
+	if (c < 0) {
 		ERR(sess, "poll");
 		return 0;
 	}
@@ -216,6 +379,8 @@ io_read_nonblocking(struct sess *sess,
  * Blocking read of the full size of the buffer.
  * This can be called from either the error type message or a regular
  * message---or for that matter, multiplexed or not.
+ * Small reads are served from a buffer that we fill with as much as
+ * the descriptor has, so most don't need a system call at all.
  * Returns 0 on failure, non-zero on success (all bytes read).
  */
 static int
@@ -226,7 +391,36 @@ io_read_blocking(struct sess *sess,
 	int	 c;
 
 	while (sz > 0) {
-		c = io_read_nonblocking(sess, fd, buf, sz, &rsz);
+		/* First use what we've read ahead. */
+
+		if (sess->rbufpos < sess->rbufsz) {
+			assert(sess->rbuffd == fd);
+			rsz = sess->rbufsz - sess->rbufpos < sz ?
+				sess->rbufsz - sess->rbufpos : sz;
+			memcpy(buf, sess->rbuf + sess->rbufpos, rsz);
+			sess->rbufpos += rsz;
+			buf += rsz;
+			sz -= rsz;
+			continue;
+		}
+
+		/*
+		 * Reads bigger than the buffer go directly into the
+		 * caller's buffer, otherwise refill ours.
+		 */
+
+		if (sz >= sizeof(sess->rbuf)) {
+			c = io_read_nonblocking(sess, fd, buf, sz, &rsz);
+			buf += rsz;
+			sz -= rsz;
+		} else {
+			c = io_read_nonblocking(sess, fd,
+				sess->rbuf, sizeof(sess->rbuf), &rsz);
+			sess->rbuffd = fd;
+			sess->rbufpos = 0;
+			sess->rbufsz = rsz;
+		}
+
 		if (!c) {
 			ERRX1(sess, "io_read_nonblocking");
 			return 0;
@@ -234,8 +428,6 @@ io_read_blocking(struct sess *sess,
 			ERRX(sess, "io_read_nonblocking: short read");
 			return 0;
 		}
-		buf += rsz;
-		sz -= rsz;
 	}
 
 	return 1;
@@ -320,8 +512,8 @@ io_read_flush(struct sess *sess, int fd)
  * Returns zero on failure, non-zero on success (all bytes read from
  * the descriptor).
  */
-int
-io_read_buf(struct sess *sess, int fd, void *buf, size_t sz)
+static int
+io_read_data(struct sess *sess, int fd, void *buf, size_t sz)
 {
 	size_t	 rsz;
 	int	 c;
@@ -367,6 +559,27 @@ io_read_buf(struct sess *sess, int fd, void *buf, size_t sz)
 	return 1;
 }
 
+/*
+ * Read buffer as with io_read_data(), adding what's read to the batch
+ * we're recording, if any.
+ * Returns zero on failure, non-zero on success (all bytes read from
+ * the descriptor).
+ */
+int
+io_read_buf(struct sess *sess, int fd, void *buf, size_t sz)
+{
+
+	if (!io_read_data(sess, fd, buf, sz)) {
+		ERRX1(sess, "io_read_data");
+		return 0;
+	} else if (sess->batch != NULL &&
+	    !batch_tee(sess, sess->batch, 0, buf, sz)) {
+		ERRX1(sess, "batch_tee");
+		return 0;
+	}
+	return 1;
+}
+
 int
 io_write_long(struct sess *sess, int fd, int64_t val)
 {
@@ -422,6 +635,17 @@ io_buffer_buf(struct sess *sess, void *buf,
 	*bufpos += valsz;
 }
 
+/*
+ * Like io_buffer_buf() for a single byte.
+ */
+void
+io_buffer_byte(struct sess *sess, void *buf,
+	size_t *bufpos, size_t buflen, uint8_t val)
+{
+
+	io_buffer_buf(sess, buf, bufpos, buflen, &val, sizeof(uint8_t));
+}
+
 /*
  * Converts "val" to LE prior to io_buffer_buf().
  */
@@ -434,6 +658,26 @@ io_buffer_int(struct sess *sess, void *buf,
 	io_buffer_buf(sess, buf, bufpos, buflen, &nv, sizeof(int32_t));
 }
 
+/*
+ * Buffer "val" like io_write_long() would write it: as an integer if
+ * possible, else as the maximum integer followed by the 64-bit value.
+ */
+void
+io_buffer_long(struct sess *sess, void *buf,
+	size_t *bufpos, size_t buflen, int64_t val)
+{
+	int64_t	nv;
+
+	if (val <= INT32_MAX && val >= 0) {
+		io_buffer_int(sess, buf, bufpos, buflen, (int32_t)val);
+		return;
+	}
+
+	nv = htole64(val);
+	io_buffer_int(sess, buf, bufpos, buflen, INT32_MAX);
+	io_buffer_buf(sess, buf, bufpos, buflen, &nv, sizeof(int64_t));
+}
+
 int
 io_read_ulong(struct sess *sess, int fd, uint64_t *val)
 {
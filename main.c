@@ -278,18 +278,233 @@ fargs_parse(size_t argc, char *argv[])
 	return f;
 }
 
+/*
+ * Run a single session with the remote described by "f", which is
+ * either a daemon we connect to or a server we start.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+run_session(const struct opts *opts, const struct fargs *f)
+{
+	pid_t		 child;
+	int		 fds[2], c, st;
+
+	/*
+	 * If we're contacting an rsync:// daemon, then we don't need to
+	 * fork, because we won't start a server ourselves.
+	 * Route directly into the socket code, in that case.
+	 */
+
+	if (f->remote) {
+		assert(f->mode == FARGS_RECEIVER);
+		if (pledge("stdio rpath wpath cpath inet fattr dns getpw unveil",
+		    NULL) == -1)
+			err(EXIT_FAILURE, "pledge");
+		return rsync_socket(opts, f);
+	}
+
+	/* Drop the dns/inet possibility. */
+
+	if (pledge("stdio rpath wpath cpath fattr getpw proc exec unveil",
+	    NULL) == -1)
+		err(EXIT_FAILURE, "pledge");
+
+	/* Create a bidirectional socket and start our child. */
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == -1)
+		err(EXIT_FAILURE, "socketpair");
+
+	if ((child = fork()) == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		err(EXIT_FAILURE, "fork");
+	}
+
+	/* Drop the fork possibility. */
+
+	if (pledge("stdio rpath wpath cpath fattr getpw exec unveil", NULL) == -1)
+		err(EXIT_FAILURE, "pledge");
+
+	if (child == 0) {
+		close(fds[0]);
+		fds[0] = -1;
+		if (pledge("stdio exec", NULL) == -1)
+			err(EXIT_FAILURE, "pledge");
+		rsync_child(opts, fds[1], f);
+		/* NOTREACHED */
+	}
+
+	close(fds[1]);
+	fds[1] = -1;
+	if (pledge("stdio rpath wpath cpath fattr getpw unveil", NULL) == -1)
+		err(EXIT_FAILURE, "pledge");
+	c = rsync_client(opts, fds[0], f);
+
+	/*
+	 * If the client has an error and exits, the server may be
+	 * sitting around waiting to get data while we waitpid().
+	 * So close the connection here so that they don't hang.
+	 */
+
+	if (!c) {
+		close(fds[0]);
+		fds[0] = -1;
+	}
+
+	if (waitpid(child, &st, 0) == -1)
+		err(EXIT_FAILURE, "waitpid");
+	if (!(WIFEXITED(st) && WEXITSTATUS(st) == EXIT_SUCCESS))
+		c = 0;
+
+	if (fds[0] != -1)
+		close(fds[0]);
+	return c;
+}
+
+/*
+ * Start stream "idx" of --streams as a child running its own session,
+ * which passes its statistics back over the returned descriptor.
+ * Returns the child or -1 on failure.
+ */
+static pid_t
+start_stream(const struct opts *opts, const struct fargs *f,
+	size_t idx, int *fd)
+{
+	struct opts	 o = *opts;
+	pid_t		 pid;
+	int		 fds[2];
+
+	if (pipe(fds) == -1) {
+		warn("pipe");
+		return -1;
+	} else if ((pid = fork()) == -1) {
+		warn("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		o.stream = idx;
+		o.stream_fd = fds[1];
+
+		/* Only the last, with the whole view, deletes. */
+
+		if (idx < o.streams)
+			o.del = 0;
+		_exit(run_session(&o, f) ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	close(fds[1]);
+	*fd = fds[0];
+	return pid;
+}
+
+/*
+ * Wait for stream "pid" to finish, adding its statistics from "fd".
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+wait_stream(struct sess *sess, pid_t pid, int fd)
+{
+	int	 c, st;
+
+	c = sess_stats_merge(sess, fd);
+	close(fd);
+	if (waitpid(pid, &st, 0) == -1)
+		err(EXIT_FAILURE, "waitpid");
+	if (!(WIFEXITED(st) && WEXITSTATUS(st) == EXIT_SUCCESS))
+		c = 0;
+	return c;
+}
+
+/*
+ * With --streams, run that many sessions at once, each with the whole
+ * file list but only transferring its share of the files.
+ * Once they're all done, a last session fixes up directories and
+ * deletes, seeing the files as they've all been transferred.
+ * Then report the statistics of all of them.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+run_streams(const struct opts *opts, const struct fargs *f)
+{
+	struct sess	 sess;
+	struct opts	 o = *opts;
+	pid_t		*pids, pid;
+	int		*fds, fd, c = 1;
+	size_t		 i;
+
+	memset(&sess, 0, sizeof(struct sess));
+	o.streams = 0;
+	sess.opts = &o;
+	sess.stats.start = stats_now();
+
+	if ((pids = calloc(opts->streams, sizeof(pid_t))) == NULL ||
+	    (fds = calloc(opts->streams, sizeof(int))) == NULL)
+		err(EXIT_FAILURE, "calloc");
+
+	for (i = 0; i < opts->streams; i++)
+		if ((pids[i] = start_stream(opts, f, i, &fds[i])) == -1)
+			break;
+
+	/* Wait for all we started, even if we couldn't start some. */
+
+	if (i < opts->streams)
+		c = 0;
+	while (i-- > 0)
+		if (!wait_stream(&sess, pids[i], fds[i]))
+			c = 0;
+
+	free(pids);
+	free(fds);
+
+	if (!c) {
+		warnx("not all streams succeeded: not finishing");
+		return 0;
+	}
+
+	if ((pid = start_stream(opts, f, opts->streams, &fd)) == -1 ||
+	    !wait_stream(&sess, pid, fd))
+		return 0;
+
+	sess_stats_report(&sess, 1);
+	return 1;
+}
+
 int
 main(int argc, char *argv[])
 {
 	struct opts	 opts;
-	pid_t		 child;
-	int		 fds[2], c, st;
+	int		 c;
 	struct fargs	*fargs;
+	const char	*errstr;
+	char		*cp;
 	struct option	 lopts[] = {
+		{ "block-size",	required_argument, NULL,	'B' },
 		{ "delete",	no_argument,	&opts.del,	1 },
 		{ "rsync-path",	required_argument, NULL,	1 },
 		{ "sender",	no_argument,	&opts.sender,	1 },
 		{ "server",	no_argument,	&opts.server,	1 },
+		{ "sparse",	no_argument,	&opts.sparse,	1 },
+		{ "compress",	no_argument,	&opts.compress,	1 },
+		{ "checksum-choice", required_argument, NULL,	12 },
+		{ "checksum-seed", required_argument, NULL,	8 },
+		{ "sig-cache",	required_argument, NULL,	7 },
+		{ "sign-threads", required_argument, NULL,	2 },
+		{ "stat-threads", required_argument, NULL,	11 },
+		{ "stats",	no_argument,	&opts.stats,	1 },
+		{ "stats-json",	no_argument,	NULL,		5 },
+		{ "stats-interval", required_argument, NULL,	6 },
+		{ "stream",	required_argument, NULL,	10 },
+		{ "streams",	required_argument, NULL,	9 },
+		{ "walk-threads", required_argument, NULL,	3 },
+		{ "whole-file",	no_argument,	NULL,		'W' },
+		{ "no-whole-file", no_argument,	NULL,		4 },
+		{ "no-inc-recursive", no_argument, &opts.no_inc_recursive, 1 },
+		{ "read-batch",	required_argument, NULL,	14 },
+		{ "write-batch", required_argument, NULL,	13 },
 		{ NULL,		0,		NULL,		0 }};
 
 	/* Global pledge. */
@@ -300,10 +515,31 @@ main(int argc, char *argv[])
 
 	memset(&opts, 0, sizeof(struct opts));
 
-	while ((c = getopt_long(argc, argv, "e:glnprtv", lopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "B:SWe:glnprtvz", lopts, NULL)) != -1) {
 		switch (c) {
+		case 'B':
+			opts.block_size =
+				strtonum(optarg, 1, BLOCK_SIZE_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "--block-size: %s: %s",
+					optarg, errstr);
+			break;
+		case 'S':
+			opts.sparse = 1;
+			break;
+		case 'W':
+			opts.whole_file = 1;
+			opts.no_whole_file = 0;
+			break;
 		case 'e':
-			/* Ignore. */
+			/*
+			 * Ignore, unless it's an openrsync client
+			 * asking for an incremental file list or XXH64.
+			 */
+			if (optarg[0] == '.' && strchr(optarg, 'O') != NULL)
+				opts.inc_recursive = 1;
+			if (optarg[0] == '.' && strchr(optarg, 'X') != NULL)
+				opts.xxh = 1;
 			break;
 		case 'g':
 			opts.preserve_gids = 1;
@@ -326,12 +562,95 @@ main(int argc, char *argv[])
 		case 'v':
 			opts.verbose++;
 			break;
+		case 'z':
+			opts.compress = 1;
+			break;
 		case 0:
 			/* Non-NULL flag values (e.g., --sender). */
 			break;
 		case 1:
 			opts.rsync_path = optarg;
 			break;
+		case 2:
+			opts.sign_threads = strtonum(optarg, 0, 256, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "--sign-threads: %s: %s",
+					optarg, errstr);
+			break;
+		case 3:
+			opts.walk_threads = strtonum(optarg, 0, 256, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "--walk-threads: %s: %s",
+					optarg, errstr);
+			break;
+		case 4:
+			opts.whole_file = 0;
+			opts.no_whole_file = 1;
+			break;
+		case 5:
+			opts.stats = opts.stats_json = 1;
+			break;
+		case 6:
+			opts.stats_interval =
+				strtonum(optarg, 1, 86400, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "--stats-interval: %s: %s",
+					optarg, errstr);
+			opts.stats = 1;
+			break;
+		case 7:
+			opts.sig_cache = optarg;
+			break;
+		case 8:
+			opts.checksum_seed =
+				strtonum(optarg, 0, INT32_MAX, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "--checksum-seed: %s: %s",
+					optarg, errstr);
+			break;
+		case 9:
+			opts.streams = strtonum(optarg, 1, 64, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "--streams: %s: %s",
+					optarg, errstr);
+			break;
+		case 10:
+			/* Server: which of "index/streams" we are. */
+			if ((cp = strchr(optarg, '/')) == NULL)
+				errx(EXIT_FAILURE, "--stream: %s: "
+					"malformed", optarg);
+			*cp++ = '\0';
+			opts.streams = strtonum(cp, 2, 64, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "--stream: %s: %s",
+					cp, errstr);
+			opts.stream = strtonum(optarg, 0,
+				opts.streams, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "--stream: %s: %s",
+					optarg, errstr);
+			break;
+		case 11:
+			opts.stat_threads = strtonum(optarg, 0, 256, &errstr);
+			if (errstr != NULL)
+				errx(EXIT_FAILURE, "--stat-threads: %s: %s",
+					optarg, errstr);
+			break;
+		case 12:
+			if (strcmp(optarg, "md4") == 0)
+				opts.checksum_md4 = 1;
+			else if (strcmp(optarg, "xxh64") == 0)
+				opts.checksum_md4 = 0;
+			else
+				errx(EXIT_FAILURE, "--checksum-choice: "
+					"%s: unknown checksum", optarg);
+			break;
+		case 13:
+			opts.write_batch = optarg;
+			break;
+		case 14:
+			opts.read_batch = optarg;
+			break;
 		default:
 			goto usage;
 		}
@@ -340,11 +659,49 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	/*
+	 * A batch (--read-batch) has everything but the destination.
+	 * Replaying what, on a different destination, would have been
+	 * a dry run mightn't be, so don't try.
+	 */
+
+	if (opts.read_batch != NULL && !opts.server) {
+		if (argc != 1)
+			goto usage;
+		if (opts.write_batch != NULL || opts.streams > 1 ||
+		    opts.dry_run)
+			errx(EXIT_FAILURE, "--read-batch: not with "
+				"--write-batch, --streams, or -n");
+		if (pledge("stdio rpath wpath cpath fattr getpw unveil",
+		    NULL) == -1)
+			err(EXIT_FAILURE, "pledge");
+		c = rsync_batch(&opts, argv[0]);
+		return c ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+
 	/* FIXME: reference implementation rsync accepts this. */
 
 	if (argc < 2)
 		goto usage;
 
+	/* Each stream would be its own batch, and a dry run none. */
+
+	if (opts.write_batch != NULL && !opts.server) {
+		if (opts.streams > 1 || opts.dry_run)
+			errx(EXIT_FAILURE, "--write-batch: not with "
+				"--streams or -n");
+		if (strcmp(opts.write_batch, "-") == 0 && opts.stats)
+			errx(EXIT_FAILURE, "--write-batch: not to "
+				"standard output with --stats");
+	}
+
+	/* The streams would all write the same cache. */
+
+	if (opts.streams > 1 && opts.sig_cache != NULL && !opts.server)
+		errx(EXIT_FAILURE, "--streams: not with --sig-cache");
+	if (opts.streams == 1)
+		opts.streams = 0;
+
 	/*
 	 * This is what happens when we're started with the "hidden"
 	 * --server option, which is invoked for the rsync on the remote
@@ -372,81 +729,28 @@ main(int argc, char *argv[])
 	assert(fargs != NULL);
 
 	/*
-	 * If we're contacting an rsync:// daemon, then we don't need to
-	 * fork, because we won't start a server ourselves.
-	 * Route directly into the socket code, in that case.
+	 * Copying between local files, reading the destination to find
+	 * what's changed costs as much as just copying it.
 	 */
 
-	if (fargs->remote) {
-		assert(fargs->mode == FARGS_RECEIVER);
-		if (pledge("stdio rpath wpath cpath inet fattr dns getpw unveil",
-		    NULL) == -1)
-			err(EXIT_FAILURE, "pledge");
-		c = rsync_socket(&opts, fargs);
-		fargs_free(fargs);
-		return c ? EXIT_SUCCESS : EXIT_FAILURE;
-	}
-
-	/* Drop the dns/inet possibility. */
-
-	if (pledge("stdio rpath wpath cpath fattr getpw proc exec unveil",
-	    NULL) == -1)
-		err(EXIT_FAILURE, "pledge");
-
-	/* Create a bidirectional socket and start our child. */
-
-	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == -1)
-		err(EXIT_FAILURE, "socketpair");
+	if (fargs->host == NULL && !opts.no_whole_file)
+		opts.whole_file = 1;
 
-	if ((child = fork()) == -1) {
-		close(fds[0]);
-		close(fds[1]);
-		err(EXIT_FAILURE, "fork");
-	}
-
-	/* Drop the fork possibility. */
-
-	if (pledge("stdio rpath wpath cpath fattr getpw exec unveil", NULL) == -1)
-		err(EXIT_FAILURE, "pledge");
-
-	if (child == 0) {
-		close(fds[0]);
-		fds[0] = -1;
-		if (pledge("stdio exec", NULL) == -1)
-			err(EXIT_FAILURE, "pledge");
-		rsync_child(&opts, fds[1], fargs);
-		/* NOTREACHED */
-	}
-
-	close(fds[1]);
-	fds[1] = -1;
-	if (pledge("stdio rpath wpath cpath fattr getpw unveil", NULL) == -1)
-		err(EXIT_FAILURE, "pledge");
-	c = rsync_client(&opts, fds[0], fargs);
+	if (opts.streams > 1)
+		c = run_streams(&opts, fargs);
+	else
+		c = run_session(&opts, fargs);
 	fargs_free(fargs);
-
-	/*
-	 * If the client has an error and exits, the server may be
-	 * sitting around waiting to get data while we waitpid().
-	 * So close the connection here so that they don't hang.
-	 */
-
-	if (!c) {
-		close(fds[0]);
-		fds[0] = -1;
-	}
-
-	if (waitpid(child, &st, 0) == -1)
-		err(EXIT_FAILURE, "waitpid");
-	if (!(WIFEXITED(st) && WEXITSTATUS(st) == EXIT_SUCCESS))
-		c = 0;
-
-	if (fds[0] != -1)
-		close(fds[0]);
 	return c ? EXIT_SUCCESS : EXIT_FAILURE;
 usage:
-	fprintf(stderr, "usage: %s [-glnprtv] "
-		"[--delete] [--rsync-path=prog] src ... dst\n",
-		getprogname());
+	fprintf(stderr, "usage: %s [-SWglnprtvz] [-B size] "
+		"[--checksum-choice=name] [--checksum-seed=num] [--delete] "
+		"[--rsync-path=prog] [--sig-cache=file] [--sign-threads=num] "
+		"[--stat-threads=num] [--walk-threads=num] [--no-inc-recursive] "
+		"[--no-whole-file] [--stats] [--stats-interval=seconds] "
+		"[--stats-json] [--streams=num] [--write-batch=file] "
+		"src ... dst\n"
+		"       %s [-v] [--delete] [--read-batch=file] dst\n",
+		getprogname(), getprogname());
 	return EXIT_FAILURE;
 }
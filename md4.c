@@ -34,6 +34,7 @@
  * optimizations are not included to reduce source code size and avoid
  * compile-time configuration.
  */
+#include <pthread.h>
 #include <string.h>
 
 #include "md4.h"
@@ -263,3 +264,242 @@ void MD4_Final(unsigned char *result, MD4_CTX *ctx)
 
 	memset(ctx, 0, sizeof(*ctx));
 }
+
+/*
+ * Multi-buffer extension (not part of the original implementation).
+ *
+ * Hash several equal-length messages at once, each followed by the
+ * same short suffix, by running one message per lane of a vector.
+ * The F, G, H, and STEP macros above work unchanged on GCC vector
+ * types, so this is the same transformation as body() with each
+ * 32-bit word widened to MD4_LANES words.
+ * Without GCC vector extensions, fall back to one lane at a time.
+ */
+#if defined(__GNUC__)
+
+typedef MD4_u32plus md4_lanes_t
+	__attribute__((vector_size(MD4_LANES * sizeof(MD4_u32plus))));
+
+static inline __attribute__((always_inline)) void
+lanes_body(unsigned char *const result[], const unsigned char *const data[],
+	unsigned long size, const unsigned char *suffix,
+	unsigned long suffixsz)
+{
+	unsigned char pad[MD4_LANES][192];
+	const unsigned char *ptr[MD4_LANES];
+	MD4_u32plus t;
+	md4_lanes_t a, b, c, d, x[16];
+	md4_lanes_t saved_a, saved_b, saved_c, saved_d;
+	const MD4_u32plus ac1 = 0x5a827999, ac2 = 0x6ed9eba1;
+	unsigned long full, rem, tail, k, bits;
+	size_t i, n;
+
+	/*
+	 * Whole 64-byte blocks are read straight from the caller.
+	 * The rest of the data, the suffix, and MD4 padding are laid out
+	 * per lane in "pad", which needs at most three blocks.
+	 */
+
+	full = size / 64;
+	rem = size % 64;
+	tail = (rem + suffixsz + 8) / 64 + 1;
+	bits = (size + suffixsz) << 3;
+
+	for (i = 0; i < MD4_LANES; i++) {
+		memcpy(pad[i], data[i] + full * 64, rem);
+		memcpy(pad[i] + rem, suffix, suffixsz);
+		pad[i][rem + suffixsz] = 0x80;
+		memset(pad[i] + rem + suffixsz + 1, 0,
+			tail * 64 - rem - suffixsz - 1 - 8);
+		OUT(&pad[i][tail * 64 - 8], bits)
+		OUT(&pad[i][tail * 64 - 4], (MD4_u32plus)((size +
+			suffixsz) >> 29))
+	}
+
+	a = (md4_lanes_t){ 0 } + 0x67452301;
+	b = (md4_lanes_t){ 0 } + 0xefcdab89;
+	c = (md4_lanes_t){ 0 } + 0x98badcfe;
+	d = (md4_lanes_t){ 0 } + 0x10325476;
+
+	for (k = 0; k < full + tail; k++) {
+		for (i = 0; i < MD4_LANES; i++)
+			ptr[i] = k < full ? data[i] + k * 64 :
+				pad[i] + (k - full) * 64;
+
+		/* Transpose: word n of every lane into one vector. */
+
+		for (i = 0; i < MD4_LANES; i++)
+			for (n = 0; n < 16; n++) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+				memcpy(&t, &ptr[i][n * 4], sizeof(t));
+#else
+				t = (MD4_u32plus)ptr[i][n * 4] |
+				    ((MD4_u32plus)ptr[i][n * 4 + 1] << 8) |
+				    ((MD4_u32plus)ptr[i][n * 4 + 2] << 16) |
+				    ((MD4_u32plus)ptr[i][n * 4 + 3] << 24);
+#endif
+				x[n][i] = t;
+			}
+
+		saved_a = a;
+		saved_b = b;
+		saved_c = c;
+		saved_d = d;
+
+/* Round 1 */
+		STEP(F, a, b, c, d, x[0], 3)
+		STEP(F, d, a, b, c, x[1], 7)
+		STEP(F, c, d, a, b, x[2], 11)
+		STEP(F, b, c, d, a, x[3], 19)
+		STEP(F, a, b, c, d, x[4], 3)
+		STEP(F, d, a, b, c, x[5], 7)
+		STEP(F, c, d, a, b, x[6], 11)
+		STEP(F, b, c, d, a, x[7], 19)
+		STEP(F, a, b, c, d, x[8], 3)
+		STEP(F, d, a, b, c, x[9], 7)
+		STEP(F, c, d, a, b, x[10], 11)
+		STEP(F, b, c, d, a, x[11], 19)
+		STEP(F, a, b, c, d, x[12], 3)
+		STEP(F, d, a, b, c, x[13], 7)
+		STEP(F, c, d, a, b, x[14], 11)
+		STEP(F, b, c, d, a, x[15], 19)
+
+/* Round 2 */
+		STEP(G, a, b, c, d, x[0] + ac1, 3)
+		STEP(G, d, a, b, c, x[4] + ac1, 5)
+		STEP(G, c, d, a, b, x[8] + ac1, 9)
+		STEP(G, b, c, d, a, x[12] + ac1, 13)
+		STEP(G, a, b, c, d, x[1] + ac1, 3)
+		STEP(G, d, a, b, c, x[5] + ac1, 5)
+		STEP(G, c, d, a, b, x[9] + ac1, 9)
+		STEP(G, b, c, d, a, x[13] + ac1, 13)
+		STEP(G, a, b, c, d, x[2] + ac1, 3)
+		STEP(G, d, a, b, c, x[6] + ac1, 5)
+		STEP(G, c, d, a, b, x[10] + ac1, 9)
+		STEP(G, b, c, d, a, x[14] + ac1, 13)
+		STEP(G, a, b, c, d, x[3] + ac1, 3)
+		STEP(G, d, a, b, c, x[7] + ac1, 5)
+		STEP(G, c, d, a, b, x[11] + ac1, 9)
+		STEP(G, b, c, d, a, x[15] + ac1, 13)
+
+/* Round 3 */
+		STEP(H, a, b, c, d, x[0] + ac2, 3)
+		STEP(H, d, a, b, c, x[8] + ac2, 9)
+		STEP(H, c, d, a, b, x[4] + ac2, 11)
+		STEP(H, b, c, d, a, x[12] + ac2, 15)
+		STEP(H, a, b, c, d, x[2] + ac2, 3)
+		STEP(H, d, a, b, c, x[10] + ac2, 9)
+		STEP(H, c, d, a, b, x[6] + ac2, 11)
+		STEP(H, b, c, d, a, x[14] + ac2, 15)
+		STEP(H, a, b, c, d, x[1] + ac2, 3)
+		STEP(H, d, a, b, c, x[9] + ac2, 9)
+		STEP(H, c, d, a, b, x[5] + ac2, 11)
+		STEP(H, b, c, d, a, x[13] + ac2, 15)
+		STEP(H, a, b, c, d, x[3] + ac2, 3)
+		STEP(H, d, a, b, c, x[11] + ac2, 9)
+		STEP(H, c, d, a, b, x[7] + ac2, 11)
+		STEP(H, b, c, d, a, x[15] + ac2, 15)
+
+		a += saved_a;
+		b += saved_b;
+		c += saved_c;
+		d += saved_d;
+	}
+
+	for (i = 0; i < MD4_LANES; i++) {
+		OUT(&result[i][0], a[i])
+		OUT(&result[i][4], b[i])
+		OUT(&result[i][8], c[i])
+		OUT(&result[i][12], d[i])
+	}
+}
+
+/*
+ * Without AVX2 the compiler splits each vector into SSE2 (or NEON)
+ * registers of four lanes apiece.
+ */
+static void lanes_generic(unsigned char *const result[],
+	const unsigned char *const data[], unsigned long size,
+	const unsigned char *suffix, unsigned long suffixsz)
+{
+	lanes_body(result, data, size, suffix, suffixsz);
+}
+
+#if defined(__i386__) || defined(__x86_64__)
+__attribute__((target("avx2")))
+static void lanes_avx2(unsigned char *const result[],
+	const unsigned char *const data[], unsigned long size,
+	const unsigned char *suffix, unsigned long suffixsz)
+{
+	lanes_body(result, data, size, suffix, suffixsz);
+}
+#endif
+
+/*
+ * Pick the lanes for this CPU, once, by whichever thread gets here
+ * first.
+ */
+static pthread_once_t lanes_once = PTHREAD_ONCE_INIT;
+static void (*lanes)(unsigned char *const [],
+	const unsigned char *const [], unsigned long,
+	const unsigned char *, unsigned long);
+
+static void lanes_pick(void)
+{
+	lanes = lanes_generic;
+#if defined(__i386__) || defined(__x86_64__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		lanes = lanes_avx2;
+#endif
+}
+
+#endif /* __GNUC__ */
+
+void MD4_Lanes(unsigned char *const result[], const void *const data[],
+	size_t n, unsigned long size, const void *suffix,
+	unsigned long suffixsz)
+{
+	MD4_CTX ctx;
+	size_t i;
+#if defined(__GNUC__)
+	unsigned char scratch[MD4_DIGEST_LENGTH];
+	unsigned char *res[MD4_LANES];
+	const unsigned char *dat[MD4_LANES];
+	size_t j;
+
+	pthread_once(&lanes_once, lanes_pick);
+
+	/*
+	 * Full groups go straight through; a short trailing group has its
+	 * idle lanes repeat the first message into a scratch digest.
+	 * A lone message isn't worth the transposition.
+	 */
+
+	for (i = 0; suffixsz <= MD4_LANES_SUFFIX_MAX && n - i > 1;
+	    i += MD4_LANES) {
+		for (j = 0; j < MD4_LANES; j++) {
+			if (i + j < n) {
+				res[j] = result[i + j];
+				dat[j] = data[i + j];
+			} else {
+				res[j] = scratch;
+				dat[j] = data[i];
+			}
+		}
+		lanes(res, dat, size, suffix, suffixsz);
+		if (n - i <= MD4_LANES) {
+			i = n;
+			break;
+		}
+	}
+#else
+	i = 0;
+#endif
+	for ( ; i < n; i++) {
+		MD4_Init(&ctx);
+		MD4_Update(&ctx, data[i], size);
+		MD4_Update(&ctx, suffix, suffixsz);
+		MD4_Final(result[i], &ctx);
+	}
+}
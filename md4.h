@@ -28,6 +28,13 @@
 
 #define	MD4_DIGEST_LENGTH		16
 
+/*
+ * Messages hashed together by MD4_Lanes(), and the longest suffix it
+ * will hash in parallel.
+ */
+#define	MD4_LANES			8
+#define	MD4_LANES_SUFFIX_MAX		56
+
 /* Any 32-bit or wider unsigned integer data type will do */
 typedef unsigned int MD4_u32plus;
 
@@ -43,6 +50,9 @@ __BEGIN_DECLS
 extern void MD4_Init(MD4_CTX *ctx);
 extern void MD4_Update(MD4_CTX *ctx, const void *data, unsigned long size);
 extern void MD4_Final(unsigned char *result, MD4_CTX *ctx);
+extern void MD4_Lanes(unsigned char *const result[],
+	const void *const data[], size_t n, unsigned long size,
+	const void *suffix, unsigned long suffixsz);
 
 __END_DECLS
 
@@ -0,0 +1,311 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "extern.h"
+
+/*
+ * A fixed set of worker threads running batches of jobs.
+ * A batch is a function called once for each job index in [0, njobs).
+ * Jobs are handed out in index order and we track the longest prefix of
+ * completed jobs, so the caller can consume results in order while
+ * later jobs are still running.
+ * Job functions run without the lock and must not use the session's
+ * logging or error reporting.
+ * If a job fails, no more jobs are handed out and the batch ends once
+ * those running are done; see pool_ok().
+ */
+struct	pool {
+	pthread_mutex_t	  mtx;
+	pthread_cond_t	  work; /* new batch or quitting */
+	pthread_cond_t	  done; /* job completed */
+	pthread_t	 *thrs; /* worker threads */
+	size_t		  thrsz; /* number of workers */
+	pool_fn		  fn; /* job function or NULL if idle */
+	void		 *arg; /* argument to fn */
+	size_t		  njobs; /* jobs in batch */
+	size_t		  next; /* next job to hand out */
+	size_t		  prefix; /* jobs [0, prefix) are done */
+	unsigned char	 *fin; /* per-job completion if out of order */
+	size_t		  finmax; /* allocated size of fin */
+	int		  failed; /* a job in the batch failed */
+	int		  quit; /* workers should exit */
+};
+
+static void *
+pool_worker(void *arg)
+{
+	struct pool	*p = arg;
+	size_t		 job;
+	int		 c;
+
+	pthread_mutex_lock(&p->mtx);
+	for (;;) {
+		while (!p->quit && (p->fn == NULL || p->next == p->njobs))
+			pthread_cond_wait(&p->work, &p->mtx);
+		if (p->quit)
+			break;
+
+		job = p->next++;
+		pthread_mutex_unlock(&p->mtx);
+		c = p->fn(p->arg, job);
+		pthread_mutex_lock(&p->mtx);
+
+		if (!c && !p->failed) {
+			p->failed = 1;
+			p->njobs = p->next;
+		}
+		p->fin[job] = 1;
+		while (p->prefix < p->njobs && p->fin[p->prefix])
+			p->prefix++;
+		pthread_cond_broadcast(&p->done);
+	}
+	pthread_mutex_unlock(&p->mtx);
+	return NULL;
+}
+
+/*
+ * Start "thrs" worker threads.
+ * Returns NULL on failure.
+ * On success, pool_free() must be called with the allocated pointer.
+ */
+struct pool *
+pool_alloc(struct sess *sess, size_t thrs)
+{
+	struct pool	*p;
+	int		 rc;
+
+	assert(thrs > 0);
+
+	if ((p = calloc(1, sizeof(struct pool))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	} else if ((p->thrs = calloc(thrs, sizeof(pthread_t))) == NULL) {
+		ERR(sess, "calloc");
+		free(p);
+		return NULL;
+	}
+
+	pthread_mutex_init(&p->mtx, NULL);
+	pthread_cond_init(&p->work, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	for ( ; p->thrsz < thrs; p->thrsz++) {
+		rc = pthread_create(&p->thrs[p->thrsz],
+			NULL, pool_worker, p);
+		if (rc != 0) {
+			errno = rc;
+			ERR(sess, "pthread_create");
+			pool_free(p);
+			return NULL;
+		}
+	}
+
+	LOG3(sess, "started %zu worker threads", p->thrsz);
+	return p;
+}
+
+/*
+ * Stop and join all workers, then free the pool.
+ * Any running batch is cancelled first.
+ * Passing a NULL to this function is ok.
+ */
+void
+pool_free(struct pool *p)
+{
+	size_t	 i;
+
+	if (p == NULL)
+		return;
+
+	pool_cancel(p);
+
+	pthread_mutex_lock(&p->mtx);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->mtx);
+
+	for (i = 0; i < p->thrsz; i++)
+		pthread_join(p->thrs[i], NULL);
+
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->work);
+	pthread_mutex_destroy(&p->mtx);
+	free(p->fin);
+	free(p->thrs);
+	free(p);
+}
+
+/*
+ * Start running "fn" over jobs [0, njobs).
+ * The pool must be idle, i.e., any prior batch must have been fully
+ * waited for with pool_wait() or stopped with pool_cancel().
+ * Returns zero on failure, non-zero on success.
+ */
+int
+pool_start(struct sess *sess, struct pool *p,
+	pool_fn fn, void *arg, size_t njobs)
+{
+	void	*pp;
+
+	assert(fn != NULL);
+
+	pthread_mutex_lock(&p->mtx);
+	assert(p->fn == NULL);
+
+	if (njobs > p->finmax) {
+		if ((pp = realloc(p->fin, njobs)) == NULL) {
+			pthread_mutex_unlock(&p->mtx);
+			ERR(sess, "realloc");
+			return 0;
+		}
+		p->fin = pp;
+		p->finmax = njobs;
+	}
+
+	memset(p->fin, 0, njobs);
+	p->fn = fn;
+	p->arg = arg;
+	p->njobs = njobs;
+	p->next = p->prefix = 0;
+	p->failed = 0;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->mtx);
+	return 1;
+}
+
+/*
+ * Grow the current batch, which mustn't be idle, to "njobs" jobs.
+ * Nothing is added once a job has failed.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+pool_extend(struct sess *sess, struct pool *p, size_t njobs)
+{
+	void	*pp;
+
+	pthread_mutex_lock(&p->mtx);
+	assert(p->fn != NULL);
+
+	if (p->failed || njobs <= p->njobs) {
+		pthread_mutex_unlock(&p->mtx);
+		return 1;
+	}
+
+	if (njobs > p->finmax) {
+		if ((pp = realloc(p->fin, njobs)) == NULL) {
+			pthread_mutex_unlock(&p->mtx);
+			ERR(sess, "realloc");
+			return 0;
+		}
+		p->fin = pp;
+		p->finmax = njobs;
+	}
+
+	memset(p->fin + p->njobs, 0, njobs - p->njobs);
+	p->njobs = njobs;
+	pthread_cond_broadcast(&p->work);
+	pthread_mutex_unlock(&p->mtx);
+	return 1;
+}
+
+/*
+ * The number of worker threads.
+ */
+size_t
+pool_size(const struct pool *p)
+{
+
+	return p->thrsz;
+}
+
+/*
+ * Whether no job of the current (or last) batch has failed.
+ * If one has, the results of the jobs reported done can't be trusted
+ * to be complete.
+ */
+int
+pool_ok(struct pool *p)
+{
+	int	 c;
+
+	pthread_mutex_lock(&p->mtx);
+	c = !p->failed;
+	pthread_mutex_unlock(&p->mtx);
+	return c;
+}
+
+/*
+ * Wait until more than "have" leading jobs of the current batch are
+ * done (or all of them are) and return how many are.
+ * Once this returns the batch size, the pool is idle again.
+ */
+size_t
+pool_wait(struct pool *p, size_t have)
+{
+	size_t	 done;
+
+	pthread_mutex_lock(&p->mtx);
+	assert(p->fn != NULL);
+	while (p->prefix <= have && p->prefix < p->njobs)
+		pthread_cond_wait(&p->done, &p->mtx);
+	if ((done = p->prefix) == p->njobs)
+		p->fn = NULL;
+	pthread_mutex_unlock(&p->mtx);
+	return done;
+}
+
+/*
+ * Like pool_wait(), but don't block.
+ */
+size_t
+pool_done(struct pool *p)
+{
+	size_t	 done;
+
+	pthread_mutex_lock(&p->mtx);
+	assert(p->fn != NULL);
+	if ((done = p->prefix) == p->njobs)
+		p->fn = NULL;
+	pthread_mutex_unlock(&p->mtx);
+	return done;
+}
+
+/*
+ * Stop handing out jobs from the current batch (if any), wait for
+ * those already running, and leave the pool idle.
+ */
+void
+pool_cancel(struct pool *p)
+{
+
+	pthread_mutex_lock(&p->mtx);
+	if (p->fn != NULL) {
+		p->njobs = p->next;
+		while (p->prefix < p->njobs)
+			pthread_cond_wait(&p->done, &p->mtx);
+		p->fn = NULL;
+	}
+	pthread_mutex_unlock(&p->mtx);
+}
@@ -49,10 +49,13 @@ rsync_receiver(struct sess *sess,
 	int fdin, int fdout, const char *root)
 {
 	struct flist	*fl = NULL, *dfl = NULL;
-	size_t		 i, flsz = 0, dflsz = 0, excl;
+	size_t		 i, flsz = 0, dflsz = 0, excl, n, redosz;
+	const size_t	*redo;
 	char		*tofree;
 	int		 rc = 0, dfd = -1, phase = 0, c;
+	int		 fldone, flnew = 0;
 	int32_t		 ioerror;
+	uint64_t	 t;
 	struct pollfd	 pfd[PFD__MAX];
 	struct download	*dl = NULL;
 	struct upload	*ul = NULL;
@@ -84,12 +87,26 @@ rsync_receiver(struct sess *sess,
 	/*
 	 * Start by receiving the file list and our mystery number.
 	 * These we're going to be touching on our local system.
+	 * This is where a batch (--write-batch) starts.
 	 */
 
+	if (sess->batch != NULL)
+		batch_record(sess->batch, 1);
+
+	t = stats_now();
 	if (!flist_recv(sess, fdin, &fl, &flsz)) {
 		ERRX1(sess, "flist_recv");
 		goto out;
 	}
+	sess->stats.flist_xfer += stats_now() - t;
+	sess->stats.files = flsz;
+
+	/*
+	 * If incremental, this is just the first segment of the list:
+	 * the rest follow with the files.
+	 */
+
+	fldone = !sess->inc_flist;
 
 	/* The IO error is sent after the file list. */
 
@@ -152,12 +169,23 @@ rsync_receiver(struct sess *sess,
 	 * unveil.
 	 */
 
+	t = stats_now();
 	if (sess->opts->del &&
 	    sess->opts->recursive &&
 	    !flist_gen_dels(sess, root, &dfl, &dflsz, fl, flsz)) {
 		ERRX1(sess, "flist_gen_local");
 		goto out;
 	}
+	sess->stats.del += stats_now() - t;
+
+	/* The signature cache must be opened while we can see it. */
+
+	if (sess->opts->sig_cache != NULL && !sess->opts->dry_run &&
+	    (sess->sigcache = sigcache_open(sess,
+	     sess->opts->sig_cache)) == NULL) {
+		ERRX1(sess, "sigcache_open");
+		goto out;
+	}
 
 	/*
 	 * Make our entire view of the file-system be limited to what's
@@ -176,10 +204,12 @@ rsync_receiver(struct sess *sess,
 
 	/* If we have a local set, go for the deletion. */
 
+	t = stats_now();
 	if (!flist_del(sess, dfd, dfl, dflsz)) {
 		ERRX1(sess, "flist_del");
 		goto out;
 	}
+	sess->stats.del += stats_now() - t;
 
 	/* Initialise poll events to listen from the sender. */
 
@@ -209,9 +239,37 @@ rsync_receiver(struct sess *sess,
 	LOG2(sess, "%s: ready for phase 1 data", root);
 
 	for (;;) {
-		if ((c = poll(pfd, PFD__MAX, INFTIM)) == -1) {
+		if (!io_write_flush(sess)) {
+			ERRX1(sess, "io_write_flush");
+			goto out;
+		}
+
+		/*
+		 * Data we've already read from the sender (including what
+		 * we've yet to decompress) won't show in poll(), so don't
+		 * wait if we have some.
+		 * Nor if we've more of the file list for the uploader.
+		 */
+
+		c = io_read_buffered(sess, fdin) || token_buffered(sess);
+		if (poll(pfd, PFD__MAX,
+		    (c || flnew) ? 0 : sess_stats_timeout(sess)) == -1) {
 			ERR(sess, "poll");
 			goto out;
+		} else if (c)
+			pfd[PFD_SENDER_IN].revents |= POLLIN;
+
+		sess_stats_tick(sess);
+
+		/*
+		 * A batch read from a pipe (--read-batch) hangs up once
+		 * it's all written, but we've yet to read it.
+		 */
+
+		if (sess->opts->read_batch != NULL &&
+		    (pfd[PFD_SENDER_IN].revents & POLLHUP)) {
+			pfd[PFD_SENDER_IN].revents &= ~POLLHUP;
+			pfd[PFD_SENDER_IN].revents |= POLLIN;
 		}
 
 		for (i = 0; i < PFD__MAX; i++)
@@ -237,22 +295,24 @@ rsync_receiver(struct sess *sess,
 			if (!io_read_flush(sess, fdin)) {
 				ERRX1(sess, "io_read_flush");
 				goto out;
-			} else if (sess->mplex_read_remain == 0)
+			} else if (sess->mplex_read_remain == 0 &&
+			    !token_buffered(sess))
 				pfd[PFD_SENDER_IN].revents &= ~POLLIN;
 		}
 
 
 		/*
-		 * We run the uploader if we have files left to examine
-		 * (i < flsz) or if we have a file that we've opened and
-		 * is read to mmap.
+		 * We run the uploader if we have signatures ready to
+		 * send, if we have a file that we've opened and is
+		 * ready to read, or if it has more files to look at.
 		 */
 
-		if ((POLLIN & pfd[PFD_UPLOADER_IN].revents) ||
+		if (flnew ||
+		    (POLLIN & pfd[PFD_UPLOADER_IN].revents) ||
 		    (POLLOUT & pfd[PFD_SENDER_OUT].revents)) {
-			c = rsync_uploader(ul,
-				&pfd[PFD_UPLOADER_IN].fd,
-				sess, &pfd[PFD_SENDER_OUT].fd);
+			flnew = 0;
+			c = rsync_uploader(ul, &pfd[PFD_UPLOADER_IN],
+				sess, &pfd[PFD_SENDER_OUT]);
 			if (c < 0) {
 				ERRX1(sess, "rsync_uploader");
 				goto out;
@@ -266,8 +326,14 @@ rsync_receiver(struct sess *sess,
 		 * XXX: we don't disable PFD_SENDER_IN like with the
 		 * uploader because we might stop getting error
 		 * messages, which will otherwise clog up the pipes.
+		 * A batch (--read-batch) is all there already, so wait
+		 * for the uploader to make the directories and links
+		 * of files it's looked at before the files come.
 		 */
 
+		if (sess->opts->read_batch != NULL && !upload_idle(ul))
+			continue;
+
 		if ((POLLIN & pfd[PFD_SENDER_IN].revents) ||
 		    (POLLIN & pfd[PFD_DOWNLOADER_IN].revents)) {
 			c = rsync_downloader(dl, sess,
@@ -275,21 +341,63 @@ rsync_receiver(struct sess *sess,
 			if (c < 0) {
 				ERRX1(sess, "rsync_downloader");
 				goto out;
+			} else if (c == 2) {
+				if (fldone) {
+					ERRX(sess, "file list segment "
+						"after end of list");
+					goto out;
+				}
+				n = flsz;
+				t = stats_now();
+				if (!flist_recv_seg(sess, fdin, &fl, &flsz)) {
+					ERRX1(sess, "flist_recv_seg");
+					goto out;
+				}
+				sess->stats.flist_xfer += stats_now() - t;
+				sess->stats.files = flsz;
+				fldone = flsz == n;
+				download_flist(dl, fl, flsz);
+				if (!upload_flist(ul, sess,
+				    fl, flsz, fldone)) {
+					ERRX1(sess, "upload_flist");
+					goto out;
+				}
+				flnew = 1;
 			} else if (c == 0) {
-				assert(phase == 0);
-				phase++;
-				LOG2(sess, "%s: receiver ready "
-					"for phase 2 data", root);
-				break;
+				if (!fldone) {
+					ERRX(sess, "phase ended "
+						"before end of file list");
+					goto out;
+				}
+				redo = download_redo(dl, &redosz);
+				if (phase++ > 0 || (redosz == 0 &&
+				    sess->opts->read_batch == NULL)) {
+					LOG2(sess, "%s: receiver ready "
+						"for phase 2 data", root);
+					break;
+				}
+
+				/*
+				 * A batch has what was asked for again
+				 * when it was written, so read through
+				 * the second phase.
+				 */
+
+				if (sess->opts->read_batch != NULL)
+					continue;
+
+				/*
+				 * Files got out of sync between the
+				 * sender and us, so ask for them again
+				 * with long checksums in the second
+				 * phase, which the uploader ends.
+				 */
+
+				LOG2(sess, "%s: receiver asking again "
+					"for %zu files", root, redosz);
+				upload_redo(ul, sess, redo, redosz);
+				flnew = 1;
 			}
-
-			/*
-			 * FIXME: if we have any errors during the
-			 * download, most notably files getting out of
-			 * sync between the send and the receiver, then
-			 * here we should bump our checksum length and
-			 * go into the second phase.
-			 */
 		}
 	}
 
@@ -308,6 +416,11 @@ rsync_receiver(struct sess *sess,
 		}
 	}
 
+	/* That's the end of a batch. */
+
+	if (sess->batch != NULL)
+		batch_record(sess->batch, 0);
+
 	/*
 	 * Now all of our transfers are complete, so we can fix up our
 	 * directory permissions.
@@ -316,6 +429,10 @@ rsync_receiver(struct sess *sess,
 	if (!rsync_uploader_tail(ul, sess)) {
 		ERRX1(sess, "rsync_uploader_tail");
 		goto out;
+	} else if (sess->sigcache != NULL &&
+	    !sigcache_close(sess, sess->sigcache)) {
+		ERRX1(sess, "sigcache_close");
+		goto out;
 	}
 
 	/* Process server statistics and say good-bye. */
@@ -326,15 +443,32 @@ rsync_receiver(struct sess *sess,
 	} else if (!io_write_int(sess, fdout, -1)) {
 		ERRX1(sess, "io_write_int");
 		goto out;
+	} else if (!io_write_flush(sess)) {
+		ERRX1(sess, "io_write_flush");
+		goto out;
 	}
 
 	LOG2(sess, "receiver finished updating");
+	sess_stats_report(sess, 1);
+
+	/* Files of a batch that didn't match what it was written for. */
+
+	if (sess->opts->read_batch != NULL &&
+	    download_redo(dl, &redosz) != NULL && redosz > 0) {
+		ERRX(sess, "%zu files not updated", redosz);
+		goto out;
+	}
 	rc = 1;
 out:
 	if (dfd != -1)
 		close(dfd);
 	upload_free(ul);
 	download_free(dl);
+	token_free(sess);
+	if (!rc)
+		sigcache_fail(sess, sess->sigcache);
+	sigcache_free(sess->sigcache);
+	sess->sigcache = NULL;
 	flist_free(fl, flsz);
 	flist_free(dfl, dflsz);
 	return rc;
@@ -0,0 +1,51 @@
+#! /bin/sh
+#	$Id$
+#
+# Regression tests of the signature cache (--sig-cache) over local
+# transfers: each case syncs a file, changes it, and syncs it again
+# with the cached signature, checking the result.
+#
+# Usage: sh regress/sigcache.sh [openrsync]
+
+set -e
+
+case "${1:-./openrsync}" in
+/*)	O="${1:-./openrsync}" ;;
+*)	O="$(pwd)/${1:-./openrsync}" ;;
+esac
+T="$(mktemp -d /tmp/regress-sigcache.XXXXXX)"
+trap 'rm -rf "$T"' EXIT
+
+# Sync a file of the given size twice with the given arguments, first
+# byte changed in between, then check the destination.
+
+run()
+{
+	name="$1"
+	size="$2"
+	shift 2
+	rm -rf "$T/src" "$T/dst" "$T/cache"
+	mkdir "$T/src"
+	dd if=/dev/urandom of="$T/src/file" bs="$size" count=1 2>/dev/null
+	touch -t 202001010000 "$T/src/file"
+	"$O" --rsync-path="$O" -rt --no-whole-file --checksum-seed=7 \
+	    --sig-cache="$T/cache" "$@" "$T/src/" "$T/dst"
+	printf x | dd of="$T/src/file" bs=1 conv=notrunc 2>/dev/null
+	touch -t 202001020000 "$T/src/file"
+	"$O" --rsync-path="$O" -rt --no-whole-file --checksum-seed=7 \
+	    --sig-cache="$T/cache" "$@" "$T/src/" "$T/dst"
+	if ! cmp -s "$T/src/file" "$T/dst/file" ||
+	    [ "$(ls -A "$T/dst")" != file ]; then
+		echo "$name: FAIL"
+		exit 1
+	fi
+	echo "$name: ok"
+}
+
+# Sizes that are a multiple of the block length have a full-length
+# last block.
+
+run "default block length" 495616
+run "default block length, remainder" 495617
+run "512 B blocks" 524288 -B 512
+run "512 B blocks, remainder" 524300 -B 512
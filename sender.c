@@ -14,16 +14,180 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
+#include <sys/queue.h>
 #include <sys/stat.h>
 
 #include <assert.h>
 #include <inttypes.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "extern.h"
 
+/*
+ * Most requests we read ahead of those we're sending.
+ * Each holds the receiver's block set for a file, so this bounds our
+ * memory use when the receiver gets far ahead of us.
+ */
+#define	SEND_QUEUE_MAX	64
+
+enum	pfdt {
+	PFD_RECEIVER_IN = 0, /* requests from the receiver */
+	PFD_RECEIVER_OUT, /* data to the receiver */
+	PFD__MAX
+};
+
+/*
+ * A request read from the receiver but not yet answered.
+ * This is either a file index with the blocks the receiver has (if not
+ * in dry-run mode), or the end of a phase (-1).
+ */
+struct	send_up {
+	int32_t		   idx; /* file index or -1 */
+	struct blkset	  *blks; /* receiver's blocks or NULL */
+	TAILQ_ENTRY(send_up) entries;
+};
+
+TAILQ_HEAD(send_upq, send_up);
+
+static void
+send_up_free(struct send_up *p)
+{
+
+	if (p == NULL)
+		return;
+	blkset_free(p->blks);
+	free(p);
+}
+
+/*
+ * Read the next request from the receiver and queue it.
+ * If it's for a file, the receiver then sends us its view of the file.
+ * It does so by cutting a file into a series of blocks and checksumming
+ * each block.
+ * We can then compare the blocks in our file and those in theirs, and
+ * send them blocks they're missing or don't have.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+send_up_read(struct sess *sess, int fdin,
+	const struct flist *fl, size_t flsz, struct send_upq *q)
+{
+	struct send_up	*p;
+	int32_t		 idx;
+
+	if (!io_read_int(sess, fdin, &idx)) {
+		ERRX1(sess, "io_read_int");
+		return 0;
+	}
+
+	/* Validate index and file type. */
+
+	if (idx != -1) {
+		if (idx < 0 || (uint32_t)idx >= flsz) {
+			ERRX(sess, "file index out of bounds: "
+				"invalid %" PRId32 " out of %zu",
+				idx, flsz);
+			return 0;
+		} else if (S_ISDIR(fl[idx].st.mode)) {
+			ERRX(sess, "blocks requested for "
+				"directory: %s", fl[idx].path);
+			return 0;
+		} else if (S_ISLNK(fl[idx].st.mode)) {
+			ERRX(sess, "blocks requested for "
+				"symlink: %s", fl[idx].path);
+			return 0;
+		} else if (!S_ISREG(fl[idx].st.mode)) {
+			ERRX(sess, "blocks requested for "
+				"special: %s", fl[idx].path);
+			return 0;
+		}
+	}
+
+	if ((p = calloc(1, sizeof(struct send_up))) == NULL) {
+		ERR(sess, "calloc");
+		return 0;
+	}
+	p->idx = idx;
+
+	/* Dry-run doesn't send blocks. */
+
+	if (idx != -1 && !sess->opts->dry_run) {
+		p->blks = blk_recv(sess, fdin, fl[idx].path);
+		if (p->blks == NULL) {
+			ERRX1(sess, "blk_recv");
+			free(p);
+			return 0;
+		}
+	}
+
+	TAILQ_INSERT_TAIL(q, p, entries);
+	return 1;
+}
+
+/*
+ * Start answering the request "p": for a file, this begins matching
+ * our copy against the receiver's blocks into "bm".
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+send_up_start(struct sess *sess, int fdout, const struct flist *fl,
+	const struct send_up *p, size_t *phase, struct blkmatch **bm)
+{
+
+	/*
+	 * If we receive an invalid index (-1), then we're either
+	 * promoted to the second phase or it's time to exit, depending
+	 * upon which phase we're in.
+	 */
+
+	if (p->idx == -1) {
+		if (!io_write_int(sess, fdout, p->idx)) {
+			ERRX1(sess, "io_write_int");
+			return 0;
+		}
+
+		/* FIXME: I don't understand this ack. */
+
+		if (sess->opts->server && sess->rver > 27)
+			if (!io_write_int(sess, fdout, p->idx)) {
+				ERRX1(sess, "io_write_int");
+				return 0;
+			}
+
+		if ((*phase)++ == 0)
+			LOG2(sess, "sender transmitting phase 2 data");
+		return 1;
+	}
+
+	if (!sess->opts->server)
+		LOG1(sess, "%s", fl[p->idx].wpath);
+	sess->stats.files_xfer++;
+
+	/* Dry-run doesn't do anything. */
+
+	if (sess->opts->dry_run) {
+		if (!io_write_int(sess, fdout, p->idx)) {
+			ERRX1(sess, "io_write_int");
+			return 0;
+		}
+		return 1;
+	}
+
+	if (!blk_recv_ack(sess, fdout, p->blks, p->idx)) {
+		ERRX1(sess, "blk_recv_ack");
+		return 0;
+	} else if ((*bm = blk_match_alloc(sess,
+	    p->blks, fl[p->idx].path)) == NULL) {
+		ERRX1(sess, "blk_match_alloc");
+		return 0;
+	}
+
+	return 1;
+}
+
 /*
  * A client sender manages the read-only source files and sends data to
  * the receiver as requested.
@@ -38,10 +202,18 @@ rsync_sender(struct sess *sess, int fdin,
 	int fdout, size_t argc, char **argv)
 {
 	struct flist	*fl = NULL;
-	size_t		 flsz = 0, phase = 0, excl;
-	int		 rc = 0, c;
+	size_t		 i, flsz = 0, phase = 0, queued = 0, qsz = 0, excl;
+	size_t		 start;
+	int		 rc = 0, c, rbuf;
 	int32_t		 idx;
-	struct blkset	*blks = NULL;
+	struct pollfd	 pfd[PFD__MAX];
+	struct send_upq	 q;
+	struct send_up	*up = NULL;
+	struct blkmatch	*bm = NULL;
+	struct flgen	*gen = NULL;
+	uint64_t	 t;
+
+	TAILQ_INIT(&q);
 
 	if (pledge("stdio getpw rpath unveil", NULL) == -1) {
 		ERR(sess, "pledge");
@@ -52,12 +224,24 @@ rsync_sender(struct sess *sess, int fdin,
 	 * Generate the list of files we want to send from our
 	 * command-line input.
 	 * This will also remove all invalid files.
+	 * If the receiver takes the list incrementally and we have a
+	 * single directory tree, we only start the walk here and send
+	 * the rest of the list in segments as we go.
 	 */
 
-	if (!flist_gen(sess, argc, argv, &fl, &flsz)) {
+	t = stats_now();
+	if (sess->inc_flist && sess->opts->recursive && argc == 1) {
+		gen = flist_gen_inc(sess, argv[0], &fl, &flsz);
+		if (gen == NULL) {
+			ERRX1(sess, "flist_gen_inc");
+			goto out;
+		}
+	} else if (!flist_gen(sess, argc, argv, &fl, &flsz)) {
 		ERRX1(sess, "flist_gen");
 		goto out;
 	}
+	sess->stats.flist_gen += stats_now() - t;
+	sess->stats.files = flsz;
 
 	/* Client sends zero-length exclusions if deleting. */
 
@@ -70,8 +254,13 @@ rsync_sender(struct sess *sess, int fdin,
 	/*
 	 * Then the file list in any mode.
 	 * Finally, the IO error (always zero for us).
+	 * This is where a batch (--write-batch) starts.
 	 */
 
+	if (sess->batch != NULL)
+		batch_record(sess->batch, 1);
+
+	t = stats_now();
 	if (!flist_send(sess, fdin, fdout, fl, flsz)) {
 		ERRX1(sess, "flist_send");
 		goto out;
@@ -79,6 +268,19 @@ rsync_sender(struct sess *sess, int fdin,
 		ERRX1(sess, "io_write_int");
 		goto out;
 	}
+	sess->stats.flist_xfer += stats_now() - t;
+
+	/*
+	 * If the receiver expects segments but we've the whole list
+	 * already, end it with an empty one right away.
+	 */
+
+	if (sess->inc_flist && gen == NULL &&
+	    (!io_write_int(sess, fdout, FLIST_SEGMENT) ||
+	     !flist_send(sess, fdin, fdout, NULL, 0))) {
+		ERRX1(sess, "flist_send");
+		goto out;
+	}
 
 	/* Exit if we're the server with zero files. */
 
@@ -107,100 +309,168 @@ rsync_sender(struct sess *sess, int fdin,
 	/*
 	 * We have two phases: the first has a two-byte checksum, the
 	 * second has a full 16-byte checksum.
+	 * Each ends when the receiver sends us -1, which we echo.
+	 * Rather than answering each request in turn, we read requests
+	 * (and their blocks) as they arrive and queue them, then answer
+	 * them in order a step at a time.
+	 * This way, the receiver never waits on us to read the blocks
+	 * for the next file while we're sending the current one.
 	 */
 
 	LOG2(sess, "sender transmitting phase 1 data");
 
+	pfd[PFD_RECEIVER_IN].fd = fdin;
+	pfd[PFD_RECEIVER_OUT].fd = fdout;
+
 	for (;;) {
-		if (!io_read_int(sess, fdin, &idx)) {
-			ERRX1(sess, "io_read_int");
-			goto out;
-		}
+		/*
+		 * Stop reading after the end of the second phase or if
+		 * our queue is full.
+		 * Only write if we've something to write, which includes
+		 * the rest of the file list.
+		 * We're done when we've neither.
+		 */
+
+		pfd[PFD_RECEIVER_IN].events =
+			(phase + queued < 2 && qsz < SEND_QUEUE_MAX) ?
+			POLLIN : 0;
+		pfd[PFD_RECEIVER_OUT].events =
+			(bm != NULL || qsz > 0 || gen != NULL) ? POLLOUT : 0;
+
+		if (pfd[PFD_RECEIVER_IN].events == 0 &&
+		    pfd[PFD_RECEIVER_OUT].events == 0)
+			break;
 
 		/*
-		 * If we receive an invalid index (-1), then we're
-		 * either promoted to the second phase or it's time to
-		 * exit, depending upon which phase we're in.
+		 * Only write out our buffered data when we'd otherwise
+		 * wait, so it's sent in as few writes as possible.
+		 * Requests we've already read from the receiver won't
+		 * show in poll(), so we don't wait if we want them.
 		 */
 
-		if (idx == -1) {
-			if (!io_write_int(sess, fdout, idx)) {
-				ERRX1(sess, "io_write_int");
+		rbuf = pfd[PFD_RECEIVER_IN].events &&
+			io_read_buffered(sess, fdin);
+
+		if ((c = poll(pfd, PFD__MAX, 0)) == 0 && !rbuf) {
+			if (!io_write_flush(sess)) {
+				ERRX1(sess, "io_write_flush");
 				goto out;
 			}
+			c = poll(pfd, PFD__MAX, sess_stats_timeout(sess));
+		}
+		if (c == -1) {
+			ERR(sess, "poll");
+			goto out;
+		} else if (rbuf)
+			pfd[PFD_RECEIVER_IN].revents |= POLLIN;
 
-			/* FIXME: I don't understand this ack. */
+		sess_stats_tick(sess);
 
-			if (sess->opts->server && sess->rver > 27)
-				if (!io_write_int(sess, fdout, idx)) {
-					ERRX1(sess, "io_write_int");
-					goto out;
-				}
+		for (i = 0; i < PFD__MAX; i++)
+			if (pfd[i].revents & (POLLERR|POLLNVAL)) {
+				ERRX(sess, "poll: bad fd");
+				goto out;
+			} else if (pfd[i].revents & POLLHUP) {
+				ERRX(sess, "poll: hangup");
+				goto out;
+			}
 
-			if (phase++)
-				break;
-			LOG2(sess, "sender transmitting phase 2 data");
-			continue;
-		}
+		/*
+		 * If we have a read event and we're multiplexing, we
+		 * might just have error messages in the pipe.
+		 * Flush these out and only read a request if there's
+		 * something left in the pipe.
+		 */
 
-		/* Validate index and file type. */
+		if (sess->mplex_reads &&
+		    (POLLIN & pfd[PFD_RECEIVER_IN].revents)) {
+			if (!io_read_flush(sess, fdin)) {
+				ERRX1(sess, "io_read_flush");
+				goto out;
+			} else if (sess->mplex_read_remain == 0)
+				pfd[PFD_RECEIVER_IN].revents &= ~POLLIN;
+		}
 
-		if (idx < 0 || (uint32_t)idx >= flsz) {
-			ERRX(sess, "file index out of bounds: "
-				"invalid %" PRId32 " out of %zu",
-				idx, flsz);
-			goto out;
-		} else if (S_ISDIR(fl[idx].st.mode)) {
-			ERRX(sess, "blocks requested for "
-				"directory: %s", fl[idx].path);
-			goto out;
-		} else if (S_ISLNK(fl[idx].st.mode)) {
-			ERRX(sess, "blocks requested for "
-				"symlink: %s", fl[idx].path);
-			goto out;
-		} else if (!S_ISREG(fl[idx].st.mode)) {
-			ERRX(sess, "blocks requested for "
-				"special: %s", fl[idx].path);
-			goto out;
+		if (POLLIN & pfd[PFD_RECEIVER_IN].revents) {
+			if (!send_up_read(sess, fdin, fl, flsz, &q)) {
+				ERRX1(sess, "send_up_read");
+				goto out;
+			}
+			if (TAILQ_LAST(&q, send_upq)->idx == -1)
+				queued++;
+			qsz++;
 		}
 
-		if (!sess->opts->server)
-			LOG1(sess, "%s", fl[idx].wpath);
+		if (!(POLLOUT & pfd[PFD_RECEIVER_OUT].revents))
+			continue;
 
-		/* Dry-run doesn't do anything. */
+		/*
+		 * Between files, send the next segment of the list, if
+		 * any, ending it with an empty segment.
+		 * The receiver can't ask for these files before it has
+		 * them, so this comes before its queued requests.
+		 */
 
-		if (sess->opts->dry_run) {
-			if (!io_write_int(sess, fdout, idx)) {
+		if (bm == NULL && gen != NULL) {
+			start = flsz;
+			t = stats_now();
+			if ((c = flist_gen_next(sess, gen, &fl, &flsz)) < 0) {
+				ERRX1(sess, "flist_gen_next");
+				goto out;
+			} else if (c == 0) {
+				flist_gen_free(gen);
+				gen = NULL;
+			}
+			sess->stats.flist_gen += stats_now() - t;
+			sess->stats.files = flsz;
+			t = stats_now();
+			if (!io_write_int(sess, fdout, FLIST_SEGMENT)) {
 				ERRX1(sess, "io_write_int");
 				goto out;
+			} else if (!flist_send(sess, fdin, fdout,
+			    fl + start, flsz - start)) {
+				ERRX1(sess, "flist_send");
+				goto out;
 			}
+			sess->stats.flist_xfer += stats_now() - t;
 			continue;
 		}
 
 		/*
-		 * The server will now send us its view of the file.
-		 * It does so by cutting a file into a series of blocks
-		 * and checksumming each block.
-		 * We can then compare the blocks in our file and those
-		 * in theirs, and send them blocks they're missing or
-		 * don't have.
+		 * Either start on the next request or continue sending
+		 * the file we're matching.
 		 */
 
-		blks = blk_recv(sess, fdin, fl[idx].path);
-		if (blks == NULL) {
-			ERRX1(sess, "blk_recv");
-			goto out;
-		} else if (!blk_recv_ack(sess, fdout, blks, idx)) {
-			ERRX1(sess, "blk_recv_ack");
-			goto out;
+		if (bm == NULL) {
+			up = TAILQ_FIRST(&q);
+			assert(up != NULL);
+			TAILQ_REMOVE(&q, up, entries);
+			qsz--;
+			if (up->idx == -1)
+				queued--;
+			if (!send_up_start(sess,
+			    fdout, fl, up, &phase, &bm)) {
+				ERRX1(sess, "send_up_start");
+				goto out;
+			}
+			if (bm == NULL) {
+				send_up_free(up);
+				up = NULL;
+			}
+			continue;
 		}
 
-		c = blk_match(sess, fdout, blks, fl[idx].path);
-		blkset_free(blks);
-
-		if (!c) {
-			ERRX1(sess, "blk_match");
+		t = stats_now();
+		c = blk_match_step(sess, fdout, bm);
+		sess->stats.match += stats_now() - t;
+		if (c < 0) {
+			ERRX1(sess, "blk_match_step");
 			goto out;
+		} else if (c == 0) {
+			blk_match_free(bm);
+			bm = NULL;
+			send_up_free(up);
+			up = NULL;
 		}
 	}
 
@@ -220,8 +490,17 @@ rsync_sender(struct sess *sess, int fdin,
 	}
 
 	LOG2(sess, "sender finished updating");
+	sess_stats_report(sess, 1);
 	rc = 1;
 out:
+	blk_match_free(bm);
+	send_up_free(up);
+	while ((up = TAILQ_FIRST(&q)) != NULL) {
+		TAILQ_REMOVE(&q, up, entries);
+		send_up_free(up);
+	}
+	flist_gen_free(gen);
 	flist_free(fl, flsz);
+	token_free(sess);
 	return rc;
 }
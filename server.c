@@ -71,12 +71,25 @@ rsync_server(const struct opts *opts, size_t argc, char *argv[])
 	/* Standard rsync preamble, server side. */
 
 	sess.lver = RSYNC_PROTOCOL;
-	sess.seed = arc4random();
+	sess.seed = opts->checksum_seed != 0 ?
+		opts->checksum_seed : (int32_t)arc4random();
+
+	/*
+	 * Agree to an incremental file list if the client asked for
+	 * one and we'd use it, but don't otherwise change the version
+	 * we'd send to other clients.
+	 */
+
+	sess.inc_flist = opts->inc_recursive &&
+		opts->recursive && !opts->del;
+	sess.xxh = opts->xxh && !opts->checksum_md4;
 
 	if (!io_read_int(&sess, fdin, &sess.rver)) {
 		ERRX1(&sess, "io_read_int");
 		goto out;
-	} else if (!io_write_int(&sess, fdout, sess.lver)) {
+	} else if (!io_write_int(&sess, fdout, sess.lver |
+	    (sess.inc_flist ? RSYNC_CAP_INC_FLIST << RSYNC_CAP_SHIFT : 0) |
+	    (sess.xxh ? RSYNC_CAP_XXH << RSYNC_CAP_SHIFT : 0))) {
 		ERRX1(&sess, "io_write_int");
 		goto out;
 	} else if (!io_write_int(&sess, fdout, sess.seed)) {
@@ -95,8 +108,8 @@ rsync_server(const struct opts *opts, size_t argc, char *argv[])
 	}
 
 	LOG2(&sess, "server detected client version %" PRId32
-		", server version %" PRId32 ", seed %" PRId32,
-		sess.rver, sess.lver, sess.seed);
+		", server version %" PRId32 ", seed %" PRId32 ", %s",
+		sess.rver, sess.lver, sess.seed, sess.xxh ? "XXH64" : "MD4");
 
 	if (sess.opts->sender) {
 		LOG2(&sess, "server starting sender");
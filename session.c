@@ -17,12 +17,27 @@
 #include <sys/param.h>
 
 #include <assert.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "extern.h"
 
+/*
+ * What each of the --streams tells the parent when it's done.
+ */
+struct	streamstats {
+	struct stats	 stats;
+	uint64_t	 total_read;
+	uint64_t	 total_size;
+	uint64_t	 total_write;
+};
+
 /*
  * Accept how much we've read, written, and file-size, and print them in
  * a human-readable fashion (with GB, MB, etc. prefixes).
@@ -144,6 +159,11 @@ sess_stats_recv(struct sess *sess, int fd)
 	if (sess->opts->server || sess->opts->verbose == 0)
 		return 1;
 
+	/* Batches (--read-batch) end before the statistics. */
+
+	if (sess->opts->read_batch != NULL)
+		return 1;
+
 	if (!io_read_ulong(sess, fd, &tw)) {
 		ERRX1(sess, "io_read_ulong");
 		return 0;
@@ -158,3 +178,210 @@ sess_stats_recv(struct sess *sess, int fd)
 	stats_log(sess, tr, tw, ts);
 	return 1;
 }
+
+/*
+ * Nanoseconds on the monotonic clock, for timing the stages of the
+ * transfer in struct stats.
+ * Returns zero if the clock can't be read.
+ */
+uint64_t
+stats_now(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Read the statistics of one of the --streams from "fd" and add them to
+ * our own, which are otherwise only the elapsed time.
+ * Each stream has the whole file list, so count that only once.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+sess_stats_merge(struct sess *sess, int fd)
+{
+	struct streamstats	 ss;
+	struct stats		*st = &sess->stats;
+	ssize_t			 ssz;
+
+	if ((ssz = read(fd, &ss, sizeof(ss))) == -1) {
+		ERR(sess, "read");
+		return 0;
+	} else if (ssz == 0) {
+		return 1;
+	} else if ((size_t)ssz != sizeof(ss)) {
+		ERRX(sess, "short read");
+		return 0;
+	}
+
+	if (st->files < ss.stats.files)
+		st->files = ss.stats.files;
+	if (sess->total_size < ss.total_size)
+		sess->total_size = ss.total_size;
+	st->flist_gen += ss.stats.flist_gen;
+	st->flist_xfer += ss.stats.flist_xfer;
+	st->sign += ss.stats.sign;
+	st->match += ss.stats.match;
+	st->write += ss.stats.write;
+	st->rename += ss.stats.rename;
+	st->del += ss.stats.del;
+	st->files_xfer += ss.stats.files_xfer;
+	st->files_del += ss.stats.files_del;
+	st->literal += ss.stats.literal;
+	st->matched += ss.stats.matched;
+	sess->total_read += ss.total_read;
+	sess->total_write += ss.total_write;
+	return 1;
+}
+
+/*
+ * Pass our final statistics to the parent of --streams, which it reads
+ * with sess_stats_merge().
+ * This is well under PIPE_BUF, so is written at once.
+ */
+static void
+stats_stream(struct sess *sess)
+{
+	struct streamstats	 ss;
+
+	memset(&ss, 0, sizeof(ss));
+	ss.stats = sess->stats;
+	ss.total_read = sess->total_read;
+	ss.total_size = sess->total_size;
+	ss.total_write = sess->total_write;
+	if (write(sess->opts->stream_fd, &ss, sizeof(ss)) == -1)
+		WARN(sess, "write");
+}
+
+/*
+ * Print our own counters and timers if we're the client with --stats,
+ * either as a final report or (if "final" is zero) a progress line.
+ * With --stats-json, both are a single JSON object on a line of
+ * standard output, otherwise they're logged.
+ * One of --streams instead passes its final statistics to the parent,
+ * which prints them for all of the streams.
+ */
+void
+sess_stats_report(struct sess *sess, int final)
+{
+	const struct stats *st = &sess->stats;
+	uint64_t	 now;
+	double		 el, rate;
+
+	if (sess->opts->server || !sess->opts->stats)
+		return;
+
+	if (sess->opts->streams > 0) {
+		if (final)
+			stats_stream(sess);
+		return;
+	}
+
+	now = stats_now();
+	el = (now - st->start) / 1e9;
+	rate = el > 0.0 ?
+		(sess->total_read + sess->total_write) / el : 0.0;
+
+	if (sess->opts->stats_json) {
+		printf("{\"final\": %s, "
+		    "\"elapsed\": %.3f, "
+		    "\"files\": %" PRIu64 ", "
+		    "\"files_xfer\": %" PRIu64 ", "
+		    "\"files_del\": %" PRIu64 ", "
+		    "\"total_size\": %" PRIu64 ", "
+		    "\"bytes_read\": %" PRIu64 ", "
+		    "\"bytes_written\": %" PRIu64 ", "
+		    "\"literal\": %" PRIu64 ", "
+		    "\"matched\": %" PRIu64 ", "
+		    "\"flist_gen\": %.3f, "
+		    "\"flist_xfer\": %.3f, "
+		    "\"sign\": %.3f, "
+		    "\"match\": %.3f, "
+		    "\"write\": %.3f, "
+		    "\"rename\": %.3f, "
+		    "\"delete\": %.3f}\n",
+		    final ? "true" : "false", el,
+		    st->files, st->files_xfer, st->files_del,
+		    sess->total_size, sess->total_read,
+		    sess->total_write, st->literal, st->matched,
+		    st->flist_gen / 1e9, st->flist_xfer / 1e9,
+		    st->sign / 1e9, st->match / 1e9, st->write / 1e9,
+		    st->rename / 1e9, st->del / 1e9);
+		fflush(stdout);
+		return;
+	}
+
+	if (!final) {
+		LOG0(sess, "%.1f s: %" PRIu64 " B sent, %" PRIu64
+		    " B read (%.0f B/s), %" PRIu64 "/%" PRIu64 " files, "
+		    "%" PRIu64 " B literal, %" PRIu64 " B matched",
+		    el, sess->total_write, sess->total_read, rate,
+		    st->files_xfer, st->files, st->literal, st->matched);
+		return;
+	}
+
+	LOG0(sess, "Number of files: %" PRIu64, st->files);
+	LOG0(sess, "Number of files transferred: %" PRIu64,
+	    st->files_xfer);
+	LOG0(sess, "Number of files deleted: %" PRIu64, st->files_del);
+	LOG0(sess, "Total file size: %" PRIu64 " B", sess->total_size);
+	LOG0(sess, "Literal data: %" PRIu64 " B", st->literal);
+	LOG0(sess, "Matched data: %" PRIu64 " B", st->matched);
+	LOG0(sess, "Total bytes sent: %" PRIu64 " B", sess->total_write);
+	LOG0(sess, "Total bytes received: %" PRIu64 " B",
+	    sess->total_read);
+	LOG0(sess, "Elapsed time: %.3f s (%.0f B/s)", el, rate);
+	LOG0(sess, "File list generation: %.3f s", st->flist_gen / 1e9);
+	LOG0(sess, "File list transfer: %.3f s", st->flist_xfer / 1e9);
+	LOG0(sess, "Signature generation: %.3f s", st->sign / 1e9);
+	LOG0(sess, "Block matching: %.3f s", st->match / 1e9);
+	LOG0(sess, "Disc writes: %.3f s", st->write / 1e9);
+	LOG0(sess, "Renames: %.3f s", st->rename / 1e9);
+	LOG0(sess, "Deletions: %.3f s", st->del / 1e9);
+}
+
+/*
+ * Print a progress report if --stats-interval seconds have passed
+ * since the last one.
+ * Call this from each pass of an event loop.
+ */
+void
+sess_stats_tick(struct sess *sess)
+{
+	uint64_t	 now;
+
+	if (sess->opts->server || sess->opts->stats_interval == 0)
+		return;
+
+	now = stats_now();
+	if (sess->stats.last == 0)
+		sess->stats.last = sess->stats.start;
+	if (now - sess->stats.last <
+	    sess->opts->stats_interval * 1000000000ULL)
+		return;
+
+	sess_stats_report(sess, 0);
+	sess->stats.last = now;
+}
+
+/*
+ * The poll(2) timeout, in milliseconds, for an event loop that would
+ * otherwise wait indefinitely, so progress reports are made on time
+ * even when we're idle.
+ */
+int
+sess_stats_timeout(const struct sess *sess)
+{
+	uint64_t	 now, next;
+
+	if (sess->opts->server || sess->opts->stats_interval == 0)
+		return INFTIM;
+
+	now = stats_now();
+	next = (sess->stats.last ? sess->stats.last : sess->stats.start) +
+	    sess->opts->stats_interval * 1000000000ULL;
+	return next > now ? (int)((next - now) / 1000000) + 1 : 0;
+}
@@ -0,0 +1,778 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * The signature cache (--sig-cache) keeps the block checksums of files
+ * we've received, keyed on their device, inode, size, and modification
+ * and status change times (to the nanosecond), so they needn't be read
+ * and hashed again when next signed.
+ * Long checksums depend on the session's seed and hash (MD4 or XXH64),
+ * so the cache is only used when these are what they were when written,
+ * which is to say when the seed is fixed with --checksum-seed.
+ *
+ * On disc, all little-endian, there's a header, then fixed-size entries
+ * sorted by device and inode, then each entry's blocks:
+ *
+ *   header: magic (8 bytes), version (4), seed (4), entries (8),
+ *           hash (4, non-zero for XXH64), unused (4)
+ *   entry: device (8), inode (8), size (8), mtime (8), ctime (8),
+ *          mtime nanoseconds (4), ctime nanoseconds (4),
+ *          block length (4), blocks (4), offset of blocks (8)
+ *   block: short checksum (4), long checksum (16)
+ *
+ * The header and entries are read up front, a file's blocks only when
+ * it's signed.
+ * When the receiver's done, the cache is written anew with the entries
+ * of files the uploader found unchanged, and those of files received.
+ * If the session fails, it's written without the entries we used, as
+ * one of those might be why.
+ */
+#define	SIGCACHE_MAGIC		"ORSYNCSC"
+#define	SIGCACHE_VERSION	3
+#define	SIGCACHE_HDR		32
+#define	SIGCACHE_ENT		64
+#define	SIGCACHE_BLK		(4 + CSUM_LENGTH_PHASE2)
+
+struct	sigent {
+	uint64_t	 dev; /* device of file */
+	uint64_t	 ino; /* inode of file */
+	int64_t		 size; /* size of file */
+	int64_t		 mtime; /* modification time of file */
+	int64_t		 ctime; /* status change time of file */
+	uint32_t	 mtimensec; /* nanoseconds of mtime */
+	uint32_t	 ctimensec; /* nanoseconds of ctime */
+	uint32_t	 len; /* block length */
+	uint32_t	 blksz; /* number of blocks */
+	uint64_t	 offs; /* offset of blocks in old cache */
+	unsigned char	*blks; /* blocks (if new) or NULL */
+	int		 keep; /* write out again */
+	int		 used; /* given to the uploader */
+};
+
+struct	sigcache {
+	char		*path; /* cache file */
+	char		*tmp; /* new cache file or NULL */
+	int		 fd; /* old cache or -1 */
+	int		 tmpfd; /* new cache or -1 */
+	struct sigent	*ents; /* entries of old cache */
+	size_t		 entsz; /* number of ents */
+	struct sigent	*nents; /* entries of received files */
+	size_t		 nentsz; /* number of nents */
+	size_t		 nentmax; /* allocated nents */
+};
+
+/*
+ * Signature of a file being received, built up as it's written.
+ */
+struct	sigbuild {
+	struct blkset	 set; /* layout of blocks */
+	unsigned char	*buf; /* partial block */
+	size_t		 bufsz; /* bytes in buf */
+	unsigned char	*blks; /* blocks so far */
+	size_t		 idx; /* number of blocks so far */
+	off_t		 total; /* bytes so far */
+};
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	uint32_t	 v;
+
+	memcpy(&v, p, sizeof(uint32_t));
+	return le32toh(v);
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+	uint64_t	 v;
+
+	memcpy(&v, p, sizeof(uint64_t));
+	return le64toh(v);
+}
+
+static void
+put32(unsigned char *p, uint32_t v)
+{
+
+	v = htole32(v);
+	memcpy(p, &v, sizeof(uint32_t));
+}
+
+static void
+put64(unsigned char *p, uint64_t v)
+{
+
+	v = htole64(v);
+	memcpy(p, &v, sizeof(uint64_t));
+}
+
+static int
+sigent_cmp(const void *a, const void *b)
+{
+	const struct sigent *e1 = a, *e2 = b;
+
+	if (e1->dev != e2->dev)
+		return e1->dev < e2->dev ? -1 : 1;
+	if (e1->ino != e2->ino)
+		return e1->ino < e2->ino ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Fill in the key of "e" from "st" (all but the device and inode).
+ */
+static void
+sigent_key(struct sigent *e, const struct stat *st)
+{
+
+	e->size = st->st_size;
+	e->mtime = st->st_mtime;
+	e->ctime = st->st_ctime;
+	e->mtimensec = st->st_mtim.tv_nsec;
+	e->ctimensec = st->st_ctim.tv_nsec;
+}
+
+/*
+ * Look up the entry of the old cache for "st", if any and if it's still
+ * of the same size, and modification and status change times.
+ */
+static struct sigent *
+sigent_find(struct sigcache *c, const struct stat *st)
+{
+	struct sigent	 key, *e;
+
+	key.dev = st->st_dev;
+	key.ino = st->st_ino;
+	sigent_key(&key, st);
+	e = bsearch(&key, c->ents, c->entsz,
+		sizeof(struct sigent), sigent_cmp);
+	if (e == NULL || e->size != key.size ||
+	    e->mtime != key.mtime || e->ctime != key.ctime ||
+	    e->mtimensec != key.mtimensec ||
+	    e->ctimensec != key.ctimensec)
+		return NULL;
+	return e;
+}
+
+/*
+ * Read the header and entries of the old cache in c->fd.
+ * It's not an error if the cache is unusable, in which case we don't
+ * read any entries.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+sigcache_read(struct sess *sess, struct sigcache *c)
+{
+	struct stat	 st;
+	unsigned char	 hdr[SIGCACHE_HDR], *buf = NULL;
+	uint64_t	 n;
+	size_t		 i;
+	ssize_t		 ssz;
+	struct sigent	*e;
+
+	if (fstat(c->fd, &st) == -1) {
+		ERR(sess, "%s: fstat", c->path);
+		return 0;
+	}
+	if ((ssz = pread(c->fd, hdr, sizeof(hdr), 0)) == -1) {
+		ERR(sess, "%s: pread", c->path);
+		return 0;
+	} else if (ssz != sizeof(hdr) ||
+	    memcmp(hdr, SIGCACHE_MAGIC, 8) ||
+	    get32(hdr + 8) != SIGCACHE_VERSION) {
+		WARNX(sess, "%s: not a signature cache: ignoring", c->path);
+		return 1;
+	} else if ((int32_t)get32(hdr + 12) != sess->seed) {
+		LOG2(sess, "%s: signature cache has another "
+			"checksum seed: ignoring", c->path);
+		return 1;
+	} else if ((get32(hdr + 24) != 0) != (sess->xxh != 0)) {
+		LOG2(sess, "%s: signature cache has another "
+			"hash: ignoring", c->path);
+		return 1;
+	}
+
+	n = get64(hdr + 16);
+	if (n > (uint64_t)(st.st_size - SIGCACHE_HDR) / SIGCACHE_ENT) {
+		WARNX(sess, "%s: signature cache truncated: "
+			"ignoring", c->path);
+		return 1;
+	} else if (n == 0)
+		return 1;
+
+	if ((buf = malloc(n * SIGCACHE_ENT)) == NULL) {
+		ERR(sess, "malloc");
+		return 0;
+	} else if ((c->ents = calloc(n, sizeof(struct sigent))) == NULL) {
+		ERR(sess, "calloc");
+		free(buf);
+		return 0;
+	}
+	if ((ssz = pread(c->fd, buf,
+	    n * SIGCACHE_ENT, SIGCACHE_HDR)) == -1) {
+		ERR(sess, "%s: pread", c->path);
+		free(buf);
+		return 0;
+	} else if ((size_t)ssz != n * SIGCACHE_ENT) {
+		WARNX(sess, "%s: signature cache truncated: "
+			"ignoring", c->path);
+		free(buf);
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		e = &c->ents[i];
+		e->dev = get64(buf + i * SIGCACHE_ENT);
+		e->ino = get64(buf + i * SIGCACHE_ENT + 8);
+		e->size = get64(buf + i * SIGCACHE_ENT + 16);
+		e->mtime = get64(buf + i * SIGCACHE_ENT + 24);
+		e->ctime = get64(buf + i * SIGCACHE_ENT + 32);
+		e->mtimensec = get32(buf + i * SIGCACHE_ENT + 40);
+		e->ctimensec = get32(buf + i * SIGCACHE_ENT + 44);
+		e->len = get32(buf + i * SIGCACHE_ENT + 48);
+		e->blksz = get32(buf + i * SIGCACHE_ENT + 52);
+		e->offs = get64(buf + i * SIGCACHE_ENT + 56);
+		if (e->offs > (uint64_t)st.st_size ||
+		    e->blksz > ((uint64_t)st.st_size - e->offs) /
+		     SIGCACHE_BLK ||
+		    (i > 0 && sigent_cmp(&c->ents[i - 1], e) >= 0)) {
+			WARNX(sess, "%s: signature cache corrupt: "
+				"ignoring", c->path);
+			free(buf);
+			return 1;
+		}
+	}
+
+	free(buf);
+	c->entsz = n;
+	LOG3(sess, "%s: signature cache: %zu entries", c->path, c->entsz);
+	return 1;
+}
+
+/*
+ * Open the signature cache "path", creating it if it doesn't exist.
+ * This must be called before we've restricted our view of the file
+ * system, as it makes sure we can still get at the cache.
+ * Returns NULL on failure.
+ * On success, sigcache_free() must be called with the pointer.
+ */
+struct sigcache *
+sigcache_open(struct sess *sess, const char *path)
+{
+	struct sigcache	*c;
+
+	if ((c = calloc(1, sizeof(struct sigcache))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	}
+	c->fd = c->tmpfd = -1;
+
+	if ((c->path = strdup(path)) == NULL) {
+		ERR(sess, "strdup");
+		goto out;
+	} else if (asprintf(&c->tmp, "%s.new", path) == -1) {
+		ERR(sess, "asprintf");
+		c->tmp = NULL;
+		goto out;
+	}
+
+	if ((c->fd = open(path, O_RDONLY, 0)) == -1 && errno != ENOENT) {
+		ERR(sess, "%s: open", path);
+		goto out;
+	} else if (c->fd != -1 && !sigcache_read(sess, c)) {
+		ERRX1(sess, "sigcache_read");
+		goto out;
+	}
+
+	c->tmpfd = open(c->tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (c->tmpfd == -1) {
+		ERR(sess, "%s: open", c->tmp);
+		goto out;
+	}
+
+	if (unveil(c->path, "rwc") == -1) {
+		ERR(sess, "%s: unveil", c->path);
+		goto out;
+	} else if (unveil(c->tmp, "rwc") == -1) {
+		ERR(sess, "%s: unveil", c->tmp);
+		goto out;
+	}
+	return c;
+out:
+	sigcache_free(c);
+	return NULL;
+}
+
+/*
+ * Fill in the block set "set" for the file "st" from the cache, with
+ * the block length it had when cached (unless that's not what was asked
+ * for with --block-size).
+ * The blocks are allocated and must be freed by the caller.
+ * Returns <0 on failure, 0 if the file isn't in the cache, >0 if it is.
+ */
+int
+sigcache_get(struct sess *sess, struct sigcache *c,
+	const struct stat *st, struct blkset *set)
+{
+	struct sigent	*e;
+	unsigned char	*buf, *p;
+	size_t		 i, sz;
+	ssize_t		 ssz;
+
+	if ((e = sigent_find(c, st)) == NULL || e->len == 0 ||
+	    (sess->opts->block_size > 0 &&
+	     e->len != sess->opts->block_size))
+		return 0;
+
+	blkset_init(set, st->st_size, e->len);
+	if (e->blksz != set->blksz)
+		return 0;
+
+	sz = (size_t)e->blksz * SIGCACHE_BLK;
+	if ((buf = malloc(sz)) == NULL) {
+		ERR(sess, "malloc");
+		return -1;
+	} else if ((ssz = pread(c->fd, buf, sz, e->offs)) == -1) {
+		ERR(sess, "%s: pread", c->path);
+		free(buf);
+		return -1;
+	} else if ((size_t)ssz != sz) {
+		ERRX(sess, "%s: short read", c->path);
+		free(buf);
+		return -1;
+	} else if ((set->blks = calloc(set->blksz,
+	    sizeof(struct blk))) == NULL) {
+		ERR(sess, "calloc");
+		free(buf);
+		return -1;
+	}
+
+	for (i = 0; i < set->blksz; i++) {
+		p = buf + i * SIGCACHE_BLK;
+		set->blks[i].idx = i;
+		set->blks[i].offs = (off_t)i * set->len;
+		set->blks[i].len = i < set->blksz - 1 || set->rem == 0 ?
+			set->len : set->rem;
+		set->blks[i].chksum_short = get32(p);
+		memcpy(set->blks[i].chksum_long, p + 4, CSUM_LENGTH_PHASE2);
+	}
+
+	free(buf);
+	e->keep = e->used = 1;
+	return 1;
+}
+
+/*
+ * Keep the entry of the file "st" when the cache is written out, if
+ * it's still valid, as that file hasn't been touched.
+ */
+void
+sigcache_keep(struct sigcache *c, const struct stat *st)
+{
+	struct sigent	*e;
+
+	if ((e = sigent_find(c, st)) != NULL)
+		e->keep = 1;
+}
+
+/*
+ * Don't write out the entry of the file "st" again, as its signature
+ * wasn't what the sender's file hash said.
+ */
+void
+sigcache_drop(struct sigcache *c, const struct stat *st)
+{
+	struct sigent	*e;
+
+	if ((e = sigent_find(c, st)) != NULL)
+		e->keep = 0;
+}
+
+/*
+ * Start building the signature of a file of "size" bytes as it's
+ * received, with the blocks it'll have when next signed.
+ * Returns NULL on failure.
+ * On success, sigcache_build_free() must be called with the pointer.
+ */
+struct sigbuild *
+sigcache_build_alloc(struct sess *sess, off_t size)
+{
+	struct sigbuild	*b;
+
+	if ((b = calloc(1, sizeof(struct sigbuild))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	}
+
+	blkset_init(&b->set, size, blkset_len(sess, size));
+	if ((b->buf = malloc(b->set.len)) == NULL) {
+		ERR(sess, "malloc");
+		free(b);
+		return NULL;
+	}
+	b->blks = reallocarray(NULL, b->set.blksz, SIGCACHE_BLK);
+	if (b->blks == NULL) {
+		ERR(sess, "reallocarray");
+		free(b->buf);
+		free(b);
+		return NULL;
+	}
+	return b;
+}
+
+/*
+ * Sign the block "buf" of "sz" bytes as the next one.
+ */
+static void
+sigcache_build_blk(struct sess *sess,
+	struct sigbuild *b, const void *buf, size_t sz)
+{
+	unsigned char	*p;
+
+	assert(b->idx < b->set.blksz);
+	p = b->blks + b->idx * SIGCACHE_BLK;
+	put32(p, hash_fast(buf, sz));
+	hash_slow(buf, sz, p + 4, sess);
+	b->idx++;
+}
+
+/*
+ * Add the next "sz" bytes of the file, "buf", to its signature,
+ * signing each full block.
+ */
+void
+sigcache_build_add(struct sess *sess,
+	struct sigbuild *b, const void *buf, size_t sz)
+{
+	const unsigned char *p = buf;
+	size_t		 n;
+
+	if (b->total + (off_t)sz > b->set.size) {
+		/* Not what the file list said: give up. */
+		b->total = b->set.size + 1;
+		return;
+	}
+	b->total += sz;
+
+	while (sz > 0) {
+		if (b->bufsz == 0 && sz >= b->set.len) {
+			sigcache_build_blk(sess, b, p, b->set.len);
+			p += b->set.len;
+			sz -= b->set.len;
+			continue;
+		}
+		n = b->set.len - b->bufsz;
+		if (n > sz)
+			n = sz;
+		memcpy(b->buf + b->bufsz, p, n);
+		b->bufsz += n;
+		p += n;
+		sz -= n;
+		if (b->bufsz == b->set.len) {
+			sigcache_build_blk(sess, b, b->buf, b->bufsz);
+			b->bufsz = 0;
+		}
+	}
+}
+
+/*
+ * Finish the signature "b" of the received file, now "st", and add it
+ * to the cache.
+ * If we weren't given the whole file, it's discarded.
+ * Either way, "b" is freed.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+sigcache_build_put(struct sess *sess, struct sigcache *c,
+	struct sigbuild *b, const struct stat *st)
+{
+	struct sigent	*e;
+	void		*pp;
+	size_t		 max;
+
+	if (b->bufsz > 0 && b->total == b->set.size) {
+		sigcache_build_blk(sess, b, b->buf, b->bufsz);
+		b->bufsz = 0;
+	}
+	if (b->total != b->set.size || b->idx != b->set.blksz ||
+	    st->st_size != b->set.size) {
+		sigcache_build_free(b);
+		return 1;
+	}
+
+	if (c->nentsz == c->nentmax) {
+		max = c->nentmax ? c->nentmax * 2 : 64;
+		pp = reallocarray(c->nents, max, sizeof(struct sigent));
+		if (pp == NULL) {
+			ERR(sess, "reallocarray");
+			sigcache_build_free(b);
+			return 0;
+		}
+		c->nents = pp;
+		c->nentmax = max;
+	}
+
+	e = &c->nents[c->nentsz++];
+	memset(e, 0, sizeof(struct sigent));
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	sigent_key(e, st);
+	e->len = b->set.len;
+	e->blksz = b->set.blksz;
+	e->blks = b->blks;
+	e->keep = 1;
+	b->blks = NULL;
+	sigcache_build_free(b);
+	return 1;
+}
+
+/*
+ * Free a signature being built.
+ * Passing a NULL to this function is ok.
+ */
+void
+sigcache_build_free(struct sigbuild *b)
+{
+
+	if (b == NULL)
+		return;
+	free(b->buf);
+	free(b->blks);
+	free(b);
+}
+
+/*
+ * Write out the blocks of entry "e" to the new cache.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+sigcache_write_blks(struct sess *sess,
+	struct sigcache *c, const struct sigent *e)
+{
+	unsigned char	 buf[64 * SIGCACHE_BLK];
+	const unsigned char *p;
+	size_t		 sz, left;
+	ssize_t		 ssz;
+	uint64_t	 offs = e->offs;
+
+	left = (size_t)e->blksz * SIGCACHE_BLK;
+	p = e->blks;
+	while (left > 0) {
+		sz = left < sizeof(buf) ? left : sizeof(buf);
+		if (e->blks == NULL) {
+			if ((ssz = pread(c->fd, buf, sz, offs)) == -1) {
+				ERR(sess, "%s: pread", c->path);
+				return 0;
+			} else if ((size_t)ssz != sz) {
+				ERRX(sess, "%s: short read", c->path);
+				return 0;
+			}
+			p = buf;
+			offs += sz;
+		}
+		if ((ssz = write(c->tmpfd, p, sz)) == -1) {
+			ERR(sess, "%s: write", c->tmp);
+			return 0;
+		} else if ((size_t)ssz != sz) {
+			ERRX(sess, "%s: short write", c->tmp);
+			return 0;
+		}
+		if (e->blks != NULL)
+			p += sz;
+		left -= sz;
+	}
+	return 1;
+}
+
+/*
+ * Write out the new cache and move it into place.
+ * The header goes last, so a cache that's only partly written is
+ * ignored when next read.
+ * The cache is still to be freed with sigcache_free().
+ * Returns zero on failure, non-zero on success.
+ */
+int
+sigcache_close(struct sess *sess, struct sigcache *c)
+{
+	struct sigent	**ents = NULL, *e;
+	unsigned char	 *buf = NULL, *p, hdr[SIGCACHE_HDR];
+	size_t		  i, j, n = 0;
+	uint64_t	  offs;
+	int		  rc = 0;
+
+	assert(c->tmp != NULL);
+
+	/*
+	 * Merge the entries we're keeping from the old cache with the
+	 * new ones, which replace old ones of the same inode.
+	 */
+
+	qsort(c->nents, c->nentsz, sizeof(struct sigent), sigent_cmp);
+	ents = reallocarray(NULL, c->entsz + c->nentsz + 1,
+		sizeof(struct sigent *));
+	if (ents == NULL) {
+		ERR(sess, "reallocarray");
+		goto out;
+	}
+	for (i = j = 0; i < c->entsz || j < c->nentsz; ) {
+		if (j == c->nentsz ||
+		    (i < c->entsz &&
+		     sigent_cmp(&c->ents[i], &c->nents[j]) < 0)) {
+			if (c->ents[i].keep)
+				ents[n++] = &c->ents[i];
+			i++;
+			continue;
+		}
+		if (i < c->entsz &&
+		    sigent_cmp(&c->ents[i], &c->nents[j]) == 0)
+			i++;
+		/* Only keep the last of the same inode received. */
+		if (j + 1 == c->nentsz ||
+		    sigent_cmp(&c->nents[j], &c->nents[j + 1]))
+			ents[n++] = &c->nents[j];
+		j++;
+	}
+
+	if ((buf = calloc(n + 1, SIGCACHE_ENT)) == NULL) {
+		ERR(sess, "calloc");
+		goto out;
+	} else if (lseek(c->tmpfd,
+	    SIGCACHE_HDR + n * SIGCACHE_ENT, SEEK_SET) == -1) {
+		ERR(sess, "%s: lseek", c->tmp);
+		goto out;
+	}
+
+	offs = SIGCACHE_HDR + n * SIGCACHE_ENT;
+	for (i = 0; i < n; i++) {
+		e = ents[i];
+		if (!sigcache_write_blks(sess, c, e)) {
+			ERRX1(sess, "sigcache_write_blks");
+			goto out;
+		}
+		p = buf + i * SIGCACHE_ENT;
+		put64(p, e->dev);
+		put64(p + 8, e->ino);
+		put64(p + 16, e->size);
+		put64(p + 24, e->mtime);
+		put64(p + 32, e->ctime);
+		put32(p + 40, e->mtimensec);
+		put32(p + 44, e->ctimensec);
+		put32(p + 48, e->len);
+		put32(p + 52, e->blksz);
+		put64(p + 56, offs);
+		offs += (uint64_t)e->blksz * SIGCACHE_BLK;
+	}
+
+	memcpy(hdr, SIGCACHE_MAGIC, 8);
+	put32(hdr + 8, SIGCACHE_VERSION);
+	put32(hdr + 12, sess->seed);
+	put64(hdr + 16, n);
+	put32(hdr + 24, sess->xxh != 0);
+	put32(hdr + 28, 0);
+
+	if (pwrite(c->tmpfd, buf, n * SIGCACHE_ENT,
+	    SIGCACHE_HDR) != (ssize_t)(n * SIGCACHE_ENT)) {
+		ERR(sess, "%s: pwrite", c->tmp);
+		goto out;
+	} else if (pwrite(c->tmpfd, hdr, sizeof(hdr), 0) !=
+	    sizeof(hdr)) {
+		ERR(sess, "%s: pwrite", c->tmp);
+		goto out;
+	} else if (close(c->tmpfd) == -1) {
+		c->tmpfd = -1;
+		ERR(sess, "%s: close", c->tmp);
+		goto out;
+	}
+	c->tmpfd = -1;
+
+	if (rename(c->tmp, c->path) == -1) {
+		ERR(sess, "%s: rename: %s", c->tmp, c->path);
+		goto out;
+	}
+	free(c->tmp);
+	c->tmp = NULL;
+
+	LOG3(sess, "%s: signature cache: wrote %zu entries", c->path, n);
+	rc = 1;
+out:
+	free(ents);
+	free(buf);
+	return rc;
+}
+
+/*
+ * The session failed, so write out the cache with the entries of the
+ * old cache other than those we used, as any of them might be why.
+ * If that fails too, remove the cache altogether.
+ * Does nothing if the cache has already been written out.
+ */
+void
+sigcache_fail(struct sess *sess, struct sigcache *c)
+{
+	size_t	 i;
+
+	if (c == NULL || c->tmp == NULL)
+		return;
+	for (i = 0; i < c->entsz; i++)
+		c->ents[i].keep = !c->ents[i].used;
+	if (sigcache_close(sess, c))
+		return;
+	ERRX1(sess, "sigcache_close");
+	if (unlink(c->path) == -1 && errno != ENOENT)
+		ERR(sess, "%s: unlink", c->path);
+}
+
+/*
+ * Free the cache, removing the new cache if it wasn't written out.
+ * Passing a NULL to this function is ok.
+ */
+void
+sigcache_free(struct sigcache *c)
+{
+	size_t	 i;
+
+	if (c == NULL)
+		return;
+	if (c->fd != -1)
+		close(c->fd);
+	if (c->tmpfd != -1)
+		close(c->tmpfd);
+	if (c->tmp != NULL)
+		unlink(c->tmp);
+	for (i = 0; i < c->nentsz; i++)
+		free(c->nents[i].blks);
+	free(c->nents);
+	free(c->ents);
+	free(c->path);
+	free(c->tmp);
+	free(c);
+}
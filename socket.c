@@ -248,6 +248,7 @@ rsync_socket(const struct opts *opts, const struct fargs *f)
 	memset(&sess, 0, sizeof(struct sess));
 	sess.lver = RSYNC_PROTOCOL;
 	sess.opts = opts;
+	sess.stats.start = stats_now();
 
 	assert(f->host != NULL);
 	assert(f->module != NULL);
@@ -0,0 +1,617 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "extern.h"
+
+/*
+ * The stream of literal data and block tokens for a file.
+ * Without -z, each is an integer: a positive length followed by that
+ * much data, a negative block index, or zero at the end.
+ * With -z, we use rsync's compressed format, which is a byte of flags
+ * per element: the data is deflated into one stream per file, with
+ * each run of data ending in a sync flush (less its trailing 00 00 ff
+ * ff); matched blocks are added to the stream's history on both sides
+ * without being sent; and runs of consecutive blocks are sent as one.
+ */
+#define	TOKEN_END	0x00 /* end of file */
+#define	TOKEN_LONG	0x20 /* followed by 32-bit token */
+#define	TOKENRUN_LONG	0x21 /* same, then 16-bit run count */
+#define	TOKEN_DATA	0x40 /* + 6-bit high length, then low byte */
+#define	TOKEN_REL	0x80 /* + 6-bit token relative to last run */
+#define	TOKENRUN_REL	0xc0 /* same, then 16-bit run count */
+
+/*
+ * The most deflated data in one element, fitting in 14 bits.
+ */
+#define	TOKEN_DATA_MAX	(16383)
+
+/*
+ * Matched blocks are added to the history in pieces of at most this
+ * size, each preceded by a fake stored block header on the receiver.
+ * In protocols before 31, both sides re-add a block's first piece for
+ * each following one, rather than moving on: we must do the same.
+ */
+#define	TOKEN_SEE_MAX	(0xffff)
+
+enum	tokenrx {
+	TOKENRX_INIT = 0, /* start of file */
+	TOKENRX_IDLE, /* waiting for an element */
+	TOKENRX_INFLATING, /* inflating a data element */
+	TOKENRX_INFLATED, /* data element consumed */
+	TOKENRX_RUNNING /* returning a run of tokens */
+};
+
+/*
+ * Compression state for both directions, kept across files so that
+ * the streams needn't be reallocated but reset for each.
+ */
+struct	token {
+	int		 txinit; /* tx is initialised */
+	z_stream	 tx; /* deflating sent data */
+	int32_t		 txlast; /* last token, -1 at start, -2 data */
+	int32_t		 txrun; /* first token of current run */
+	int32_t		 txrunend; /* last token of last run sent */
+	int		 txflush; /* data to be flushed */
+	unsigned char	 txbuf[TOKEN_DATA_MAX + 2]; /* header, data */
+	int		 rxinit; /* rx is initialised */
+	z_stream	 rx; /* inflating received data */
+	enum tokenrx	 rxstate; /* where we are in the stream */
+	int32_t		 rxtok; /* last token read */
+	int32_t		 rxrun; /* tokens left in run */
+	int		 rxflag; /* flags read ahead, or -1 */
+	unsigned char	 rxbuf[TOKEN_DATA_MAX]; /* deflated data */
+	unsigned char	 rxout[MAX_CHUNK]; /* inflated data */
+};
+
+/*
+ * Get our compression state, allocating it if needed.
+ * Returns NULL on failure.
+ */
+static struct token *
+token_get(struct sess *sess)
+{
+
+	if (sess->token != NULL)
+		return sess->token;
+	if ((sess->token = calloc(1, sizeof(struct token))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	}
+	sess->token->txlast = -1;
+	sess->token->rxflag = -1;
+	return sess->token;
+}
+
+/*
+ * Free compression state, if any.
+ */
+void
+token_free(struct sess *sess)
+{
+
+	if (sess->token == NULL)
+		return;
+	if (sess->token->txinit)
+		deflateEnd(&sess->token->tx);
+	if (sess->token->rxinit)
+		inflateEnd(&sess->token->rx);
+	free(sess->token);
+	sess->token = NULL;
+}
+
+/*
+ * Whether we've received data that's been read past by our caller,
+ * i.e., there's more to get with token_recv() without polling.
+ */
+int
+token_buffered(const struct sess *sess)
+{
+	const struct token *t = sess->token;
+
+	if (t == NULL)
+		return 0;
+	return t->rxstate == TOKENRX_INFLATING ||
+		t->rxstate == TOKENRX_RUNNING ||
+		t->rxflag != -1;
+}
+
+/*
+ * Deflate "sz" bytes of "buf" (which may be zero bytes) on the way to
+ * token "tok", sending out whatever the compressor gives us.
+ * If "tok" isn't -2, there's no more data before the token, so flush
+ * the compressor, trimming the 00 00 ff ff at the end: the receiver
+ * adds it back.
+ * Being flushed also readies the history for matched blocks.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+token_deflate(struct sess *sess, int fd, struct token *t,
+	const void *buf, size_t sz, int32_t tok)
+{
+	const unsigned char *cp = buf;
+	size_t		 n;
+	int		 flush = Z_NO_FLUSH, c;
+
+	t->tx.avail_in = 0;
+	t->tx.avail_out = 0;
+
+	do {
+		if (t->tx.avail_in == 0 && sz > 0) {
+			n = sz < MAX_CHUNK ? sz : MAX_CHUNK;
+			t->tx.next_in = (Bytef *)cp;
+			t->tx.avail_in = n;
+			cp += n;
+			sz -= n;
+		}
+
+		/*
+		 * When flushing, we hold back the last four bytes of a
+		 * full buffer in case they're the end of the flush.
+		 * Move them to the start of the next.
+		 */
+
+		if (t->tx.avail_out == 0) {
+			t->tx.next_out = t->txbuf + 2;
+			t->tx.avail_out = TOKEN_DATA_MAX;
+			if (flush != Z_NO_FLUSH) {
+				memcpy(t->tx.next_out,
+					t->txbuf + 2 + TOKEN_DATA_MAX - 4, 4);
+				t->tx.next_out += 4;
+				t->tx.avail_out -= 4;
+			}
+		}
+
+		if (sz == 0 && tok != -2)
+			flush = Z_SYNC_FLUSH;
+		if ((c = deflate(&t->tx, flush)) != Z_OK) {
+			ERRX(sess, "deflate: %d", c);
+			return 0;
+		}
+
+		if (sz == 0 || t->tx.avail_out == 0) {
+			n = TOKEN_DATA_MAX - t->tx.avail_out;
+			if (flush != Z_NO_FLUSH) {
+				assert(n >= 4);
+				n -= 4;
+			}
+			if (n > 0) {
+				t->txbuf[0] = TOKEN_DATA + (n >> 8);
+				t->txbuf[1] = n & 0xff;
+				if (!io_write_buf(sess, fd, t->txbuf, n + 2)) {
+					ERRX1(sess, "io_write_buf");
+					return 0;
+				}
+			}
+		}
+	} while (sz > 0 || t->tx.avail_out == 0);
+
+	return 1;
+}
+
+/*
+ * Account for token "tok" (-1 at the end of file, -2 for data alone)
+ * in the compressed stream, which tells us whether the last run of
+ * tokens is over and must be sent.
+ * If "data" is set, data comes before the token.
+ * At the start of a file, this also (re)starts the compressor.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+token_run(struct sess *sess, int fd, struct token *t, int32_t tok, int data)
+{
+	int32_t		 r, n;
+	int		 c;
+
+	if (t->txlast == -1) {
+		if (!t->txinit) {
+			c = deflateInit2(&t->tx, Z_DEFAULT_COMPRESSION,
+				Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+			if (c != Z_OK) {
+				ERRX(sess, "deflateInit2: %d", c);
+				return 0;
+			}
+			t->txinit = 1;
+		} else if ((c = deflateReset(&t->tx)) != Z_OK) {
+			ERRX(sess, "deflateReset: %d", c);
+			return 0;
+		}
+		t->txrunend = 0;
+		t->txrun = tok;
+		t->txflush = 0;
+	} else if (t->txlast == -2) {
+		t->txrun = tok;
+	} else if (data || tok != t->txlast + 1 ||
+	    tok >= t->txrun + 65536) {
+		r = t->txrun - t->txrunend;
+		n = t->txlast - t->txrun;
+		if (r >= 0 && r <= 63) {
+			c = io_write_byte(sess, fd,
+				(n == 0 ? TOKEN_REL : TOKENRUN_REL) + r);
+		} else {
+			c = io_write_byte(sess, fd,
+				n == 0 ? TOKEN_LONG : TOKENRUN_LONG) &&
+			    io_write_int(sess, fd, t->txrun);
+		}
+		if (c && n != 0)
+			c = io_write_byte(sess, fd, n & 0xff) &&
+			    io_write_byte(sess, fd, (n >> 8) & 0xff);
+		if (!c) {
+			ERRX1(sess, "io_write");
+			return 0;
+		}
+		t->txrunend = t->txlast;
+		t->txrun = tok;
+	}
+
+	t->txlast = tok;
+	return 1;
+}
+
+/*
+ * Send "sz" bytes of literal data in "buf".
+ * Returns zero on failure, non-zero on success.
+ */
+int
+token_send_data(struct sess *sess, int fd, const void *buf, size_t sz)
+{
+	struct token	*t;
+
+	assert(sz > 0);
+
+	if (!sess->opts->compress) {
+		if (!io_write_int(sess, fd, sz)) {
+			ERRX1(sess, "io_write_int");
+			return 0;
+		} else if (!io_write_buf(sess, fd, buf, sz)) {
+			ERRX1(sess, "io_write_buf");
+			return 0;
+		}
+		return 1;
+	}
+
+	if ((t = token_get(sess)) == NULL) {
+		ERRX1(sess, "token_get");
+		return 0;
+	} else if (!token_run(sess, fd, t, -2, 1)) {
+		ERRX1(sess, "token_run");
+		return 0;
+	} else if (!token_deflate(sess, fd, t, buf, sz, -2)) {
+		ERRX1(sess, "token_deflate");
+		return 0;
+	}
+	t->txflush = 1;
+	return 1;
+}
+
+/*
+ * Send a token for the block "idx", which is "sz" bytes of "buf" in
+ * our file.
+ * With -z, the block is added to the compressor's history: the
+ * receiver does the same in token_see().
+ * Returns zero on failure, non-zero on success.
+ */
+int
+token_send_block(struct sess *sess, int fd, size_t idx,
+	const void *buf, size_t sz)
+{
+	struct token	*t;
+	size_t		 n;
+	int		 c;
+
+	if (!sess->opts->compress) {
+		if (!io_write_int(sess, fd, -(int32_t)(idx + 1))) {
+			ERRX1(sess, "io_write_int");
+			return 0;
+		}
+		return 1;
+	}
+
+	if ((t = token_get(sess)) == NULL) {
+		ERRX1(sess, "token_get");
+		return 0;
+	} else if (!token_run(sess, fd, t, idx, 0)) {
+		ERRX1(sess, "token_run");
+		return 0;
+	} else if (t->txflush &&
+	    !token_deflate(sess, fd, t, NULL, 0, idx)) {
+		ERRX1(sess, "token_deflate");
+		return 0;
+	}
+	t->txflush = 0;
+
+	/*
+	 * Having flushed, the compressor has no input pending, so we
+	 * can add to its history as if it were a dictionary.
+	 * See TOKEN_SEE_MAX for why we don't move on in "buf".
+	 */
+
+	while (sz > 0) {
+		n = sz > TOKEN_SEE_MAX ? TOKEN_SEE_MAX : sz;
+		c = deflateSetDictionary(&t->tx, buf, n);
+		if (c != Z_OK) {
+			ERRX(sess, "deflateSetDictionary: %d", c);
+			return 0;
+		}
+		sz -= n;
+	}
+	return 1;
+}
+
+/*
+ * Send the end of the file's data and tokens.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+token_send_end(struct sess *sess, int fd)
+{
+	struct token	*t;
+
+	if (!sess->opts->compress) {
+		if (!io_write_int(sess, fd, 0)) {
+			ERRX1(sess, "io_write_int");
+			return 0;
+		}
+		return 1;
+	}
+
+	if ((t = token_get(sess)) == NULL) {
+		ERRX1(sess, "token_get");
+		return 0;
+	} else if (!token_run(sess, fd, t, -1, 0)) {
+		ERRX1(sess, "token_run");
+		return 0;
+	} else if (t->txflush &&
+	    !token_deflate(sess, fd, t, NULL, 0, -1)) {
+		ERRX1(sess, "token_deflate");
+		return 0;
+	} else if (!io_write_byte(sess, fd, TOKEN_END)) {
+		ERRX1(sess, "io_write_byte");
+		return 0;
+	}
+	t->txflush = 0;
+	return 1;
+}
+
+/*
+ * Receive the next element of a file's data and tokens into "rawtok",
+ * which is as with blk_match_step(): >0 for that many bytes of literal
+ * data, <0 for a token, zero at the end of the file.
+ * Without -z, "buf" is set to NULL and the caller must read the
+ * literal data itself; otherwise, "buf" is set to the data, which is
+ * good until the next call.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+token_recv(struct sess *sess, int fd, int32_t *rawtok, const void **buf)
+{
+	struct token	*t;
+	uint8_t		 flag, bval;
+	size_t		 n;
+	int		 c;
+
+	*buf = NULL;
+
+	if (!sess->opts->compress) {
+		if (!io_read_int(sess, fd, rawtok)) {
+			ERRX1(sess, "io_read_int");
+			return 0;
+		}
+		return 1;
+	}
+
+	if ((t = token_get(sess)) == NULL) {
+		ERRX1(sess, "token_get");
+		return 0;
+	}
+
+	for (;;) {
+		switch (t->rxstate) {
+		case TOKENRX_INIT:
+			if (!t->rxinit) {
+				if ((c = inflateInit2(&t->rx, -15)) != Z_OK) {
+					ERRX(sess, "inflateInit2: %d", c);
+					return 0;
+				}
+				t->rxinit = 1;
+			} else if ((c = inflateReset(&t->rx)) != Z_OK) {
+				ERRX(sess, "inflateReset: %d", c);
+				return 0;
+			}
+			t->rxstate = TOKENRX_IDLE;
+			t->rxtok = 0;
+			break;
+		case TOKENRX_IDLE:
+		case TOKENRX_INFLATED:
+			if (t->rxflag != -1) {
+				flag = t->rxflag;
+				t->rxflag = -1;
+			} else if (!io_read_byte(sess, fd, &flag)) {
+				ERRX1(sess, "io_read_byte");
+				return 0;
+			}
+
+			if ((flag & 0xc0) == TOKEN_DATA) {
+				if (!io_read_byte(sess, fd, &bval)) {
+					ERRX1(sess, "io_read_byte");
+					return 0;
+				}
+				n = ((flag & 0x3f) << 8) + bval;
+				if (!io_read_buf(sess, fd, t->rxbuf, n)) {
+					ERRX1(sess, "io_read_buf");
+					return 0;
+				}
+				t->rx.next_in = t->rxbuf;
+				t->rx.avail_in = n;
+				t->rxstate = TOKENRX_INFLATING;
+				break;
+			}
+
+			/*
+			 * Data is followed by something else: get the
+			 * rest of the data out of the decompressor,
+			 * come back for the flags, then end the data
+			 * with the flush trimmed by the sender.
+			 */
+
+			if (t->rxstate == TOKENRX_INFLATED) {
+				t->rx.avail_in = 0;
+				t->rx.next_out = t->rxout;
+				t->rx.avail_out = sizeof(t->rxout);
+				c = inflate(&t->rx, Z_SYNC_FLUSH);
+				n = sizeof(t->rxout) - t->rx.avail_out;
+				if (c != Z_OK && c != Z_BUF_ERROR) {
+					ERRX(sess, "inflate: %d", c);
+					return 0;
+				} else if (n > 0 && c != Z_BUF_ERROR) {
+					t->rxflag = flag;
+					*rawtok = n;
+					*buf = t->rxout;
+					return 1;
+				} else if (!inflateSyncPoint(&t->rx)) {
+					ERRX(sess, "inflate: lost sync");
+					return 0;
+				}
+				t->rxbuf[0] = t->rxbuf[1] = 0x00;
+				t->rxbuf[2] = t->rxbuf[3] = 0xff;
+				t->rx.next_in = t->rxbuf;
+				t->rx.avail_in = 4;
+				inflate(&t->rx, Z_SYNC_FLUSH);
+				t->rxstate = TOKENRX_IDLE;
+			}
+
+			if (flag == TOKEN_END) {
+				t->rxstate = TOKENRX_INIT;
+				*rawtok = 0;
+				return 1;
+			}
+
+			/* Otherwise, a token or the start of a run. */
+
+			if (flag & TOKEN_REL) {
+				t->rxtok += flag & 0x3f;
+				flag >>= 6;
+			} else if (!io_read_int(sess, fd, &t->rxtok)) {
+				ERRX1(sess, "io_read_int");
+				return 0;
+			}
+			if (flag & 1) {
+				if (!io_read_byte(sess, fd, &bval)) {
+					ERRX1(sess, "io_read_byte");
+					return 0;
+				}
+				t->rxrun = bval;
+				if (!io_read_byte(sess, fd, &bval)) {
+					ERRX1(sess, "io_read_byte");
+					return 0;
+				}
+				t->rxrun += bval << 8;
+				if (t->rxrun > 0)
+					t->rxstate = TOKENRX_RUNNING;
+			}
+			if (t->rxtok < 0) {
+				ERRX(sess, "negative token: %" PRId32,
+					t->rxtok);
+				return 0;
+			}
+			*rawtok = -1 - t->rxtok;
+			return 1;
+		case TOKENRX_INFLATING:
+			t->rx.next_out = t->rxout;
+			t->rx.avail_out = sizeof(t->rxout);
+			c = inflate(&t->rx, Z_NO_FLUSH);
+			n = sizeof(t->rxout) - t->rx.avail_out;
+			if (c != Z_OK) {
+				ERRX(sess, "inflate: %d", c);
+				return 0;
+			}
+			if (t->rx.avail_in == 0)
+				t->rxstate = TOKENRX_INFLATED;
+			if (n > 0) {
+				*rawtok = n;
+				*buf = t->rxout;
+				return 1;
+			}
+			break;
+		case TOKENRX_RUNNING:
+			t->rxtok++;
+			if (--t->rxrun == 0)
+				t->rxstate = TOKENRX_IDLE;
+			*rawtok = -1 - t->rxtok;
+			return 1;
+		}
+	}
+}
+
+/*
+ * With -z, add the "sz" bytes of "buf", our copy of a block we've been
+ * sent a token for, to the decompressor's history, as the sender did.
+ * This is fed to it as stored (uncompressed) blocks.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+token_see(struct sess *sess, const void *buf, size_t sz)
+{
+	struct token	*t = sess->token;
+	unsigned char	 hdr[5];
+	size_t		 blklen = 0;
+	int		 c;
+
+	if (!sess->opts->compress)
+		return 1;
+	assert(t != NULL && t->rxinit);
+
+	t->rx.avail_in = 0;
+	hdr[0] = 0;
+
+	do {
+		if (t->rx.avail_in == 0 && sz > 0) {
+			if (blklen == 0) {
+				blklen = sz > TOKEN_SEE_MAX ?
+					TOKEN_SEE_MAX : sz;
+				hdr[1] = blklen & 0xff;
+				hdr[2] = blklen >> 8;
+				hdr[3] = ~hdr[1];
+				hdr[4] = ~hdr[2];
+				t->rx.next_in = hdr;
+				t->rx.avail_in = sizeof(hdr);
+			} else {
+				/* See TOKEN_SEE_MAX: "buf" stays put. */
+				t->rx.next_in = (Bytef *)buf;
+				t->rx.avail_in = blklen;
+				sz -= blklen;
+				blklen = 0;
+			}
+		}
+		t->rx.next_out = t->rxout;
+		t->rx.avail_out = sizeof(t->rxout);
+		c = inflate(&t->rx, Z_SYNC_FLUSH);
+		if (c != Z_OK && c != Z_BUF_ERROR) {
+			ERRX(sess, "inflate: %d", c);
+			return 0;
+		}
+	} while (sz > 0 || t->rx.avail_out == 0);
+
+	return 1;
+}
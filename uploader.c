@@ -14,14 +14,13 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
-#include <sys/mman.h>
+#include <sys/queue.h>
 #include <sys/stat.h>
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
-#include <math.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,31 +30,120 @@
 
 #include "extern.h"
 
+/*
+ * Blocks to batch up for hash_slow_many() when signing.
+ */
+#define BLK_BATCH	64
+
+/*
+ * Bytes of file signed at a time, which is also the job size given to
+ * the signing threads.
+ */
+#define SIGN_CHUNK	(4 * 1024 * 1024)
+
+/*
+ * Most signatures we prepare ahead of those written to the sender, and
+ * roughly the most memory they may use.
+ * We always allow one, no matter its size.
+ */
+#define	UPLOAD_QUEUE_MAX	64
+#define	UPLOAD_QUEUE_BYTES	(16 * 1024 * 1024)
+
+/*
+ * Most regular files stat'd at once by the stat threads.
+ */
+#define	UPSTAT_MAX	256
+
 enum	uploadst {
 	UPLOAD_FIND_NEXT = 0, /* find next to upload to sender */
-	UPLOAD_WRITE_LOCAL, /* wait to write to sender */
 	UPLOAD_READ_LOCAL, /* wait to read from local file */
+	UPLOAD_SIGN_LOCAL, /* wait for signing threads */
+	UPLOAD_WRITE_LOCAL, /* wait to write the rest to sender */
 	UPLOAD_FINISHED /* nothing more to do in phase */
 };
 
+/*
+ * A message to the sender: the signature of a file (or, in dry-run
+ * mode, just its index) or the end of the phase.
+ */
+struct	upsig {
+	char		   *buf; /* message */
+	size_t		    bufsz; /* size of buf */
+	size_t		    bufpos; /* position in buf */
+	size_t		    bufready; /* bytes of buf ready to write */
+	TAILQ_ENTRY(upsig)  entries;
+};
+
+TAILQ_HEAD(upsigq, upsig);
+
+/*
+ * A file being signed by the signing threads (--sign-threads).
+ * Each job signs "chunk" blocks and writes them straight into their
+ * place in the upload buffer, so the leading completed jobs are ready
+ * to be written out while the rest are being hashed.
+ */
+struct	upsign {
+	struct blkset	    blk; /* blocks being signed */
+	int		    fd; /* file being signed */
+	struct upsig	   *sig; /* its message */
+	char		   *buf; /* upload buffer */
+	size_t		    bufsz; /* size of buf */
+	size_t		    hdrsz; /* bytes of header in buf */
+	size_t		    chunk; /* blocks per job */
+	size_t		    njobs; /* number of jobs */
+	size_t		    done; /* leading jobs completed */
+	uint64_t	    start; /* when signing started */
+	struct sess	   *sess;
+};
+
+/*
+ * Regular files being stat'd ahead of us by the stat threads
+ * (--stat-threads), so those that are up to date needn't be opened.
+ * The paths are those of the file list, which stay put even if the
+ * incremental file list is reallocated.
+ */
+struct	upstat {
+	int		    rootfd; /* destination directory */
+	const char	   *path[UPSTAT_MAX]; /* files being stat'd */
+	size_t		    idx[UPSTAT_MAX]; /* their index in the list */
+	struct stat	    st[UPSTAT_MAX]; /* their status */
+	int		    err[UPSTAT_MAX]; /* zero or fstatat(2) errno */
+	size_t		    njobs; /* files in the batch */
+	size_t		    next; /* next to look at */
+	size_t		    done; /* leading files stat'd */
+	int		    running; /* batch is running on the pool */
+};
+
 /*
  * Used to keep track of data flowing from the receiver to the sender.
  * This is managed by the receiver process.
+ * We look ahead of what we're writing: while the sender has yet to
+ * read our messages, we prepare those for the next files.
  */
 struct	upload {
 	enum uploadst	    state;
-	char		   *buf; /* if not NULL, pending upload */
-	size_t		    bufsz; /* size of buf */
-	size_t		    bufmax; /* maximum size of buf */
-	size_t		    bufpos; /* position in buf */
+	struct upsigq	    queue; /* pending messages */
+	size_t		    queuesz; /* number of messages in queue */
+	size_t		    queuebytes; /* total size of queue */
+	struct iowrite	    write; /* writing head of queue */
+	struct pool	   *pool; /* signing threads or NULL */
+	int		    signing; /* sign is running on pool */
+	struct upsign	    sign; /* if signing, the signature */
+	struct pool	   *spool; /* stat threads or NULL */
+	struct upstat	    stat; /* files being stat'd on spool */
 	size_t		    idx; /* current transfer index */
 	mode_t		    oumask; /* umask for creating files */
 	int		    rootfd; /* destination directory */
+	struct dircache	   *dirs; /* directories under rootfd */
 	size_t		    csumlen; /* checksum length */
 	int		    fdout; /* write descriptor to sender */
 	const struct flist *fl; /* file list */
 	size_t		    flsz; /* size of file list */
+	int		    fldone; /* no more of fl to come */
 	int		   *newdir; /* non-zero if mkdir'd */
+	const size_t	   *redo; /* files to send again or NULL */
+	size_t		    redosz; /* number of redo */
+	size_t		    redopos; /* next of redo to look at */
 };
 
 /*
@@ -99,67 +187,192 @@ log_file(struct sess *sess, const struct flist *f)
 }
 
 /*
- * Prepare the overall block set's metadata.
- * We always have at least one block.
- * The block size is an important part of the algorithm.
- * I use the same heuristic as the reference rsync, but implemented in a
- * bit more of a straightforward way.
- * In general, the individual block length is the rounded square root of
- * the total file size.
- * The minimum block length is 700.
+ * For each block, prepare the block's metadata.
+ * We use the block's data in "buf" to set our fast checksum.
+ * The slow checksum is filled in later by init_blk_slow().
  */
 static void
-init_blkset(struct blkset *p, off_t sz)
+init_blk(struct blk *p, const struct blkset *set, off_t offs,
+	size_t idx, const void *buf)
 {
-	double	 v;
 
-	if (sz >= (BLOCK_SIZE_MIN * BLOCK_SIZE_MIN)) {
-		/* Simple rounded-up integer square root. */
+	/*
+	 * Block length inherits for all but the last, which is short if
+	 * there's a remainder.
+	 */
 
-		v = sqrt(sz);
-		p->len = ceil(v);
+	p->idx = idx;
+	p->len = idx < set->blksz - 1 || set->rem == 0 ?
+		set->len : set->rem;
+	p->offs = offs;
 
-		/*
-		 * Always be a multiple of eight.
-		 * There's no reason to do this, but rsync does.
-		 */
+	p->chksum_short = hash_fast(buf, p->len);
+}
+
+/*
+ * Set the slow checksums of blocks [lo, hi) in "set", whose data starts
+ * at "base".
+ * Runs of blocks with the same length (all but possibly the last) are
+ * hashed together, which is much faster than one at a time.
+ */
+static void
+init_blk_slow(struct blkset *set, size_t lo, size_t hi,
+	const char *base, const struct sess *sess)
+{
+	const void	*buf[BLK_BATCH];
+	unsigned char	*md[BLK_BATCH];
+	size_t		 i, n;
+
+	for (i = lo; i < hi; i += n) {
+		for (n = 0; n < BLK_BATCH && i + n < hi; n++) {
+			if (set->blks[i + n].len != set->blks[i].len)
+				break;
+			buf[n] = base +
+				(set->blks[i + n].offs - set->blks[lo].offs);
+			md[n] = set->blks[i + n].chksum_long;
+		}
+		hash_slow_many(buf, n, set->blks[i].len, md, sess);
+	}
+}
+
+/*
+ * Prepare blocks [lo, hi) of "set", whose data starts at "base".
+ */
+static void
+sign_blks(struct blkset *set, size_t lo, size_t hi,
+	const char *base, const struct sess *sess)
+{
+	size_t	 i;
+	off_t	 offs;
 
-		if ((p->len % 8) > 0)
-			p->len += 8 - (p->len % 8);
-	} else
-		p->len = BLOCK_SIZE_MIN;
+	offs = (off_t)lo * set->len;
+	for (i = lo; i < hi; i++) {
+		init_blk(&set->blks[i], set, offs, i,
+			base + (offs - (off_t)lo * set->len));
+		offs += set->len;
+	}
+	init_blk_slow(set, lo, hi, base, sess);
+}
 
-	p->size = sz;
-	if ((p->blksz = sz / p->len) == 0)
-		p->rem = sz;
-	else
-		p->rem = sz % p->len;
+/*
+ * Get the range of blocks [*lo, *hi) and their span in the file of
+ * chunk number "chunk" of "chunksz" blocks apiece.
+ */
+static void
+sign_chunk(const struct blkset *set, size_t chunk, size_t chunksz,
+	size_t *lo, size_t *hi, off_t *offs, size_t *len)
+{
 
-	/* If we have a remainder, then we need an extra block. */
+	*lo = chunk * chunksz;
+	*hi = *lo + chunksz < set->blksz ? *lo + chunksz : set->blksz;
+	*offs = (off_t)*lo * set->len;
+	*len = (*hi == set->blksz ? set->size :
+		(off_t)*hi * (off_t)set->len) - *offs;
+}
 
-	if (p->rem)
-		p->blksz++;
+/*
+ * Serialise the checksums of blocks [lo, hi) into "buf".
+ */
+static void
+put_blk(struct sess *sess, char *buf, size_t *pos, size_t bufsz,
+	const struct blkset *set, size_t lo, size_t hi)
+{
+	size_t	 i;
+
+	for (i = lo; i < hi; i++) {
+		io_buffer_int(sess, buf, pos, bufsz,
+			set->blks[i].chksum_short);
+		io_buffer_buf(sess, buf, pos, bufsz,
+			set->blks[i].chksum_long, set->csum);
+	}
 }
 
 /*
- * For each block, prepare the block's metadata.
- * We use the mapped "map" file to set our checksums.
+ * Signing thread job: read and sign one chunk of blocks and put it in
+ * place.
+ * Jobs touch disjoint blocks and disjoint parts of the buffer.
+ * Returns zero if the chunk couldn't be read, non-zero on success.
+ */
+static int
+sign_job(void *arg, size_t job)
+{
+	struct upsign	*s = arg;
+	size_t		 lo, hi, pos, len, have = 0;
+	off_t		 offs;
+	ssize_t		 ssz;
+	char		*buf;
+
+	sign_chunk(&s->blk, job, s->chunk, &lo, &hi, &offs, &len);
+
+	if ((buf = malloc(len)) == NULL)
+		return 0;
+	while (have < len) {
+		ssz = pread(s->fd, buf + have, len - have, offs + have);
+		if (ssz <= 0) {
+			free(buf);
+			return 0;
+		}
+		have += ssz;
+	}
+
+	sign_blks(&s->blk, lo, hi, buf, s->sess);
+	free(buf);
+
+	pos = s->hdrsz + lo * (sizeof(int32_t) + s->blk.csum);
+	put_blk(s->sess, s->buf, &pos, s->bufsz, &s->blk, lo, hi);
+	return 1;
+}
+
+/*
+ * Stop any signing in progress.
  */
 static void
-init_blk(struct blk *p, const struct blkset *set, off_t offs,
-	size_t idx, const void *map, const struct sess *sess)
+sign_cancel(struct upload *u)
 {
 
-	assert(map != MAP_FAILED);
+	if (!u->signing)
+		return;
+	pool_cancel(u->pool);
+	close(u->sign.fd);
+	free(u->sign.blk.blks);
+	u->signing = 0;
+}
+
+/*
+ * See how much of the file being signed is ready to upload, blocking
+ * until there's more than we've already seen if "wait" is set.
+ * Cleans up once the signing threads are done.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+sign_update(struct upload *u, struct sess *sess, int wait)
+{
+	struct upsign	*s = &u->sign;
+	size_t		 blks;
 
-	/* Block length inherits for all but the last. */
+	assert(u->signing);
 
-	p->idx = idx;
-	p->len = idx < set->blksz - 1 ? set->len : set->rem;
-	p->offs = offs;
+	s->done = wait ? pool_wait(u->pool, s->done) : pool_done(u->pool);
+	if (!pool_ok(u->pool)) {
+		ERRX(sess, "%s: failed to read while signing",
+			u->fl[u->idx].path);
+		sign_cancel(u);
+		return 0;
+	}
 
-	p->chksum_short = hash_fast(map + offs, p->len);
-	hash_slow(map + offs, p->len, p->chksum_long, sess);
+	blks = s->done * s->chunk < s->blk.blksz ?
+		s->done * s->chunk : s->blk.blksz;
+	s->sig->bufready = s->hdrsz +
+		blks * (sizeof(int32_t) + s->blk.csum);
+
+	if (s->done == s->njobs) {
+		assert(s->sig->bufready == s->sig->bufsz);
+		close(s->fd);
+		free(s->blk.blks);
+		u->signing = 0;
+		sess->stats.sign += stats_now() - s->start;
+	}
+	return 1;
 }
 
 /*
@@ -168,8 +381,9 @@ init_blk(struct blk *p, const struct blkset *set, off_t offs,
 static int
 pre_link(struct upload *p, struct sess *sess)
 {
-	int		 rc, newlink = 0;
+	int		 rc, dfd, newlink = 0;
 	char		*b;
+	const char	*name;
 	struct stat	 st;
 	struct timespec	 tv[2];
 	const struct flist *f;
@@ -188,7 +402,8 @@ pre_link(struct upload *p, struct sess *sess)
 	/* See if the symlink already exists. */
 
 	assert(p->rootfd != -1);
-	rc = fstatat(p->rootfd, f->path, &st, AT_SYMLINK_NOFOLLOW);
+	dfd = dircache_get(p->dirs, f->path, &name);
+	rc = fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW);
 	if (rc != -1 && !S_ISLNK(st.st_mode)) {
 		WARNX(sess, "%s: not a symlink", f->path);
 		return -1;
@@ -208,13 +423,13 @@ pre_link(struct upload *p, struct sess *sess)
 	if (rc == -1) {
 		LOG3(sess, "%s: creating "
 			"symlink: %s", f->path, f->link);
-		if (symlinkat(f->link, p->rootfd, f->path) == -1) {
+		if (symlinkat(f->link, dfd, name) == -1) {
 			WARN(sess, "%s: symlinkat", f->path);
 			return -1;
 		}
 		newlink = 1;
 	} else {
-		b = symlinkat_read(sess, p->rootfd, f->path);
+		b = symlinkat_read(sess, dfd, name);
 		if (b == NULL) {
 			ERRX1(sess, "%s: symlinkat_read", f->path);
 			return -1;
@@ -224,11 +439,11 @@ pre_link(struct upload *p, struct sess *sess)
 			b = NULL;
 			LOG3(sess, "%s: updating "
 				"symlink: %s", f->path, f->link);
-			if (unlinkat(p->rootfd, f->path, 0) == -1) {
+			if (unlinkat(dfd, name, 0) == -1) {
 				WARN(sess, "%s: unlinkat", f->path);
 				return -1;
 			}
-			if (symlinkat(f->link, p->rootfd, f->path) == -1) {
+			if (symlinkat(f->link, dfd, name) == -1) {
 				WARN(sess, "%s: symlinkat", f->path);
 				return -1;
 			}
@@ -244,8 +459,7 @@ pre_link(struct upload *p, struct sess *sess)
 		tv[0].tv_nsec = 0;
 		tv[1].tv_sec = f->st.mtime;
 		tv[1].tv_nsec = 0;
-		rc = utimensat(p->rootfd,
-			f->path, tv, AT_SYMLINK_NOFOLLOW);
+		rc = utimensat(dfd, name, tv, AT_SYMLINK_NOFOLLOW);
 		if (rc == -1) {
 			ERR(sess, "%s: utimensat", f->path);
 			return -1;
@@ -259,8 +473,7 @@ pre_link(struct upload *p, struct sess *sess)
 	 */
 
 	if (newlink || sess->opts->preserve_perms) {
-		rc = fchmodat(p->rootfd,
-			f->path, f->st.mode, AT_SYMLINK_NOFOLLOW);
+		rc = fchmodat(dfd, name, f->st.mode, AT_SYMLINK_NOFOLLOW);
 		if (rc == -1) {
 			ERR(sess, "%s: fchmodat", f->path);
 			return -1;
@@ -278,10 +491,11 @@ pre_link(struct upload *p, struct sess *sess)
  * Return <0 on failure 0 on success.
  */
 static int
-pre_dir(const struct upload *p, struct sess *sess)
+pre_dir(struct upload *p, struct sess *sess)
 {
 	struct stat	 st;
-	int		 rc;
+	int		 rc, dfd;
+	const char	*name;
 	const struct flist *f;
 
 	f = &p->fl[p->idx];
@@ -296,7 +510,8 @@ pre_dir(const struct upload *p, struct sess *sess)
 	}
 
 	assert(p->rootfd != -1);
-	rc = fstatat(p->rootfd, f->path, &st, AT_SYMLINK_NOFOLLOW);
+	dfd = dircache_get(p->dirs, f->path, &name);
+	rc = fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW);
 	if (rc == -1 && errno != ENOENT) {
 		WARN(sess, "%s: fstatat", f->path);
 		return -1;
@@ -320,13 +535,30 @@ pre_dir(const struct upload *p, struct sess *sess)
 	 * case it's u-w or something.
 	 */
 
+	/* Another of the --streams may have beaten us to it. */
+
 	LOG3(sess, "%s: creating directory", f->path);
-	if (mkdirat(p->rootfd, f->path, 0777 & ~p->oumask) == -1) {
+	if (mkdirat(dfd, name, 0777 & ~p->oumask) == -1) {
+		if (errno == EEXIST && sess->opts->streams > 0)
+			return 0;
 		WARN(sess, "%s: mkdirat", f->path);
 		return -1;
 	}
 
 	p->newdir[p->idx] = 1;
+
+	/*
+	 * With --streams, the last fixes up directories, but it sees
+	 * this one as already there, so give it its mode now.
+	 * We (and the other streams) still need to write into it.
+	 */
+
+	if (sess->opts->streams > 0 &&
+	    fchmodat(dfd, name, f->st.mode | S_IRWXU, 0) == -1) {
+		WARN(sess, "%s: fchmodat", f->path);
+		return -1;
+	}
+
 	log_dir(sess, f);
 	return 0;
 }
@@ -336,10 +568,11 @@ pre_dir(const struct upload *p, struct sess *sess)
  * Returns zero on failure, non-zero on success.
  */
 static int
-post_dir(struct sess *sess, const struct upload *u, size_t idx)
+post_dir(struct sess *sess, struct upload *u, size_t idx)
 {
 	struct timespec	 tv[2];
-	int		 rc;
+	int		 rc, dfd;
+	const char	*name;
 	struct stat	 st;
 	const struct flist *f;
 
@@ -353,7 +586,8 @@ post_dir(struct sess *sess, const struct upload *u, size_t idx)
 	else if (sess->opts->dry_run)
 		return 1;
 
-	if (fstatat(u->rootfd, f->path, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+	dfd = dircache_get(u->dirs, f->path, &name);
+	if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
 		ERR(sess, "%s: fstatat", f->path);
 		return 0;
 	} else if (!S_ISDIR(st.st_mode)) {
@@ -373,7 +607,7 @@ post_dir(struct sess *sess, const struct upload *u, size_t idx)
 		tv[0].tv_nsec = 0;
 		tv[1].tv_sec = f->st.mtime;
 		tv[1].tv_nsec = 0;
-		rc = utimensat(u->rootfd, f->path, tv, 0);
+		rc = utimensat(dfd, name, tv, 0);
 		if (rc == -1) {
 			ERR(sess, "%s: utimensat", f->path);
 			return 0;
@@ -389,7 +623,7 @@ post_dir(struct sess *sess, const struct upload *u, size_t idx)
 	if (u->newdir[idx] ||
 	    (sess->opts->preserve_perms &&
 	     st.st_mode != f->st.mode)) {
-		rc = fchmodat(u->rootfd, f->path, f->st.mode, 0);
+		rc = fchmodat(dfd, name, f->st.mode, 0);
 		if (rc == -1) {
 			ERR(sess, "%s: fchmodat", f->path);
 			return 0;
@@ -400,40 +634,219 @@ post_dir(struct sess *sess, const struct upload *u, size_t idx)
 	return 1;
 }
 
+/*
+ * Queue a message of "sz" bytes for the sender.
+ * Its buffer is ready to be filled in; the caller sets how much of it
+ * is ready to write.
+ * Returns NULL on failure.
+ */
+static struct upsig *
+upsig_alloc(struct upload *u, struct sess *sess, size_t sz)
+{
+	struct upsig	*s;
+
+	if ((s = calloc(1, sizeof(struct upsig))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	} else if ((s->buf = malloc(sz)) == NULL) {
+		ERR(sess, "malloc");
+		free(s);
+		return NULL;
+	}
+
+	s->bufsz = sz;
+	TAILQ_INSERT_TAIL(&u->queue, s, entries);
+	u->queuesz++;
+	u->queuebytes += sz;
+	return s;
+}
+
+/*
+ * Remove a message from the queue and free it.
+ */
+static void
+upsig_free(struct upload *u, struct upsig *s)
+{
+
+	TAILQ_REMOVE(&u->queue, s, entries);
+	u->queuesz--;
+	u->queuebytes -= s->bufsz;
+	free(s->buf);
+	free(s);
+}
+
+/*
+ * Queue a message that's only a single integer.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+upsig_int(struct upload *u, struct sess *sess, int32_t val)
+{
+	struct upsig	*s;
+	size_t		 pos = 0;
+
+	if ((s = upsig_alloc(u, sess, sizeof(int32_t))) == NULL) {
+		ERRX1(sess, "upsig_alloc");
+		return 0;
+	}
+	io_buffer_int(sess, s->buf, &pos, s->bufsz, val);
+	s->bufready = s->bufsz;
+	return 1;
+}
+
+/*
+ * With --streams, each stream looks after the files whose names hash
+ * (with FNV-1a) to it, and all of them make the directories.
+ * The last, after the others, has none of the files.
+ * Returns non-zero if the file is ours.
+ */
+static int
+upload_ours(const struct sess *sess, const struct flist *f)
+{
+	const unsigned char	*cp;
+	uint32_t		 h = 2166136261U;
+
+	if (sess->opts->streams == 0)
+		return 1;
+	for (cp = (const unsigned char *)f->path; *cp != '\0'; cp++)
+		h = (h ^ *cp) * 16777619U;
+	return h % sess->opts->streams == sess->opts->stream;
+}
+
+/*
+ * A job of the stat threads.
+ * Failures are for the uploader to look at, so this always succeeds.
+ */
+static int
+upstat_job(void *arg, size_t job)
+{
+	struct upstat	*s = arg;
+
+	s->err[job] = fstatat(s->rootfd, s->path[job],
+		&s->st[job], AT_SYMLINK_NOFOLLOW) == -1 ? errno : 0;
+	return 1;
+}
+
+/*
+ * Start stat'ing the regular files of ours from the current index on.
+ * The last batch must have finished.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+upstat_start(struct upload *p, struct sess *sess)
+{
+	struct upstat	*s = &p->stat;
+	size_t		 i;
+
+	assert(!s->running);
+	s->njobs = s->next = s->done = 0;
+	for (i = p->idx; i < p->flsz && s->njobs < UPSTAT_MAX; i++) {
+		if (!S_ISREG(p->fl[i].st.mode) || !upload_ours(sess, &p->fl[i]))
+			continue;
+		s->path[s->njobs] = p->fl[i].path;
+		s->idx[s->njobs++] = i;
+	}
+
+	assert(s->njobs > 0);
+	if (!pool_start(sess, p->spool, upstat_job, s, s->njobs)) {
+		ERRX1(sess, "pool_start");
+		return 0;
+	}
+	s->running = 1;
+	return 1;
+}
+
+/*
+ * Get the status of the regular file at the current index from the
+ * stat threads, starting them on the next batch if they're done.
+ * Returns <0 on failure, 0 if we don't have it (e.g., it couldn't be
+ * stat'd), >0 if we do, filling in "st".
+ */
+static int
+upstat_get(struct upload *p, struct sess *sess, struct stat *st)
+{
+	struct upstat	*s = &p->stat;
+
+	while (s->next < s->njobs && s->idx[s->next] < p->idx)
+		s->next++;
+
+	if (s->next == s->njobs) {
+		if (s->running) {
+			s->done = pool_wait(p->spool, s->njobs - 1);
+			assert(s->done == s->njobs);
+			s->running = 0;
+		}
+		if (!upstat_start(p, sess)) {
+			ERRX1(sess, "upstat_start");
+			return -1;
+		}
+	}
+
+	if (s->idx[s->next] != p->idx)
+		return 0;
+
+	if (s->done <= s->next)
+		s->done = pool_wait(p->spool, s->next);
+	if (s->done == s->njobs)
+		s->running = 0;
+
+	if (s->err[s->next] != 0)
+		return 0;
+	*st = s->st[s->next];
+	return 1;
+}
+
 /*
  * Try to open the file at the current index.
  * If the file does not exist, returns with success.
+ * With stat threads, files found to be up to date aren't opened.
  * Return <0 on failure, 0 on success w/nothing to be done, >0 on
  * success and the file needs attention.
  */
 static int
-pre_file(const struct upload *p, int *filefd, struct sess *sess)
+pre_file(struct upload *p, int *filefd, struct sess *sess)
 {
 	const struct flist *f;
+	const char	*name;
+	struct stat	 st;
+	int		 c, dfd;
 
 	f = &p->fl[p->idx];
 	assert(S_ISREG(f->st.mode));
 
 	if (sess->opts->dry_run) {
 		log_file(sess, f);
-		if (!io_write_int(sess, p->fdout, p->idx)) {
-			ERRX1(sess, "io_write_int");
+		if (!upsig_int(p, sess, p->idx)) {
+			ERRX1(sess, "upsig_int");
 			return -1;
 		}
 		return 0;
 	}
 
+	if (p->spool != NULL && p->redo == NULL) {
+		if ((c = upstat_get(p, sess, &st)) < 0) {
+			ERRX1(sess, "upstat_get");
+			return -1;
+		} else if (c > 0 && S_ISREG(st.st_mode) &&
+		    st.st_size == f->st.size &&
+		    st.st_mtime == f->st.mtime) {
+			LOG3(sess, "%s: skipping: up to date", f->path);
+			if (sess->sigcache != NULL)
+				sigcache_keep(sess->sigcache, &st);
+			return 0;
+		}
+	}
+
 	/*
-	 * For non dry-run cases, we'll write the acknowledgement later
-	 * in the rsync_uploader() function because we need to wait for
-	 * the open() call to complete.
+	 * For non dry-run cases, we'll queue the signature later in the
+	 * rsync_uploader() function because we need to wait for the
+	 * open() call to complete.
 	 * If the call to openat() fails with ENOENT, there's a
-	 * fast-path between here and the write function, so we won't do
-	 * any blocking between now and then.
+	 * fast-path to queueing an empty signature.
 	 */
 
-	*filefd = openat(p->rootfd, f->path,
-		O_RDONLY | O_NOFOLLOW | O_NONBLOCK, 0);
+	dfd = dircache_get(p->dirs, f->path, &name);
+	*filefd = openat(dfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK, 0);
 	if (*filefd != -1 || errno == ENOENT)
 		return 1;
 	ERR(sess, "%s: openat", f->path);
@@ -457,21 +870,131 @@ upload_alloc(struct sess *sess, int rootfd, int fdout,
 	}
 
 	p->state = UPLOAD_FIND_NEXT;
+	TAILQ_INIT(&p->queue);
 	p->oumask = msk;
 	p->rootfd = rootfd;
 	p->csumlen = clen;
 	p->fdout = fdout;
 	p->fl = fl;
 	p->flsz = flsz;
+	p->fldone = !sess->inc_flist;
 	p->newdir = calloc(flsz, sizeof(int));
 	if (p->newdir == NULL) {
 		ERR(sess, "calloc");
 		free(p);
 		return NULL;
 	}
+
+	if (sess->opts->sign_threads > 0) {
+		p->pool = pool_alloc(sess, sess->opts->sign_threads);
+		if (p->pool == NULL) {
+			ERRX1(sess, "pool_alloc");
+			free(p->newdir);
+			free(p);
+			return NULL;
+		}
+	}
+
+	if (sess->opts->stat_threads > 0 && !sess->opts->dry_run) {
+		p->spool = pool_alloc(sess, sess->opts->stat_threads);
+		if (p->spool == NULL) {
+			ERRX1(sess, "pool_alloc");
+			pool_free(p->pool);
+			free(p->newdir);
+			free(p);
+			return NULL;
+		}
+		p->stat.rootfd = rootfd;
+	}
+
+	if ((p->dirs = dircache_alloc(sess, rootfd)) == NULL) {
+		ERRX1(sess, "dircache_alloc");
+		pool_free(p->spool);
+		pool_free(p->pool);
+		free(p->newdir);
+		free(p);
+		return NULL;
+	}
 	return p;
 }
 
+/*
+ * With an incremental file list, pass the uploader the list "fl" of
+ * size "flsz" after more has been appended to it.
+ * If "done", there's no more to come.
+ * Returns zero on failure, non-zero on success.
+ */
+int
+upload_flist(struct upload *p, struct sess *sess,
+	const struct flist *fl, size_t flsz, int done)
+{
+	void	*pp;
+
+	assert(flsz >= p->flsz);
+
+	if (flsz > p->flsz) {
+		pp = recallocarray(p->newdir,
+			p->flsz, flsz, sizeof(int));
+		if (pp == NULL) {
+			ERR(sess, "recallocarray");
+			return 0;
+		}
+		p->newdir = pp;
+	}
+
+	p->fl = fl;
+	p->flsz = flsz;
+	p->fldone = done;
+	return 1;
+}
+
+/*
+ * After the first phase, ask the sender again for the "redosz" files
+ * (by increasing index) "redo" whose hashes didn't match once received,
+ * this time with the longest checksums we've got.
+ * The array must stay put until we're finished.
+ */
+void
+upload_redo(struct upload *p, struct sess *sess,
+	const size_t *redo, size_t redosz)
+{
+
+	assert(p->state == UPLOAD_FINISHED);
+	assert(redosz > 0);
+	p->state = UPLOAD_FIND_NEXT;
+	p->idx = 0;
+	p->csumlen = hash_slow_len(sess);
+	p->redo = redo;
+	p->redosz = redosz;
+	p->redopos = 0;
+}
+
+/*
+ * In the second phase, whether the file at the current index is one
+ * we're sending again.
+ * In the first, all of them are.
+ */
+static int
+upload_wanted(struct upload *u)
+{
+
+	if (u->redo == NULL)
+		return 1;
+	while (u->redopos < u->redosz && u->redo[u->redopos] < u->idx)
+		u->redopos++;
+	return u->redopos < u->redosz && u->redo[u->redopos] == u->idx;
+}
+
+/*
+ * Whether we've looked at all the files we've been given so far.
+ */
+int
+upload_idle(const struct upload *p)
+{
+
+	return p->idx == p->flsz;
+}
+
 /*
  * Perform all cleanups and free.
  * Passing a NULL to this function is ok.
@@ -479,154 +1002,285 @@ upload_alloc(struct sess *sess, int rootfd, int fdout,
 void
 upload_free(struct upload *p)
 {
+	struct upsig	*s;
 
 	if (p == NULL)
 		return;
+	sign_cancel(p);
+	pool_free(p->pool);
+	pool_free(p->spool);
+	while ((s = TAILQ_FIRST(&p->queue)) != NULL)
+		upsig_free(p, s);
+	dircache_free(p->dirs);
 	free(p->newdir);
-	free(p->buf);
 	free(p);
 }
 
 /*
- * Iterates through all available files and conditionally gets the file
- * ready for processing to check whether it's up to date.
- * If not up to date or empty, sends file information to the sender.
- * If returns 0, we've processed all files there are to process.
- * If returns >0, we're waiting for POLLIN or POLLOUT data.
- * Otherwise returns <0, which is an error.
+ * Whether we may prepare another message.
  */
-int
-rsync_uploader(struct upload *u, int *fileinfd,
-	struct sess *sess, int *fileoutfd)
+static int
+upload_room(const struct upload *u)
+{
+
+	return TAILQ_EMPTY(&u->queue) ||
+		(u->queuesz < UPLOAD_QUEUE_MAX &&
+		 u->queuebytes < UPLOAD_QUEUE_BYTES);
+}
+
+/*
+ * Write as much of our queued messages to the sender as it'll take
+ * without blocking.
+ * We mustn't block here as the sender might be blocked writing to us.
+ * If the signing threads are still at work on a message we're writing,
+ * only write what they've finished, waiting for them if they haven't
+ * finished anything more.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+upload_write(struct upload *u, struct sess *sess)
+{
+	struct upsig	*s;
+	size_t		 sz;
+
+	while ((s = TAILQ_FIRST(&u->queue)) != NULL) {
+		if (u->signing && s == u->sign.sig &&
+		    !sign_update(u, sess, s->bufpos == s->bufready)) {
+			ERRX1(sess, "sign_update");
+			return 0;
+		}
+
+		assert(s->bufpos < s->bufready);
+		if (!io_write_avail(sess, u->fdout, &u->write,
+		    s->buf + s->bufpos, s->bufready - s->bufpos, &sz)) {
+			ERRX1(sess, "io_write_avail");
+			return 0;
+		} else if (sz == 0)
+			break;
+		s->bufpos += sz;
+		if (s->bufpos == s->bufsz)
+			upsig_free(u, s);
+	}
+
+	return 1;
+}
+
+/*
+ * Queue the signature for the file at the current index, which is open
+ * as "*fileinfd" (with status "st") or -1 if it doesn't exist.
+ * The file is closed when we're done.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+upload_sign(struct upload *u, struct sess *sess,
+	int *fileinfd, const struct stat *st)
 {
 	struct blkset	 blk;
-	struct stat	 st;
-	void		*map, *bufp;
-	size_t		 i, mapsz, pos, sz;
+	struct fmap	 m;
+	struct upsig	*s;
+	const void	*buf;
+	size_t		 i, pos, chunk, njobs, lo, hi, len;
 	off_t		 offs;
+	uint64_t	 t;
 	int		 c;
 
-	/* This should never get called. */
+	/* Initialies our blocks. */
 
-	assert(u->state != UPLOAD_FINISHED);
+	memset(&blk, 0, sizeof(struct blkset));
+	blk.csum = u->csumlen;
 
 	/*
-	 * If we have an upload in progress, then keep writing until the
-	 * buffer has been fully written.
-	 * We must only have the output file descriptor working and also
-	 * have a valid buffer to write.
+	 * With -W, we don't sign the file at all, so the sender sends
+	 * all of it.
 	 */
 
-	if (u->state == UPLOAD_WRITE_LOCAL) {
-		assert(NULL != u->buf);
-		assert(*fileoutfd != -1);
-		assert(*fileinfd == -1);
-
+	if (*fileinfd != -1 && st->st_size > 0 && !sess->opts->whole_file) {
 		/*
-		 * Unfortunately, we need to chunk these: if we're
-		 * the server side of things, then we're multiplexing
-		 * output and need to wrap this in chunks.
-		 * This is a major deficiency of rsync.
-		 * FIXME: add a "fast-path" mode that simply dumps out
-		 * the buffer non-blocking if we're not mplexing.
+		 * If we've the signature already, skip the file.
+		 * If we're sending it again, the cached signature might
+		 * be why, so don't use it nor keep it.
 		 */
 
-		if (u->bufpos < u->bufsz) {
-			sz = MAX_CHUNK < (u->bufsz - u->bufpos) ?
-				MAX_CHUNK : (u->bufsz - u->bufpos);
-			c = io_write_buf(sess, u->fdout,
-				u->buf + u->bufpos, sz);
-			if (c == 0) {
-				ERRX1(sess, "io_write_nonblocking");
-				return -1;
+		if (sess->sigcache != NULL && u->redo != NULL)
+			sigcache_drop(sess->sigcache, st);
+		c = sess->sigcache == NULL || u->redo != NULL ? 0 :
+			sigcache_get(sess, sess->sigcache, st, &blk);
+		if (c < 0) {
+			ERRX1(sess, "sigcache_get");
+			close(*fileinfd);
+			*fileinfd = -1;
+			return 0;
+		} else if (c > 0) {
+			close(*fileinfd);
+			*fileinfd = -1;
+			LOG3(sess, "%s: signature of %jd B with %zu "
+				"blocks cached", u->fl[u->idx].path,
+				(intmax_t)blk.size, blk.blksz);
+		} else {
+			blkset_init(&blk, st->st_size,
+				blkset_len(sess, st->st_size));
+			assert(blk.blksz);
+			blk.blks = calloc(blk.blksz, sizeof(struct blk));
+			if (blk.blks == NULL) {
+				ERR(sess, "calloc");
+				close(*fileinfd);
+				*fileinfd = -1;
+				return 0;
 			}
-			u->bufpos += sz;
-			if (u->bufpos < u->bufsz)
-				return 1;
+			LOG3(sess, "%s: signing %jd B with %zu blocks "
+				"of %zu B", u->fl[u->idx].path,
+				(intmax_t)blk.size, blk.blksz, blk.len);
 		}
+	} else {
+		if (*fileinfd != -1) {
+			close(*fileinfd);
+			*fileinfd = -1;
+		}
+		blk.len = MAX_CHUNK; /* Doesn't matter. */
+		LOG3(sess, "%s: not signed", u->fl[u->idx].path);
+	}
 
-		/*
-		 * Let the UPLOAD_FIND_NEXT state handle things if we
-		 * finish, as we'll need to write a POLLOUT message and
-		 * not have a writable descriptor yet.
-		 */
+	/* Queue a big enough buffer for the block metadata. */
 
-		u->state = UPLOAD_FIND_NEXT;
-		u->idx++;
-		return 1;
+	s = upsig_alloc(u, sess,
+	     sizeof(int32_t) + /* identifier */
+	     sizeof(int32_t) + /* block count */
+	     sizeof(int32_t) + /* block length */
+	     sizeof(int32_t) + /* checksum length */
+	     sizeof(int32_t) + /* block remainder */
+	     blk.blksz *
+	     (sizeof(int32_t) + /* short checksum */
+	      blk.csum)); /* long checksum */
+
+	if (s == NULL) {
+		ERRX1(sess, "upsig_alloc");
+		if (*fileinfd != -1) {
+			close(*fileinfd);
+			*fileinfd = -1;
+		}
+		free(blk.blks);
+		return 0;
 	}
 
+	pos = 0;
+	io_buffer_int(sess, s->buf, &pos, s->bufsz, u->idx);
+	io_buffer_int(sess, s->buf, &pos, s->bufsz, blk.blksz);
+	io_buffer_int(sess, s->buf, &pos, s->bufsz, blk.len);
+	io_buffer_int(sess, s->buf, &pos, s->bufsz, blk.csum);
+	io_buffer_int(sess, s->buf, &pos, s->bufsz, blk.rem);
+
 	/*
-	 * If we invoke the uploader without a file currently open, then
-	 * we iterate through til the next available regular file and
-	 * start the opening process.
-	 * This means we must have the output file descriptor working.
+	 * The file is signed in chunks of blocks, read through a window
+	 * so as to not need all of it in memory.
+	 * With signing threads and more than one chunk, hand off the
+	 * file and start writing as soon as the leading chunks are done.
+	 * Otherwise, sign it all here.
 	 */
 
-	if (u->state == UPLOAD_FIND_NEXT) {
-		assert(*fileinfd == -1);
-		assert(*fileoutfd != -1);
-
-		for ( ; u->idx < u->flsz; u->idx++) {
-			if (S_ISDIR(u->fl[u->idx].st.mode))
-				c = pre_dir(u, sess);
-			else if (S_ISLNK(u->fl[u->idx].st.mode))
-				c = pre_link(u, sess);
-			else if (S_ISREG(u->fl[u->idx].st.mode))
-				c = pre_file(u, fileinfd, sess);
-			else
-				c = 0;
-
-			if (c < 0)
-				return -1;
-			else if (c > 0)
-				break;
+	if ((chunk = SIGN_CHUNK / blk.len) == 0)
+		chunk = 1;
+	njobs = (blk.blksz + chunk - 1) / chunk;
+
+	if (*fileinfd != -1 && u->pool != NULL && njobs > 1) {
+		u->sign.blk = blk;
+		u->sign.fd = *fileinfd;
+		u->sign.sig = s;
+		u->sign.buf = s->buf;
+		u->sign.bufsz = s->bufsz;
+		u->sign.hdrsz = pos;
+		u->sign.chunk = chunk;
+		u->sign.njobs = njobs;
+		u->sign.done = 0;
+		u->sign.start = stats_now();
+		u->sign.sess = sess;
+		*fileinfd = -1;
+		if (!pool_start(sess, u->pool,
+		    sign_job, &u->sign, u->sign.njobs)) {
+			ERRX1(sess, "pool_start");
+			close(u->sign.fd);
+			free(blk.blks);
+			return 0;
 		}
+		u->signing = 1;
+		s->bufready = pos;
+		return 1;
+	}
 
-		/*
-		 * Whether we've finished writing files or not, we
-		 * disable polling on the output channel.
-		 */
-
-		*fileoutfd = -1;
-		if (u->idx == u->flsz) {
-			assert(*fileinfd == -1);
-			if (!io_write_int(sess, u->fdout, -1)) {
-				ERRX1(sess, "io_write_int");
-				return -1;
+	if (*fileinfd != -1) {
+		t = stats_now();
+		fmap_init(&m, *fileinfd, st->st_size, 0);
+		for (i = 0; i < njobs; i++) {
+			sign_chunk(&blk, i, chunk, &lo, &hi, &offs, &len);
+			if ((buf = fmap_get(sess, &m, offs, len)) == NULL) {
+				ERRX1(sess, "fmap_get");
+				fmap_free(&m);
+				close(*fileinfd);
+				*fileinfd = -1;
+				free(blk.blks);
+				return 0;
 			}
-			u->state = UPLOAD_FINISHED;
-			LOG4(sess, "uploader: finished");
-			return 0;
+			sign_blks(&blk, lo, hi, buf, sess);
 		}
+		sess->stats.sign += stats_now() - t;
+		fmap_free(&m);
+		close(*fileinfd);
+		*fileinfd = -1;
+	}
 
-		/* Go back to the event loop, if necessary. */
+	put_blk(sess, s->buf, &pos, s->bufsz, &blk, 0, blk.blksz);
+	assert(pos == s->bufsz);
+	s->bufready = s->bufsz;
+	free(blk.blks);
+	return 1;
+}
 
-		u->state = -1 == *fileinfd ?
-			UPLOAD_WRITE_LOCAL : UPLOAD_READ_LOCAL;
-		if (u->state == UPLOAD_READ_LOCAL)
-			return 1;
+/*
+ * Iterates through all available files and conditionally gets the file
+ * ready for processing to check whether it's up to date.
+ * If not up to date or empty, queues file information for the sender,
+ * which is written as "out" is writable.
+ * We keep preparing files while the queue has room, so we needn't wait
+ * on the local disc when the sender is ready for more.
+ * This sets the descriptors of "in" and "out" for what we're waiting
+ * on, and must be called when either's ready (according to revents).
+ * If returns 0, we've processed all files there are to process.
+ * If returns >0, we're waiting for POLLIN or POLLOUT data.
+ * Otherwise returns <0, which is an error.
+ */
+int
+rsync_uploader(struct upload *u, struct pollfd *in,
+	struct sess *sess, struct pollfd *out)
+{
+	struct stat	 st;
+	int		 c;
+
+	/* This should never get called. */
+
+	assert(u->state != UPLOAD_FINISHED);
+
+	if ((POLLOUT & out->revents) && !upload_write(u, sess)) {
+		ERRX1(sess, "upload_write");
+		return -1;
 	}
 
 	/*
 	 * If an input file is open, stat it and see if it's already up
 	 * to date, in which case close it and go to the next one.
-	 * Either way, we don't have a write channel open.
+	 * Otherwise, sign it.
 	 */
 
-	if (u->state == UPLOAD_READ_LOCAL) {
-		assert(*fileinfd != -1);
-		assert(*fileoutfd == -1);
+	if (u->state == UPLOAD_READ_LOCAL && (POLLIN & in->revents)) {
+		assert(in->fd != -1);
 
-		if (fstat(*fileinfd, &st) == -1) {
+		if (fstat(in->fd, &st) == -1) {
 			WARN(sess, "%s: fstat", u->fl[u->idx].path);
-			close(*fileinfd);
-			*fileinfd = -1;
+			close(in->fd);
+			in->fd = -1;
 			return -1;
 		} else if (!S_ISREG(st.st_mode)) {
 			WARNX(sess, "%s: not regular", u->fl[u->idx].path);
-			close(*fileinfd);
-			*fileinfd = -1;
+			close(in->fd);
+			in->fd = -1;
 			return -1;
 		}
 
@@ -634,111 +1288,100 @@ rsync_uploader(struct upload *u, int *fileinfd,
 		    st.st_mtime == u->fl[u->idx].st.mtime) {
 			LOG3(sess, "%s: skipping: "
 				"up to date", u->fl[u->idx].path);
-			close(*fileinfd);
-			*fileinfd = -1;
-			*fileoutfd = u->fdout;
+			if (sess->sigcache != NULL)
+				sigcache_keep(sess->sigcache, &st);
+			close(in->fd);
+			in->fd = -1;
 			u->state = UPLOAD_FIND_NEXT;
 			u->idx++;
-			return 1;
+		} else if (!upload_sign(u, sess, &in->fd, &st)) {
+			ERRX1(sess, "upload_sign");
+			return -1;
+		} else {
+			u->state = u->signing ?
+				UPLOAD_SIGN_LOCAL : UPLOAD_FIND_NEXT;
+			if (!u->signing)
+				u->idx++;
 		}
-
-		/* Fallthrough... */
-
-		u->state = UPLOAD_WRITE_LOCAL;
 	}
 
-	/* Initialies our blocks. */
+	/* See if the signing threads are done with the file. */
 
-	assert(u->state == UPLOAD_WRITE_LOCAL);
-	memset(&blk, 0, sizeof(struct blkset));
-	blk.csum = u->csumlen;
-
-	if (*fileinfd != -1 && st.st_size > 0) {
-		mapsz = st.st_size;
-		map = mmap(NULL, mapsz,
-			PROT_READ, MAP_SHARED, *fileinfd, 0);
-		if (map == MAP_FAILED) {
-			WARN(sess, "%s: mmap", u->fl[u->idx].path);
-			close(*fileinfd);
-			*fileinfd = -1;
+	if (u->state == UPLOAD_SIGN_LOCAL) {
+		if (u->signing && !sign_update(u, sess, 0)) {
+			ERRX1(sess, "sign_update");
 			return -1;
+		} else if (!u->signing) {
+			u->state = UPLOAD_FIND_NEXT;
+			u->idx++;
 		}
+	}
 
-		init_blkset(&blk, st.st_size);
-		assert(blk.blksz);
+	/*
+	 * If we don't have a file currently open, then we iterate
+	 * through til the next available regular file and start the
+	 * opening process, as long as we have room to queue it.
+	 * Files that don't exist are queued immediately.
+	 * At the end of the list, we queue the end of the phase, unless
+	 * we're waiting on more of an incremental file list.
+	 */
 
-		blk.blks = calloc(blk.blksz, sizeof(struct blk));
-		if (blk.blks == NULL) {
-			ERR(sess, "calloc");
-			munmap(map, mapsz);
-			close(*fileinfd);
-			*fileinfd = -1;
-			return -1;
-		}
+	while (u->state == UPLOAD_FIND_NEXT && upload_room(u)) {
+		assert(in->fd == -1);
 
-		offs = 0;
-		for (i = 0; i < blk.blksz; i++) {
-			init_blk(&blk.blks[i],
-				&blk, offs, i, map, sess);
-			offs += blk.len;
-		}
+		for (c = 0; u->idx < u->flsz; u->idx++) {
+			if (!upload_wanted(u))
+				c = 0;
+			else if (S_ISDIR(u->fl[u->idx].st.mode))
+				c = pre_dir(u, sess);
+			else if (!upload_ours(sess, &u->fl[u->idx]))
+				c = 0;
+			else if (S_ISLNK(u->fl[u->idx].st.mode))
+				c = pre_link(u, sess);
+			else if (S_ISREG(u->fl[u->idx].st.mode))
+				c = pre_file(u, &in->fd, sess);
+			else
+				c = 0;
 
-		munmap(map, mapsz);
-		close(*fileinfd);
-		*fileinfd = -1;
-		LOG3(sess, "%s: mapped %jd B with %zu blocks",
-			u->fl[u->idx].path, (intmax_t)blk.size,
-			blk.blksz);
-	} else {
-		if (*fileinfd != -1) {
-			close(*fileinfd);
-			*fileinfd = -1;
+			if (c < 0)
+				return -1;
+			else if (c > 0)
+				break;
+			else if (!upload_room(u))
+				break;
 		}
-		blk.len = MAX_CHUNK; /* Doesn't matter. */
-		LOG3(sess, "%s: not mapped", u->fl[u->idx].path);
-	}
-
-	assert(*fileinfd == -1);
-
-	/* Make sure the block metadata buffer is big enough. */
-
-	u->bufsz =
-	     sizeof(int32_t) + /* identifier */
-	     sizeof(int32_t) + /* block count */
-	     sizeof(int32_t) + /* block length */
-	     sizeof(int32_t) + /* checksum length */
-	     sizeof(int32_t) + /* block remainder */
-	     blk.blksz *
-	     (sizeof(int32_t) + /* short checksum */
-	      blk.csum); /* long checksum */
 
-	if (u->bufsz > u->bufmax) {
-		if ((bufp = realloc(u->buf, u->bufsz)) == NULL) {
-			ERR(sess, "realloc");
+		if (u->idx == u->flsz && !u->fldone) {
+			break;
+		} else if (u->idx == u->flsz) {
+			assert(in->fd == -1);
+			if (!upsig_int(u, sess, -1)) {
+				ERRX1(sess, "upsig_int");
+				return -1;
+			}
+			u->state = UPLOAD_WRITE_LOCAL;
+		} else if (c == 0) {
+			/* Dry-run filled the queue. */
+			u->idx++;
+		} else if (in->fd != -1) {
+			u->state = UPLOAD_READ_LOCAL;
+		} else if (!upload_sign(u, sess, &in->fd, NULL)) {
+			ERRX1(sess, "upload_sign");
 			return -1;
-		}
-		u->buf = bufp;
-		u->bufmax = u->bufsz;
+		} else
+			u->idx++;
 	}
 
-	u->bufpos = pos = 0;
-	io_buffer_int(sess, u->buf, &pos, u->bufsz, u->idx);
-	io_buffer_int(sess, u->buf, &pos, u->bufsz, blk.blksz);
-	io_buffer_int(sess, u->buf, &pos, u->bufsz, blk.len);
-	io_buffer_int(sess, u->buf, &pos, u->bufsz, blk.csum);
-	io_buffer_int(sess, u->buf, &pos, u->bufsz, blk.rem);
-	for (i = 0; i < blk.blksz; i++) {
-		io_buffer_int(sess, u->buf, &pos, u->bufsz,
-			blk.blks[i].chksum_short);
-		io_buffer_buf(sess, u->buf, &pos, u->bufsz,
-			blk.blks[i].chksum_long, blk.csum);
-	}
-	assert(pos == u->bufsz);
+	/* Poll on what we're waiting for. */
 
-	/* Reenable the output poller and clean up. */
+	out->fd = TAILQ_EMPTY(&u->queue) ? -1 : u->fdout;
+
+	if (u->state == UPLOAD_WRITE_LOCAL && TAILQ_EMPTY(&u->queue)) {
+		u->state = UPLOAD_FINISHED;
+		LOG4(sess, "uploader: finished");
+		return 0;
+	}
 
-	*fileoutfd = u->fdout;
-	free(blk.blks);
 	return 1;
 }
 
@@ -761,6 +1404,11 @@ rsync_uploader_tail(struct upload *u, struct sess *sess)
 	     !sess->opts->preserve_perms)
 		return 1;
 
+	/* With --streams, the last does this when the others are done. */
+
+	if (sess->opts->stream < sess->opts->streams)
+		return 1;
+
 	LOG2(sess, "fixing up directory times and permissions");
 
 	for (i = 0; i < u->flsz; i++)
@@ -0,0 +1,483 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/param.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "extern.h"
+
+/*
+ * Directories read ahead of those passed on by walk_step(), per reading
+ * thread, bounding the memory held by those read but not yet consumed.
+ */
+#define	WALK_AHEAD	4
+
+/*
+ * A file found while reading a directory.
+ * If "errfn" is set, the named call failed with "err" and the other
+ * fields (besides the path) are not to be used.
+ */
+struct	walkent {
+	char		*path; /* full path */
+	char		*link; /* symlink target or NULL */
+	struct stat	 st; /* lstat(2) of the file */
+	const char	*errfn; /* failing call or NULL */
+	int		 err; /* errno of failing call */
+};
+
+/*
+ * A directory to be read by a job and what it contained.
+ */
+struct	walkdir {
+	char		*path; /* directory path */
+	struct walkent	*ents; /* entries in directory */
+	size_t		 entsz; /* number of entries */
+	size_t		 entmax; /* allocated entries */
+	int		 err; /* errno if unreadable or zero */
+	int		 fatal; /* errno if job failed or zero */
+};
+
+/*
+ * A walk through a tree, one depth at a time.
+ * The directories at the current depth are read in parallel, one job
+ * per directory, and consumed in order by walk_step() as they complete.
+ * Only "ahead" directories past those consumed are handed to the pool,
+ * more as we consume them.
+ * Jobs only look at "dirs", "dirbase" and "flags".
+ */
+struct	walk {
+	struct walkdir	*dirs; /* directories at this depth */
+	size_t		 dirsz; /* number of directories */
+	size_t		 dirpos; /* directories consumed */
+	size_t		 dirdone; /* leading directories read */
+	size_t		 dirbase; /* directory of the batch's first job */
+	size_t		 dirjobs; /* directories handed to the pool */
+	size_t		 ahead; /* most directories past dirpos to read */
+	struct walkdir	*next; /* directories at next depth */
+	size_t		 nextsz; /* number of next directories */
+	size_t		 nextmax; /* allocated next directories */
+	struct pool	*pool; /* readers or NULL */
+	int		 started; /* pool is reading dirs */
+	int		 flags; /* WALK_xxx */
+	walk_fn		 fn; /* called for each file */
+	void		*arg; /* argument to fn */
+};
+
+/*
+ * Read the symbolic link "name" relative to "fd".
+ * Like symlinkat_read(), but safe to call from a pool job.
+ * Returns the target or NULL on failure with errno set.
+ */
+static char *
+walk_readlink(int fd, const char *name)
+{
+	char	*buf = NULL;
+	size_t	 sz;
+	ssize_t	 nsz;
+	void	*pp;
+
+	for (sz = MAXPATHLEN; ; sz *= 2) {
+		if ((pp = realloc(buf, sz + 1)) == NULL) {
+			free(buf);
+			return NULL;
+		}
+		buf = pp;
+
+		if ((nsz = readlinkat(fd, name, buf, sz)) == -1) {
+			free(buf);
+			return NULL;
+		} else if (nsz == 0) {
+			free(buf);
+			errno = EINVAL;
+			return NULL;
+		} else if ((size_t)nsz < sz)
+			break;
+	}
+
+	buf[nsz] = '\0';
+	return buf;
+}
+
+/*
+ * Pool job: read directory "idx" of the walk and stat (and possibly
+ * read the link of) each entry relative to the directory descriptor.
+ * A directory that can't be read isn't a failure; it's noted and
+ * warned about by walk().
+ * Returns zero on failure (memory), non-zero on success.
+ */
+static int
+walk_dir(void *arg, size_t idx)
+{
+	struct walk	*w = arg;
+	struct walkdir	*d = &w->dirs[w->dirbase + idx];
+	struct walkent	*e;
+	struct dirent	*dp;
+	DIR		*dirp;
+	const char	*sep;
+	size_t		 len;
+	int		 fd;
+	void		*pp;
+
+	fd = open(d->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1) {
+		d->err = errno;
+		return 1;
+	} else if ((dirp = fdopendir(fd)) == NULL) {
+		d->err = errno;
+		close(fd);
+		return 1;
+	}
+
+	len = strlen(d->path);
+	sep = (len > 0 && d->path[len - 1] == '/') ? "" : "/";
+
+	for (;;) {
+		errno = 0;
+		if ((dp = readdir(dirp)) == NULL) {
+			d->err = errno;
+			break;
+		} else if (strcmp(dp->d_name, ".") == 0 ||
+		    strcmp(dp->d_name, "..") == 0)
+			continue;
+
+		if (d->entsz == d->entmax) {
+			pp = reallocarray(d->ents,
+				d->entmax + 64, sizeof(struct walkent));
+			if (pp == NULL)
+				goto fail;
+			d->ents = pp;
+			d->entmax += 64;
+		}
+
+		e = &d->ents[d->entsz];
+		memset(e, 0, sizeof(struct walkent));
+		if (asprintf(&e->path, "%s%s%s",
+		    d->path, sep, dp->d_name) == -1) {
+			e->path = NULL;
+			goto fail;
+		}
+		d->entsz++;
+
+		if (fstatat(fd, dp->d_name, &e->st,
+		    AT_SYMLINK_NOFOLLOW) == -1) {
+			e->errfn = "fstatat";
+			e->err = errno;
+		} else if (S_ISLNK(e->st.st_mode) &&
+		    (w->flags & WALK_LINKS) &&
+		    (e->link = walk_readlink(fd, dp->d_name)) == NULL) {
+			e->errfn = "readlinkat";
+			e->err = errno;
+		}
+	}
+
+	closedir(dirp);
+	return 1;
+fail:
+	d->fatal = errno;
+	closedir(dirp);
+	return 0;
+}
+
+/*
+ * Free the contents of a directory but not the structure itself.
+ */
+static void
+walk_dir_free(struct walkdir *d)
+{
+	size_t	 i;
+
+	for (i = 0; i < d->entsz; i++) {
+		free(d->ents[i].path);
+		free(d->ents[i].link);
+	}
+	free(d->ents);
+	free(d->path);
+	memset(d, 0, sizeof(struct walkdir));
+}
+
+/*
+ * Pass a found directory entry to "fn" if it's one we handle, queueing
+ * up directories to be read at the next depth.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+walk_ent(struct sess *sess, struct walk *w, struct walkent *e)
+{
+	char	*link;
+	void	*pp;
+
+	if (e->errfn != NULL && strcmp(e->errfn, "readlinkat") == 0) {
+		errno = e->err;
+		ERR(sess, "%s: readlinkat", e->path);
+		return 0;
+	} else if (e->errfn != NULL) {
+		errno = e->err;
+		if (!(w->flags & WALK_QUIET))
+			WARN(sess, "%s: could not stat", e->path);
+		return 1;
+	} else if (!S_ISDIR(e->st.st_mode) &&
+	    !S_ISREG(e->st.st_mode) &&
+	    !S_ISLNK(e->st.st_mode)) {
+		WARNX(sess, "%s: skipping special", e->path);
+		return 1;
+	}
+
+	link = e->link;
+	e->link = NULL;
+	if (!(*w->fn)(sess, w->arg, e->path, &e->st, link))
+		return 0;
+
+	if (!S_ISDIR(e->st.st_mode))
+		return 1;
+
+	if (w->nextsz == w->nextmax) {
+		pp = reallocarray(w->next,
+			w->nextmax + 64, sizeof(struct walkdir));
+		if (pp == NULL) {
+			ERR(sess, "reallocarray");
+			return 0;
+		}
+		w->next = pp;
+		w->nextmax += 64;
+	}
+
+	memset(&w->next[w->nextsz], 0, sizeof(struct walkdir));
+	w->next[w->nextsz++].path = e->path;
+	e->path = NULL;
+	return 1;
+}
+
+/*
+ * Start walking the file-system tree at "root" without following
+ * symbolic links, calling "fn" for each directory (before its
+ * contents), regular file, or symbolic link found.
+ * The root itself is passed to "fn" right away, the rest by
+ * walk_step().
+ * Symbolic link targets are read with WALK_LINKS in "flags".
+ * With WALK_QUIET, files that can't be stat'd are skipped silently.
+ * Paths are given as "root/sub/file", or "root" for the root.
+ * Directories are read by the pool "p", or in-line if NULL.
+ * A non-existent root is silently skipped.
+ * Returns NULL on failure.
+ * On success, walk_free() must be called with the allocated pointer.
+ */
+struct walk *
+walk_alloc(struct sess *sess, struct pool *p, const char *root,
+	int flags, walk_fn fn, void *arg)
+{
+	struct walk	*w;
+	struct stat	 st;
+	char		*link = NULL;
+
+	if ((w = calloc(1, sizeof(struct walk))) == NULL) {
+		ERR(sess, "calloc");
+		return NULL;
+	}
+	w->pool = p;
+	if (p != NULL)
+		w->ahead = WALK_AHEAD * pool_size(p);
+	w->flags = flags;
+	w->fn = fn;
+	w->arg = arg;
+
+	if (lstat(root, &st) == -1) {
+		if (errno != ENOENT && !(flags & WALK_QUIET))
+			WARN(sess, "%s: could not stat", root);
+		return w;
+	} else if (!S_ISDIR(st.st_mode) &&
+	    !S_ISREG(st.st_mode) &&
+	    !S_ISLNK(st.st_mode)) {
+		WARNX(sess, "%s: skipping special", root);
+		return w;
+	}
+
+	if (S_ISLNK(st.st_mode) && (flags & WALK_LINKS) &&
+	    (link = symlink_read(sess, root)) == NULL) {
+		ERRX1(sess, "symlink_read");
+		goto out;
+	} else if (!(*fn)(sess, arg, root, &st, link))
+		goto out;
+	else if (!S_ISDIR(st.st_mode))
+		return w;
+
+	/* The root is the only directory at the next depth. */
+
+	if ((w->next = calloc(1, sizeof(struct walkdir))) == NULL) {
+		ERR(sess, "calloc");
+		goto out;
+	} else if ((w->next[0].path = strdup(root)) == NULL) {
+		ERR(sess, "strdup");
+		goto out;
+	}
+	w->nextsz = w->nextmax = 1;
+	return w;
+out:
+	walk_free(w);
+	return NULL;
+}
+
+/*
+ * Have the pool reading up to "ahead" directories past the one we're
+ * about to consume, either growing the batch it's running or, if it's
+ * finished the last one, starting another from where that ended.
+ * Returns zero on failure, non-zero on success.
+ */
+static int
+walk_ahead(struct sess *sess, struct walk *w)
+{
+	size_t	 want;
+
+	want = w->dirpos + w->ahead;
+	if (want > w->dirsz)
+		want = w->dirsz;
+	if (want <= w->dirjobs)
+		return 1;
+
+	if (w->started) {
+		if (!pool_extend(sess, w->pool, want - w->dirbase)) {
+			ERRX1(sess, "pool_extend");
+			return 0;
+		}
+	} else {
+		w->dirbase = w->dirjobs;
+		if (!pool_start(sess, w->pool,
+		    walk_dir, w, want - w->dirbase)) {
+			ERRX1(sess, "pool_start");
+			return 0;
+		}
+		w->started = 1;
+	}
+	w->dirjobs = want;
+	return 1;
+}
+
+/*
+ * Pass the contents of the next directory to the walk's function,
+ * waiting for it to be read if need be.
+ * Returns <0 on failure, 0 if the walk is finished, >0 otherwise.
+ */
+int
+walk_step(struct sess *sess, struct walk *w)
+{
+	struct walkdir	*d;
+	size_t		 i;
+
+	/* Move on to the next depth, if any. */
+
+	if (w->dirpos == w->dirsz) {
+		assert(!w->started);
+		free(w->dirs);
+		w->dirs = w->next;
+		w->dirsz = w->nextsz;
+		w->dirpos = w->dirdone = 0;
+		w->dirbase = w->dirjobs = 0;
+		w->next = NULL;
+		w->nextsz = w->nextmax = 0;
+		if (w->dirsz == 0)
+			return 0;
+	}
+
+	if (w->pool == NULL) {
+		walk_dir(w, w->dirpos);
+		w->dirdone = w->dirpos + 1;
+	} else {
+		if (!walk_ahead(sess, w)) {
+			ERRX1(sess, "walk_ahead");
+			return -1;
+		}
+		if (w->dirdone <= w->dirpos) {
+			w->dirdone = w->dirbase +
+				pool_wait(w->pool, w->dirpos - w->dirbase);
+			if (w->dirdone == w->dirjobs)
+				w->started = 0;
+		}
+		if (w->dirdone <= w->dirpos || !pool_ok(w->pool)) {
+			ERRX(sess, "walk_dir: job failed");
+			return -1;
+		}
+	}
+	assert(w->dirdone > w->dirpos);
+
+	d = &w->dirs[w->dirpos++];
+	if (d->fatal) {
+		errno = d->fatal;
+		ERR(sess, "%s: walk_dir", d->path);
+		return -1;
+	} else if (d->err) {
+		errno = d->err;
+		WARN(sess, "%s: unreadable directory", d->path);
+	}
+
+	for (i = 0; i < d->entsz; i++)
+		if (!walk_ent(sess, w, &d->ents[i]))
+			return -1;
+
+	walk_dir_free(d);
+	return 1;
+}
+
+/*
+ * Stop walking, waiting for any directories being read, and free.
+ * Passing a NULL to this function is ok.
+ */
+void
+walk_free(struct walk *w)
+{
+	size_t	 i;
+
+	if (w == NULL)
+		return;
+	if (w->started)
+		pool_cancel(w->pool);
+	for (i = 0; i < w->dirsz; i++)
+		walk_dir_free(&w->dirs[i]);
+	free(w->dirs);
+	for (i = 0; i < w->nextsz; i++)
+		walk_dir_free(&w->next[i]);
+	free(w->next);
+	free(w);
+}
+
+/*
+ * Walk all of the tree at "root", as described for walk_alloc().
+ * Returns zero on failure, non-zero on success.
+ */
+int
+walk(struct sess *sess, struct pool *p, const char *root, int flags,
+	walk_fn fn, void *arg)
+{
+	struct walk	*w;
+	int		 c;
+
+	if ((w = walk_alloc(sess, p, root, flags, fn, arg)) == NULL) {
+		ERRX1(sess, "walk_alloc");
+		return 0;
+	}
+	while ((c = walk_step(sess, w)) > 0)
+		continue;
+	walk_free(w);
+	return c == 0;
+}
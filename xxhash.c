@@ -0,0 +1,214 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <sys/types.h>
+
+#include <endian.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "md4.h"
+#include "xxhash.h"
+
+#define	PRIME64_1	0x9E3779B185EBCA87ULL
+#define	PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define	PRIME64_3	0x165667B19E3779F9ULL
+#define	PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define	PRIME64_5	0x27D4EB2F165667C5ULL
+
+static uint64_t
+rotl64(uint64_t x, int r)
+{
+
+	return (x << r) | (x >> (64 - r));
+}
+
+/*
+ * Input is read little-endian, whatever the host, and needn't be
+ * aligned.
+ */
+static inline uint64_t
+read64(const unsigned char *p)
+{
+	uint64_t	 v;
+
+	memcpy(&v, p, sizeof(v));
+	return le64toh(v);
+}
+
+static inline uint32_t
+read32(const unsigned char *p)
+{
+	uint32_t	 v;
+
+	memcpy(&v, p, sizeof(v));
+	return le32toh(v);
+}
+
+static uint64_t
+xxh64_round(uint64_t acc, uint64_t in)
+{
+
+	acc += in * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static uint64_t
+xxh64_merge(uint64_t acc, uint64_t v)
+{
+
+	acc ^= xxh64_round(0, v);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+/*
+ * Consume as many 32-byte stripes of "p" as there are into "v".
+ * Returns the bytes consumed.
+ */
+static size_t
+xxh64_stripes(uint64_t v[4], const unsigned char *p, size_t len)
+{
+	uint64_t	 v1 = v[0], v2 = v[1], v3 = v[2], v4 = v[3];
+	size_t		 i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v1 = xxh64_round(v1, read64(p + i));
+		v2 = xxh64_round(v2, read64(p + i + 8));
+		v3 = xxh64_round(v3, read64(p + i + 16));
+		v4 = xxh64_round(v4, read64(p + i + 24));
+	}
+	v[0] = v1;
+	v[1] = v2;
+	v[2] = v3;
+	v[3] = v4;
+	return i;
+}
+
+static void
+xxh64_reset(uint64_t v[4], uint64_t seed)
+{
+
+	v[0] = seed + PRIME64_1 + PRIME64_2;
+	v[1] = seed + PRIME64_2;
+	v[2] = seed;
+	v[3] = seed - PRIME64_1;
+}
+
+/*
+ * Finish the hash given the accumulators (if at least a stripe was
+ * hashed), the total length, and the remaining fewer than 32 bytes.
+ */
+static uint64_t
+xxh64_finish(const uint64_t v[4], uint64_t seed, uint64_t total,
+	const unsigned char *p, size_t len)
+{
+	uint64_t	 h;
+	size_t		 i = 0;
+
+	if (total >= 32) {
+		h = rotl64(v[0], 1) + rotl64(v[1], 7) +
+		    rotl64(v[2], 12) + rotl64(v[3], 18);
+		h = xxh64_merge(h, v[0]);
+		h = xxh64_merge(h, v[1]);
+		h = xxh64_merge(h, v[2]);
+		h = xxh64_merge(h, v[3]);
+	} else
+		h = seed + PRIME64_5;
+
+	h += total;
+
+	for ( ; i + 8 <= len; i += 8) {
+		h ^= xxh64_round(0, read64(p + i));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+	if (i + 4 <= len) {
+		h ^= (uint64_t)read32(p + i) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		i += 4;
+	}
+	for ( ; i < len; i++) {
+		h ^= p[i] * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * Hash "len" bytes of "buf" at once.
+ */
+uint64_t
+xxh64(const void *buf, size_t len, uint64_t seed)
+{
+	uint64_t	 v[4];
+	size_t		 i;
+
+	xxh64_reset(v, seed);
+	i = xxh64_stripes(v, buf, len);
+	return xxh64_finish(v, seed, len,
+		(const unsigned char *)buf + i, len - i);
+}
+
+void
+xxh64_init(struct xxh64 *x, uint64_t seed)
+{
+
+	memset(x, 0, sizeof(struct xxh64));
+	x->seed = seed;
+	xxh64_reset(x->v, seed);
+}
+
+void
+xxh64_update(struct xxh64 *x, const void *buf, size_t len)
+{
+	const unsigned char	*p = buf;
+	size_t			 sz;
+
+	x->total += len;
+
+	/* Fill up a partial stripe first. */
+
+	if (x->memsz > 0) {
+		sz = sizeof(x->mem) - x->memsz;
+		if (sz > len)
+			sz = len;
+		memcpy(x->mem + x->memsz, p, sz);
+		x->memsz += sz;
+		p += sz;
+		len -= sz;
+		if (x->memsz < sizeof(x->mem))
+			return;
+		xxh64_stripes(x->v, x->mem, sizeof(x->mem));
+		x->memsz = 0;
+	}
+
+	sz = xxh64_stripes(x->v, p, len);
+	memcpy(x->mem, p + sz, len - sz);
+	x->memsz = len - sz;
+}
+
+uint64_t
+xxh64_final(const struct xxh64 *x)
+{
+
+	return xxh64_finish(x->v, x->seed, x->total, x->mem, x->memsz);
+}
@@ -0,0 +1,56 @@
+/*	$Id$ */
+/*
+ * Copyright (c) 2019 Kristaps Dzonsons <kristaps@bsd.lv>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef XXHASH_H
+#define XXHASH_H
+
+/*
+ * XXH64, a fast non-cryptographic hash by Yann Collet, used in place of
+ * MD4 between openrsync peers.
+ * See https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ * for the algorithm, which this implements from scratch.
+ */
+#define	XXH64_DIGEST_LENGTH	8
+
+struct	xxh64 {
+	uint64_t	 v[4]; /* accumulators */
+	uint64_t	 seed;
+	uint64_t	 total; /* bytes hashed */
+	unsigned char	 mem[32]; /* part of a stripe */
+	size_t		 memsz; /* bytes in mem */
+};
+
+/*
+ * Hash of a whole file, either MD4 (with the seed first) or, if "xxh",
+ * XXH64 seeded with the seed.
+ * See hash_file_init().
+ */
+struct	hashfile {
+	int		 xxh;
+	MD4_CTX		 md4;
+	struct xxh64	 xxh64;
+};
+
+__BEGIN_DECLS
+
+uint64_t	xxh64(const void *, size_t, uint64_t);
+void		xxh64_init(struct xxh64 *, uint64_t);
+void		xxh64_update(struct xxh64 *, const void *, size_t);
+uint64_t	xxh64_final(const struct xxh64 *);
+
+__END_DECLS
+
+#endif